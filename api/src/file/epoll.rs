@@ -11,20 +11,24 @@ use alloc::{
     collections::vec_deque::VecDeque,
     sync::{Arc, Weak},
     task::Wake,
+    vec::Vec,
 };
 use core::{
     any::Any,
     hash::{Hash, Hasher},
-    sync::atomic::{AtomicBool, Ordering},
+    mem,
+    ptr::null_mut,
+    sync::atomic::{AtomicBool, AtomicPtr, AtomicU8, Ordering},
     task::{Context, Waker},
 };
 
 use axerrno::{AxError, AxResult};
 use axpoll::{IoEvents, PollSet, Pollable};
+use axtask::current;
 use bitflags::bitflags;
 use hashbrown::HashMap;
 use kspin::SpinNoPreempt;
-use linux_raw_sys::general::{EPOLLET, EPOLLONESHOT, epoll_event};
+use linux_raw_sys::general::{EPOLLET, EPOLLEXCLUSIVE, EPOLLONESHOT, epoll_event};
 
 use crate::file::{FileLike, Kstat, SealedBuf, SealedBufMut, get_file_like};
 
@@ -39,55 +43,45 @@ bitflags! {
     pub struct EpollFlags: u32 {
         const EDGE_TRIGGER = EPOLLET;
         const ONESHOT = EPOLLONESHOT;
+        const EXCLUSIVE = EPOLLEXCLUSIVE;
     }
 }
 
 /// Interest trigger mode
-#[derive(Debug, Clone, Copy)]
+///
+/// Stored in an [`AtomicU8`] so that consuming an event never takes a lock.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+#[repr(u8)]
 enum TriggerMode {
     /// Level-triggered: until the condition is cleared
-    Level,
+    Level        = 0,
     /// Edge-triggered: only notify when the condition changes
-    Edge,
+    Edge         = 1,
     /// One-shot: notify only once
-    OneShot { fired: bool },
+    OneShot      = 2,
+    /// One-shot that has already fired
+    OneShotFired = 3,
 }
 
 impl TriggerMode {
     fn from_flags(flags: EpollFlags) -> Self {
         if flags.contains(EpollFlags::ONESHOT) {
-            TriggerMode::OneShot { fired: false }
+            TriggerMode::OneShot
         } else if flags.contains(EpollFlags::EDGE_TRIGGER) {
             TriggerMode::Edge
         } else {
             TriggerMode::Level
         }
     }
+}
 
-    // return should notify and new mode
-    fn should_notify(&self) -> (bool, Self) {
-        match self {
-            TriggerMode::Level => {
-                // LT: always notify
-                (true, *self)
-            }
-            // if we could wake, we need notify
-            TriggerMode::Edge => (true, TriggerMode::Edge),
-            TriggerMode::OneShot { fired } => {
-                // ONESHOT: 只触发一次
-                if *fired {
-                    (false, *self)
-                } else {
-                    (true, TriggerMode::OneShot { fired: true })
-                }
-            }
-        }
-    }
-
-    fn is_enabled(&self) -> bool {
-        match self {
-            TriggerMode::OneShot { fired } => !fired,
-            _ => true,
+impl From<u8> for TriggerMode {
+    fn from(value: u8) -> Self {
+        match value {
+            1 => Self::Edge,
+            2 => Self::OneShot,
+            3 => Self::OneShotFired,
+            _ => Self::Level,
         }
     }
 }
@@ -137,28 +131,57 @@ impl Eq for EntryKey {}
 struct EpollInterest {
     key: EntryKey,
     event: EpollEvent,
-    mode: SpinNoPreempt<TriggerMode>,
+    exclusive: bool,
+    mode: AtomicU8,
     in_ready_queue: AtomicBool,
+    /// Set once the interest has been deleted, or replaced by `modify`.
+    removed: AtomicBool,
+    /// Next interest in the [`ReadyStack`] while this one is pushed there.
+    next: AtomicPtr<EpollInterest>,
+    /// Waker registered on the file, created once per interest.
+    waker: Waker,
 }
 
 impl EpollInterest {
-    fn new(key: EntryKey, event: EpollEvent, flags: EpollFlags) -> Self {
-        Self {
+    fn new(
+        key: EntryKey,
+        event: EpollEvent,
+        flags: EpollFlags,
+        epoll: Weak<EpollInner>,
+    ) -> Arc<Self> {
+        Arc::new_cyclic(|interest| Self {
             key,
             event,
-            mode: SpinNoPreempt::new(TriggerMode::from_flags(flags)),
+            exclusive: flags.contains(EpollFlags::EXCLUSIVE),
+            mode: AtomicU8::new(TriggerMode::from_flags(flags) as u8),
             in_ready_queue: AtomicBool::new(false),
-        }
+            removed: AtomicBool::new(false),
+            next: AtomicPtr::new(null_mut()),
+            waker: Waker::from(Arc::new(InterestWaker {
+                epoll,
+                interest: interest.clone(),
+            })),
+        })
+    }
+
+    #[inline]
+    fn mode(&self) -> TriggerMode {
+        self.mode.load(Ordering::Acquire).into()
     }
 
     #[inline]
     fn is_enabled(&self) -> bool {
-        self.mode.lock().is_enabled()
+        self.mode() != TriggerMode::OneShotFired
+    }
+
+    #[inline]
+    fn is_removed(&self) -> bool {
+        self.removed.load(Ordering::Acquire)
     }
 
     #[inline]
-    fn is_in_queue(&self) -> bool {
-        self.in_ready_queue.load(Ordering::Acquire)
+    fn mark_removed(&self) {
+        self.removed.store(true, Ordering::Release);
     }
 
     #[inline]
@@ -182,17 +205,27 @@ impl EpollInterest {
             return ConsumeResult::NoEvent;
         }
 
-        let mut mode = self.mode.lock();
-        let (should_notify, new_mode) = mode.should_notify();
-        *mode = new_mode;
-        trace!(
-            "consume fd: {} matches {:?} should notify: {} ",
-            self.key.fd, matched, should_notify
-        );
-
-        if !should_notify {
-            return ConsumeResult::NoEvent;
-        }
+        let mode = match self.mode() {
+            TriggerMode::OneShot => {
+                // ONESHOT: only the first consumer gets the event
+                if self
+                    .mode
+                    .compare_exchange(
+                        TriggerMode::OneShot as u8,
+                        TriggerMode::OneShotFired as u8,
+                        Ordering::AcqRel,
+                        Ordering::Acquire,
+                    )
+                    .is_err()
+                {
+                    return ConsumeResult::NoEvent;
+                }
+                TriggerMode::OneShot
+            }
+            TriggerMode::OneShotFired => return ConsumeResult::NoEvent,
+            mode => mode,
+        };
+        trace!("consume fd: {} matches {:?}", self.key.fd, matched);
 
         // create event
         let event = EpollEvent {
@@ -201,11 +234,69 @@ impl EpollInterest {
         };
 
         // shoud still keep in ready?
-        match *mode {
+        match mode {
             TriggerMode::Level => ConsumeResult::EventAndKeep(event),
-            TriggerMode::Edge | TriggerMode::OneShot { .. } => ConsumeResult::EventAndRemove(event),
+            _ => ConsumeResult::EventAndRemove(event),
+        }
+    }
+}
+
+/// Lock-free intrusive stack of interests whose files became ready.
+///
+/// Wakers push with a single CAS and `epoll_wait` detaches the whole stack at
+/// once, so there is no ABA hazard. An interest is pushed at most once until
+/// its `in_ready_queue` flag is cleared, which keeps `next` stable.
+struct ReadyStack {
+    head: AtomicPtr<EpollInterest>,
+}
+
+impl ReadyStack {
+    const fn new() -> Self {
+        Self {
+            head: AtomicPtr::new(null_mut()),
+        }
+    }
+
+    fn is_empty(&self) -> bool {
+        self.head.load(Ordering::Acquire).is_null()
+    }
+
+    fn push(&self, interest: Arc<EpollInterest>) {
+        let node = Arc::into_raw(interest).cast_mut();
+        let mut head = self.head.load(Ordering::Relaxed);
+        loop {
+            // SAFETY: `node` comes from `Arc::into_raw` and is owned by us
+            // until it is published.
+            unsafe { (*node).next.store(head, Ordering::Relaxed) };
+            match self
+                .head
+                .compare_exchange_weak(head, node, Ordering::Release, Ordering::Relaxed)
+            {
+                Ok(_) => break,
+                Err(current) => head = current,
+            }
         }
     }
+
+    /// Moves every pushed interest to the back of `out`, oldest first.
+    fn take_all(&self, out: &mut VecDeque<Arc<EpollInterest>>) {
+        let mut node = self.head.swap(null_mut(), Ordering::Acquire);
+        let start = out.len();
+        while !node.is_null() {
+            // SAFETY: every node in the stack was produced by `Arc::into_raw`
+            // in `push` and is reclaimed exactly once here.
+            let interest = unsafe { Arc::from_raw(node) };
+            node = interest.next.load(Ordering::Relaxed);
+            out.push_back(interest);
+        }
+        out.make_contiguous()[start..].reverse();
+    }
+}
+
+impl Drop for ReadyStack {
+    fn drop(&mut self) {
+        self.take_all(&mut VecDeque::new());
+    }
 }
 
 struct InterestWaker {
@@ -227,36 +318,76 @@ impl Wake for InterestWaker {
             return;
         };
 
-        if interest.try_mark_in_queue() {
-            epoll
-                .ready_queue
-                .lock()
-                .push_back(Arc::downgrade(&interest));
-            trace!(
-                "Epoll: fd={} added to ready queue, events={:?} wake up poller",
-                interest.key.fd, interest.event.events
-            );
-            epoll.poll_ready.wake();
+        if interest.is_removed() || !interest.try_mark_in_queue() {
+            return;
+        }
+
+        trace!(
+            "Epoll: fd={} added to ready queue, events={:?} wake up poller",
+            interest.key.fd, interest.event.events
+        );
+        let exclusive = interest.exclusive;
+        epoll.incoming.push(interest);
+        if exclusive {
+            epoll.wake_one();
+        } else {
+            epoll.wake_all();
         }
     }
 }
 
 struct EpollInner {
     interests: SpinNoPreempt<HashMap<EntryKey, Arc<EpollInterest>>>,
-    ready_queue: SpinNoPreempt<VecDeque<Weak<EpollInterest>>>,
+    /// Interests made ready by wakers, not yet picked up by `epoll_wait`.
+    incoming: ReadyStack,
+    /// Interests picked up by `epoll_wait`, in FIFO order.
+    ready_queue: SpinNoPreempt<VecDeque<Arc<EpollInterest>>>,
+    /// Whoever polls the instance itself: `poll`, `select` and other epoll
+    /// instances.
     poll_ready: PollSet,
+    /// Tasks blocked in `epoll_wait` on the instance, by task id. Only these
+    /// are woken one at a time for EPOLLEXCLUSIVE interests.
+    waiters: SpinNoPreempt<VecDeque<(u64, Waker)>>,
 }
 
 impl Default for EpollInner {
     fn default() -> Self {
         Self {
             interests: SpinNoPreempt::new(HashMap::new()),
+            incoming: ReadyStack::new(),
             ready_queue: SpinNoPreempt::new(VecDeque::new()),
             poll_ready: PollSet::new(),
+            waiters: SpinNoPreempt::new(VecDeque::new()),
         }
     }
 }
 
+impl EpollInner {
+    fn has_ready(&self) -> bool {
+        !self.incoming.is_empty() || !self.ready_queue.lock().is_empty()
+    }
+
+    /// Wakes one `epoll_wait` caller, and everyone polling the instance.
+    ///
+    /// The caller is taken off the queue; it puts itself back if it has to
+    /// wait again.
+    fn wake_one(&self) {
+        let waiter = self.waiters.lock().pop_front();
+        if let Some((_, waker)) = waiter {
+            waker.wake();
+        }
+        self.poll_ready.wake();
+    }
+
+    /// Wakes every `epoll_wait` caller and everyone polling the instance.
+    fn wake_all(&self) {
+        for (_, waker) in self.waiters.lock().iter() {
+            waker.wake_by_ref();
+        }
+        self.poll_ready.wake();
+    }
+}
+
 #[derive(Default)]
 pub struct Epoll {
     inner: Arc<EpollInner>,
@@ -268,7 +399,7 @@ impl Epoll {
     }
 
     // only register waker, not add to ready queue
-    fn register_waker_only(&self, interest: &Arc<EpollInterest>) {
+    fn register_waker_only(&self, interest: &EpollInterest) {
         let Some(file) = interest.key.get_file() else {
             return;
         };
@@ -277,17 +408,12 @@ impl Epoll {
             return;
         }
 
-        let waker = Waker::from(Arc::new(InterestWaker {
-            epoll: Arc::downgrade(&self.inner),
-            interest: Arc::downgrade(interest),
-        }));
-
-        let mut context = Context::from_waker(&waker);
+        let mut context = Context::from_waker(&interest.waker);
         file.register(&mut context, interest.event.events);
     }
 
     // for add/modify
-    fn check_and_register_waker(&self, interest: &Arc<EpollInterest>) {
+    fn check_and_register_waker(&self, interest: &EpollInterest) {
         let Some(file) = interest.key.get_file() else {
             return;
         };
@@ -296,17 +422,13 @@ impl Epoll {
             return;
         }
 
-        let waker = Waker::from(Arc::new(InterestWaker {
-            epoll: Arc::downgrade(&self.inner),
-            interest: Arc::downgrade(interest),
-        }));
-
+        let waker = &interest.waker;
         let current = file.poll() & interest.event.events;
 
         if !current.is_empty() {
             waker.wake_by_ref();
         } else {
-            let mut context = Context::from_waker(&waker);
+            let mut context = Context::from_waker(waker);
             file.register(&mut context, interest.event.events);
 
             let current = file.poll() & interest.event.events;
@@ -317,13 +439,16 @@ impl Epoll {
     }
 
     pub fn add(&self, fd: i32, event: EpollEvent, flags: EpollFlags) -> AxResult<()> {
+        if flags.contains(EpollFlags::EXCLUSIVE | EpollFlags::ONESHOT) {
+            return Err(AxError::InvalidInput);
+        }
         let key = EntryKey::new(fd)?;
-        let interest = Arc::new(EpollInterest::new(key.clone(), event, flags));
+        let interest = EpollInterest::new(key.clone(), event, flags, Arc::downgrade(&self.inner));
         let mut guard = self.inner.interests.lock();
         if guard.contains_key(&key) {
             return Err(AxError::AlreadyExists);
         }
-        guard.insert(key.clone(), Arc::clone(&interest));
+        guard.insert(key, Arc::clone(&interest));
         drop(guard);
         trace!("Epoll add fd: {} interest {:?} ", fd, interest.event.events);
         self.check_and_register_waker(&interest);
@@ -331,16 +456,21 @@ impl Epoll {
     }
 
     pub fn modify(&self, fd: i32, event: EpollEvent, flags: EpollFlags) -> AxResult<()> {
+        if flags.contains(EpollFlags::EXCLUSIVE) {
+            return Err(AxError::InvalidInput);
+        }
         let key = EntryKey::new(fd)?;
-        let interest = Arc::new(EpollInterest::new(key.clone(), event, flags));
+        let interest = EpollInterest::new(key.clone(), event, flags, Arc::downgrade(&self.inner));
 
         let mut guard = self.inner.interests.lock();
         let old = guard.get_mut(&key).ok_or(AxError::NotFound)?;
-
-        // update new interest if old already in ready queue
-        if old.is_in_queue() {
-            interest.in_ready_queue.store(true, Ordering::Release);
+        if old.exclusive {
+            return Err(AxError::InvalidInput);
         }
+
+        // the old interest may still sit in the ready queue; it is skipped
+        // there once marked removed
+        old.mark_removed();
         *old = Arc::clone(&interest);
         drop(guard);
         trace!(
@@ -358,37 +488,65 @@ impl Epoll {
             .interests
             .lock()
             .remove(&key)
-            .ok_or(AxError::NotFound)?;
+            .ok_or(AxError::NotFound)?
+            .mark_removed();
         trace!("Epoll: delete fd={fd}");
         Ok(())
     }
 
+    /// Returns what `epoll_wait` blocks on.
+    ///
+    /// Unlike the instance itself, which `poll` and `select` register with,
+    /// it puts the task on the queue that EPOLLEXCLUSIVE interests wake one
+    /// at a time.
+    pub fn waiter(&self) -> EpollWaiter<'_> {
+        EpollWaiter { epoll: self }
+    }
+
+    /// Removes the current task from the `epoll_wait` queue.
+    ///
+    /// Called when `epoll_wait` returns, so that a later wake-one is not
+    /// spent on a task that is no longer waiting.
+    pub fn unregister_current(&self) {
+        let id = current().id().as_u64();
+        self.inner.waiters.lock().retain(|(tid, _)| *tid != id);
+    }
+
+    /// Collects ready events into `out`.
+    ///
+    /// Only interests that were actually woken are visited, so the cost is
+    /// proportional to the number of ready interests rather than the number
+    /// registered. When several tasks wait on one instance, one of them
+    /// drains the queue at a time and the others find it empty.
     pub fn poll_events(&self, out: &mut [epoll_event]) -> AxResult<usize> {
         trace!("Epoll: poll_events called, out.len()={}", out.len());
-        let mut count = 0;
-        loop {
-            let weak_interest = {
-                let mut queue = self.inner.ready_queue.lock();
-                queue.pop_front()
-            };
+        let mut batch = {
+            let mut queue = self.inner.ready_queue.lock();
+            self.inner.incoming.take_all(&mut queue);
+            mem::take(&mut *queue)
+        };
 
-            let Some(weak_interest) = weak_interest else {
+        let mut count = 0;
+        let mut keep = Vec::new();
+        while count < out.len() {
+            let Some(interest) = batch.pop_front() else {
                 break;
             };
 
-            if count >= out.len() {
-                self.inner.ready_queue.lock().push_front(weak_interest);
-                break;
-            }
-
-            let Some(interest) = weak_interest.upgrade() else {
+            if interest.is_removed() {
                 continue; // interest already removed
-            };
+            }
 
             let Some(file) = interest.key.get_file() else {
                 // file already closed remove interests
-                self.inner.interests.lock().remove(&interest.key);
-                interest.mark_not_in_queue();
+                let mut interests = self.inner.interests.lock();
+                if interests
+                    .get(&interest.key)
+                    .is_some_and(|it| Arc::ptr_eq(it, &interest))
+                {
+                    interests.remove(&interest.key);
+                }
+                interest.mark_removed();
                 continue;
             };
 
@@ -404,10 +562,7 @@ impl Epoll {
                         data: event.user_data,
                     };
                     count += 1;
-                    self.inner
-                        .ready_queue
-                        .lock()
-                        .push_back(Arc::downgrade(&interest));
+                    keep.push(interest);
                 }
                 ConsumeResult::EventAndRemove(event) => {
                     out[count] = epoll_event {
@@ -425,6 +580,23 @@ impl Epoll {
             }
         }
 
+        if !batch.is_empty() || !keep.is_empty() {
+            // Unvisited interests go first, then the level-triggered ones we
+            // just reported, then whatever other callers put back meanwhile.
+            let mut queue = self.inner.ready_queue.lock();
+            let newer = mem::take(&mut *queue);
+            batch.extend(keep);
+            batch.extend(newer);
+            *queue = batch;
+            drop(queue);
+            // Pass the baton, so that a wake-one is not lost on a waiter
+            // that left with events still pending. Events were reported, so
+            // the caller is leaving; take it off the queue first so that the
+            // wakeup reaches another waiter instead of the caller itself.
+            self.unregister_current();
+            self.inner.wake_one();
+        }
+
         if count == 0 {
             Err(AxError::WouldBlock)
         } else {
@@ -457,10 +629,10 @@ impl FileLike for Epoll {
 
 impl Pollable for Epoll {
     fn poll(&self) -> IoEvents {
-        if self.inner.ready_queue.lock().is_empty() {
-            IoEvents::empty()
-        } else {
+        if self.inner.has_ready() {
             IoEvents::IN
+        } else {
+            IoEvents::empty()
         }
     }
 
@@ -470,3 +642,26 @@ impl Pollable for Epoll {
         }
     }
 }
+
+/// An `epoll_wait` caller blocking on an [`Epoll`].
+pub struct EpollWaiter<'a> {
+    epoll: &'a Epoll,
+}
+
+impl Pollable for EpollWaiter<'_> {
+    fn poll(&self) -> IoEvents {
+        self.epoll.poll()
+    }
+
+    fn register(&self, context: &mut Context<'_>, events: IoEvents) {
+        if events.contains(IoEvents::IN) {
+            let id = current().id().as_u64();
+            let mut waiters = self.epoll.inner.waiters.lock();
+            if let Some((_, waker)) = waiters.iter_mut().find(|(tid, _)| *tid == id) {
+                waker.clone_from(context.waker());
+            } else {
+                waiters.push_back((id, context.waker().clone()));
+            }
+        }
+    }
+}
@@ -0,0 +1,173 @@
+//! The per-process file descriptor table.
+//!
+//! Lookups vastly outnumber updates, so the table is guarded by a big-reader
+//! lock: a reader only bumps a counter in a cache line owned by its CPU, and a
+//! writer announces itself and waits for every CPU's readers to drain. Threads
+//! hammering `read`/`write` on different CPUs therefore never share a cache
+//! line through the table itself.
+//!
+//! Like the `spin::RwLock` it replaces, the lock prefers readers: a reader only
+//! backs off while a writer holds the table, not while one waits for readers
+//! to drain. A task holding a read guard may thus take another one, e.g. in
+//! nested `get_file_like` calls. Waiters yield after spinning for a while, so
+//! that a holder preempted on the same CPU gets to run.
+
+use core::{
+    cell::UnsafeCell,
+    hint::spin_loop,
+    ops::{Deref, DerefMut},
+    sync::atomic::{AtomicBool, AtomicUsize, Ordering},
+};
+
+use axconfig::plat::CPU_NUM;
+use axhal::percpu::this_cpu_id;
+use flatten_objects::FlattenObjects;
+use starry_core::resources::AX_FILE_LIMIT;
+
+use super::FileDescriptor;
+
+type Table = FlattenObjects<FileDescriptor, AX_FILE_LIMIT>;
+
+/// Spins before a waiter starts yielding the CPU.
+const SPINS_BEFORE_YIELD: usize = 64;
+
+/// Waits until `done` returns `true`.
+fn spin_until(mut done: impl FnMut() -> bool) {
+    let mut spins = 0;
+    while !done() {
+        if spins < SPINS_BEFORE_YIELD {
+            spins += 1;
+            spin_loop();
+        } else {
+            axtask::yield_now();
+        }
+    }
+}
+
+#[repr(align(64))]
+struct ReaderCount(AtomicUsize);
+
+/// A file descriptor table with per-CPU reader counts.
+pub struct FdTable {
+    readers: [ReaderCount; CPU_NUM],
+    /// Taken by a writer, waiting or not.
+    writer: AtomicBool,
+    /// Set while a writer holds the table.
+    active: AtomicBool,
+    table: UnsafeCell<Table>,
+}
+
+// SAFETY: access to `table` is serialized by the reader counts and `active`.
+unsafe impl Sync for FdTable {}
+unsafe impl Send for FdTable {}
+
+impl Default for FdTable {
+    fn default() -> Self {
+        Self {
+            readers: [const { ReaderCount(AtomicUsize::new(0)) }; CPU_NUM],
+            writer: AtomicBool::new(false),
+            active: AtomicBool::new(false),
+            table: UnsafeCell::new(FlattenObjects::new()),
+        }
+    }
+}
+
+impl FdTable {
+    /// Locks the table for shared access.
+    pub fn read(&self) -> FdTableReadGuard<'_> {
+        loop {
+            // The task may migrate after this; the guard remembers the slot.
+            let slot = this_cpu_id() % CPU_NUM;
+            self.readers[slot].0.fetch_add(1, Ordering::SeqCst);
+            if !self.active.load(Ordering::SeqCst) {
+                return FdTableReadGuard { lock: self, slot };
+            }
+            self.readers[slot].0.fetch_sub(1, Ordering::Release);
+            spin_until(|| !self.active.load(Ordering::Relaxed));
+        }
+    }
+
+    /// Locks the table for exclusive access.
+    pub fn write(&self) -> FdTableWriteGuard<'_> {
+        spin_until(|| {
+            self.writer
+                .compare_exchange_weak(false, true, Ordering::Acquire, Ordering::Relaxed)
+                .is_ok()
+        });
+        loop {
+            spin_until(|| self.drained());
+            self.active.store(true, Ordering::SeqCst);
+            if self.drained() {
+                return FdTableWriteGuard { lock: self };
+            }
+            // A reader got in before it could see `active`; let it finish.
+            self.active.store(false, Ordering::SeqCst);
+        }
+    }
+
+    /// Whether no reader holds the table.
+    fn drained(&self) -> bool {
+        self.readers
+            .iter()
+            .all(|reader| reader.0.load(Ordering::SeqCst) == 0)
+    }
+
+    /// Accesses the table without taking the lock.
+    ///
+    /// # Safety
+    ///
+    /// The caller must guarantee that no writer can run concurrently, i.e. it
+    /// is the only thread using this table.
+    pub unsafe fn get_unlocked(&self) -> &Table {
+        unsafe { &*self.table.get() }
+    }
+}
+
+pub struct FdTableReadGuard<'a> {
+    lock: &'a FdTable,
+    slot: usize,
+}
+
+impl Deref for FdTableReadGuard<'_> {
+    type Target = Table;
+
+    fn deref(&self) -> &Table {
+        // SAFETY: writers wait for this guard to be dropped.
+        unsafe { &*self.lock.table.get() }
+    }
+}
+
+impl Drop for FdTableReadGuard<'_> {
+    fn drop(&mut self) {
+        self.lock.readers[self.slot]
+            .0
+            .fetch_sub(1, Ordering::Release);
+    }
+}
+
+pub struct FdTableWriteGuard<'a> {
+    lock: &'a FdTable,
+}
+
+impl Deref for FdTableWriteGuard<'_> {
+    type Target = Table;
+
+    fn deref(&self) -> &Table {
+        // SAFETY: this guard excludes all readers and other writers.
+        unsafe { &*self.lock.table.get() }
+    }
+}
+
+impl DerefMut for FdTableWriteGuard<'_> {
+    fn deref_mut(&mut self) -> &mut Table {
+        // SAFETY: this guard excludes all readers and other writers.
+        unsafe { &mut *self.lock.table.get() }
+    }
+}
+
+impl Drop for FdTableWriteGuard<'_> {
+    fn drop(&mut self) {
+        self.lock.active.store(false, Ordering::Release);
+        self.lock.writer.store(false, Ordering::Release);
+    }
+}
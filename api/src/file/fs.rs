@@ -8,16 +8,24 @@ use core::{
 };
 
 use axerrno::{AxError, AxResult};
-use axfs::{FS_CONTEXT, FsContext};
+use axfs::{FS_CONTEXT, FileBackend, FsContext};
 use axfs_ng_vfs::{Location, Metadata, NodeFlags};
 use axpoll::{IoEvents, Pollable};
 use axsync::Mutex;
 use axtask::future::{block_on, poll_io};
-use linux_raw_sys::general::{AT_EMPTY_PATH, AT_FDCWD, AT_SYMLINK_NOFOLLOW};
+use linux_raw_sys::general::{
+    AT_EMPTY_PATH, AT_FDCWD, AT_SYMLINK_NOFOLLOW, POSIX_FADV_DONTNEED, POSIX_FADV_NOREUSE,
+    POSIX_FADV_NORMAL, POSIX_FADV_RANDOM, POSIX_FADV_SEQUENTIAL, POSIX_FADV_WILLNEED,
+};
 
 use super::{FileLike, Kstat, get_file_like};
 use crate::file::{SealedBuf, SealedBufMut};
-use crate::vfs::readahead::{ReadaheadAction, ReadaheadState, do_sync_readahead, readahead_decide};
+use crate::vfs::prefetch::{FileId, PrefetchHandle};
+use crate::vfs::readahead::{
+    PAGE_SIZE, RaAdvice, ReadaheadAction, ReadaheadState, do_sync_readahead, mount_window,
+    readahead_decide,
+};
+use crate::vfs::{cache_only, reclaim, writeback};
 use axio::BufMut;
 
 pub fn with_fs<R>(dirfd: c_int, f: impl FnOnce(&mut FsContext) -> AxResult<R>) -> AxResult<R> {
@@ -105,6 +113,10 @@ pub struct File {
     nonblock: AtomicBool,
     /// Readahead state for sequential read optimization
     ra_state: ReadaheadState,
+    /// Owns the windows this file queued for the readahead workers
+    prefetch: PrefetchHandle,
+    /// Identity of the file, looked up on first use
+    id: spin::Once<Option<FileId>>,
 }
 
 impl File {
@@ -113,6 +125,8 @@ impl File {
             inner,
             nonblock: AtomicBool::new(false),
             ra_state: ReadaheadState::new(),
+            prefetch: PrefetchHandle::new(),
+            id: spin::Once::new(),
         }
     }
 
@@ -133,6 +147,11 @@ impl File {
             Err(_) => return,
         };
 
+        if !self.ra_state.has_window() {
+            self.ra_state
+                .set_window(mount_window(&path_for(self.inner.location())));
+        }
+
         // Get current file position
         let offset = self.inner.position();
 
@@ -146,20 +165,136 @@ impl File {
             } => {
                 // Perform sync readahead
                 do_sync_readahead(backend, start_page, num_pages);
+                self.readahead_done(backend, start_page, num_pages);
             }
             ReadaheadAction::Async {
                 start_page,
                 num_pages,
             } => {
-                // Perform async readahead
-                let backend = backend.clone();
-                axtask::spawn(move || {
-                    backend.try_prefetch_pages(start_page, num_pages);
-                });
+                // Hand the window over to the readahead workers
+                self.prefetch_async(backend, start_page, num_pages);
+                self.readahead_done(backend, start_page, num_pages);
             }
             ReadaheadAction::None => {}
         }
     }
+
+    fn prefetch_async(&self, backend: &FileBackend, start_page: u32, num_pages: u32) {
+        let Some(file) = self.file_id() else {
+            return;
+        };
+        self.prefetch.submit(file, backend, start_page, num_pages);
+    }
+
+    /// Queue the pages of a readahead window for reclaim before the pages
+    /// the application actually reads.
+    fn readahead_done(&self, backend: &FileBackend, start_page: u32, num_pages: u32) {
+        if let Some(file) = self.file_id() {
+            let pages = start_page..start_page.saturating_add(num_pages);
+            reclaim::note_readahead(file, backend, pages);
+        }
+    }
+
+    /// Identifies the file for readahead, writeback and reclaim.
+    fn file_id(&self) -> Option<FileId> {
+        *self.id.call_once(|| {
+            let metadata = self.inner.location().metadata().ok()?;
+            Some(FileId {
+                device: metadata.device,
+                inode: metadata.inode,
+            })
+        })
+    }
+
+    /// Record that `len` bytes at `offset` were read, for reclaim.
+    ///
+    /// Reads that bypass [`FileLike::read`], like `pread`, must call this.
+    pub fn accessed(&self, offset: u64, len: usize) {
+        if len > 0
+            && let Ok(backend) = self.inner.backend()
+            && matches!(backend, FileBackend::Cached(_))
+            && let Some(file) = self.file_id()
+        {
+            let start = (offset / PAGE_SIZE).min(u32::MAX as u64) as u32;
+            let end = (offset + len as u64)
+                .div_ceil(PAGE_SIZE)
+                .min(u32::MAX as u64) as u32;
+            reclaim::mark_accessed(file, backend, start..end);
+        }
+    }
+
+    /// Record that `len` bytes at `offset` were written, for writeback.
+    ///
+    /// Writes that bypass [`FileLike::write`], like `pwrite`, must call this.
+    pub fn written(&self, offset: u64, len: usize) {
+        if let Ok(backend) = self.inner.backend()
+            && matches!(backend, FileBackend::Cached(_))
+            && let Some(file) = self.file_id()
+        {
+            writeback::account_write(file, backend, self.inner.flags(), offset, len);
+        }
+    }
+
+    /// Flush the file to its storage, as `fsync` and `fdatasync` do.
+    pub fn sync(&self, data_only: bool) -> AxResult {
+        match self.file_id() {
+            Some(file) => writeback::sync_file(file, || self.inner.sync(data_only)),
+            None => self.inner.sync(data_only),
+        }
+    }
+
+    /// Apply a `posix_fadvise` hint to `[offset, offset + len)`.
+    ///
+    /// A `len` of 0 extends the range to the end of the file.
+    pub fn advise(&self, advice: u32, offset: u64, len: u64) -> AxResult {
+        match advice {
+            POSIX_FADV_NORMAL => self.ra_state.advise(RaAdvice::Normal),
+            POSIX_FADV_SEQUENTIAL => self.ra_state.advise(RaAdvice::Sequential),
+            POSIX_FADV_RANDOM => self.ra_state.advise(RaAdvice::Random),
+            POSIX_FADV_NOREUSE => {}
+            POSIX_FADV_WILLNEED | POSIX_FADV_DONTNEED => {
+                let Ok(backend) = self.inner.backend() else {
+                    return Ok(());
+                };
+                let end = if len == 0 {
+                    self.inner.location().metadata()?.size
+                } else {
+                    offset.saturating_add(len)
+                };
+                // Pages are read in if touched at all, but only dropped if
+                // they lie entirely inside the range (or past EOF).
+                let willneed = advice == POSIX_FADV_WILLNEED;
+                let start_page = if willneed {
+                    offset / PAGE_SIZE
+                } else {
+                    offset.div_ceil(PAGE_SIZE)
+                };
+                let end_page = if willneed || len == 0 {
+                    end.div_ceil(PAGE_SIZE)
+                } else {
+                    end / PAGE_SIZE
+                };
+                let start_page = start_page.min(u32::MAX as u64) as u32;
+                let end_page = end_page.min(u32::MAX as u64) as u32;
+                if end_page <= start_page {
+                    return Ok(());
+                }
+                let num_pages = end_page - start_page;
+                if willneed {
+                    self.prefetch_async(backend, start_page, num_pages);
+                } else if !cache_only(backend) {
+                    // The cache is the only copy of tmpfs files. Elsewhere,
+                    // dirty pages are written back before being dropped.
+                    if let Some(file) = self.file_id() {
+                        writeback::writeback(file)?;
+                    }
+                    backend.evict_pages(start_page, num_pages);
+                }
+            }
+            _ => return Err(AxError::InvalidInput),
+        }
+        Ok(())
+    }
 }
 
 fn path_for(loc: &Location) -> Cow<'static, str> {
@@ -175,24 +310,29 @@ impl FileLike for File {
         // Trigger readahead for sequential access optimization
         self.maybe_readahead(read_len);
 
-        if likely(self.is_blocking()) {
-            inner.read(dst)
+        let read = if likely(self.is_blocking()) {
+            inner.read(dst)?
         } else {
             block_on(poll_io(self, IoEvents::IN, self.nonblocking(), || {
                 inner.read(dst)
-            }))
-        }
+            }))?
+        };
+        self.accessed(inner.position().saturating_sub(read as u64), read);
+        Ok(read)
     }
 
     fn write(&self, src: &mut SealedBuf) -> AxResult<usize> {
         let inner = self.inner();
-        if likely(self.is_blocking()) {
-            inner.write(src)
+        let written = if likely(self.is_blocking()) {
+            inner.write(src)?
         } else {
             block_on(poll_io(self, IoEvents::OUT, self.nonblocking(), || {
                 inner.write(src)
-            }))
-        }
+            }))?
+        };
+        // The position is past the data just written, even for appends.
+        self.written(inner.position().saturating_sub(written as u64), written);
+        Ok(written)
     }
 
     fn stat(&self) -> AxResult<Kstat> {
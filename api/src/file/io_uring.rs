@@ -0,0 +1,875 @@
+//! Asynchronous I/O through io_uring submission and completion rings.
+//!
+//! The SQ/CQ rings and the SQE array live in [`SharedPages`] that userspace
+//! maps through `sys_mmap` at the `IORING_OFF_*` offsets. The kernel reaches
+//! them through the linear mapping of those pages, so an `munmap` of the rings
+//! cannot make a ring access fault.
+//!
+//! Submission never blocks. A request whose file is not ready parks a waker on
+//! that file's [`Pollable`] and is retried from `io_uring_enter`, which then
+//! posts its completion, much like Linux runs deferred completions as task
+//! work of the submitter instead of on a dedicated kernel thread. Polling the
+//! ring never runs requests; it reports the ring readable while woken requests
+//! wait for `io_uring_enter`, like `io_has_work` does on Linux.
+
+use alloc::{borrow::Cow, collections::VecDeque, sync::Arc, task::Wake, vec::Vec};
+use core::{
+    any::Any,
+    mem, ptr,
+    sync::atomic::{AtomicBool, AtomicU32, Ordering},
+    task::{Context, Waker},
+    time::Duration,
+};
+
+use axerrno::{AxError, AxResult, LinuxError};
+use axhal::{mem::phys_to_virt, paging::PageSize, time::monotonic_time};
+use axmm::backend::SharedPages;
+use axnet::{RecvFlags, RecvOptions, SendFlags, SendOptions, SocketOps};
+use axpoll::{IoEvents, PollSet, Pollable};
+use axsync::Mutex;
+use axtask::future::{self, block_on, poll_io};
+use linux_raw_sys::{
+    general::{O_CLOEXEC, O_NONBLOCK, timespec},
+    net::{MSG_PEEK, MSG_TRUNC, sockaddr, socklen_t},
+};
+use memory_addr::{PAGE_SIZE_4K, align_up_4k};
+
+use super::{File, FileLike, Kstat, SealedBuf, SealedBufMut, Socket, get_file_like};
+use crate::{
+    io::{IoVec, IoVectorBuf},
+    mm::{UserConstPtr, UserPtr, VmBytes, VmBytesMut},
+    socket::SocketAddrExt,
+    time::TimeValueLike,
+};
+
+// Values from `include/uapi/linux/io_uring.h`.
+pub const IORING_SETUP_CQSIZE: u32 = 1 << 3;
+pub const IORING_FEAT_SINGLE_MMAP: u32 = 1 << 0;
+pub const IORING_FEAT_NODROP: u32 = 1 << 1;
+pub const IORING_ENTER_GETEVENTS: u32 = 1 << 0;
+pub const IORING_ENTER_EXT_ARG: u32 = 1 << 3;
+pub const IORING_OFF_SQ_RING: usize = 0;
+pub const IORING_OFF_CQ_RING: usize = 0x800_0000;
+pub const IORING_OFF_SQES: usize = 0x1000_0000;
+pub const IORING_REGISTER_BUFFERS: u32 = 0;
+pub const IORING_UNREGISTER_BUFFERS: u32 = 1;
+pub const IORING_REGISTER_FILES: u32 = 2;
+pub const IORING_UNREGISTER_FILES: u32 = 3;
+
+const IOSQE_FIXED_FILE: u8 = 1 << 0;
+const IORING_TIMEOUT_ABS: u32 = 1 << 0;
+
+const IORING_OP_NOP: u8 = 0;
+const IORING_OP_READV: u8 = 1;
+const IORING_OP_WRITEV: u8 = 2;
+const IORING_OP_FSYNC: u8 = 3;
+const IORING_OP_READ_FIXED: u8 = 4;
+const IORING_OP_WRITE_FIXED: u8 = 5;
+const IORING_OP_POLL_ADD: u8 = 6;
+const IORING_OP_TIMEOUT: u8 = 11;
+const IORING_OP_ACCEPT: u8 = 13;
+const IORING_OP_READ: u8 = 22;
+const IORING_OP_WRITE: u8 = 23;
+const IORING_OP_SEND: u8 = 26;
+const IORING_OP_RECV: u8 = 27;
+
+/// Maximum number of submission queue entries.
+pub const IORING_MAX_ENTRIES: u32 = 4096;
+
+/// Parameters of `io_uring_setup`, laid out like `struct io_uring_params`.
+#[repr(C)]
+#[derive(Debug, Clone, Copy, Default)]
+pub struct IoUringParams {
+    pub sq_entries: u32,
+    pub cq_entries: u32,
+    pub flags: u32,
+    pub sq_thread_cpu: u32,
+    pub sq_thread_idle: u32,
+    pub features: u32,
+    pub wq_fd: u32,
+    pub resv: [u32; 3],
+    pub sq_off: SqRingOffsets,
+    pub cq_off: CqRingOffsets,
+}
+
+/// Laid out like `struct io_sqring_offsets`.
+#[repr(C)]
+#[derive(Debug, Clone, Copy, Default)]
+pub struct SqRingOffsets {
+    pub head: u32,
+    pub tail: u32,
+    pub ring_mask: u32,
+    pub ring_entries: u32,
+    pub flags: u32,
+    pub dropped: u32,
+    pub array: u32,
+    pub resv1: u32,
+    pub user_addr: u64,
+}
+
+/// Laid out like `struct io_cqring_offsets`.
+#[repr(C)]
+#[derive(Debug, Clone, Copy, Default)]
+pub struct CqRingOffsets {
+    pub head: u32,
+    pub tail: u32,
+    pub ring_mask: u32,
+    pub ring_entries: u32,
+    pub overflow: u32,
+    pub cqes: u32,
+    pub flags: u32,
+    pub resv1: u32,
+    pub user_addr: u64,
+}
+
+/// Submission queue entry, laid out like `struct io_uring_sqe`.
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+struct Sqe {
+    opcode: u8,
+    flags: u8,
+    ioprio: u16,
+    fd: i32,
+    off: u64,
+    addr: u64,
+    len: u32,
+    /// `rw_flags`, `poll32_events`, `msg_flags`, `timeout_flags`, ...
+    op_flags: u32,
+    user_data: u64,
+    buf_index: u16,
+    personality: u16,
+    file_index: u32,
+    addr3: u64,
+    _pad: u64,
+}
+
+/// Completion queue entry, laid out like `struct io_uring_cqe`.
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+struct Cqe {
+    user_data: u64,
+    res: i32,
+    flags: u32,
+}
+
+/// Head of the shared ring region. The CQE array follows it directly and the
+/// SQ index array follows the CQEs.
+#[repr(C, align(64))]
+struct RingHeader {
+    sq_head: AtomicU32,
+    sq_tail: AtomicU32,
+    sq_ring_mask: AtomicU32,
+    sq_ring_entries: AtomicU32,
+    sq_flags: AtomicU32,
+    sq_dropped: AtomicU32,
+    cq_head: AtomicU32,
+    cq_tail: AtomicU32,
+    cq_ring_mask: AtomicU32,
+    cq_ring_entries: AtomicU32,
+    cq_overflow: AtomicU32,
+    cq_flags: AtomicU32,
+}
+
+const CQES_OFFSET: usize = size_of::<RingHeader>();
+
+/// Returns the kernel address of the `T` at `offset` bytes into `pages`.
+///
+/// Ring entries are at most 64 bytes, divide the page size and are naturally
+/// aligned, so an entry never straddles two pages.
+fn kernel_ptr<T>(pages: &SharedPages, offset: usize) -> *mut T {
+    phys_to_virt(pages[offset / PAGE_SIZE_4K] + offset % PAGE_SIZE_4K)
+        .as_mut_ptr()
+        .cast()
+}
+
+/// The rings as seen through the kernel mapping of their pages.
+struct RingView<'a> {
+    header: &'a RingHeader,
+    rings: &'a SharedPages,
+    sqes: &'a SharedPages,
+    sq_entries: u32,
+    cq_entries: u32,
+}
+
+impl RingView<'_> {
+    fn cq_len(&self) -> u32 {
+        let head = self.header.cq_head.load(Ordering::Acquire);
+        let tail = self.header.cq_tail.load(Ordering::Relaxed);
+        tail.wrapping_sub(head)
+    }
+
+    fn push_cqe(&self, cqe: Cqe) -> bool {
+        let tail = self.header.cq_tail.load(Ordering::Relaxed);
+        if self.cq_len() >= self.cq_entries {
+            return false;
+        }
+        let index = (tail & (self.cq_entries - 1)) as usize;
+        let slot = kernel_ptr::<Cqe>(self.rings, CQES_OFFSET + index * size_of::<Cqe>());
+        // SAFETY: the index is masked into the CQE array of the ring pages.
+        unsafe { ptr::write_volatile(slot, cqe) };
+        self.header
+            .cq_tail
+            .store(tail.wrapping_add(1), Ordering::Release);
+        true
+    }
+
+    /// Pops the next submission, or `None` if the queue is empty.
+    fn pop_sqe(&self) -> Option<Result<Sqe, ()>> {
+        let head = self.header.sq_head.load(Ordering::Relaxed);
+        let tail = self.header.sq_tail.load(Ordering::Acquire);
+        if head == tail {
+            return None;
+        }
+        let slot = IoUring::sq_array_offset(self.cq_entries)
+            + (head & (self.sq_entries - 1)) as usize * size_of::<u32>();
+        // SAFETY: the slot is masked into the SQ index array of the ring pages.
+        let index = unsafe { ptr::read_volatile(kernel_ptr::<u32>(self.rings, slot)) };
+        let sqe = (index < self.sq_entries)
+            .then(|| {
+                let sqe = kernel_ptr::<Sqe>(self.sqes, index as usize * size_of::<Sqe>());
+                // SAFETY: the index is bounded by the SQE array.
+                unsafe { ptr::read_volatile(sqe) }
+            })
+            .ok_or(());
+        self.header
+            .sq_head
+            .store(head.wrapping_add(1), Ordering::Release);
+        Some(sqe)
+    }
+}
+
+/// Waker parked on a file on behalf of a pending request.
+struct OpWaker {
+    fired: AtomicBool,
+    /// Set for the whole ring until the next reap.
+    work: Arc<AtomicBool>,
+    poll_cq: Arc<PollSet>,
+}
+
+impl Wake for OpWaker {
+    fn wake(self: Arc<Self>) {
+        self.wake_by_ref();
+    }
+
+    fn wake_by_ref(self: &Arc<Self>) {
+        self.fired.store(true, Ordering::Release);
+        self.work.store(true, Ordering::Release);
+        self.poll_cq.wake();
+    }
+}
+
+struct PendingOp {
+    sqe: Sqe,
+    file: Option<Arc<dyn FileLike>>,
+    /// Monotonic deadline of a `TIMEOUT` request.
+    deadline: Option<Duration>,
+    /// Completion count that satisfies a `TIMEOUT` request early.
+    target: Option<u64>,
+    waker: Arc<OpWaker>,
+}
+
+enum Progress {
+    Done(i32),
+    /// Wait until the file reports these events.
+    Wait(IoEvents),
+    /// Wait until the deadline or the completion target.
+    Sleep(Duration, Option<u64>),
+}
+
+#[derive(Default)]
+struct RingState {
+    pending: Vec<PendingOp>,
+    /// Completions that did not fit into the CQ ring yet.
+    overflow: VecDeque<Cqe>,
+    /// Number of completions posted so far.
+    completions: u64,
+    files: Vec<Option<Arc<dyn FileLike>>>,
+    buffers: Vec<(usize, usize)>,
+}
+
+impl RingState {
+    fn next_deadline(&self) -> Option<Duration> {
+        self.pending.iter().filter_map(|op| op.deadline).min()
+    }
+}
+
+/// An io_uring instance.
+pub struct IoUring {
+    sq_entries: u32,
+    cq_entries: u32,
+    rings: Arc<SharedPages>,
+    sqes: Arc<SharedPages>,
+    state: Mutex<RingState>,
+    /// Whether `state.overflow` holds completions, for `poll`.
+    overflowed: AtomicBool,
+    /// Whether a parked request was woken since the last reap.
+    work: Arc<AtomicBool>,
+    poll_cq: Arc<PollSet>,
+}
+
+impl IoUring {
+    pub fn new(sq_entries: u32, cq_entries: u32) -> AxResult<Self> {
+        let ring = Self {
+            sq_entries,
+            cq_entries,
+            rings: Arc::new(SharedPages::new(
+                Self::rings_size(sq_entries, cq_entries),
+                PageSize::Size4K,
+            )?),
+            sqes: Arc::new(SharedPages::new(
+                align_up_4k(sq_entries as usize * size_of::<Sqe>()),
+                PageSize::Size4K,
+            )?),
+            state: Mutex::new(RingState::default()),
+            overflowed: AtomicBool::new(false),
+            work: Arc::new(AtomicBool::new(false)),
+            poll_cq: Arc::new(PollSet::new()),
+        };
+        let header = ring.view().header;
+        header.sq_ring_mask.store(sq_entries - 1, Ordering::Relaxed);
+        header.sq_ring_entries.store(sq_entries, Ordering::Relaxed);
+        header.cq_ring_mask.store(cq_entries - 1, Ordering::Relaxed);
+        header.cq_ring_entries.store(cq_entries, Ordering::Relaxed);
+        Ok(ring)
+    }
+
+    fn sq_array_offset(cq_entries: u32) -> usize {
+        CQES_OFFSET + cq_entries as usize * size_of::<Cqe>()
+    }
+
+    fn rings_size(sq_entries: u32, cq_entries: u32) -> usize {
+        align_up_4k(Self::sq_array_offset(cq_entries) + sq_entries as usize * size_of::<u32>())
+    }
+
+    /// Fills in the ring geometry reported by `io_uring_setup`.
+    pub fn fill_params(&self, params: &mut IoUringParams) {
+        macro_rules! offset {
+            ($field:ident) => {
+                core::mem::offset_of!(RingHeader, $field) as u32
+            };
+        }
+        params.sq_entries = self.sq_entries;
+        params.cq_entries = self.cq_entries;
+        params.features = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP;
+        params.sq_off = SqRingOffsets {
+            head: offset!(sq_head),
+            tail: offset!(sq_tail),
+            ring_mask: offset!(sq_ring_mask),
+            ring_entries: offset!(sq_ring_entries),
+            flags: offset!(sq_flags),
+            dropped: offset!(sq_dropped),
+            array: Self::sq_array_offset(self.cq_entries) as u32,
+            ..Default::default()
+        };
+        params.cq_off = CqRingOffsets {
+            head: offset!(cq_head),
+            tail: offset!(cq_tail),
+            ring_mask: offset!(cq_ring_mask),
+            ring_entries: offset!(cq_ring_entries),
+            overflow: offset!(cq_overflow),
+            cqes: CQES_OFFSET as u32,
+            flags: offset!(cq_flags),
+            ..Default::default()
+        };
+    }
+
+    /// Returns the pages backing the region at mmap `offset`, and its size.
+    pub fn mmap_region(&self, offset: usize) -> AxResult<(Arc<SharedPages>, usize)> {
+        match offset {
+            IORING_OFF_SQ_RING | IORING_OFF_CQ_RING => Ok((
+                self.rings.clone(),
+                Self::rings_size(self.sq_entries, self.cq_entries),
+            )),
+            IORING_OFF_SQES => Ok((
+                self.sqes.clone(),
+                align_up_4k(self.sq_entries as usize * size_of::<Sqe>()),
+            )),
+            _ => Err(AxError::InvalidInput),
+        }
+    }
+
+    fn view(&self) -> RingView<'_> {
+        RingView {
+            // SAFETY: the header is at the start of the first ring page, which
+            // lives as long as `self`.
+            header: unsafe { &*kernel_ptr::<RingHeader>(&self.rings, 0) },
+            rings: &self.rings,
+            sqes: &self.sqes,
+            sq_entries: self.sq_entries,
+            cq_entries: self.cq_entries,
+        }
+    }
+
+    /// Submits up to `to_submit` requests and, with `IORING_ENTER_GETEVENTS`,
+    /// waits until at least `min_complete` completions are available.
+    ///
+    /// Returns the number of requests consumed from the SQ ring.
+    pub fn enter(&self, to_submit: u32, min_complete: u32, flags: u32) -> AxResult<usize> {
+        let ring = self.view();
+        let submitted = {
+            let mut state = self.state.lock();
+            let submitted = self.submit(&ring, &mut state, to_submit);
+            self.reap(&ring, &mut state);
+            submitted
+        };
+
+        if flags & IORING_ENTER_GETEVENTS == 0 {
+            return Ok(submitted);
+        }
+        let min_complete = min_complete.min(self.cq_entries);
+        while ring.cq_len() < min_complete {
+            let timeout = self
+                .state
+                .lock()
+                .next_deadline()
+                .map(|deadline| deadline.saturating_sub(monotonic_time()));
+            let result = block_on(future::timeout(
+                timeout,
+                poll_io(self, IoEvents::IN, false, || {
+                    self.reap(&ring, &mut self.state.lock());
+                    if ring.cq_len() >= min_complete {
+                        Ok(())
+                    } else {
+                        Err(AxError::WouldBlock)
+                    }
+                }),
+            ));
+            match result {
+                Ok(Ok(())) => break,
+                Ok(Err(err)) if submitted == 0 => return Err(err),
+                Ok(Err(_)) => break,
+                // A TIMEOUT request expired; reap it on the next iteration.
+                Err(_) => self.reap(&ring, &mut self.state.lock()),
+            }
+        }
+        Ok(submitted)
+    }
+
+    fn submit(&self, ring: &RingView<'_>, state: &mut RingState, to_submit: u32) -> usize {
+        let mut submitted = 0;
+        while submitted < to_submit as usize {
+            let Some(sqe) = ring.pop_sqe() else {
+                break;
+            };
+            submitted += 1;
+            let Ok(sqe) = sqe else {
+                ring.header.sq_dropped.fetch_add(1, Ordering::Relaxed);
+                continue;
+            };
+            let file = match self.resolve_file(state, &sqe) {
+                Ok(file) => file,
+                Err(err) => {
+                    self.post_error(ring, state, &sqe, err);
+                    continue;
+                }
+            };
+            self.dispatch(ring, state, sqe, file);
+        }
+        submitted
+    }
+
+    fn resolve_file(&self, state: &RingState, sqe: &Sqe) -> AxResult<Option<Arc<dyn FileLike>>> {
+        if matches!(sqe.opcode, IORING_OP_NOP | IORING_OP_TIMEOUT) {
+            return Ok(None);
+        }
+        let file = if sqe.flags & IOSQE_FIXED_FILE != 0 {
+            state
+                .files
+                .get(sqe.fd as usize)
+                .cloned()
+                .flatten()
+                .ok_or(AxError::BadFileDescriptor)?
+        } else {
+            get_file_like(sqe.fd)?
+        };
+        // A request on the ring itself would keep it alive from its own state.
+        if ptr::addr_eq(Arc::as_ptr(&file), self as *const Self) {
+            return Err(AxError::InvalidInput);
+        }
+        Ok(Some(file))
+    }
+
+    /// Runs a request and either completes it or parks it.
+    fn dispatch(
+        &self,
+        ring: &RingView<'_>,
+        state: &mut RingState,
+        sqe: Sqe,
+        file: Option<Arc<dyn FileLike>>,
+    ) {
+        match execute(state, &sqe, file.as_ref()) {
+            Ok(Progress::Done(res)) => self.post(ring, state, sqe.user_data, res),
+            Ok(Progress::Wait(events)) => {
+                let waker = self.new_waker();
+                if let Some(file) = &file {
+                    let w = Waker::from(waker.clone());
+                    file.register(&mut Context::from_waker(&w), events);
+                    if !(file.poll() & events).is_empty() {
+                        waker.fired.store(true, Ordering::Release);
+                    }
+                }
+                state.pending.push(PendingOp {
+                    sqe,
+                    file,
+                    deadline: None,
+                    target: None,
+                    waker,
+                });
+            }
+            Ok(Progress::Sleep(deadline, count)) => {
+                let target = count.map(|count| state.completions + count);
+                state.pending.push(PendingOp {
+                    sqe,
+                    file,
+                    deadline: Some(deadline),
+                    target,
+                    waker: self.new_waker(),
+                });
+            }
+            Err(err) => self.post_error(ring, state, &sqe, err),
+        }
+    }
+
+    /// Flushes overflowed completions and retries pending requests that were
+    /// woken, expired or satisfied.
+    fn reap(&self, ring: &RingView<'_>, state: &mut RingState) {
+        while let Some(cqe) = state.overflow.front() {
+            if !ring.push_cqe(*cqe) {
+                break;
+            }
+            state.overflow.pop_front();
+        }
+        self.overflowed
+            .store(!state.overflow.is_empty(), Ordering::Release);
+        // Wakeups from here on are seen through the `fired` flags below.
+        self.work.store(false, Ordering::Release);
+
+        // Requests re-parked below are only looked at again on the next reap.
+        let now = monotonic_time();
+        for op in mem::take(&mut state.pending) {
+            let expired = op.deadline.is_some_and(|deadline| deadline <= now);
+            let satisfied = op.target.is_some_and(|target| state.completions >= target);
+            let fired = op.waker.fired.swap(false, Ordering::AcqRel);
+            if !(expired || satisfied || fired) {
+                state.pending.push(op);
+            } else if op.deadline.is_some() {
+                let res = if satisfied {
+                    0
+                } else {
+                    -LinuxError::ETIME.code()
+                };
+                self.post(ring, state, op.sqe.user_data, res);
+            } else {
+                self.dispatch(ring, state, op.sqe, op.file);
+            }
+        }
+    }
+
+    fn new_waker(&self) -> Arc<OpWaker> {
+        Arc::new(OpWaker {
+            fired: AtomicBool::new(false),
+            work: self.work.clone(),
+            poll_cq: self.poll_cq.clone(),
+        })
+    }
+
+    fn post(&self, ring: &RingView<'_>, state: &mut RingState, user_data: u64, res: i32) {
+        let cqe = Cqe {
+            user_data,
+            res,
+            flags: 0,
+        };
+        if !state.overflow.is_empty() || !ring.push_cqe(cqe) {
+            state.overflow.push_back(cqe);
+            self.overflowed.store(true, Ordering::Release);
+        }
+        state.completions += 1;
+        self.poll_cq.wake();
+    }
+
+    fn post_error(&self, ring: &RingView<'_>, state: &mut RingState, sqe: &Sqe, err: AxError) {
+        self.post(ring, state, sqe.user_data, -LinuxError::from(err).code());
+    }
+
+    /// Handles `io_uring_register`.
+    pub fn register(&self, opcode: u32, arg: usize, nr_args: u32) -> AxResult<isize> {
+        let mut state = self.state.lock();
+        match opcode {
+            IORING_REGISTER_BUFFERS => {
+                if !state.buffers.is_empty() {
+                    return Err(AxError::ResourceBusy);
+                }
+                let iovs = UserConstPtr::<IoVec>::from(arg).get_as_slice(nr_args as usize)?;
+                let mut buffers = Vec::with_capacity(iovs.len());
+                for iov in iovs {
+                    if iov.iov_len < 0 {
+                        return Err(AxError::InvalidInput);
+                    }
+                    buffers.push((iov.iov_base as usize, iov.iov_len as usize));
+                }
+                state.buffers = buffers;
+            }
+            IORING_UNREGISTER_BUFFERS => {
+                if state.buffers.is_empty() {
+                    return Err(AxError::from(LinuxError::ENXIO));
+                }
+                state.buffers.clear();
+            }
+            IORING_REGISTER_FILES => {
+                if !state.files.is_empty() {
+                    return Err(AxError::ResourceBusy);
+                }
+                let fds = UserConstPtr::<i32>::from(arg).get_as_slice(nr_args as usize)?;
+                state.files = fds
+                    .iter()
+                    .map(|&fd| (fd >= 0).then(|| get_file_like(fd)).transpose())
+                    .collect::<AxResult<_>>()?;
+            }
+            IORING_UNREGISTER_FILES => {
+                if state.files.is_empty() {
+                    return Err(AxError::from(LinuxError::ENXIO));
+                }
+                state.files.clear();
+            }
+            _ => return Err(AxError::InvalidInput),
+        }
+        Ok(0)
+    }
+}
+
+impl FileLike for IoUring {
+    fn read(&self, _dst: &mut SealedBufMut) -> AxResult<usize> {
+        Err(AxError::InvalidInput)
+    }
+
+    fn write(&self, _src: &mut SealedBuf) -> AxResult<usize> {
+        Err(AxError::InvalidInput)
+    }
+
+    fn stat(&self) -> AxResult<Kstat> {
+        Ok(Kstat::default())
+    }
+
+    fn path(&self) -> Cow<str> {
+        "anon_inode:[io_uring]".into()
+    }
+
+    fn into_any(self: Arc<Self>) -> Arc<dyn Any + Send + Sync> {
+        self
+    }
+}
+
+impl Pollable for IoUring {
+    fn poll(&self) -> IoEvents {
+        let mut events = IoEvents::empty();
+        // Woken requests complete on the next `io_uring_enter`, which the
+        // reader has to make to see them.
+        let ready = self.view().cq_len() > 0
+            || self.overflowed.load(Ordering::Acquire)
+            || self.work.load(Ordering::Acquire);
+        events.set(IoEvents::IN, ready);
+        events
+    }
+
+    fn register(&self, context: &mut Context<'_>, events: IoEvents) {
+        if events.contains(IoEvents::IN) {
+            self.poll_cq.register(context.waker());
+        }
+    }
+}
+
+/// Events a request has to wait for before it can run without blocking.
+fn wait_events(sqe: &Sqe) -> IoEvents {
+    match sqe.opcode {
+        IORING_OP_READ | IORING_OP_READV | IORING_OP_READ_FIXED | IORING_OP_RECV
+        | IORING_OP_ACCEPT => IoEvents::IN,
+        IORING_OP_WRITE | IORING_OP_WRITEV | IORING_OP_WRITE_FIXED | IORING_OP_SEND => {
+            IoEvents::OUT
+        }
+        IORING_OP_POLL_ADD => IoEvents::from_bits_truncate(sqe.op_flags),
+        _ => IoEvents::empty(),
+    }
+}
+
+fn check_fixed_buffer(state: &RingState, sqe: &Sqe) -> AxResult<()> {
+    let (base, len) = *state
+        .buffers
+        .get(sqe.buf_index as usize)
+        .ok_or(AxError::BadAddress)?;
+    let start = sqe.addr as usize;
+    let end = start
+        .checked_add(sqe.len as usize)
+        .ok_or(AxError::BadAddress)?;
+    let limit = base.checked_add(len).ok_or(AxError::BadAddress)?;
+    if start < base || end > limit {
+        return Err(AxError::BadAddress);
+    }
+    Ok(())
+}
+
+/// Offset-addressed access needs a regular file; `-1` means the file position.
+fn positioned(file: &Arc<dyn FileLike>, off: u64) -> AxResult<Option<(Arc<File>, u64)>> {
+    if off == u64::MAX {
+        return Ok(None);
+    }
+    let file = file
+        .clone()
+        .into_any()
+        .downcast::<File>()
+        .map_err(|_| AxError::from(LinuxError::ESPIPE))?;
+    Ok(Some((file, off)))
+}
+
+fn as_socket(file: &Arc<dyn FileLike>) -> AxResult<Arc<Socket>> {
+    file.clone()
+        .into_any()
+        .downcast::<Socket>()
+        .map_err(|_| AxError::from(LinuxError::ENOTSOCK))
+}
+
+fn execute(state: &RingState, sqe: &Sqe, file: Option<&Arc<dyn FileLike>>) -> AxResult<Progress> {
+    let events = wait_events(sqe);
+    if let Some(file) = file
+        && !events.is_empty()
+        && (file.poll() & (events | IoEvents::ERR | IoEvents::HUP)).is_empty()
+    {
+        return Ok(Progress::Wait(events));
+    }
+
+    let addr = sqe.addr as usize;
+    let len = sqe.len as usize;
+    let result = match sqe.opcode {
+        IORING_OP_NOP => Ok(0),
+        IORING_OP_TIMEOUT => {
+            if len != 1 {
+                return Err(AxError::InvalidInput);
+            }
+            let ts = UserConstPtr::<timespec>::from(addr)
+                .get_as_ref()?
+                .try_into_time_value()?;
+            let deadline = if sqe.op_flags & IORING_TIMEOUT_ABS != 0 {
+                ts
+            } else {
+                monotonic_time() + ts
+            };
+            return Ok(Progress::Sleep(deadline, (sqe.off > 0).then_some(sqe.off)));
+        }
+        _ => {
+            let file = file.ok_or(AxError::BadFileDescriptor)?;
+            execute_file_op(state, sqe, file)
+        }
+    };
+    match result {
+        Ok(res) => Ok(Progress::Done(res as i32)),
+        Err(AxError::WouldBlock) if !events.is_empty() => Ok(Progress::Wait(events)),
+        Err(err) => Err(err),
+    }
+}
+
+fn execute_file_op(state: &RingState, sqe: &Sqe, file: &Arc<dyn FileLike>) -> AxResult<usize> {
+    let addr = sqe.addr as usize;
+    let len = sqe.len as usize;
+    match sqe.opcode {
+        IORING_OP_READ | IORING_OP_READ_FIXED => {
+            if sqe.opcode == IORING_OP_READ_FIXED {
+                check_fixed_buffer(state, sqe)?;
+            }
+            let mut buf = VmBytesMut::new(addr as *mut u8, len);
+            match positioned(file, sqe.off)? {
+                Some((file, off)) => file.inner().read_at(&mut buf, off),
+                None => file.read(&mut buf.into()),
+            }
+        }
+        IORING_OP_WRITE | IORING_OP_WRITE_FIXED => {
+            if sqe.opcode == IORING_OP_WRITE_FIXED {
+                check_fixed_buffer(state, sqe)?;
+            }
+            let mut buf = VmBytes::new(addr as *const u8, len);
+            match positioned(file, sqe.off)? {
+                Some((file, off)) => file
+                    .inner()
+                    .write_at(&mut buf, off)
+                    .inspect(|&n| file.written(off, n)),
+                None => file.write(&mut buf.into()),
+            }
+        }
+        IORING_OP_READV => {
+            let mut buf = IoVectorBuf::new(addr as *const IoVec, len)?.into_io();
+            match positioned(file, sqe.off)? {
+                Some((file, off)) => file.inner().read_at(&mut buf, off),
+                None => file.read(&mut buf.into()),
+            }
+        }
+        IORING_OP_WRITEV => {
+            let mut buf = IoVectorBuf::new(addr as *const IoVec, len)?.into_io();
+            match positioned(file, sqe.off)? {
+                Some((file, off)) => file
+                    .inner()
+                    .write_at(&mut buf, off)
+                    .inspect(|&n| file.written(off, n)),
+                None => file.write(&mut buf.into()),
+            }
+        }
+        IORING_OP_FSYNC => {
+            let (file, _) = positioned(file, 0)?.ok_or(AxError::InvalidInput)?;
+            // IORING_FSYNC_DATASYNC
+            file.sync(sqe.op_flags & 1 != 0)?;
+            Ok(0)
+        }
+        IORING_OP_POLL_ADD => {
+            let events = IoEvents::from_bits_truncate(sqe.op_flags);
+            let ready = file.poll() & (events | IoEvents::ERR | IoEvents::HUP);
+            if ready.is_empty() {
+                Err(AxError::WouldBlock)
+            } else {
+                Ok(ready.bits() as usize)
+            }
+        }
+        IORING_OP_SEND => {
+            let socket = as_socket(file)?;
+            socket.send(
+                &mut VmBytes::new(addr as *const u8, len),
+                SendOptions {
+                    to: None,
+                    flags: SendFlags::default(),
+                    cmsg: Vec::new(),
+                },
+            )
+        }
+        IORING_OP_RECV => {
+            let socket = as_socket(file)?;
+            let mut flags = RecvFlags::empty();
+            if sqe.op_flags & MSG_PEEK != 0 {
+                flags |= RecvFlags::PEEK;
+            }
+            if sqe.op_flags & MSG_TRUNC != 0 {
+                flags |= RecvFlags::TRUNCATE;
+            }
+            socket.recv(
+                &mut VmBytesMut::new(addr as *mut u8, len),
+                RecvOptions {
+                    from: None,
+                    flags,
+                    cmsg: None,
+                },
+            )
+        }
+        IORING_OP_ACCEPT => {
+            let socket = as_socket(file)?;
+            let socket = Socket::new(socket.accept()?);
+            if sqe.op_flags & O_NONBLOCK != 0 {
+                socket.set_nonblocking(true)?;
+            }
+            let remote_addr = socket.peer_addr()?;
+            let fd = socket.add_to_fd_table(sqe.op_flags & O_CLOEXEC != 0)?;
+            if addr != 0 {
+                remote_addr.write_to_user(
+                    UserPtr::<sockaddr>::from(addr),
+                    UserPtr::<socklen_t>::from(sqe.off as usize).get_as_mut()?,
+                )?;
+            }
+            Ok(fd as usize)
+        }
+        _ => Err(AxError::InvalidInput),
+    }
+}
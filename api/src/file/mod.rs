@@ -1,6 +1,8 @@
 pub mod epoll;
 pub mod event;
+mod fd_table;
 mod fs;
+pub mod io_uring;
 mod net;
 mod pidfd;
 mod pipe;
@@ -19,15 +21,16 @@ use axtask::current;
 use flatten_objects::FlattenObjects;
 use inherit_methods_macro::inherit_methods;
 use linux_raw_sys::general::{RLIMIT_NOFILE, stat, statx, statx_timestamp};
-use spin::RwLock;
 use starry_core::{resources::AX_FILE_LIMIT, task::AsThread};
 
 pub use self::{
+    fd_table::FdTable,
     fs::{Directory, File, ResolveAtResult, metadata_to_kstat, resolve_at, with_fs},
-    net::Socket,
+    net::{BufferKind, BufferLimits, RMEM, Socket, WMEM},
     pidfd::PidFd,
     pipe::Pipe,
 };
+pub(crate) use self::pipe::PIPE_PAGES;
 use crate::{
     io::IoVectorBufIo,
     mm::{VmBytes, VmBytesMut},
@@ -288,7 +291,7 @@ pub struct FileDescriptor {
 
 scope_local::scope_local! {
     /// The current file descriptor table.
-    pub static FD_TABLE: Arc<RwLock<FlattenObjects<FileDescriptor, AX_FILE_LIMIT>>> = Arc::default();
+    pub static FD_TABLE: Arc<FdTable> = Arc::default();
 }
 
 /// Get a file-like object by `fd`.
@@ -300,6 +303,29 @@ pub fn get_file_like(fd: c_int) -> AxResult<Arc<dyn FileLike>> {
         .ok_or(AxError::BadFileDescriptor)
 }
 
+/// Run `f` on the file-like object at `fd` without taking a reference to it
+/// when possible.
+///
+/// If the current thread is the only user of the fd table, nothing else can
+/// close `fd` while `f` runs, so the table is read without locking and the
+/// object is borrowed in place. `f` must not close `fd` itself.
+pub fn with_file_like<R>(fd: c_int, f: impl FnOnce(&dyn FileLike) -> AxResult<R>) -> AxResult<R> {
+    let curr = current();
+    if Arc::strong_count(&FD_TABLE) == 1 && Arc::strong_count(&curr.as_thread().proc_data) == 1 {
+        // Every thread holds a reference to its `ProcessData` and every
+        // process sharing the table holds one to the table, so neither count
+        // can grow while this thread is inside a syscall.
+        let file: *const dyn FileLike = unsafe { FD_TABLE.get_unlocked() }
+            .get(fd as usize)
+            .map(|fd| Arc::as_ptr(&fd.inner))
+            .ok_or(AxError::BadFileDescriptor)?;
+        // SAFETY: the object is owned by the table entry, which only this
+        // thread could remove.
+        return f(unsafe { &*file });
+    }
+    f(get_file_like(fd)?.as_ref())
+}
+
 /// Add a file to the file descriptor table.
 pub fn add_file_like(f: Arc<dyn FileLike>, cloexec: bool) -> AxResult<c_int> {
     let max_nofile = current().as_thread().proc_data.rlim.read()[RLIMIT_NOFILE].current;
@@ -1,9 +1,15 @@
 use alloc::{borrow::Cow, format, sync::Arc};
-use core::{ffi::c_int, ops::Deref, task::Context};
+use core::{
+    ffi::c_int,
+    ops::Deref,
+    sync::atomic::{AtomicBool, AtomicUsize, Ordering},
+    task::Context,
+};
 
 use axerrno::{AxError, AxResult};
+use axio::{Buf, BufMut};
 use axnet::{
-    SocketOps,
+    RecvOptions, SendOptions, SocketOps,
     options::{Configurable, GetSocketOption, SetSocketOption},
 };
 use axpoll::{IoEvents, Pollable};
@@ -12,23 +18,187 @@ use linux_raw_sys::general::S_IFSOCK;
 use super::{FileLike, Kstat};
 use crate::file::{SealedBuf, SealedBufMut, get_file_like};
 
-pub struct Socket(pub axnet::Socket);
+/// Size limits for the socket buffers of one direction.
+pub struct BufferLimits {
+    /// Smallest size `SO_SNDBUF`/`SO_RCVBUF` can set.
+    pub min: AtomicUsize,
+    /// The default size, as reported in `tcp_wmem`/`tcp_rmem`.
+    pub default: AtomicUsize,
+    /// Largest size `SO_SNDBUF`/`SO_RCVBUF` can set (`wmem_max`/`rmem_max`).
+    pub max_explicit: AtomicUsize,
+    /// Largest size autotuning grows a buffer to.
+    pub max: AtomicUsize,
+}
+
+impl BufferLimits {
+    const fn new(min: usize, default: usize, max_explicit: usize, max: usize) -> Self {
+        Self {
+            min: AtomicUsize::new(min),
+            default: AtomicUsize::new(default),
+            max_explicit: AtomicUsize::new(max_explicit),
+            max: AtomicUsize::new(max),
+        }
+    }
+}
+
+/// Send buffer limits, `net.ipv4.tcp_wmem` and `net.core.wmem_max`.
+pub static WMEM: BufferLimits = BufferLimits::new(4608, 16 * 1024, 208 * 1024, 4 * 1024 * 1024);
+/// Receive buffer limits, `net.ipv4.tcp_rmem` and `net.core.rmem_max`.
+pub static RMEM: BufferLimits = BufferLimits::new(2304, 128 * 1024, 208 * 1024, 6 * 1024 * 1024);
+
+/// A direction of socket traffic.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum BufferKind {
+    /// The send buffer.
+    Send,
+    /// The receive buffer.
+    Receive,
+}
+
+impl BufferKind {
+    fn limits(self) -> &'static BufferLimits {
+        match self {
+            Self::Send => &WMEM,
+            Self::Receive => &RMEM,
+        }
+    }
+}
+
+/// Autotuning state of one socket buffer.
+#[derive(Default)]
+struct BufferTuner {
+    /// Last known size, 0 if not queried yet.
+    size: AtomicUsize,
+    /// Set once the size was chosen with `SO_SNDBUF`/`SO_RCVBUF`.
+    locked: AtomicBool,
+}
+
+/// A socket file.
+///
+/// The send and receive buffers are rings owned by `axnet`, allocated when
+/// the socket is created and resized in place by autotuning. Sends and
+/// receives copy straight between user memory and those rings, so unlike
+/// pipe pages there are no per-call buffers here to keep in an object pool.
+pub struct Socket {
+    inner: axnet::Socket,
+    sndbuf: BufferTuner,
+    rcvbuf: BufferTuner,
+}
+
+impl Socket {
+    pub fn new(inner: axnet::Socket) -> Self {
+        Self {
+            inner,
+            sndbuf: BufferTuner::default(),
+            rcvbuf: BufferTuner::default(),
+        }
+    }
+
+    fn tuner(&self, kind: BufferKind) -> &BufferTuner {
+        match kind {
+            BufferKind::Send => &self.sndbuf,
+            BufferKind::Receive => &self.rcvbuf,
+        }
+    }
+
+    fn buffer_size(&self, kind: BufferKind) -> AxResult<usize> {
+        let mut size = 0;
+        match kind {
+            BufferKind::Send => self.get_option(GetSocketOption::SendBuffer(&mut size))?,
+            BufferKind::Receive => self.get_option(GetSocketOption::ReceiveBuffer(&mut size))?,
+        }
+        Ok(size)
+    }
+
+    fn apply_buffer_size(&self, kind: BufferKind, size: usize) -> AxResult {
+        match kind {
+            BufferKind::Send => self.set_option(SetSocketOption::SendBuffer(&size)),
+            BufferKind::Receive => self.set_option(SetSocketOption::ReceiveBuffer(&size)),
+        }?;
+        self.tuner(kind).size.store(size, Ordering::Relaxed);
+        Ok(())
+    }
+
+    /// Sets a buffer size on behalf of `SO_SNDBUF`/`SO_RCVBUF`.
+    ///
+    /// As in Linux, the request is capped by the `*mem_max` sysctl and then
+    /// doubled to leave room for bookkeeping, and the buffer is no longer
+    /// autotuned.
+    pub fn set_buffer_size(&self, kind: BufferKind, requested: usize) -> AxResult {
+        let limits = kind.limits();
+        let size = (requested.min(limits.max_explicit.load(Ordering::Relaxed)) * 2)
+            .max(limits.min.load(Ordering::Relaxed));
+        self.apply_buffer_size(kind, size)?;
+        self.tuner(kind).locked.store(true, Ordering::Relaxed);
+        Ok(())
+    }
+
+    /// Grows a buffer that the application keeps filling, up to the
+    /// autotuning limit.
+    ///
+    /// `moved` is the number of bytes one call just moved through the
+    /// buffer, or `None` if the call found the buffer full.
+    fn autotune(&self, kind: BufferKind, moved: Option<usize>) {
+        let tuner = self.tuner(kind);
+        if moved == Some(0) || tuner.locked.load(Ordering::Relaxed) {
+            return;
+        }
+        let mut size = tuner.size.load(Ordering::Relaxed);
+        if size == 0 {
+            let Ok(current) = self.buffer_size(kind) else {
+                // Not a socket with buffers of its own.
+                tuner.locked.store(true, Ordering::Relaxed);
+                return;
+            };
+            size = current;
+            tuner.size.store(size, Ordering::Relaxed);
+        }
+        let max = kind.limits().max.load(Ordering::Relaxed);
+        // A call moving half the buffer at once means the buffer, not the
+        // application, is what bounds the transfer.
+        if moved.is_some_and(|moved| moved * 2 < size) || size >= max {
+            return;
+        }
+        let _ = self.apply_buffer_size(kind, (size * 2).min(max));
+    }
+
+    /// Sends through the socket, growing the send buffer as needed.
+    pub fn send_tuned(&self, src: &mut impl Buf, options: SendOptions) -> AxResult<usize> {
+        let requested = src.remaining();
+        let result = self.send(src, options);
+        match &result {
+            Ok(_) => self.autotune(BufferKind::Send, Some(requested)),
+            Err(AxError::WouldBlock) => self.autotune(BufferKind::Send, None),
+            Err(_) => {}
+        }
+        result
+    }
+
+    /// Receives from the socket, growing the receive buffer as needed.
+    pub fn recv_tuned(&self, dst: &mut impl BufMut, options: RecvOptions) -> AxResult<usize> {
+        let result = self.recv(dst, options);
+        if let Ok(received) = result {
+            self.autotune(BufferKind::Receive, Some(received));
+        }
+        result
+    }
+}
 
 impl Deref for Socket {
     type Target = axnet::Socket;
 
     fn deref(&self) -> &Self::Target {
-        &self.0
+        &self.inner
     }
 }
 
 impl FileLike for Socket {
     fn read(&self, dst: &mut SealedBufMut) -> AxResult<usize> {
-        self.recv(dst, axnet::RecvOptions::default())
+        self.recv_tuned(dst, RecvOptions::default())
     }
 
     fn write(&self, src: &mut SealedBuf) -> AxResult<usize> {
-        self.send(src, axnet::SendOptions::default())
+        self.send_tuned(src, SendOptions::default())
     }
 
     fn stat(&self) -> AxResult<Kstat> {
@@ -52,7 +222,7 @@ impl FileLike for Socket {
     }
 
     fn set_nonblocking(&self, nonblocking: bool) -> AxResult<()> {
-        self.0
+        self.inner
             .set_option(SetSocketOption::NonBlocking(&nonblocking))
     }
 
@@ -72,10 +242,10 @@ impl FileLike for Socket {
 }
 impl Pollable for Socket {
     fn poll(&self) -> IoEvents {
-        self.0.poll()
+        self.inner.poll()
     }
 
     fn register(&self, context: &mut Context<'_>, events: IoEvents) {
-        self.0.register(context, events);
+        self.inner.register(context, events);
     }
 }
@@ -1,7 +1,6 @@
-use alloc::{borrow::Cow, format, sync::Arc};
+use alloc::{borrow::Cow, collections::VecDeque, format, sync::Arc, vec::Vec};
 use core::{
     any::Any,
-    mem,
     sync::atomic::{AtomicBool, Ordering},
     task::Context,
 };
@@ -9,18 +8,17 @@ use core::{
 use axerrno::{AxError, AxResult};
 use axio::{Buf, BufMut, Read, Write};
 use axpoll::{IoEvents, PollSet, Pollable};
-use axsync::Mutex;
+use axsync::{Mutex, MutexGuard};
 use axtask::{
     current,
     future::{block_on, poll_io},
 };
 use linux_raw_sys::{general::S_IFIFO, ioctl::FIONREAD};
 use memory_addr::PAGE_SIZE_4K;
-use ringbuf::{
-    HeapRb,
-    traits::{Consumer, Observer, Producer},
+use starry_core::{
+    pool::ObjectPool,
+    task::{AsThread, send_signal_to_process},
 };
-use starry_core::task::{AsThread, send_signal_to_process};
 use starry_signal::{SignalInfo, Signo};
 use starry_vm::VmMutPtr;
 
@@ -29,8 +27,281 @@ use crate::file::{SealedBuf, SealedBufMut};
 
 const RING_BUFFER_INIT_SIZE: usize = 65536; // 64 KiB
 
+/// Number of drained pages kept around for reuse by each pipe.
+const SPARE_PAGES: usize = 4;
+
+/// Pages drained or left behind by pipes beyond their own spares, shared by
+/// all pipes.
+pub(crate) static PIPE_PAGES: ObjectPool<PipePage> = ObjectPool::new(16, 16);
+
+/// A page of pipe data.
+///
+/// Pages may be referenced by several pipes at once (see [`Pipe::tee_to`]),
+/// so a page is only written to while it is uniquely owned.
+type PipePage = Arc<[u8; PAGE_SIZE_4K]>;
+
+/// A slice of a [`PipePage`], similar to Linux's `struct pipe_buffer`.
+#[derive(Clone)]
+struct PipeBuffer {
+    page: PipePage,
+    offset: usize,
+    len: usize,
+}
+
+impl PipeBuffer {
+    fn data(&self) -> &[u8] {
+        &self.page[self.offset..self.offset + self.len]
+    }
+
+    /// Splits off the first `len` bytes as a new buffer sharing the page.
+    fn split_front(&mut self, len: usize) -> PipeBuffer {
+        let front = PipeBuffer {
+            page: self.page.clone(),
+            offset: self.offset,
+            len,
+        };
+        self.offset += len;
+        self.len -= len;
+        front
+    }
+}
+
+/// Ring of page-granular buffers backing a pipe.
+///
+/// As on Linux, the capacity is a number of buffer slots, one page each.
+/// Buffers shared with another pipe or split off by `splice` may be mostly
+/// empty, so bounding the bytes alone would let a pipe pin far more pages.
+struct PipeRing {
+    bufs: VecDeque<PipeBuffer>,
+    /// Number of bytes stored in `bufs`.
+    len: usize,
+    /// Maximum number of bytes the ring can hold, a multiple of the page size.
+    capacity: usize,
+    spare: Vec<PipePage>,
+}
+
+impl PipeRing {
+    fn new(capacity: usize) -> Self {
+        Self {
+            bufs: VecDeque::new(),
+            len: 0,
+            capacity,
+            spare: Vec::new(),
+        }
+    }
+
+    fn occupied_len(&self) -> usize {
+        self.len
+    }
+
+    fn slots(&self) -> usize {
+        self.capacity / PAGE_SIZE_4K
+    }
+
+    /// Bytes that can still be added, if a slot is free.
+    ///
+    /// A full ring may still take a few bytes into its tail page, but is not
+    /// reported as writable, as on Linux.
+    fn vacant_len(&self) -> usize {
+        if self.bufs.len() >= self.slots() {
+            return 0;
+        }
+        self.capacity.saturating_sub(self.len)
+    }
+
+    fn alloc_page(&mut self) -> PipePage {
+        self.spare
+            .pop()
+            .unwrap_or_else(|| PIPE_PAGES.get_or_else(|| Arc::new([0; PAGE_SIZE_4K])))
+    }
+
+    fn release_page(&mut self, page: PipePage) {
+        if Arc::strong_count(&page) != 1 {
+            return;
+        }
+        if self.spare.len() < SPARE_PAGES {
+            self.spare.push(page);
+        } else {
+            PIPE_PAGES.put(page);
+        }
+    }
+
+    /// Returns the tail buffer if more bytes can be appended to it in place.
+    fn writable_tail(&mut self) -> Option<&mut PipeBuffer> {
+        self.bufs
+            .back_mut()
+            .filter(|buf| buf.offset + buf.len < PAGE_SIZE_4K && Arc::strong_count(&buf.page) == 1)
+    }
+
+    /// Copies bytes from `src` into the ring, filling the tail page first.
+    fn push_from(&mut self, src: &mut SealedBuf) -> AxResult<usize> {
+        let max = src.remaining();
+        self.push_with(max, |buf| src.read(buf))
+    }
+
+    /// Appends up to `max` bytes produced by `read`, which is handed the free
+    /// part of a page at a time and returns how much of it it filled.
+    ///
+    /// An error is only returned if nothing was added.
+    fn push_with(
+        &mut self,
+        max: usize,
+        mut read: impl FnMut(&mut [u8]) -> AxResult<usize>,
+    ) -> AxResult<usize> {
+        let mut count = 0;
+        while self.len < self.capacity && count < max {
+            if self.writable_tail().is_none() {
+                if self.bufs.len() >= self.slots() {
+                    break;
+                }
+                let page = self.alloc_page();
+                self.bufs.push_back(PipeBuffer {
+                    page,
+                    offset: 0,
+                    len: 0,
+                });
+            }
+            let vacant = (self.capacity - self.len).min(max - count);
+            let buf = self.writable_tail().unwrap();
+            let start = buf.offset + buf.len;
+            let end = (start + vacant).min(PAGE_SIZE_4K);
+            let page = Arc::get_mut(&mut buf.page).unwrap();
+            let read = match read(&mut page[start..end]) {
+                Ok(read) => read,
+                Err(_) if count > 0 => break,
+                Err(err) => return Err(err),
+            };
+            if read == 0 {
+                break;
+            }
+            buf.len += read;
+            self.len += read;
+            count += read;
+        }
+        Ok(count)
+    }
+
+    /// Copies bytes out of the ring into `dst`, releasing drained pages.
+    fn pop_into(&mut self, dst: &mut SealedBufMut) -> AxResult<usize> {
+        let mut count = 0;
+        while let Some(buf) = self.bufs.front_mut() {
+            let written = dst.write(buf.data())?;
+            buf.offset += written;
+            buf.len -= written;
+            self.len -= written;
+            count += written;
+            if buf.len > 0 {
+                break;
+            }
+            let buf = self.bufs.pop_front().unwrap();
+            self.release_page(buf.page);
+        }
+        Ok(count)
+    }
+
+    /// Hands up to `max` buffered bytes to `write` a buffer at a time and
+    /// consumes only what it took, releasing drained pages.
+    ///
+    /// An error is only returned if nothing was taken.
+    fn pop_with(
+        &mut self,
+        max: usize,
+        mut write: impl FnMut(&[u8]) -> AxResult<usize>,
+    ) -> AxResult<usize> {
+        let mut count = 0;
+        while count < max {
+            let Some(buf) = self.bufs.front_mut() else {
+                break;
+            };
+            let len = buf.len.min(max - count);
+            if len > 0 {
+                let written = match write(&buf.data()[..len]) {
+                    Ok(written) => written,
+                    Err(_) if count > 0 => break,
+                    Err(err) => return Err(err),
+                };
+                buf.offset += written;
+                buf.len -= written;
+                self.len -= written;
+                count += written;
+                if written < len {
+                    break;
+                }
+            }
+            if buf.len == 0 {
+                let buf = self.bufs.pop_front().unwrap();
+                self.release_page(buf.page);
+            }
+        }
+        Ok(count)
+    }
+
+    /// Hands up to `len` bytes of buffers over to `dst` by page reference.
+    ///
+    /// With `consume` the buffers are moved out of this ring (`splice`),
+    /// otherwise they are shared and stay readable here (`tee`).
+    fn transfer_to(&mut self, dst: &mut PipeRing, len: usize, consume: bool) -> usize {
+        let mut left = len.min(dst.vacant_len()).min(self.len);
+        let mut count = 0;
+        let mut index = 0;
+        while left > 0 && dst.bufs.len() < dst.slots() {
+            let Some(buf) = self.bufs.get_mut(index) else {
+                break;
+            };
+            let piece = if buf.len <= left {
+                if consume {
+                    self.bufs.pop_front().unwrap()
+                } else {
+                    index += 1;
+                    buf.clone()
+                }
+            } else if consume {
+                buf.split_front(left)
+            } else {
+                PipeBuffer {
+                    len: left,
+                    ..buf.clone()
+                }
+            };
+            left -= piece.len;
+            count += piece.len;
+            if piece.len > 0 {
+                dst.bufs.push_back(piece);
+            }
+        }
+        if consume {
+            self.len -= count;
+        }
+        dst.len += count;
+        count
+    }
+
+    fn resize(&mut self, new_size: usize) -> AxResult<()> {
+        if new_size < self.len || new_size / PAGE_SIZE_4K < self.bufs.len() {
+            return Err(AxError::ResourceBusy);
+        }
+        self.capacity = new_size;
+        Ok(())
+    }
+}
+
+impl Drop for PipeRing {
+    fn drop(&mut self) {
+        let pages = self
+            .spare
+            .drain(..)
+            .chain(self.bufs.drain(..).map(|buf| buf.page));
+        for page in pages {
+            // Pages still shared with another pipe through `tee` stay there.
+            if Arc::strong_count(&page) == 1 {
+                PIPE_PAGES.put(page);
+            }
+        }
+    }
+}
+
 struct Shared {
-    buffer: Mutex<HeapRb<u8>>,
+    buffer: Mutex<PipeRing>,
     poll_rx: PollSet,
     poll_tx: PollSet,
     poll_close: PollSet,
@@ -50,7 +321,7 @@ impl Drop for Pipe {
 impl Pipe {
     pub fn new() -> (Pipe, Pipe) {
         let shared = Arc::new(Shared {
-            buffer: Mutex::new(HeapRb::new(RING_BUFFER_INIT_SIZE)),
+            buffer: Mutex::new(PipeRing::new(RING_BUFFER_INIT_SIZE)),
             poll_rx: PollSet::new(),
             poll_tx: PollSet::new(),
             poll_close: PollSet::new(),
@@ -81,24 +352,173 @@ impl Pipe {
     }
 
     pub fn capacity(&self) -> usize {
-        self.shared.buffer.lock().capacity().get()
+        self.shared.buffer.lock().capacity
     }
 
     pub fn resize(&self, new_size: usize) -> AxResult<()> {
         let new_size = new_size.div_ceil(PAGE_SIZE_4K).max(1) * PAGE_SIZE_4K;
 
-        let mut buffer = self.shared.buffer.lock();
-        if new_size == buffer.capacity().get() {
-            return Ok(());
+        self.shared.buffer.lock().resize(new_size)
+    }
+
+    /// Locks the buffers of `self` and `other` in a consistent order.
+    fn lock_pair<'a>(
+        &'a self,
+        other: &'a Pipe,
+    ) -> (MutexGuard<'a, PipeRing>, MutexGuard<'a, PipeRing>) {
+        if Arc::as_ptr(&self.shared) < Arc::as_ptr(&other.shared) {
+            let this = self.shared.buffer.lock();
+            (this, other.shared.buffer.lock())
+        } else {
+            let other = other.shared.buffer.lock();
+            (self.shared.buffer.lock(), other)
         }
-        if new_size < buffer.occupied_len() {
-            return Err(AxError::ResourceBusy);
+    }
+
+    /// Moves up to `len` bytes from this pipe (a read end) to `dst` (a write
+    /// end) by page reference, without copying.
+    pub fn splice_to(&self, dst: &Pipe, len: usize, nonblocking: bool) -> AxResult<usize> {
+        self.transfer_to(dst, len, nonblocking, true)
+    }
+
+    /// Duplicates up to `len` bytes from this pipe (a read end) into `dst` (a
+    /// write end) without consuming them. The pages are shared, not copied.
+    pub fn tee_to(&self, dst: &Pipe, len: usize, nonblocking: bool) -> AxResult<usize> {
+        self.transfer_to(dst, len, nonblocking, false)
+    }
+
+    /// Fills this pipe (a write end) with up to `len` bytes produced by
+    /// `read` straight into its pages, as `splice` from a file does.
+    ///
+    /// Returns once some bytes were added, or 0 if `read` had none.
+    pub fn splice_from(
+        &self,
+        len: usize,
+        nonblocking: bool,
+        mut read: impl FnMut(&mut [u8]) -> AxResult<usize>,
+    ) -> AxResult<usize> {
+        if !self.is_write() {
+            return Err(AxError::BadFileDescriptor);
+        }
+        if len == 0 {
+            return Ok(0);
+        }
+
+        block_on(poll_io(self, IoEvents::OUT, nonblocking, || {
+            if self.closed() {
+                raise_pipe();
+                return Err(AxError::BrokenPipe);
+            }
+            let mut ring = self.shared.buffer.lock();
+            if ring.vacant_len() == 0 {
+                return Err(AxError::WouldBlock);
+            }
+            let added = ring.push_with(len, &mut read)?;
+            drop(ring);
+            if added > 0 {
+                self.shared.poll_rx.wake();
+            }
+            Ok(added)
+        }))
+    }
+
+    /// Drains up to `len` bytes of this pipe (a read end) into `write`, as
+    /// `splice` to a file or socket does.
+    ///
+    /// `write` is handed the buffered data a page at a time and returns how
+    /// much of it the sink took. Only that much is consumed, so a short write
+    /// leaves the rest in the pipe. Returns 0 once the pipe is empty and its
+    /// write end closed.
+    pub fn splice_into(
+        &self,
+        len: usize,
+        nonblocking: bool,
+        mut write: impl FnMut(&[u8]) -> AxResult<usize>,
+    ) -> AxResult<usize> {
+        if !self.is_read() {
+            return Err(AxError::BadFileDescriptor);
+        }
+        if len == 0 {
+            return Ok(0);
+        }
+
+        block_on(poll_io(self, IoEvents::IN, nonblocking, || {
+            let mut ring = self.shared.buffer.lock();
+            if ring.occupied_len() == 0 {
+                return if self.closed() {
+                    Ok(0)
+                } else {
+                    Err(AxError::WouldBlock)
+                };
+            }
+            let taken = ring.pop_with(len, &mut write)?;
+            drop(ring);
+            if taken > 0 {
+                self.shared.poll_tx.wake();
+            }
+            Ok(taken)
+        }))
+    }
+
+    fn transfer_to(
+        &self,
+        dst: &Pipe,
+        len: usize,
+        nonblocking: bool,
+        consume: bool,
+    ) -> AxResult<usize> {
+        if !self.is_read() || !dst.is_write() {
+            return Err(AxError::BadFileDescriptor);
+        }
+        if Arc::ptr_eq(&self.shared, &dst.shared) {
+            return Err(AxError::InvalidInput);
+        }
+        if len == 0 {
+            return Ok(0);
+        }
+
+        loop {
+            block_on(poll_io(dst, IoEvents::OUT, nonblocking, || {
+                if dst.closed() {
+                    raise_pipe();
+                    return Err(AxError::BrokenPipe);
+                }
+                if dst.shared.buffer.lock().vacant_len() > 0 {
+                    Ok(())
+                } else {
+                    Err(AxError::WouldBlock)
+                }
+            }))?;
+
+            // `None` means `dst` filled up again before we got to it.
+            let moved = block_on(poll_io(self, IoEvents::IN, nonblocking, || {
+                let (mut src_ring, mut dst_ring) = self.lock_pair(dst);
+                if src_ring.occupied_len() == 0 {
+                    return if self.closed() {
+                        Ok(Some(0))
+                    } else {
+                        Err(AxError::WouldBlock)
+                    };
+                }
+                match src_ring.transfer_to(&mut dst_ring, len, consume) {
+                    0 => Ok(None),
+                    n => Ok(Some(n)),
+                }
+            }))?;
+
+            match moved {
+                Some(0) => return Ok(0),
+                Some(n) => {
+                    dst.shared.poll_rx.wake();
+                    if consume {
+                        self.shared.poll_tx.wake();
+                    }
+                    return Ok(n);
+                }
+                None if nonblocking => return Err(AxError::WouldBlock),
+                None => {}
+            }
         }
-        let old_buffer = mem::replace(&mut *buffer, HeapRb::new(new_size));
-        let (left, right) = old_buffer.as_slices();
-        buffer.push_slice(left);
-        buffer.push_slice(right);
-        Ok(())
     }
 }
 
@@ -121,16 +541,7 @@ impl FileLike for Pipe {
         }
 
         block_on(poll_io(self, IoEvents::IN, self.nonblocking(), || {
-            let read = {
-                let cons = self.shared.buffer.lock();
-                let (left, right) = cons.as_slices();
-                let mut count = dst.write(left)?;
-                if count >= left.len() {
-                    count += dst.write(right)?;
-                }
-                unsafe { cons.advance_read_index(count) };
-                count
-            };
+            let read = self.shared.buffer.lock().pop_into(dst)?;
             if read > 0 {
                 self.shared.poll_tx.wake();
                 Ok(read)
@@ -159,16 +570,7 @@ impl FileLike for Pipe {
                 return Err(AxError::BrokenPipe);
             }
 
-            let written = {
-                let mut prod = self.shared.buffer.lock();
-                let (left, right) = prod.vacant_slices_mut();
-                let mut count = src.read(unsafe { left.assume_init_mut() })?;
-                if count >= left.len() {
-                    count += src.read(unsafe { right.assume_init_mut() })?;
-                }
-                unsafe { prod.advance_write_index(count) };
-                count
-            };
+            let written = self.shared.buffer.lock().push_from(src)?;
             if written > 0 {
                 self.shared.poll_rx.wake();
                 total_written += written;
@@ -1,4 +1,7 @@
-use alloc::{borrow::Cow, sync::Arc};
+use alloc::{
+    borrow::Cow,
+    sync::{Arc, Weak},
+};
 use core::{
     any::Any,
     sync::atomic::{AtomicBool, Ordering},
@@ -6,22 +9,22 @@ use core::{
 };
 
 use axerrno::{AxError, AxResult};
-use axhal::time::{monotonic_time, wall_time, TimeValue};
+use axhal::time::{TimeValue, monotonic_time, wall_time};
 use axio::{BufMut, Write};
-use axpoll::{Pollable, IoEvents, PollSet};
+use axpoll::{IoEvents, PollSet, Pollable};
 use axsync::Mutex;
-use axtask::future::{block_on, poll_io, timeout_at};
-use event_listener::{Event, listener};
+use axtask::future::{block_on, poll_io};
 use linux_raw_sys::general::{CLOCK_MONOTONIC, CLOCK_REALTIME, itimerspec};
+use starry_core::time::{Alarm, AlarmHandle, cancel_alarm, set_alarm};
 
 use crate::file::{FileLike, Kstat, SealedBuf, SealedBufMut};
 
-#[allow(dead_code)]
-#[derive(Debug, Copy, Clone)]
 struct TimerState {
     ticks: u64,
     interval: Duration,
     next_expiration: Option<TimeValue>,
+    /// The alarm armed for `next_expiration` on the per-CPU timer wheels.
+    alarm: Option<AlarmHandle>,
 }
 
 #[allow(dead_code)]
@@ -30,27 +33,24 @@ pub struct TimerFd {
     state: Mutex<TimerState>,
     non_blocking: AtomicBool,
     poll_read: PollSet,
-    update_event: Event,
+    this: Weak<Self>,
 }
 
 #[allow(dead_code)]
 impl TimerFd {
     pub fn new(clockid: i32, _flags: i32) -> AxResult<Arc<Self>> {
-        let timer = Arc::new(Self {
+        Ok(Arc::new_cyclic(|this| Self {
             clockid,
             state: Mutex::new(TimerState {
                 ticks: 0,
                 interval: Duration::ZERO,
                 next_expiration: None,
+                alarm: None,
             }),
             non_blocking: AtomicBool::new(false),
             poll_read: PollSet::new(),
-            update_event: Event::new(),
-        });
-
-        let t = timer.clone();
-        axtask::spawn(move || block_on(t.timer_loop()));
-        Ok(timer)
+            this: this.clone(),
+        }))
     }
 
     pub fn current_time(&self) -> TimeValue {
@@ -80,8 +80,14 @@ impl TimerFd {
                 old.it_interval.tv_nsec = state.interval.subsec_nanos() as _;
             } else {
                 *old = itimerspec {
-                    it_interval: linux_raw_sys::general::timespec { tv_sec: 0, tv_nsec: 0 },
-                    it_value: linux_raw_sys::general::timespec { tv_sec: 0, tv_nsec: 0 },
+                    it_interval: linux_raw_sys::general::timespec {
+                        tv_sec: 0,
+                        tv_nsec: 0,
+                    },
+                    it_value: linux_raw_sys::general::timespec {
+                        tv_sec: 0,
+                        tv_nsec: 0,
+                    },
                 };
             }
         }
@@ -111,7 +117,7 @@ impl TimerFd {
             state.next_expiration = Some(target);
         }
 
-        self.update_event.notify(usize::MAX);
+        self.rearm(&mut state);
         Ok(())
     }
 
@@ -119,7 +125,7 @@ impl TimerFd {
         self.non_blocking.store(flag, Ordering::Release);
         Ok(())
     }
-    
+
     pub fn get_time(&self, curr_value: &mut itimerspec) {
         let state = self.state.lock();
         let now = self.current_time();
@@ -135,43 +141,54 @@ impl TimerFd {
         curr_value.it_interval.tv_nsec = state.interval.subsec_nanos() as _;
     }
 
-    async fn timer_loop(&self) {
-        loop {
-            let target = {
-                let state = self.state.lock();
-                state.next_expiration
-            };
+    /// Replaces the pending alarm with one for `state.next_expiration`.
+    fn rearm(&self, state: &mut TimerState) {
+        if let Some(alarm) = state.alarm.take() {
+            cancel_alarm(alarm);
+        }
+        if let Some(target) = state.next_expiration {
+            // The wheels run on the wall clock.
+            let deadline = wall_time() + target.saturating_sub(self.current_time());
+            let this: Weak<dyn Alarm> = self.this.clone();
+            state.alarm = Some(set_alarm(deadline, this));
+        }
+    }
+}
 
-            if let Some(target_time) = target {
-                // Translate the monotonic-based target to the wall-clock deadline used by timeout_at.
-                let now_mono = self.current_time();
-                let delta = target_time.saturating_sub(now_mono);
-
-                if delta.is_zero() {
-                    let mut state = self.state.lock();
-                    if state.next_expiration == Some(target_time) {
-                        state.ticks += 1;
-                        self.poll_read.wake();
-
-                        if !state.interval.is_zero() {
-                            state.next_expiration = Some(now_mono + state.interval);
-                        } else {
-                            state.next_expiration = None;
-                        }
-                    }
-                    continue;
-                }
-
-                let deadline = wall_time() + delta;
-                listener!(self.update_event => listener);
-                let _ = timeout_at(Some(deadline), listener).await;
-            } else {
-                listener!(self.update_event => listener);
-                let _ = listener.await;
-            }
+impl Alarm for TimerFd {
+    fn fire(&self) {
+        let mut state = self.state.lock();
+        let now = self.current_time();
+        let Some(target) = state.next_expiration else {
+            return;
+        };
+        // An alarm that was already taken off the wheel when the timer was
+        // set again is stale; the new one is still pending.
+        if target > now {
+            return;
+        }
+        if state.interval.is_zero() {
+            state.ticks += 1;
+            state.next_expiration = None;
+        } else {
+            // Count the periods missed while the alarm was late, as Linux.
+            let periods = (now - target).as_nanos() / state.interval.as_nanos() + 1;
+            state.ticks += periods as u64;
+            state.next_expiration =
+                Some(target + Duration::from_nanos((periods * state.interval.as_nanos()) as u64));
         }
+        self.rearm(&mut state);
+        drop(state);
+        self.poll_read.wake();
     }
+}
 
+impl Drop for TimerFd {
+    fn drop(&mut self) {
+        if let Some(alarm) = self.state.lock().alarm.take() {
+            cancel_alarm(alarm);
+        }
+    }
 }
 
 impl FileLike for TimerFd {
@@ -234,4 +251,4 @@ impl Pollable for TimerFd {
             self.poll_read.register(context.waker());
         }
     }
-}
\ No newline at end of file
+}
@@ -1,10 +1,20 @@
+use alloc::vec::Vec;
 use core::mem::{self, MaybeUninit};
 
 use axerrno::{AxError, AxResult};
 use axio::{Buf, BufMut, Read, Write};
 use bytemuck::AnyBitPattern;
+use starry_core::pool::ObjectPool;
 use starry_vm::{VmPtr, vm_read_slice, vm_write_slice};
 
+/// Size of the buffers in [`COPY_BUFFERS`].
+pub const COPY_BUFFER_SIZE: usize = 0x10000;
+
+/// Scratch buffers for copies between files done inside the kernel
+/// (`sendfile`, `splice`), so that such a loop does not allocate a big buffer
+/// per call.
+pub static COPY_BUFFERS: ObjectPool<Vec<u8>> = ObjectPool::new(2, 8);
+
 #[repr(C)]
 #[derive(Debug, Copy, Clone, AnyBitPattern)]
 pub struct IoVec {
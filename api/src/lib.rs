@@ -25,12 +25,22 @@ pub mod vfs;
 pub fn init() {
     info!("Initialize VFS...");
     vfs::mount_all().expect("Failed to mount vfs");
+    vfs::prefetch::spawn_workers();
+    vfs::writeback::spawn_flusher();
+    vfs::reclaim::spawn_kswapd();
 
     info!("Initialize /proc/interrupts...");
     axtask::register_timer_callback(|_| {
         time::inc_irq_cnt();
+        starry_core::vdso::prepare_cpu();
+        starry_core::vdso::update();
     });
 
+    info!("Initialize vDSO...");
+    starry_core::vdso::init();
+
     info!("Initialize alarm...");
     starry_core::time::spawn_alarm_task();
+
+    starry_core::thp::spawn_collapse_task();
 }
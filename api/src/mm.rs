@@ -1,4 +1,4 @@
-use alloc::string::String;
+use alloc::{string::String, vec::Vec};
 use core::{
     alloc::Layout,
     ffi::c_char,
@@ -16,10 +16,11 @@ use axio::{Buf, BufMut, Read, Write};
 use axtask::current;
 use memory_addr::{MemoryAddr, PAGE_SIZE_4K, VirtAddr};
 use starry_core::{
+    fault,
     mm::{access_user_memory, is_accessing_user_memory},
     task::AsThread,
 };
-use starry_vm::{vm_load_until_nul, vm_read_slice, vm_write_slice};
+use starry_vm::{vm_read_slice, vm_write_slice};
 
 fn check_region(start: VirtAddr, layout: Layout, access_flags: MappingFlags) -> AxResult<()> {
     let align = layout.align();
@@ -28,7 +29,8 @@ fn check_region(start: VirtAddr, layout: Layout, access_flags: MappingFlags) ->
     }
 
     let curr = current();
-    let mut aspace = curr.as_thread().proc_data.aspace.lock();
+    let aspace = curr.as_thread().proc_data.aspace();
+    let mut aspace = aspace.lock();
 
     if !aspace.can_access_range(start, layout.size(), access_flags) {
         return Err(AxError::BadAddress);
@@ -41,6 +43,38 @@ fn check_region(start: VirtAddr, layout: Layout, access_flags: MappingFlags) ->
     Ok(())
 }
 
+const WORD: usize = size_of::<usize>();
+const LOW_BITS: usize = usize::from_ne_bytes([0x01; WORD]);
+const HIGH_BITS: usize = usize::from_ne_bytes([0x80; WORD]);
+
+/// Returns the index of the first zero byte in `[ptr, ptr + len)`.
+///
+/// Scans a word at a time. Words are read aligned, so the bytes around the
+/// range that share a word with it are read too.
+///
+/// # Safety
+///
+/// The words covering the range must be readable.
+unsafe fn find_zero_byte(ptr: *const u8, len: usize) -> Option<usize> {
+    let start = ptr as usize;
+    let end = start + len;
+    let mut word = start & !(WORD - 1);
+    // Bytes before `ptr` are made non-zero.
+    let mut mask = (1usize << (8 * (start - word))).wrapping_sub(1);
+    while word < end {
+        // SAFETY: the word overlaps the range and is aligned.
+        let value = usize::from_le(unsafe { (word as *const usize).read_volatile() }) | mask;
+        let zeros = value.wrapping_sub(LOW_BITS) & !value & HIGH_BITS;
+        if zeros != 0 {
+            let index = word + zeros.trailing_zeros() as usize / 8 - start;
+            return (index < len).then_some(index);
+        }
+        word += WORD;
+        mask = 0;
+    }
+    None
+}
+
 fn check_null_terminated<T: PartialEq + Default>(
     start: VirtAddr,
     access_flags: MappingFlags,
@@ -51,42 +85,43 @@ fn check_null_terminated<T: PartialEq + Default>(
     }
 
     let zero = T::default();
-
     let mut page = start.align_down_4k();
-
-    let start = start.as_ptr_of::<T>();
+    let mut ptr = start.as_ptr_of::<T>();
     let mut len = 0;
 
     access_user_memory(|| {
         loop {
-            // SAFETY: This won't overflow the address space since we'll check
-            // it below.
-            let ptr = unsafe { start.add(len) };
-            while ptr as usize >= page.as_ptr() as usize {
-                // We cannot prepare `aspace` outside of the loop, since holding
-                // aspace requires a mutex which would be required on page
-                // fault, and page faults can trigger inside the loop.
-
-                // TODO: this is inefficient, but we have to do this instead of
-                // querying the page table since the page might has not been
-                // allocated yet.
+            // The address space cannot be locked while scanning, since page
+            // faults inside the scan need it. Since the page might not have
+            // been allocated yet, the page table cannot be queried instead.
+            {
                 let curr = current();
-                let aspace = curr.as_thread().proc_data.aspace.lock();
+                let aspace = curr.as_thread().proc_data.aspace();
+                let aspace = aspace.lock();
                 if !aspace.can_access_range(page, PAGE_SIZE_4K, access_flags) {
                     return Err(AxError::BadAddress);
                 }
-
-                page += PAGE_SIZE_4K;
             }
-
-            // This might trigger a page fault
-            // SAFETY: The pointer is valid and points to a valid memory region.
-            if unsafe { ptr.read_volatile() } == zero {
-                break;
+            let page_end = (page + PAGE_SIZE_4K).as_ptr_of::<T>();
+            let count = (page_end as usize - ptr as usize).div_ceil(size_of::<T>());
+
+            // These reads might trigger page faults.
+            let found = if size_of::<T>() == 1 {
+                // SAFETY: the rest of the page is accessible.
+                unsafe { find_zero_byte(ptr as *const u8, count) }
+            } else {
+                // SAFETY: the elements starting in this page are accessible.
+                (0..count).find(|&i| unsafe { ptr.add(i).read_volatile() } == zero)
+            };
+            if let Some(index) = found {
+                len += index;
+                return Ok(());
             }
-            len += 1;
+            len += count;
+            // SAFETY: `count` elements take us to the next page.
+            ptr = unsafe { ptr.add(count) };
+            page += PAGE_SIZE_4K;
         }
-        Ok(())
     })?;
 
     Ok(len)
@@ -249,15 +284,33 @@ fn handle_page_fault(vaddr: VirtAddr, access_flags: MappingFlags) -> bool {
         return false;
     };
 
-    thr.proc_data
-        .aspace
-        .lock()
-        .handle_page_fault(vaddr, access_flags)
+    fault::handle_page_fault(&thr.proc_data, vaddr, access_flags)
 }
 
+/// First chunk [`vm_load_string`] copies; later ones double up to a page.
+const STRING_CHUNK: usize = 256;
+
 pub fn vm_load_string(ptr: *const c_char) -> AxResult<String> {
-    #[allow(clippy::unnecessary_cast)]
-    let bytes = vm_load_until_nul(ptr as *const u8)?;
+    let mut bytes = Vec::new();
+    let mut addr = ptr as usize;
+    let mut chunk = STRING_CHUNK;
+    loop {
+        // Stop at the page end, so that a string ending right before an
+        // unmapped page still loads.
+        let len = chunk.min(PAGE_SIZE_4K - addr % PAGE_SIZE_4K);
+        let old_len = bytes.len();
+        bytes.reserve(len);
+        vm_read_slice(addr as *const u8, &mut bytes.spare_capacity_mut()[..len])?;
+        // SAFETY: `len` bytes were just initialized.
+        unsafe { bytes.set_len(old_len + len) };
+
+        if let Some(index) = bytes[old_len..].iter().position(|&b| b == 0) {
+            bytes.truncate(old_len + index);
+            break;
+        }
+        addr += len;
+        chunk = (chunk * 2).min(PAGE_SIZE_4K);
+    }
     String::from_utf8(bytes).map_err(|_| AxError::IllegalBytes)
 }
 
@@ -21,6 +21,7 @@ use crate::{
     file::{Directory, FileLike, get_file_like, resolve_at, with_fs},
     mm::vm_load_string,
     time::TimeValueLike,
+    vfs::{prefetch::FileId, reclaim, writeback},
 };
 
 /// The ioctl() system call manipulates the underlying device parameters
@@ -232,7 +233,15 @@ pub fn sys_unlinkat(dirfd: i32, path: *const c_char, flags: usize) -> AxResult<i
         if flags == AT_REMOVEDIR as _ {
             fs.remove_dir(path)?;
         } else {
+            let metadata = fs.resolve_no_follow(&path)?.metadata()?;
             fs.remove_file(path)?;
+            if metadata.nlink <= 1 {
+                // Whoever still has the file open keeps the cache alive.
+                reclaim::forget(FileId {
+                    device: metadata.device,
+                    inode: metadata.inode,
+                });
+            }
         }
         Ok(0)
     })
@@ -514,11 +523,13 @@ pub fn sys_renameat2(
 }
 
 pub fn sys_sync() -> AxResult<isize> {
-    warn!("dummy sys_sync");
+    // sync(2) cannot fail; errors are left to fsync.
+    let _ = writeback::writeback_all(None);
     Ok(0)
 }
 
-pub fn sys_syncfs(_fd: i32) -> AxResult<isize> {
-    warn!("dummy sys_syncfs");
+pub fn sys_syncfs(fd: i32) -> AxResult<isize> {
+    let device = get_file_like(fd)?.stat()?.dev;
+    writeback::writeback_all(Some(device))?;
     Ok(0)
 }
@@ -4,19 +4,23 @@ use core::{
     task::Context,
 };
 
-use axerrno::{AxError, AxResult};
+use axerrno::{AxError, AxResult, LinuxError};
 use axfs::{FS_CONTEXT, FileFlags, OpenOptions};
 use axio::{Seek, SeekFrom};
 use axpoll::{IoEvents, Pollable};
-use axtask::current;
-use linux_raw_sys::general::__kernel_off_t;
+use axtask::{
+    current,
+    future::{block_on, poll_io},
+};
+use linux_raw_sys::general::{__kernel_off_t, SPLICE_F_NONBLOCK};
 use starry_vm::{VmMutPtr, VmPtr};
 use syscalls::Sysno;
 
 use crate::{
-    file::{File, FileLike, Pipe, SealedBuf, SealedBufMut, get_file_like},
-    io::{IoVec, IoVectorBuf},
+    file::{File, FileLike, Pipe, SealedBuf, SealedBufMut, get_file_like, with_file_like},
+    io::{COPY_BUFFER_SIZE, COPY_BUFFERS, IoVec, IoVectorBuf},
     mm::{UserConstPtr, VmBytes, VmBytesMut},
+    vfs::readahead::{PAGE_SIZE, do_sync_readahead, offset_to_page},
 };
 
 struct DummyFd;
@@ -64,14 +68,15 @@ pub fn sys_dummy_fd(sysno: Sysno) -> AxResult<isize> {
 /// Return the read size if success.
 pub fn sys_read(fd: i32, buf: *mut u8, len: usize) -> AxResult<isize> {
     debug!("sys_read <= fd: {fd}, buf: {buf:p}, len: {len}");
-    Ok(get_file_like(fd)?.read(&mut VmBytesMut::new(buf, len).into())? as _)
+    with_file_like(fd, |f| f.read(&mut VmBytesMut::new(buf, len).into())).map(|n| n as _)
 }
 
 pub fn sys_readv(fd: i32, iov: *const IoVec, iovcnt: usize) -> AxResult<isize> {
     debug!("sys_readv <= fd: {fd}, iovcnt: {iovcnt}");
-    let f = get_file_like(fd)?;
-    f.read(&mut IoVectorBuf::new(iov, iovcnt)?.into_io().into())
-        .map(|n| n as _)
+    with_file_like(fd, |f| {
+        f.read(&mut IoVectorBuf::new(iov, iovcnt)?.into_io().into())
+    })
+    .map(|n| n as _)
 }
 
 /// Write data to the file indicated by `fd`.
@@ -79,14 +84,15 @@ pub fn sys_readv(fd: i32, iov: *const IoVec, iovcnt: usize) -> AxResult<isize> {
 /// Return the written size if success.
 pub fn sys_write(fd: i32, buf: *mut u8, len: usize) -> AxResult<isize> {
     debug!("sys_write <= fd: {fd}, buf: {buf:p}, len: {len}");
-    Ok(get_file_like(fd)?.write(&mut VmBytes::new(buf, len).into())? as _)
+    with_file_like(fd, |f| f.write(&mut VmBytes::new(buf, len).into())).map(|n| n as _)
 }
 
 pub fn sys_writev(fd: i32, iov: *const IoVec, iovcnt: usize) -> AxResult<isize> {
     debug!("sys_writev <= fd: {fd}, iovcnt: {iovcnt}");
-    let f = get_file_like(fd)?;
-    f.write(&mut IoVectorBuf::new(iov, iovcnt)?.into_io().into())
-        .map(|n| n as _)
+    with_file_like(fd, |f| {
+        f.write(&mut IoVectorBuf::new(iov, iovcnt)?.into_io().into())
+    })
+    .map(|n| n as _)
 }
 
 pub fn sys_lseek(fd: c_int, offset: __kernel_off_t, whence: c_int) -> AxResult<isize> {
@@ -142,14 +148,14 @@ pub fn sys_fallocate(
 pub fn sys_fsync(fd: c_int) -> AxResult<isize> {
     debug!("sys_fsync <= {fd}");
     let f = File::from_fd(fd)?;
-    f.inner().sync(false)?;
+    f.sync(false)?;
     Ok(0)
 }
 
 pub fn sys_fdatasync(fd: c_int) -> AxResult<isize> {
     debug!("sys_fdatasync <= {fd}");
     let f = File::from_fd(fd)?;
-    f.inner().sync(true)?;
+    f.sync(true)?;
     Ok(0)
 }
 
@@ -163,9 +169,16 @@ pub fn sys_fadvise64(
     if Pipe::from_fd(fd).is_ok() {
         return Err(AxError::BrokenPipe);
     }
-    if advice > 5 {
+    if advice > 5 || offset < 0 || len < 0 {
         return Err(AxError::InvalidInput);
     }
+    let file = match File::from_fd(fd) {
+        Ok(file) => file,
+        // Accepted, but there is no page cache behind a directory.
+        Err(AxError::IsADirectory) => return Ok(0),
+        Err(err) => return Err(err),
+    };
+    file.advise(advice, offset as u64, len as u64)?;
     Ok(0)
 }
 
@@ -177,6 +190,7 @@ pub fn sys_pread64(fd: c_int, buf: *mut u8, len: usize, offset: __kernel_off_t)
     let read = f
         .inner()
         .read_at(&mut VmBytesMut::new(buf, len), offset as _)?;
+    f.accessed(offset as _, read);
     Ok(read as _)
 }
 
@@ -193,6 +207,7 @@ pub fn sys_pwrite64(
     let write = f
         .inner()
         .write_at(&mut VmBytes::new(buf, len), offset as _)?;
+    f.written(offset as _, write);
     Ok(write as _)
 }
 
@@ -237,32 +252,77 @@ pub fn sys_pwritev2(
 ) -> AxResult<isize> {
     debug!("sys_pwritev2 <= fd: {fd}, iovcnt: {iovcnt}, offset: {offset}, flags: {_flags}");
     let f = File::from_fd(fd)?;
-    f.inner()
-        .read_at(&mut IoVectorBuf::new(iov, iovcnt)?.into_io(), offset as _)
-        .map(|n| n as _)
+    let write = f
+        .inner()
+        .write_at(&mut IoVectorBuf::new(iov, iovcnt)?.into_io(), offset as _)?;
+    f.written(offset as _, write);
+    Ok(write as _)
 }
 
+/// Upper bound on a single transfer chunk in [`do_send`].
+///
+/// Large enough that page-cache-backed copies are done in a few wide
+/// `read_at`/`write_at` calls rather than one call per page.
+const SEND_CHUNK_SIZE: usize = COPY_BUFFER_SIZE;
+
 enum SendFile {
     Direct(Arc<dyn FileLike>),
-    Offset(Arc<File>, *mut u64),
+    /// A file accessed at an explicit offset. The offset is read from
+    /// userspace once, tracked locally, and written back by
+    /// [`SendFile::finish`].
+    Offset {
+        file: Arc<File>,
+        ptr: *mut u64,
+        off: u64,
+    },
 }
 
 impl SendFile {
+    fn offset(file: Arc<File>, ptr: *mut u64) -> AxResult<Self> {
+        let off = ptr.vm_read()?;
+        Ok(SendFile::Offset { file, ptr, off })
+    }
+
+    fn is_stream(&self) -> bool {
+        matches!(self, SendFile::Direct(_))
+    }
+
     fn has_data(&self) -> bool {
         match self {
             SendFile::Direct(file) => file.poll(),
-            SendFile::Offset(file, ..) => file.poll(),
+            SendFile::Offset { file, .. } => file.poll(),
         }
         .contains(IoEvents::IN)
     }
 
+    /// Returns how many bytes the next read should ask for.
+    ///
+    /// For offset-addressed files the chunk is trimmed so that it ends on a
+    /// page boundary, which keeps every following chunk page-aligned in the
+    /// source page cache. Missing pages of the chunk are brought in with a
+    /// single batched prefetch instead of one fill per page.
+    fn next_chunk(&self, remaining: usize) -> usize {
+        let SendFile::Offset { file, off, .. } = self else {
+            return SEND_CHUNK_SIZE.min(remaining);
+        };
+        let misalign = (*off % PAGE_SIZE) as usize;
+        let len = (SEND_CHUNK_SIZE - misalign).min(remaining);
+        if let Ok(backend) = file.inner().backend() {
+            let start_page = offset_to_page(*off);
+            if !backend.is_page_cached(start_page) {
+                let end_page = offset_to_page(*off + len as u64 + PAGE_SIZE - 1);
+                do_sync_readahead(backend, start_page, end_page - start_page);
+            }
+        }
+        len
+    }
+
     fn read(&mut self, mut buf: &mut [u8]) -> AxResult<usize> {
         match self {
             SendFile::Direct(file) => file.read(&mut buf.into()),
-            SendFile::Offset(file, offset) => {
-                let off = offset.vm_read()?;
-                let bytes_read = file.inner().read_at(&mut buf, off)?;
-                offset.vm_write(off + bytes_read as u64)?;
+            SendFile::Offset { file, off, .. } => {
+                let bytes_read = file.inner().read_at(&mut buf, *off)?;
+                *off += bytes_read as u64;
                 Ok(bytes_read)
             }
         }
@@ -271,18 +331,108 @@ impl SendFile {
     fn write(&mut self, mut buf: &[u8]) -> AxResult<usize> {
         match self {
             SendFile::Direct(file) => file.write(&mut buf.into()),
-            SendFile::Offset(file, offset) => {
-                let off = offset.vm_read()?;
-                let bytes_written = file.inner().write_at(&mut buf, off)?;
-                offset.vm_write(off + bytes_written as u64)?;
+            SendFile::Offset { file, off, .. } => {
+                let bytes_written = file.inner().write_at(&mut buf, *off)?;
+                file.written(*off, bytes_written);
+                *off += bytes_written as u64;
                 Ok(bytes_written)
             }
         }
     }
+
+    /// Blocks until a stream sink reports that it can take more data.
+    fn wait_writable(&self) -> AxResult<()> {
+        let SendFile::Direct(file) = self else {
+            return Ok(());
+        };
+        let pollable = FilePollable(file.as_ref());
+        block_on(poll_io(&pollable, IoEvents::OUT, false, || {
+            if file
+                .poll()
+                .intersects(IoEvents::OUT | IoEvents::ERR | IoEvents::HUP)
+            {
+                Ok(())
+            } else {
+                Err(AxError::WouldBlock)
+            }
+        }))
+    }
+
+    /// Gives back `len` bytes that were read but could not be delivered.
+    ///
+    /// This is a no-op for stream sources, whose data cannot be pushed back.
+    fn unread(&mut self, len: usize) {
+        if let SendFile::Offset { off, .. } = self {
+            *off -= len as u64;
+        }
+    }
+
+    fn finish(&self) -> AxResult<()> {
+        if let SendFile::Offset { ptr, off, .. } = self {
+            ptr.vm_write(*off)?;
+        }
+        Ok(())
+    }
+}
+
+/// Lets a `dyn FileLike` be waited on with [`poll_io`].
+struct FilePollable<'a>(&'a dyn FileLike);
+
+impl Pollable for FilePollable<'_> {
+    fn poll(&self) -> IoEvents {
+        self.0.poll()
+    }
+
+    fn register(&self, context: &mut Context<'_>, events: IoEvents) {
+        self.0.register(context, events)
+    }
 }
 
 fn do_send(mut src: SendFile, mut dst: SendFile, len: usize) -> AxResult<usize> {
-    let mut buf = vec![0; 0x1000];
+    let result = send_loop(&mut src, &mut dst, len);
+    src.finish()?;
+    dst.finish()?;
+    result
+}
+
+fn send_loop(src: &mut SendFile, dst: &mut SendFile, len: usize) -> AxResult<usize> {
+    let mut buf = COPY_BUFFERS.get_or_else(|| vec![0; COPY_BUFFER_SIZE]);
+    let result = send_chunks(src, dst, len, &mut buf);
+    COPY_BUFFERS.put(buf);
+    result
+}
+
+/// Reads `src` straight into the pages of `pipe`, skipping the bounce buffer
+/// of [`do_send`]. Reads are bounded by the free space of the pipe, so stream
+/// sources never read more than the pipe can take.
+fn send_to_pipe(mut src: SendFile, pipe: &Pipe, len: usize, nonblocking: bool) -> AxResult<usize> {
+    let result = pipe.splice_from(len, nonblocking, |buf| {
+        let len = src.next_chunk(buf.len());
+        src.read(&mut buf[..len])
+    });
+    src.finish()?;
+    result
+}
+
+/// Writes the buffered pages of `pipe` straight into `dst`. Only what the sink
+/// takes is consumed, so a short write leaves the rest in the pipe.
+fn send_from_pipe(
+    pipe: &Pipe,
+    mut dst: SendFile,
+    len: usize,
+    nonblocking: bool,
+) -> AxResult<usize> {
+    let result = pipe.splice_into(len, nonblocking, |buf| dst.write(buf));
+    dst.finish()?;
+    result
+}
+
+fn send_chunks(
+    src: &mut SendFile,
+    dst: &mut SendFile,
+    len: usize,
+    buf: &mut [u8],
+) -> AxResult<usize> {
     let mut total_written = 0;
     let mut remaining = len;
 
@@ -290,7 +440,7 @@ fn do_send(mut src: SendFile, mut dst: SendFile, len: usize) -> AxResult<usize>
         if total_written > 0 && !src.has_data() {
             break;
         }
-        let to_read = buf.len().min(remaining);
+        let to_read = src.next_chunk(remaining);
         let bytes_read = match src.read(&mut buf[..to_read]) {
             Ok(n) => n,
             Err(AxError::WouldBlock) if total_written > 0 => break,
@@ -300,13 +450,33 @@ fn do_send(mut src: SendFile, mut dst: SendFile, len: usize) -> AxResult<usize>
             break;
         }
 
-        let bytes_written = dst.write(&buf[..bytes_read])?;
-        if bytes_written < bytes_read {
-            break;
+        // A seekable source can take back whatever the sink refused. Bytes
+        // read from a stream cannot be given back, so they are held until the
+        // sink takes them; only a sink that fails outright loses them, as it
+        // would with a read followed by a write.
+        let mut written = 0;
+        while written < bytes_read {
+            match dst.write(&buf[written..bytes_read]) {
+                Ok(0) => break,
+                Ok(n) => written += n,
+                Err(AxError::WouldBlock) if src.is_stream() => dst.wait_writable()?,
+                Err(e) if total_written + written == 0 => {
+                    src.unread(bytes_read);
+                    return Err(e);
+                }
+                Err(_) => break,
+            }
+            if !src.is_stream() {
+                break;
+            }
         }
 
-        total_written += bytes_written;
-        remaining -= bytes_written;
+        total_written += written;
+        if written < bytes_read {
+            src.unread(bytes_read - written);
+            break;
+        }
+        remaining -= written;
     }
 
     Ok(total_written)
@@ -325,13 +495,30 @@ pub fn sys_sendfile(out_fd: c_int, in_fd: c_int, offset: *mut u64, len: usize) -
         if offset.vm_read()? > u32::MAX as u64 {
             return Err(AxError::InvalidInput);
         }
-        SendFile::Offset(File::from_fd(in_fd)?, offset)
+        SendFile::offset(File::from_fd(in_fd)?, offset)?
     } else {
         SendFile::Direct(get_file_like(in_fd)?)
     };
 
+    if let Ok(pipe) = Pipe::from_fd(out_fd) {
+        let nonblocking = pipe.nonblocking();
+        if offset.is_null()
+            && let Ok(src) = Pipe::from_fd(in_fd)
+        {
+            return src.splice_to(&pipe, len, nonblocking).map(|n| n as _);
+        }
+        return send_to_pipe(src, &pipe, len, nonblocking).map(|n| n as _);
+    }
+
     let dst = SendFile::Direct(get_file_like(out_fd)?);
 
+    if offset.is_null()
+        && let Ok(pipe) = Pipe::from_fd(in_fd)
+    {
+        let nonblocking = pipe.nonblocking();
+        return send_from_pipe(&pipe, dst, len, nonblocking).map(|n| n as _);
+    }
+
     do_send(src, dst, len).map(|n| n as _)
 }
 
@@ -358,13 +545,13 @@ pub fn sys_copy_file_range(
     // TODO: check same file and overlap
 
     let src = if !off_in.is_null() {
-        SendFile::Offset(File::from_fd(fd_in)?, off_in)
+        SendFile::offset(File::from_fd(fd_in)?, off_in)?
     } else {
         SendFile::Direct(get_file_like(fd_in)?)
     };
 
     let dst = if !off_out.is_null() {
-        SendFile::Offset(File::from_fd(fd_out)?, off_out)
+        SendFile::offset(File::from_fd(fd_out)?, off_out)?
     } else {
         SendFile::Direct(get_file_like(fd_out)?)
     };
@@ -378,7 +565,7 @@ pub fn sys_splice(
     fd_out: c_int,
     off_out: *mut i64,
     len: usize,
-    _flags: u32,
+    flags: u32,
 ) -> AxResult<isize> {
     debug!(
         "sys_splice <= fd_in: {}, off_in: {}, fd_out: {}, off_out: {}, len: {}, flags: {}",
@@ -387,7 +574,7 @@ pub fn sys_splice(
         fd_out,
         !off_out.is_null(),
         len,
-        _flags
+        flags
     );
 
     let mut has_pipe = false;
@@ -396,11 +583,20 @@ pub fn sys_splice(
         return Err(AxError::BadFileDescriptor);
     }
 
+    // Pipe to pipe: move the page buffers over without copying.
+    if let (Ok(src), Ok(dst)) = (Pipe::from_fd(fd_in), Pipe::from_fd(fd_out)) {
+        if !off_in.is_null() || !off_out.is_null() {
+            return Err(AxError::from(LinuxError::ESPIPE));
+        }
+        let nonblocking = flags & SPLICE_F_NONBLOCK != 0 || src.nonblocking();
+        return src.splice_to(&dst, len, nonblocking).map(|n| n as _);
+    }
+
     let src = if !off_in.is_null() {
         if off_in.vm_read()? < 0 {
             return Err(AxError::InvalidInput);
         }
-        SendFile::Offset(File::from_fd(fd_in)?, off_in.cast())
+        SendFile::offset(File::from_fd(fd_in)?, off_in.cast())?
     } else {
         if let Ok(src) = Pipe::from_fd(fd_in) {
             if !src.is_read() {
@@ -420,7 +616,7 @@ pub fn sys_splice(
         if off_out.vm_read()? < 0 {
             return Err(AxError::InvalidInput);
         }
-        SendFile::Offset(File::from_fd(fd_out)?, off_out.cast())
+        SendFile::offset(File::from_fd(fd_out)?, off_out.cast())?
     } else {
         if let Ok(dst) = Pipe::from_fd(fd_out) {
             if !dst.is_write() {
@@ -442,5 +638,36 @@ pub fn sys_splice(
         return Err(AxError::InvalidInput);
     }
 
-    do_send(src, dst, len).map(|n| n as _)
+    // One end is a pipe and the other is not.
+    if let Ok(pipe) = Pipe::from_fd(fd_out) {
+        let nonblocking = flags & SPLICE_F_NONBLOCK != 0 || pipe.nonblocking();
+        return send_to_pipe(src, &pipe, len, nonblocking).map(|n| n as _);
+    }
+    let pipe = Pipe::from_fd(fd_in)?;
+    let nonblocking = flags & SPLICE_F_NONBLOCK != 0 || pipe.nonblocking();
+    send_from_pipe(&pipe, dst, len, nonblocking).map(|n| n as _)
+}
+
+pub fn sys_tee(fd_in: c_int, fd_out: c_int, len: usize, flags: u32) -> AxResult<isize> {
+    debug!("sys_tee <= fd_in: {fd_in}, fd_out: {fd_out}, len: {len}, flags: {flags}");
+    let (src, dst) = match (Pipe::from_fd(fd_in), Pipe::from_fd(fd_out)) {
+        (Ok(src), Ok(dst)) => (src, dst),
+        _ => return Err(AxError::InvalidInput),
+    };
+    let nonblocking = flags & SPLICE_F_NONBLOCK != 0 || src.nonblocking();
+    src.tee_to(&dst, len, nonblocking).map(|n| n as _)
+}
+
+pub fn sys_vmsplice(fd: c_int, iov: *const IoVec, nr_segs: usize, flags: u32) -> AxResult<isize> {
+    debug!("sys_vmsplice <= fd: {fd}, nr_segs: {nr_segs}, flags: {flags}");
+    let pipe = Pipe::from_fd(fd)?;
+    // User pages are copied into (or out of) pipe pages, so SPLICE_F_GIFT
+    // makes no difference. Blocking follows the pipe's own O_NONBLOCK.
+    let buf = IoVectorBuf::new(iov, nr_segs)?.into_io();
+    if pipe.is_write() {
+        pipe.write(&mut buf.into())
+    } else {
+        pipe.read(&mut buf.into())
+    }
+    .map(|n| n as _)
 }
@@ -0,0 +1,79 @@
+use alloc::sync::Arc;
+
+use axerrno::{AxError, AxResult};
+use starry_signal::SignalSet;
+
+use crate::{
+    file::{
+        FileLike, add_file_like,
+        io_uring::{
+            IORING_ENTER_EXT_ARG, IORING_MAX_ENTRIES, IORING_SETUP_CQSIZE, IoUring, IoUringParams,
+        },
+    },
+    mm::{UserConstPtr, UserPtr, nullable},
+    signal::with_replacen_blocked,
+    syscall::signal::check_sigset_size,
+};
+
+pub fn sys_io_uring_setup(entries: u32, params: UserPtr<IoUringParams>) -> AxResult<isize> {
+    let params = params.get_as_mut()?;
+    debug!(
+        "sys_io_uring_setup <= entries: {entries}, flags: {:#x}",
+        params.flags
+    );
+
+    if entries == 0 || entries > IORING_MAX_ENTRIES {
+        return Err(AxError::InvalidInput);
+    }
+    // SQPOLL, IOPOLL and friends need kernel-side pollers we do not have.
+    if params.flags & !IORING_SETUP_CQSIZE != 0 {
+        return Err(AxError::InvalidInput);
+    }
+
+    let sq_entries = entries.next_power_of_two();
+    let cq_entries = if params.flags & IORING_SETUP_CQSIZE != 0 {
+        if params.cq_entries < sq_entries || params.cq_entries > 2 * IORING_MAX_ENTRIES {
+            return Err(AxError::InvalidInput);
+        }
+        params.cq_entries.next_power_of_two()
+    } else {
+        2 * sq_entries
+    };
+
+    let ring = IoUring::new(sq_entries, cq_entries)?;
+    ring.fill_params(params);
+    add_file_like(Arc::new(ring), true).map(|fd| fd as _)
+}
+
+pub fn sys_io_uring_enter(
+    fd: i32,
+    to_submit: u32,
+    min_complete: u32,
+    flags: u32,
+    sig: UserConstPtr<SignalSet>,
+    sigsz: usize,
+) -> AxResult<isize> {
+    debug!(
+        "sys_io_uring_enter <= fd: {fd}, to_submit: {to_submit}, min_complete: {min_complete}, \
+         flags: {flags:#x}"
+    );
+
+    let ring = IoUring::from_fd(fd)?;
+    // `sig` would point at a `struct io_uring_getevents_arg` instead.
+    if flags & IORING_ENTER_EXT_ARG != 0 {
+        return Err(AxError::InvalidInput);
+    }
+    let sig = nullable!(sig.get_as_ref())?.copied();
+    if sig.is_some() {
+        check_sigset_size(sigsz)?;
+    }
+    with_replacen_blocked(sig, || {
+        ring.enter(to_submit, min_complete, flags).map(|n| n as _)
+    })
+}
+
+pub fn sys_io_uring_register(fd: i32, opcode: u32, arg: usize, nr_args: u32) -> AxResult<isize> {
+    debug!("sys_io_uring_register <= fd: {fd}, opcode: {opcode}, nr_args: {nr_args}");
+
+    IoUring::from_fd(fd)?.register(opcode, arg, nr_args)
+}
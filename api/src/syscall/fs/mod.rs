@@ -2,6 +2,7 @@ mod ctl;
 mod event;
 mod fd_ops;
 mod io;
+mod io_uring;
 mod memfd;
 mod mount;
 mod pidfd;
@@ -11,5 +12,5 @@ mod stat;
 mod timerfd;
 
 pub use self::{
-    ctl::*, event::*, fd_ops::*, io::*, memfd::*, mount::*, pidfd::*, pipe::*, signalfd::*, stat::*, timerfd::*,
+    ctl::*, event::*, fd_ops::*, io::*, io_uring::*, memfd::*, mount::*, pidfd::*, pipe::*, signalfd::*, stat::*, timerfd::*,
 };
@@ -1,30 +1,61 @@
+use alloc::string::{String, ToString};
 use core::ffi::{c_char, c_void};
 
 use axerrno::{AxError, AxResult};
 use axfs::FS_CONTEXT;
+use linux_raw_sys::general::MS_REMOUNT;
 
-use crate::{mm::vm_load_string, vfs::MemoryFs};
+use crate::{
+    mm::vm_load_string,
+    vfs::{
+        MemoryFs,
+        readahead::{RaWindow, set_mount_window},
+    },
+};
 
 pub fn sys_mount(
     source: *const c_char,
     target: *const c_char,
     fs_type: *const c_char,
-    _flags: i32,
-    _data: *const c_void,
+    flags: i32,
+    data: *const c_void,
 ) -> AxResult<isize> {
-    let source = vm_load_string(source)?;
+    // Remounts may leave the source and type out.
+    let load_optional = |s: *const c_char| {
+        if s.is_null() {
+            Ok(String::new())
+        } else {
+            vm_load_string(s)
+        }
+    };
+    let source = load_optional(source)?;
     let target = vm_load_string(target)?;
-    let fs_type = vm_load_string(fs_type)?;
-    debug!("sys_mount <= source: {source:?}, target: {target:?}, fs_type: {fs_type:?}");
+    let fs_type = load_optional(fs_type)?;
+    let data = if data.is_null() {
+        None
+    } else {
+        Some(vm_load_string(data as *const c_char)?)
+    };
+    debug!(
+        "sys_mount <= source: {source:?}, target: {target:?}, fs_type: {fs_type:?}, data: {data:?}"
+    );
 
-    if fs_type != "tmpfs" {
+    let remount = flags as u32 & MS_REMOUNT != 0;
+    if !remount && fs_type != "tmpfs" {
         return Err(AxError::NoSuchDevice);
     }
 
-    let fs = MemoryFs::new();
-
     let target = FS_CONTEXT.lock().resolve(target)?;
-    target.mount(&fs)?;
+    // Only the readahead bounds can be changed on a remount; this is how they
+    // reach filesystems not mounted through here, like the root.
+    if !remount {
+        target.mount(&MemoryFs::new())?;
+    }
+
+    let window = data.as_deref().and_then(RaWindow::from_mount_options);
+    if let Ok(path) = target.absolute_path() {
+        set_mount_window(&path.to_string(), window);
+    }
 
     Ok(0)
 }
@@ -34,5 +65,8 @@ pub fn sys_umount2(target: *const c_char, _flags: i32) -> AxResult<isize> {
     debug!("sys_umount2 <= target: {target:?}");
     let target = FS_CONTEXT.lock().resolve(target)?;
     target.unmount()?;
+    if let Ok(path) = target.absolute_path() {
+        set_mount_window(&path.to_string(), None);
+    }
     Ok(0)
 }
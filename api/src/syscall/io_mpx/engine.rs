@@ -0,0 +1,265 @@
+//! The wait loop shared by `poll` and `select`.
+//!
+//! A call first checks every file without registering anything, which is all
+//! a non-blocking call or one with a ready file ever does. Before blocking,
+//! each file is given its own waker, once; when one fires it marks its file
+//! in a bitmap, and the next round only checks and re-arms the marked files
+//! instead of walking the whole set again.
+//!
+//! Files have no way to drop a waker, so the wakers are kept by the thread
+//! for its next call: a file that is polled again at the same position gets
+//! the very same waker, which its poll set recognizes instead of piling up
+//! one per call.
+
+use alloc::{boxed::Box, sync::Arc, vec::Vec};
+use core::{
+    future::poll_fn,
+    mem,
+    sync::atomic::{AtomicU64, Ordering},
+    task::{Context, Poll, RawWaker, RawWakerVTable, Waker},
+};
+
+use axerrno::AxResult;
+use axhal::time::TimeValue;
+use axpoll::IoEvents;
+use axtask::{
+    current,
+    future::{self, block_on, interruptible},
+};
+use kspin::SpinNoIrq;
+use starry_core::{pool::ObjectPool, task::AsThread};
+
+use crate::file::FileLike;
+
+/// Buffers with more room than this are freed instead of pooled.
+const MAX_POOLED_ENTRIES: usize = 1024;
+
+struct PollEntry {
+    file: Arc<dyn FileLike>,
+    events: IoEvents,
+}
+
+static ENTRY_BUFFERS: ObjectPool<Vec<PollEntry>> = ObjectPool::new(4, 8);
+
+/// The files a `poll` or `select` call waits on.
+pub struct FdPollSet {
+    entries: Vec<PollEntry>,
+}
+
+impl FdPollSet {
+    /// Creates an empty set with room for `capacity` files.
+    pub fn with_capacity(capacity: usize) -> Self {
+        let mut entries = ENTRY_BUFFERS.get_or_else(Vec::new);
+        entries.reserve(capacity);
+        Self { entries }
+    }
+
+    /// Adds `file`, waiting for `events` on it.
+    pub fn push(&mut self, file: Arc<dyn FileLike>, events: IoEvents) {
+        self.entries.push(PollEntry { file, events });
+    }
+
+    fn check(
+        &self,
+        index: usize,
+        check: &mut impl FnMut(usize, IoEvents, IoEvents) -> usize,
+    ) -> usize {
+        let entry = &self.entries[index];
+        check(index, entry.file.poll(), entry.events)
+    }
+
+    fn register(&self, wake: &Arc<PollWake>, index: usize) {
+        let waker = wake.waker(index);
+        let mut cx = Context::from_waker(&waker);
+        let entry = &self.entries[index];
+        entry.file.register(&mut cx, entry.events);
+    }
+
+    /// Waits until a file is ready or `timeout` passes.
+    ///
+    /// `check` is given the index of a file, its current events and the
+    /// events of interest, records the result and returns how many events
+    /// to report for it. Returns the sum once it is not zero, or 0 on
+    /// timeout.
+    pub fn wait(
+        &self,
+        timeout: Option<TimeValue>,
+        mut check: impl FnMut(usize, IoEvents, IoEvents) -> usize,
+    ) -> AxResult<usize> {
+        let n = self.entries.len();
+        let ready: usize = (0..n).map(|i| self.check(i, &mut check)).sum();
+        if ready > 0 || timeout == Some(TimeValue::ZERO) {
+            return Ok(ready);
+        }
+
+        let mut wake: Option<Arc<PollWake>> = None;
+        let wait = poll_fn(|cx| {
+            let ready = match &wake {
+                None => {
+                    let new = PollWake::for_current(n);
+                    new.set_task(cx.waker());
+                    // Checking after registering catches whatever happened
+                    // since the first round.
+                    let ready = (0..n)
+                        .map(|i| {
+                            self.register(&new, i);
+                            self.check(i, &mut check)
+                        })
+                        .sum();
+                    wake = Some(new);
+                    ready
+                }
+                Some(wake) => {
+                    wake.set_task(cx.waker());
+                    let mut ready = 0;
+                    wake.take_fired(|i| {
+                        // The waker of `i` is used up.
+                        self.register(wake, i);
+                        ready += self.check(i, &mut check);
+                    });
+                    ready
+                }
+            };
+            if ready > 0 {
+                Poll::Ready(Ok(ready))
+            } else {
+                Poll::Pending
+            }
+        });
+        let result = block_on(future::timeout(timeout, interruptible(wait)));
+        if let Some(wake) = wake {
+            wake.release();
+        }
+        match result {
+            Ok(r) => r?,
+            Err(_) => Ok(0),
+        }
+    }
+}
+
+impl Drop for FdPollSet {
+    fn drop(&mut self) {
+        let mut entries = mem::take(&mut self.entries);
+        entries.clear();
+        if entries.capacity() <= MAX_POOLED_ENTRIES {
+            ENTRY_BUFFERS.put(entries);
+        }
+    }
+}
+
+/// Wakers of the blocking calls of one thread, one per file position.
+struct PollWake {
+    slots: Box<[WakeSlot]>,
+    /// Files whose waker fired since the last round.
+    fired: Box<[AtomicU64]>,
+    task: SpinNoIrq<Option<Waker>>,
+}
+
+/// What the waker of one file points to.
+struct WakeSlot {
+    owner: *const PollWake,
+    index: usize,
+}
+
+// SAFETY: `owner` is only used to reach the shared, thread-safe `PollWake`.
+unsafe impl Send for PollWake {}
+unsafe impl Sync for PollWake {}
+
+static WAKE_VTABLE: RawWakerVTable =
+    RawWakerVTable::new(wake_clone, wake_wake, wake_wake_by_ref, wake_drop);
+
+// Every `RawWaker` made from a slot holds a strong count of its owner, which
+// keeps the slot alive.
+
+unsafe fn wake_clone(data: *const ()) -> RawWaker {
+    let slot = unsafe { &*(data as *const WakeSlot) };
+    unsafe { Arc::increment_strong_count(slot.owner) };
+    RawWaker::new(data, &WAKE_VTABLE)
+}
+
+unsafe fn wake_wake(data: *const ()) {
+    unsafe {
+        wake_wake_by_ref(data);
+        wake_drop(data);
+    }
+}
+
+unsafe fn wake_wake_by_ref(data: *const ()) {
+    let slot = unsafe { &*(data as *const WakeSlot) };
+    unsafe { &*slot.owner }.fire(slot.index);
+}
+
+unsafe fn wake_drop(data: *const ()) {
+    let slot = unsafe { &*(data as *const WakeSlot) };
+    unsafe { Arc::decrement_strong_count(slot.owner) };
+}
+
+impl PollWake {
+    fn new(n: usize) -> Arc<Self> {
+        Arc::new_cyclic(|owner| Self {
+            slots: (0..n)
+                .map(|index| WakeSlot {
+                    owner: owner.as_ptr(),
+                    index,
+                })
+                .collect(),
+            fired: (0..n.div_ceil(64)).map(|_| AtomicU64::new(0)).collect(),
+            task: SpinNoIrq::new(None),
+        })
+    }
+
+    /// Returns the wakers cached by the current thread if there are enough of
+    /// them, or new ones.
+    fn for_current(n: usize) -> Arc<Self> {
+        let curr = current();
+        let cached = curr.as_thread().poll_wake.lock().take();
+        if let Some(wake) = cached.and_then(|wake| wake.downcast::<Self>().ok())
+            && wake.slots.len() >= n
+        {
+            // Stale wakers may have fired since the last call.
+            wake.take_fired(|_| {});
+            return wake;
+        }
+        Self::new(n.next_power_of_two())
+    }
+
+    /// Detaches the wakers from the task and hands them back to the thread.
+    fn release(self: Arc<Self>) {
+        *self.task.lock() = None;
+        *current().as_thread().poll_wake.lock() = Some(self);
+    }
+
+    fn waker(self: &Arc<Self>, index: usize) -> Waker {
+        let data = &self.slots[index] as *const WakeSlot as *const ();
+        // SAFETY: the new waker owns the count taken here.
+        unsafe {
+            Arc::increment_strong_count(Arc::as_ptr(self));
+            Waker::from_raw(RawWaker::new(data, &WAKE_VTABLE))
+        }
+    }
+
+    fn set_task(&self, waker: &Waker) {
+        let mut task = self.task.lock();
+        if !task.as_ref().is_some_and(|task| task.will_wake(waker)) {
+            *task = Some(waker.clone());
+        }
+    }
+
+    fn fire(&self, index: usize) {
+        self.fired[index / 64].fetch_or(1 << (index % 64), Ordering::AcqRel);
+        let task = self.task.lock().clone();
+        if let Some(task) = task {
+            task.wake();
+        }
+    }
+
+    fn take_fired(&self, mut f: impl FnMut(usize)) {
+        for (i, word) in self.fired.iter().enumerate() {
+            let mut bits = word.swap(0, Ordering::AcqRel);
+            while bits != 0 {
+                f(i * 64 + bits.trailing_zeros() as usize);
+                bits &= bits - 1;
+            }
+        }
+    }
+}
@@ -93,18 +93,19 @@ fn do_epoll_wait(
     }
     let events = events.get_as_mut_slice(maxevents as usize)?;
 
-    with_replacen_blocked(
-        nullable!(sigmask.get_as_ref())?.copied(),
-        || match block_on(future::timeout(
+    with_replacen_blocked(nullable!(sigmask.get_as_ref())?.copied(), || {
+        let result = block_on(future::timeout(
             timeout,
-            poll_io(epoll.as_ref(), IoEvents::IN, false, || {
+            poll_io(&epoll.waiter(), IoEvents::IN, false, || {
                 epoll.poll_events(events)
             }),
-        )) {
+        ));
+        epoll.unregister_current();
+        match result {
             Ok(r) => r.map(|n| n as _),
             Err(_) => Ok(0),
-        },
-    )
+        }
+    })
 }
 
 pub fn sys_epoll_pwait(
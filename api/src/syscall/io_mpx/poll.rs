@@ -3,13 +3,12 @@ use alloc::vec::Vec;
 use axerrno::{AxError, AxResult};
 use axhal::time::TimeValue;
 use axpoll::IoEvents;
-use axtask::future::{self, block_on, poll_io};
 use linux_raw_sys::general::{POLLNVAL, pollfd, timespec};
 use starry_signal::SignalSet;
 
 use super::FdPollSet;
 use crate::{
-    file::get_file_like,
+    file::FD_TABLE,
     mm::{UserConstPtr, UserPtr, nullable},
     signal::with_replacen_blocked,
     syscall::signal::check_sigset_size,
@@ -24,64 +23,49 @@ fn do_poll(
     debug!("do_poll fds={poll_fds:?} timeout={timeout:?}");
 
     let mut res = 0isize;
-    let mut fds = Vec::with_capacity(poll_fds.len());
+    let mut fds = FdPollSet::with_capacity(poll_fds.len());
     let mut revents = Vec::with_capacity(poll_fds.len());
+    let fd_table = FD_TABLE.read();
     for fd in poll_fds.iter_mut() {
         if fd.fd == -1 {
             // Skip -1
             continue;
         }
-        match get_file_like(fd.fd) {
-            Ok(f) => {
-                fds.push((
-                    f,
+        match fd_table.get(fd.fd as usize) {
+            Some(f) if fd.fd >= 0 => {
+                fds.push(
+                    f.inner.clone(),
                     IoEvents::from_bits(fd.events as _).ok_or(AxError::InvalidInput)?
                         | IoEvents::ALWAYS_POLL,
-                ));
+                );
                 revents.push(&mut fd.revents);
             }
-            Err(_) => {
+            _ => {
                 // If the fd is invalid, set revents to POLLNVAL
                 fd.revents = POLLNVAL as _;
                 res += 1;
             }
         }
     }
+    drop(fd_table);
     if res > 0 {
         return Ok(res);
     }
-    let fds = FdPollSet(fds);
 
     with_replacen_blocked(sigmask, || {
-        match block_on(future::timeout(
-            timeout,
-            poll_io(&fds, IoEvents::empty(), false, || {
-                let mut res = 0usize;
-                for ((fd, events), revents) in fds.0.iter().zip(revents.iter_mut()) {
-                    let mut result = fd.poll();
-                    if result.contains(IoEvents::IN) {
-                        result |= IoEvents::RDNORM;
-                    }
-                    if result.contains(IoEvents::OUT) {
-                        result |= IoEvents::WRNORM;
-                    }
-                    result &= *events;
+        let ready = fds.wait(timeout, |index, mut result, events| {
+            if result.contains(IoEvents::IN) {
+                result |= IoEvents::RDNORM;
+            }
+            if result.contains(IoEvents::OUT) {
+                result |= IoEvents::WRNORM;
+            }
+            result &= events;
 
-                    **revents = result.bits() as _;
-                    if **revents != 0 {
-                        res += 1;
-                    }
-                }
-                if res > 0 {
-                    Ok(res as _)
-                } else {
-                    Err(AxError::WouldBlock)
-                }
-            }),
-        )) {
-            Ok(r) => r,
-            Err(_) => Ok(0),
-        }
+            *revents[index] = result.bits() as _;
+            (*revents[index] != 0) as usize
+        })?;
+        Ok(ready as _)
     })
 }
 
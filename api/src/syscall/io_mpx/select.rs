@@ -3,7 +3,6 @@ use core::{fmt, time::Duration};
 
 use axerrno::{AxError, AxResult};
 use axpoll::IoEvents;
-use axtask::future::{self, block_on, poll_io};
 use bitmaps::Bitmap;
 use linux_raw_sys::{
     general::*,
@@ -77,7 +76,7 @@ fn do_select(
     let fd_table = FD_TABLE.read();
     let fd_bitmap = read_set.0 | write_set.0 | except_set.0;
     let fd_count = fd_bitmap.len();
-    let mut fds = Vec::with_capacity(fd_count);
+    let mut fds = FdPollSet::with_capacity(fd_count);
     let mut fd_indices = Vec::with_capacity(fd_count);
     for fd in fd_bitmap.into_iter() {
         let f = fd_table
@@ -90,13 +89,12 @@ fn do_select(
         events.set(IoEvents::OUT, write_set.0.get(fd));
         events.set(IoEvents::ERR, except_set.0.get(fd));
         if !events.is_empty() {
-            fds.push((f, events));
+            fds.push(f, events);
             fd_indices.push(fd);
         }
     }
 
     drop(fd_table);
-    let fds = FdPollSet(fds);
 
     if let Some(readfds) = readfds.as_deref_mut() {
         unsafe { FD_ZERO(readfds) };
@@ -108,41 +106,31 @@ fn do_select(
         unsafe { FD_ZERO(exceptfds) };
     }
     with_replacen_blocked(sigmask.copied(), || {
-        match block_on(future::timeout(
-            timeout,
-            poll_io(&fds, IoEvents::empty(), false, || {
-                let mut res = 0usize;
-                for ((fd, interested), index) in fds.0.iter().zip(fd_indices.iter().copied()) {
-                    let events = fd.poll() & *interested;
-                    if events.contains(IoEvents::IN)
-                        && let Some(set) = readfds.as_deref_mut()
-                    {
-                        res += 1;
-                        unsafe { FD_SET(index as _, set) };
-                    }
-                    if events.contains(IoEvents::OUT)
-                        && let Some(set) = writefds.as_deref_mut()
-                    {
-                        res += 1;
-                        unsafe { FD_SET(index as _, set) };
-                    }
-                    if events.contains(IoEvents::ERR)
-                        && let Some(set) = exceptfds.as_deref_mut()
-                    {
-                        res += 1;
-                        unsafe { FD_SET(index as _, set) };
-                    }
-                }
-                if res > 0 {
-                    return Ok(res as _);
-                }
-
-                Err(AxError::WouldBlock)
-            }),
-        )) {
-            Ok(r) => r,
-            Err(_) => Ok(0),
-        }
+        let ready = fds.wait(timeout, |i, events, interested| {
+            let events = events & interested;
+            let index = fd_indices[i];
+            let mut res = 0;
+            if events.contains(IoEvents::IN)
+                && let Some(set) = readfds.as_deref_mut()
+            {
+                res += 1;
+                unsafe { FD_SET(index as _, set) };
+            }
+            if events.contains(IoEvents::OUT)
+                && let Some(set) = writefds.as_deref_mut()
+            {
+                res += 1;
+                unsafe { FD_SET(index as _, set) };
+            }
+            if events.contains(IoEvents::ERR)
+                && let Some(set) = exceptfds.as_deref_mut()
+            {
+                res += 1;
+                unsafe { FD_SET(index as _, set) };
+            }
+            res
+        })?;
+        Ok(ready as _)
     })
 }
 
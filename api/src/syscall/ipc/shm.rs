@@ -9,7 +9,7 @@ use axmm::backend::{Backend, SharedPages};
 use axsync::Mutex;
 use axtask::current;
 use linux_raw_sys::general::*;
-use memory_addr::{PAGE_SIZE_4K, VirtAddr, VirtAddrRange};
+use memory_addr::{MemoryAddr, PAGE_SIZE_4K, VirtAddr, VirtAddrRange};
 use starry_core::{
     shm::{SHM_MANAGER, ShmInner, ShmidDs},
     task::AsThread,
@@ -40,11 +40,34 @@ const IPC_SET: u32 = 1;
 
 const IPC_STAT: u32 = 2;
 
+const SHM_LOCK: u32 = 11;
+
+const SHM_UNLOCK: u32 = 12;
+
+/// Backs the segment with huge pages
+const SHM_HUGETLB: usize = 0o4000;
+
+/// The huge page size is given as its log2 in these bits of `shmflg`
+const SHM_HUGE_SHIFT: usize = 26;
+const SHM_HUGE_MASK: usize = 0x3f;
+
+/// Picks the page size asked for by `shmflg`.
+fn shm_page_size(shmflg: usize) -> AxResult<PageSize> {
+    if shmflg & SHM_HUGETLB == 0 {
+        return Ok(PageSize::Size4K);
+    }
+    match (shmflg >> SHM_HUGE_SHIFT) & SHM_HUGE_MASK {
+        0 | 21 => Ok(PageSize::Size2M),
+        30 => Ok(PageSize::Size1G),
+        _ => Err(AxError::InvalidInput),
+    }
+}
+
 pub fn sys_shmget(key: i32, size: usize, shmflg: usize) -> AxResult<isize> {
-    let page_num = memory_addr::align_up_4k(size) / PAGE_SIZE_4K;
-    if page_num == 0 {
+    if size == 0 {
         return Err(AxError::InvalidInput);
     }
+    let page_size = shm_page_size(shmflg)?;
 
     let mut mapping_flags = MappingFlags::from_name("USER").unwrap();
     if shmflg & 0o400 != 0 {
@@ -77,6 +100,7 @@ pub fn sys_shmget(key: i32, size: usize, shmflg: usize) -> AxResult<isize> {
         key,
         shmid,
         size,
+        page_size,
         mapping_flags,
         cur_pid,
     )));
@@ -89,74 +113,130 @@ pub fn sys_shmget(key: i32, size: usize, shmflg: usize) -> AxResult<isize> {
 pub fn sys_shmat(shmid: i32, addr: usize, shmflg: u32) -> AxResult<isize> {
     let shm_inner = {
         let shm_manager = SHM_MANAGER.lock();
-        shm_manager.get_inner_by_shmid(shmid).unwrap()
+        shm_manager
+            .get_inner_by_shmid(shmid)
+            .ok_or(AxError::InvalidInput)?
     };
-    let mut shm_inner = shm_inner.lock();
-    let mut mapping_flags = shm_inner.mapping_flags;
     let shm_flg = ShmAtFlags::from_bits_truncate(shmflg);
 
-    if shm_flg.contains(ShmAtFlags::SHM_RDONLY) {
-        mapping_flags.remove(MappingFlags::WRITE);
-    }
-
     // TODO: solve shmflg: SHM_RND and SHM_REMAP
 
     let curr = current();
     let proc_data = &curr.as_thread().proc_data;
     let pid = proc_data.proc.pid();
-    let mut aspace = proc_data.aspace.lock();
 
-    let start_aligned = memory_addr::align_down_4k(addr);
-    let length = shm_inner.page_num * PAGE_SIZE_4K;
+    // Everything the mapping needs is taken with the segment locked, and the
+    // segment is then reserved so that IPC_RMID cannot drop it while this
+    // process builds its page tables without the lock.
+    let (mut mapping_flags, page_size, length, populate, pages) = {
+        let mut shm_inner = shm_inner.lock();
+        if shm_inner.get_addr_range(pid).is_some() {
+            return Err(AxError::InvalidInput);
+        }
+        let page_size = shm_inner.page_size;
+        let length = shm_inner.page_num * PAGE_SIZE_4K;
+        let pages = match shm_inner.phys_pages.clone() {
+            // Another proccess has attached the shared memory
+            Some(pages) => pages,
+            // This is the first process to attach the shared memory
+            None => {
+                let pages = Arc::new(SharedPages::new(length, page_size)?);
+                shm_inner.map_to_phys(pages.clone());
+                pages
+            }
+        };
+        shm_inner.begin_attach();
+        (
+            shm_inner.mapping_flags,
+            page_size,
+            length,
+            shm_inner.locked,
+            pages,
+        )
+    };
+    if shm_flg.contains(ShmAtFlags::SHM_RDONLY) {
+        mapping_flags.remove(MappingFlags::WRITE);
+    }
+
+    let start_addr = match map_segment(addr, length, page_size, mapping_flags, populate, pages) {
+        Ok(start_addr) => start_addr,
+        Err(err) => {
+            let mut shm_manager = SHM_MANAGER.lock();
+            let mut shm_inner = shm_inner.lock();
+            shm_inner.end_attach();
+            if shm_inner.removable() {
+                shm_manager.remove_shmid(shmid);
+            }
+            return Err(err);
+        }
+    };
+    let va_range = VirtAddrRange::new(start_addr, start_addr + length);
+
+    info!(
+        "Process {} alloc shm virt addr start: {:#x}, size: {}, mapping_flags: {:#x?}",
+        pid,
+        start_addr.as_usize(),
+        length,
+        mapping_flags
+    );
+
+    // The global table is always taken before the lock of a segment, as
+    // `ShmManager::clear_proc_shm` does, and both are updated together.
+    let mut shm_manager = SHM_MANAGER.lock();
+    let mut shm_inner = shm_inner.lock();
+    shm_inner.end_attach();
+    if shm_inner.get_addr_range(pid).is_some() {
+        // Another thread of this process attached the segment meanwhile.
+        let removable = shm_inner.removable();
+        drop(shm_inner);
+        drop(shm_manager);
+        proc_data.aspace().lock().unmap(start_addr, length)?;
+        if removable {
+            SHM_MANAGER.lock().remove_shmid(shmid);
+        }
+        return Err(AxError::InvalidInput);
+    }
+    shm_inner.attach_process(pid, va_range);
+    shm_manager.insert_shmid_vaddr(pid, shmid, start_addr);
+    Ok(start_addr.as_usize() as isize)
+}
+
+/// Maps `pages` into the address space of the current process, near `addr`
+/// if possible, and returns where they were mapped.
+fn map_segment(
+    addr: usize,
+    length: usize,
+    page_size: PageSize,
+    mapping_flags: MappingFlags,
+    populate: bool,
+    pages: Arc<SharedPages>,
+) -> AxResult<VirtAddr> {
+    let curr = current();
+    let aspace = curr.as_thread().proc_data.aspace();
+    let mut aspace = aspace.lock();
 
     // alloc the virtual address range
-    assert!(shm_inner.get_addr_range(pid).is_none());
     let start_addr = aspace
         .find_free_area(
-            VirtAddr::from(start_aligned),
+            VirtAddr::from(addr.align_down(page_size)),
             length,
             VirtAddrRange::new(aspace.base(), aspace.end()),
-            PAGE_SIZE_4K,
+            page_size as usize,
         )
         .or_else(|| {
             aspace.find_free_area(
                 aspace.base(),
                 length,
                 VirtAddrRange::new(aspace.base(), aspace.end()),
-                PAGE_SIZE_4K,
+                page_size as usize,
             )
         })
         .ok_or(AxError::NoMemory)?;
-    let end_addr = VirtAddr::from(start_addr.as_usize() + length);
-    let va_range = VirtAddrRange::new(start_addr, end_addr);
-
-    let mut shm_manager = SHM_MANAGER.lock();
-    shm_manager.insert_shmid_vaddr(pid, shm_inner.shmid, start_addr);
-    info!(
-        "Process {} alloc shm virt addr start: {:#x}, size: {}, mapping_flags: {:#x?}",
-        pid,
-        start_addr.as_usize(),
-        length,
-        mapping_flags
-    );
 
-    // map the virtual address range to the physical address
-    if let Some(phys_pages) = shm_inner.phys_pages.clone() {
-        // Another proccess has attached the shared memory
-        // TODO(mivik): shm page size
-        let backend = Backend::new_shared(start_addr, phys_pages);
-        aspace.map(start_addr, length, mapping_flags, false, backend)?;
-    } else {
-        // This is the first process to attach the shared memory
-        let pages = Arc::new(SharedPages::new(length, PageSize::Size4K)?);
-        let backend = Backend::new_shared(start_addr, pages.clone());
-        aspace.map(start_addr, length, mapping_flags, false, backend)?;
-
-        shm_inner.map_to_phys(pages);
-    }
-
-    shm_inner.attach_process(pid, va_range);
-    Ok(start_addr.as_usize() as isize)
+    // Locked segments are mapped in full so that they never fault.
+    let backend = Backend::new_shared(start_addr, pages);
+    aspace.map(start_addr, length, mapping_flags, populate, backend)?;
+    Ok(start_addr)
 }
 
 pub fn sys_shmctl(shmid: i32, cmd: u32, buf: UserPtr<ShmidDs>) -> AxResult<isize> {
@@ -172,15 +252,33 @@ pub fn sys_shmctl(shmid: i32, cmd: u32, buf: UserPtr<ShmidDs>) -> AxResult<isize
         shm_inner.shmid_ds = *buf.get_as_mut()?;
     } else if cmd == IPC_STAT {
         if let Some(shmid_ds) = nullable!(buf.get_as_mut())? {
-            *shmid_ds = shm_inner.shmid_ds;
+            *shmid_ds = shm_inner.stat();
         }
     } else if cmd == IPC_RMID {
         shm_inner.rmid = true;
+    } else if cmd == SHM_LOCK || cmd == SHM_UNLOCK {
+        // The pages of a segment are allocated in full when it is first
+        // attached and are never reclaimed, so they already stay resident;
+        // locking only makes later attaches map them up front.
+        shm_inner.locked = cmd == SHM_LOCK;
     } else {
         return Err(AxError::InvalidInput);
     }
 
     shm_inner.shmid_ds.shm_ctime = monotonic_time_nanos() as __kernel_time_t;
+    let rmid = shm_inner.rmid;
+    drop(shm_inner);
+    if rmid {
+        // Attaches may have raced in since the segment lock was dropped, so
+        // decide again with the global table held.
+        let mut shm_manager = SHM_MANAGER.lock();
+        let removable = shm_manager
+            .get_inner_by_shmid(shmid)
+            .is_some_and(|shm_inner| shm_inner.lock().removable());
+        if removable {
+            shm_manager.remove_shmid(shmid);
+        }
+    }
     Ok(0)
 }
 
@@ -205,32 +303,31 @@ pub fn sys_shmdt(shmaddr: usize) -> AxResult<isize> {
     let proc_data = &curr.as_thread().proc_data;
 
     let pid = proc_data.proc.pid();
-    let shmid = {
-        let shm_manager = SHM_MANAGER.lock();
-        shm_manager
+    // The attachment is dropped from both tables together before the pages are
+    // unmapped, so a concurrent detach of the same address finds nothing and
+    // no segment lock is held across the page table update.
+    let va_range = {
+        let mut shm_manager = SHM_MANAGER.lock();
+        let shmid = shm_manager
             .get_shmid_by_vaddr(pid, shmaddr)
-            .ok_or(AxError::InvalidInput)?
-    };
-
-    let shm_inner = {
-        let shm_manager = SHM_MANAGER.lock();
-        shm_manager
+            .ok_or(AxError::InvalidInput)?;
+        let shm_inner = shm_manager
             .get_inner_by_shmid(shmid)
-            .ok_or(AxError::InvalidInput)?
+            .ok_or(AxError::InvalidInput)?;
+        let mut shm_inner = shm_inner.lock();
+        let va_range = shm_inner.get_addr_range(pid).ok_or(AxError::InvalidInput)?;
+        shm_inner.detach_process(pid);
+        let removable = shm_inner.removable();
+        drop(shm_inner);
+        shm_manager.remove_shmaddr(pid, shmaddr);
+        if removable {
+            shm_manager.remove_shmid(shmid);
+        }
+        va_range
     };
-    let mut shm_inner = shm_inner.lock();
-    let va_range = shm_inner.get_addr_range(pid).ok_or(AxError::InvalidInput)?;
 
-    let mut aspace = proc_data.aspace.lock();
+    let aspace = proc_data.aspace();
+    let mut aspace = aspace.lock();
     aspace.unmap(va_range.start, va_range.size())?;
-
-    let mut shm_manager = SHM_MANAGER.lock();
-    shm_manager.remove_shmaddr(pid, shmaddr);
-    shm_inner.detach_process(pid);
-
-    if shm_inner.rmid && shm_inner.attach_count() == 0 {
-        shm_manager.remove_shmid(shmid);
-    }
-
     Ok(0)
 }
@@ -1,19 +1,37 @@
-use alloc::sync::Arc;
+use alloc::{sync::Arc, vec::Vec};
+use core::{iter, ops::Range};
 
 use axerrno::{AxError, AxResult};
 use axfs::FileBackend;
 use axhal::paging::{MappingFlags, PageSize};
-use axmm::backend::{Backend, SharedPages};
+use axmm::{
+    AddrSpace,
+    backend::{Backend, SharedPages},
+};
 use axtask::current;
+use lazy_static::lazy_static;
 use linux_raw_sys::general::*;
-use memory_addr::{MemoryAddr, VirtAddr, VirtAddrRange, align_up_4k};
+use memory_addr::{MemoryAddr, PAGE_SIZE_4K, VirtAddr, VirtAddrRange, align_up_4k};
 use starry_core::{
+    fault::FileMaps,
     task::AsThread,
+    thp::{HUGE_PAGE_SIZE, ThpState},
     vfs::{Device, DeviceMmap},
 };
 use starry_vm::{vm_load, vm_write_slice};
 
-use crate::file::{File, FileLike};
+use crate::{
+    file::{File, FileLike, io_uring::IoUring},
+    vfs::{
+        prefetch::{FileId, PrefetchHandle},
+        writeback,
+    },
+};
+
+lazy_static! {
+    /// Owns the windows queued by `MADV_WILLNEED`, which outlive the call.
+    static ref WILLNEED: PrefetchHandle = PrefetchHandle::new();
+}
 
 bitflags::bitflags! {
     /// `PROT_*` flags for use with [`sys_mmap`].
@@ -100,7 +118,8 @@ pub fn sys_mmap(
     }
 
     let curr = current();
-    let mut aspace = curr.as_thread().proc_data.aspace.lock();
+    let aspace_ref = curr.as_thread().proc_data.aspace();
+    let mut aspace = aspace_ref.lock();
     let permission_flags = MmapProt::from_bits_truncate(prot);
     // TODO: check illegal flags for mmap
     let map_flags = match MmapFlags::from_bits(flags) {
@@ -148,14 +167,28 @@ pub fn sys_mmap(
     let end = (addr + length).align_up(page_size);
     let mut length = end - start;
 
+    let proc_data = &curr.as_thread().proc_data;
+    let aspace_state = proc_data.aspace_state();
+    // Private anonymous 4K mappings are left to the transparent huge page code.
+    let thp = map_type == MmapFlags::PRIVATE && fd <= 0 && page_size == PageSize::Size4K;
+
     let start = if map_flags.intersects(MmapFlags::FIXED | MmapFlags::FIXED_NOREPLACE) {
         let dst_addr = VirtAddr::from(start);
         if !map_flags.contains(MmapFlags::FIXED_NOREPLACE) {
+            aspace_state
+                .thp
+                .lock()
+                .before_unmap(&mut aspace, start..start + length)?;
             aspace.unmap(dst_addr, length)?;
+            aspace_state.file_maps.lock().remove(start..start + length);
         }
         dst_addr
     } else {
-        let align = page_size as usize;
+        let align = if thp && ThpState::wants_alignment(length) {
+            HUGE_PAGE_SIZE
+        } else {
+            page_size as usize
+        };
         aspace
             .find_free_area(
                 VirtAddr::from(start),
@@ -172,12 +205,33 @@ pub fn sys_mmap(
             .ok_or(AxError::NoMemory)?
     };
 
+    if fd > 0
+        && let Ok(ring) = IoUring::from_fd(fd)
+    {
+        // The rings are shared with the kernel by construction.
+        if map_type == MmapFlags::PRIVATE {
+            return Err(AxError::InvalidInput);
+        }
+        let (pages, size) = ring.mmap_region(offset)?;
+        length = length.min(size);
+        aspace.map(
+            start,
+            length,
+            permission_flags.into(),
+            true,
+            Backend::new_shared(start, pages),
+        )?;
+        return Ok(start.as_usize() as _);
+    }
+
     let file = if fd > 0 {
         Some(File::from_fd(fd)?)
     } else {
         None
     };
 
+    // The page cache behind the mapping, for fault-around.
+    let mut cached_file = None;
     let backend = match map_type {
         MmapFlags::SHARED | MmapFlags::SHARED_VALIDATE => {
             if let Some(file) = file {
@@ -185,14 +239,9 @@ pub fn sys_mmap(
                 let backend = file.backend()?.clone();
                 match file.backend()?.clone() {
                     FileBackend::Cached(cache) => {
+                        cached_file = Some(backend);
                         // TODO(mivik): file mmap page size
-                        Backend::new_file(
-                            start,
-                            cache,
-                            file.flags(),
-                            offset,
-                            &curr.as_thread().proc_data.aspace,
-                        )
+                        Backend::new_file(start, cache, file.flags(), offset, &aspace_ref)
                     }
                     FileBackend::Direct(loc) => {
                         let device = loc
@@ -217,13 +266,10 @@ pub fn sys_mmap(
                                     start.as_usize() as isize - range.start.as_usize() as isize,
                                 )
                             }
-                            DeviceMmap::Cache(cache) => Backend::new_file(
-                                start,
-                                cache,
-                                file.flags(),
-                                offset,
-                                &curr.as_thread().proc_data.aspace,
-                            ),
+                            DeviceMmap::Cache(cache) => {
+                                cached_file = Some(FileBackend::Cached(cache.clone()));
+                                Backend::new_file(start, cache, file.flags(), offset, &aspace_ref)
+                            }
                         }
                     }
                 }
@@ -235,6 +281,9 @@ pub fn sys_mmap(
             if let Some(file) = file {
                 // Private mapping from a file
                 let backend = file.inner().backend()?.clone();
+                if matches!(backend, FileBackend::Cached(_)) {
+                    cached_file = Some(backend.clone());
+                }
                 Backend::new_cow(start, page_size, backend, offset as u64, None)
             } else {
                 Backend::new_alloc(start, page_size)
@@ -244,7 +293,25 @@ pub fn sys_mmap(
     };
 
     let populate = map_flags.contains(MmapFlags::POPULATE);
-    aspace.map(start, length, permission_flags.into(), populate, backend)?;
+    if thp {
+        aspace_state.thp.lock().map_anonymous(
+            &mut aspace,
+            start,
+            length,
+            permission_flags.into(),
+            populate,
+        )?;
+    } else {
+        aspace.map(start, length, permission_flags.into(), populate, backend)?;
+    }
+    if let Some(cached_file) = cached_file {
+        aspace_state.file_maps.lock().insert(
+            start.as_usize()..start.as_usize() + length,
+            cached_file,
+            offset as u64,
+            None,
+        );
+    }
 
     Ok(start.as_usize() as _)
 }
@@ -252,10 +319,24 @@ pub fn sys_mmap(
 pub fn sys_munmap(addr: usize, length: usize) -> AxResult<isize> {
     debug!("sys_munmap <= addr: {addr:#x}, length: {length:x}");
     let curr = current();
-    let mut aspace = curr.as_thread().proc_data.aspace.lock();
+    let proc_data = &curr.as_thread().proc_data;
+    let aspace = proc_data.aspace();
+    let mut aspace = aspace.lock();
+    let aspace_state = proc_data.aspace_state();
     let length = align_up_4k(length);
     let start_addr = VirtAddr::from(addr);
+    aspace_state
+        .thp
+        .lock()
+        .before_unmap(&mut aspace, addr..addr + length)?;
+    // Whatever was stored through shared mappings is only seen here.
+    let dirty = shared_file_pages(&aspace, &aspace_state.file_maps.lock(), addr..addr + length);
     aspace.unmap(start_addr, length)?;
+    aspace_state.file_maps.lock().remove(addr..addr + length);
+    drop(aspace);
+    for (backend, pages) in dirty {
+        writeback::account_mapped(&backend, pages);
+    }
     Ok(0)
 }
 
@@ -271,9 +352,16 @@ pub fn sys_mprotect(addr: usize, length: usize, prot: u32) -> AxResult<isize> {
     }
 
     let curr = current();
-    let mut aspace = curr.as_thread().proc_data.aspace.lock();
+    let proc_data = &curr.as_thread().proc_data;
+    let aspace = proc_data.aspace();
+    let mut aspace = aspace.lock();
     let length = align_up_4k(length);
     let start_addr = VirtAddr::from(addr);
+    proc_data
+        .aspace_state()
+        .thp
+        .lock()
+        .split_partial(&mut aspace, addr..addr + length)?;
     aspace.protect(start_addr, length, permission_flags.into())?;
 
     Ok(0)
@@ -293,7 +381,8 @@ pub fn sys_mremap(addr: usize, old_size: usize, new_size: usize, flags: u32) ->
     let addr = VirtAddr::from(addr);
 
     let curr = current();
-    let aspace = curr.as_thread().proc_data.aspace.lock();
+    let aspace = curr.as_thread().proc_data.aspace();
+    let aspace = aspace.lock();
     let old_size = align_up_4k(old_size);
     let new_size = align_up_4k(new_size);
 
@@ -317,14 +406,191 @@ pub fn sys_mremap(addr: usize, old_size: usize, new_size: usize, flags: u32) ->
     Ok(new_addr as isize)
 }
 
+/// Returns the file pages behind the shared writable mappings in `range`
+/// that could have been stored to.
+///
+/// The page table does not tell which pages are dirty, but a page that was
+/// never faulted in was not written through the mapping either.
+fn shared_file_pages(
+    aspace: &AddrSpace,
+    file_maps: &FileMaps,
+    range: Range<usize>,
+) -> Vec<(FileBackend, Range<u32>)> {
+    let mut pages = Vec::new();
+    file_maps.for_each_in(range, |range, backend, offset| {
+        let mut cur = range.start;
+        while cur < range.end {
+            let Some(area) = aspace.find_area(cur.into()) else {
+                break;
+            };
+            let end = area.end().as_usize().min(range.end);
+            if matches!(area.backend(), Backend::File(_))
+                && area.flags().contains(MappingFlags::WRITE)
+            {
+                let file_page =
+                    |va: usize| ((offset + (va - range.start) as u64) / PAGE_SIZE_4K as u64) as u32;
+                let mut run = None;
+                for va in (cur..end).step_by(PAGE_SIZE_4K).chain(iter::once(end)) {
+                    let mapped = va < end
+                        && aspace
+                            .page_table()
+                            .query(va.into())
+                            .is_ok_and(|(_, flags, _)| flags.contains(MappingFlags::WRITE));
+                    match (run, mapped) {
+                        (None, true) => run = Some(va),
+                        (Some(start), false) => {
+                            pages.push((backend.clone(), file_page(start)..file_page(va)));
+                            run = None;
+                        }
+                        _ => {}
+                    }
+                }
+            }
+            cur = end;
+        }
+    });
+    pages
+}
+
+/// Splits `[start, end)` along area boundaries, returning each piece with the
+/// flags and backend of the area it lies in.
+///
+/// Fails with `ENOMEM` if any part of the range is unmapped.
+fn areas_in(
+    aspace: &AddrSpace,
+    start: VirtAddr,
+    end: VirtAddr,
+) -> AxResult<Vec<(VirtAddr, usize, MappingFlags, Backend)>> {
+    let mut pieces = Vec::new();
+    let mut cur = start;
+    while cur < end {
+        let area = aspace.find_area(cur).ok_or(AxError::NoMemory)?;
+        let piece_end = area.end().min(end);
+        pieces.push((cur, piece_end - cur, area.flags(), area.backend().clone()));
+        cur = piece_end;
+    }
+    Ok(pieces)
+}
+
 pub fn sys_madvise(addr: usize, length: usize, advice: i32) -> AxResult<isize> {
     debug!("sys_madvise <= addr: {addr:#x}, length: {length:x}, advice: {advice:#x}");
+
+    if addr % PageSize::Size4K as usize != 0 {
+        return Err(AxError::InvalidInput);
+    }
+    let length = align_up_4k(length);
+    let end = addr.checked_add(length).ok_or(AxError::InvalidInput)?;
+    if length == 0 {
+        return Ok(0);
+    }
+    let (start, end) = (VirtAddr::from(addr), VirtAddr::from(end));
+
+    let curr = current();
+    let proc_data = &curr.as_thread().proc_data;
+    match advice as u32 {
+        MADV_DONTNEED | MADV_FREE => {
+            // Remapping a private area drops its frames; the next access
+            // faults in zeroes or the file contents again. Shared and device
+            // mappings keep their data, as on Linux. `MADV_FREE` is treated
+            // as an immediate `MADV_DONTNEED` since we never reclaim lazily.
+            let aspace = proc_data.aspace();
+            let mut aspace = aspace.lock();
+            proc_data
+                .aspace_state()
+                .thp
+                .lock()
+                .split_partial(&mut aspace, start.as_usize()..end.as_usize())?;
+            let pieces = areas_in(&aspace, start, end)?;
+            for (start, size, flags, backend) in pieces {
+                if matches!(backend, Backend::Cow(_)) {
+                    aspace.unmap(start, size)?;
+                    aspace.map(start, size, flags, false, backend)?;
+                }
+            }
+        }
+        MADV_WILLNEED => {
+            // Only the file pages are read ahead, by the readahead workers,
+            // so neither the caller nor the address space waits for the I/O.
+            let mut windows = Vec::new();
+            {
+                let aspace = proc_data.aspace();
+                let aspace = aspace.lock();
+                areas_in(&aspace, start, end)?;
+                proc_data.aspace_state().file_maps.lock().for_each_in(
+                    start.as_usize()..end.as_usize(),
+                    |range, backend, offset| {
+                        let first = (offset / PAGE_SIZE_4K as u64) as u32;
+                        let last = (offset + range.len() as u64).div_ceil(PAGE_SIZE_4K as u64);
+                        windows.push((backend.clone(), first, last as u32 - first));
+                    },
+                );
+            }
+            for (backend, start_page, num_pages) in windows {
+                if let Some(file) = FileId::of(&backend) {
+                    WILLNEED.submit(file, &backend, start_page, num_pages);
+                }
+            }
+        }
+        MADV_HUGEPAGE => {
+            let aspace = proc_data.aspace();
+            let mut aspace = aspace.lock();
+            areas_in(&aspace, start, end)?;
+            let aspace_state = proc_data.aspace_state();
+            let mut thp = aspace_state.thp.lock();
+            thp.advise(start.as_usize()..end.as_usize());
+            thp.promote_untouched(&mut aspace, start.as_usize()..end.as_usize())?;
+        }
+        MADV_NOHUGEPAGE => {
+            areas_in(&proc_data.aspace().lock(), start, end)?;
+            proc_data
+                .aspace_state()
+                .thp
+                .lock()
+                .unadvise(start.as_usize()..end.as_usize());
+        }
+        // Everything else, e.g. MADV_SEQUENTIAL or MADV_DONTFORK, is purely
+        // advisory here and accepted as before.
+        _ => {}
+    }
     Ok(0)
 }
 
 pub fn sys_msync(addr: usize, length: usize, flags: u32) -> AxResult<isize> {
     debug!("sys_msync <= addr: {addr:#x}, length: {length:x}, flags: {flags:#x}");
 
+    if addr % PageSize::Size4K as usize != 0
+        || flags & !(MS_ASYNC | MS_SYNC | MS_INVALIDATE) != 0
+        || (flags & MS_ASYNC != 0 && flags & MS_SYNC != 0)
+    {
+        return Err(AxError::InvalidInput);
+    }
+    let length = align_up_4k(length);
+    let end = addr.checked_add(length).ok_or(AxError::InvalidInput)?;
+    if length == 0 {
+        return Ok(0);
+    }
+
+    let curr = current();
+    let proc_data = &curr.as_thread().proc_data;
+    let pieces = {
+        let aspace = proc_data.aspace();
+        let aspace = aspace.lock();
+        areas_in(&aspace, addr.into(), end.into())?;
+        shared_file_pages(
+            &aspace,
+            &proc_data.aspace_state().file_maps.lock(),
+            addr..end,
+        )
+    };
+    // The page cache is shared with the mappings, so MS_INVALIDATE has
+    // nothing to do.
+    for (backend, pages) in pieces {
+        if flags & MS_SYNC != 0 {
+            writeback::sync_mapped(&backend, pages)?;
+        } else {
+            writeback::account_mapped(&backend, pages);
+        }
+    }
     Ok(0)
 }
 
@@ -33,7 +33,7 @@ fn send_impl(
     debug!("sys_send <= fd: {fd}, flags: {flags}, addr: {addr:?}");
 
     let socket = Socket::from_fd(fd)?;
-    let sent = socket.send(
+    let sent = socket.send_tuned(
         &mut src,
         SendOptions {
             to: addr,
@@ -104,7 +104,7 @@ fn recv_impl(
 
     let mut remote_addr =
         (!addr.is_null()).then(|| SocketAddrEx::Ip((Ipv4Addr::UNSPECIFIED, 0).into()));
-    let recv = socket.recv(
+    let recv = socket.recv_tuned(
         &mut dst,
         RecvOptions {
             from: remote_addr.as_mut(),
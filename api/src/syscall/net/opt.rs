@@ -3,7 +3,7 @@ use axnet::options::{Configurable, GetSocketOption, SetSocketOption};
 use linux_raw_sys::net::socklen_t;
 
 use crate::{
-    file::{FileLike, Socket},
+    file::{BufferKind, FileLike, Socket},
     mm::{UserConstPtr, UserPtr},
 };
 
@@ -177,6 +177,19 @@ pub fn sys_setsockopt(
     }
 
     let socket = Socket::from_fd(fd)?;
+    let buffer = match (level, optname) {
+        (linux_raw_sys::net::SOL_SOCKET, linux_raw_sys::net::SO_SNDBUF) => Some(BufferKind::Send),
+        (linux_raw_sys::net::SOL_SOCKET, linux_raw_sys::net::SO_RCVBUF) => {
+            Some(BufferKind::Receive)
+        }
+        _ => None,
+    };
+    if let Some(kind) = buffer {
+        let requested = *get::<i32>(optval, optlen)?;
+        socket.set_buffer_size(kind, requested.max(0) as usize)?;
+        return Ok(0);
+    }
+
     macro_rules! dispatch {
         ($which:ident) => {
             socket.set_option(SetSocketOption::$which(get(optval, optlen)?))?;
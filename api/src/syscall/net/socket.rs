@@ -55,7 +55,7 @@ pub fn sys_socket(domain: u32, raw_ty: u32, proto: u32) -> AxResult<isize> {
             return Err(AxError::from(LinuxError::EAFNOSUPPORT));
         }
     };
-    let socket = Socket(socket);
+    let socket = Socket::new(socket);
 
     if raw_ty & O_NONBLOCK != 0 {
         socket.set_nonblocking(true)?;
@@ -120,12 +120,12 @@ pub fn sys_accept4(
     let cloexec = flags & O_CLOEXEC != 0;
 
     let socket = Socket::from_fd(fd)?;
-    let socket = Socket(socket.accept()?);
+    let socket = Socket::new(socket.accept()?);
     if flags & O_NONBLOCK != 0 {
         socket.set_nonblocking(true)?;
     }
 
-    let remote_addr = socket.local_addr()?;
+    let remote_addr = socket.peer_addr()?;
     let fd = socket.add_to_fd_table(cloexec).map(|fd| fd as isize)?;
     debug!("sys_accept => fd: {fd}, addr: {remote_addr:?}");
 
@@ -177,8 +177,8 @@ pub fn sys_socketpair(
             return Err(AxError::from(LinuxError::ESOCKTNOSUPPORT));
         }
     };
-    let sock1 = Socket(axnet::Socket::Unix(sock1));
-    let sock2 = Socket(axnet::Socket::Unix(sock2));
+    let sock1 = Socket::new(axnet::Socket::Unix(sock1));
+    let sock2 = Socket::new(axnet::Socket::Unix(sock2));
 
     if raw_ty & O_NONBLOCK != 0 {
         sock1.set_nonblocking(true)?;
@@ -0,0 +1,153 @@
+//! Syscall counters and latency histograms.
+//!
+//! Collection is off until enabled through `/proc/starry/syscalls`; while it
+//! is off, a syscall only pays for one relaxed load. Once on, every syscall
+//! bumps counters of the CPU it ran on, so CPUs never write to the same cache
+//! line, plus the totals of its process.
+
+use alloc::string::String;
+use core::{
+    fmt::Write,
+    sync::atomic::{AtomicBool, AtomicU64, Ordering},
+};
+
+use axconfig::plat::CPU_NUM;
+use axhal::{percpu::this_cpu_id, time::monotonic_time_nanos};
+use starry_core::task::{AsThread, processes};
+use syscalls::Sysno;
+
+/// Syscall numbers at or above this are counted together in the last slot.
+const MAX_SYSNO: usize = 512;
+
+/// Number of latency buckets; bucket `i > 0` counts calls taking
+/// `[2^(i-1), 2^i)` ns, and the last one everything longer.
+const BUCKETS: usize = 32;
+
+struct SyscallCounters {
+    calls: AtomicU64,
+    total_ns: AtomicU64,
+    histogram: [AtomicU64; BUCKETS],
+}
+
+#[repr(align(64))]
+struct CpuStats([SyscallCounters; MAX_SYSNO]);
+
+static ENABLED: AtomicBool = AtomicBool::new(false);
+
+static STATS: [CpuStats; CPU_NUM] = [const {
+    CpuStats(
+        [const {
+            SyscallCounters {
+                calls: AtomicU64::new(0),
+                total_ns: AtomicU64::new(0),
+                histogram: [const { AtomicU64::new(0) }; BUCKETS],
+            }
+        }; MAX_SYSNO],
+    )
+}; CPU_NUM];
+
+/// Whether syscalls are being counted.
+#[inline]
+pub fn enabled() -> bool {
+    ENABLED.load(Ordering::Relaxed)
+}
+
+/// Starts or stops counting syscalls.
+pub fn set_enabled(enabled: bool) {
+    ENABLED.store(enabled, Ordering::Relaxed);
+}
+
+/// Returns the current time for [`record`].
+#[inline]
+pub fn start() -> u64 {
+    monotonic_time_nanos()
+}
+
+/// Accounts a call of `sysno` that began at `start`.
+pub fn record(sysno: Sysno, start: u64) {
+    let ns = monotonic_time_nanos().saturating_sub(start);
+    let counters = &STATS[this_cpu_id() % CPU_NUM].0[(sysno.id() as usize).min(MAX_SYSNO - 1)];
+    counters.calls.fetch_add(1, Ordering::Relaxed);
+    counters.total_ns.fetch_add(ns, Ordering::Relaxed);
+    let bucket = (u64::BITS - ns.leading_zeros()) as usize;
+    counters.histogram[bucket.min(BUCKETS - 1)].fetch_add(1, Ordering::Relaxed);
+
+    if let Some(thr) = axtask::current().try_as_thread() {
+        let proc_data = &thr.proc_data;
+        proc_data.syscalls.fetch_add(1, Ordering::Relaxed);
+        proc_data.syscall_ns.fetch_add(ns, Ordering::Relaxed);
+    }
+}
+
+/// Clears all counters.
+pub fn reset() {
+    for cpu in &STATS {
+        for counters in &cpu.0 {
+            counters.calls.store(0, Ordering::Relaxed);
+            counters.total_ns.store(0, Ordering::Relaxed);
+            for bucket in &counters.histogram {
+                bucket.store(0, Ordering::Relaxed);
+            }
+        }
+    }
+    for proc_data in processes() {
+        proc_data.syscalls.store(0, Ordering::Relaxed);
+        proc_data.syscall_ns.store(0, Ordering::Relaxed);
+    }
+}
+
+/// Renders the counters for `/proc/starry/syscalls`.
+///
+/// Each syscall that was called gets a line with its name, number of calls,
+/// total time in ns and the latency histogram, followed by one line per
+/// process with its pid, number of calls and total time.
+pub fn report() -> String {
+    let mut out = String::new();
+    let _ = writeln!(out, "enabled {}", enabled() as u8);
+    let _ = writeln!(
+        out,
+        "# syscall calls total_ns histogram (log2 ns buckets 0..{BUCKETS})"
+    );
+    for sysno in 0..MAX_SYSNO {
+        let mut calls = 0;
+        let mut total_ns = 0;
+        let mut histogram = [0; BUCKETS];
+        for cpu in &STATS {
+            let counters = &cpu.0[sysno];
+            calls += counters.calls.load(Ordering::Relaxed);
+            total_ns += counters.total_ns.load(Ordering::Relaxed);
+            for (sum, bucket) in histogram.iter_mut().zip(&counters.histogram) {
+                *sum += bucket.load(Ordering::Relaxed);
+            }
+        }
+        if calls == 0 {
+            continue;
+        }
+        match Sysno::new(sysno) {
+            Some(sysno) if sysno.id() as usize != MAX_SYSNO - 1 => {
+                let _ = write!(out, "{sysno} {calls} {total_ns}");
+            }
+            _ => {
+                let _ = write!(out, "other {calls} {total_ns}");
+            }
+        }
+        for count in histogram {
+            let _ = write!(out, " {count}");
+        }
+        out.push('\n');
+    }
+
+    let _ = writeln!(out, "# pid calls total_ns");
+    for proc_data in processes() {
+        let calls = proc_data.syscalls.load(Ordering::Relaxed);
+        if calls > 0 {
+            let _ = writeln!(
+                out,
+                "{} {calls} {}",
+                proc_data.proc.pid(),
+                proc_data.syscall_ns.load(Ordering::Relaxed)
+            );
+        }
+    }
+    out
+}
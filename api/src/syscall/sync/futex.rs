@@ -1,18 +1,44 @@
-use core::sync::atomic::Ordering;
+use alloc::vec::Vec;
+use core::{
+    sync::atomic::{AtomicU32, Ordering},
+    time::Duration,
+};
 
 use axerrno::{AxError, AxResult, LinuxError};
+use axhal::time::{monotonic_time, wall_time};
 use axtask::current;
+use bytemuck::AnyBitPattern;
 use linux_raw_sys::general::{
-    FUTEX_CMD_MASK, FUTEX_CMP_REQUEUE, FUTEX_REQUEUE, FUTEX_WAIT, FUTEX_WAIT_BITSET, FUTEX_WAKE,
-    FUTEX_WAKE_BITSET, robust_list_head, timespec,
+    CLOCK_MONOTONIC, CLOCK_REALTIME, FUTEX_CLOCK_REALTIME, FUTEX_CMD_MASK, FUTEX_CMP_REQUEUE,
+    FUTEX_CMP_REQUEUE_PI, FUTEX_LOCK_PI, FUTEX_LOCK_PI2, FUTEX_OWNER_DIED, FUTEX_REQUEUE,
+    FUTEX_TID_MASK, FUTEX_TRYLOCK_PI, FUTEX_UNLOCK_PI, FUTEX_WAIT, FUTEX_WAIT_BITSET,
+    FUTEX_WAIT_REQUEUE_PI, FUTEX_WAITERS, FUTEX_WAITV_MAX, FUTEX_WAKE, FUTEX_WAKE_BITSET,
+    robust_list_head, timespec,
 };
 use starry_core::{
-    futex::FutexKey,
+    futex::{FutexKey, FutexTable, WakeReason, wait_multiple},
     task::{AsThread, get_task},
 };
 use starry_vm::{VmMutPtr, VmPtr};
 
-use crate::time::TimeValueLike;
+use crate::{
+    mm::{UserConstPtr, UserPtr},
+    time::TimeValueLike,
+};
+
+// Values from `include/uapi/linux/futex.h`.
+const FUTEX2_SIZE_U32: u32 = 0x02;
+const FUTEX2_PRIVATE: u32 = 128;
+
+/// Laid out like `struct futex_waitv`.
+#[repr(C)]
+#[derive(Debug, Clone, Copy, AnyBitPattern)]
+pub struct FutexWaitv {
+    val: u64,
+    uaddr: u64,
+    flags: u32,
+    reserved: u32,
+}
 
 fn assert_unsigned(value: u32) -> AxResult<u32> {
     if (value as i32) < 0 {
@@ -22,6 +48,126 @@ fn assert_unsigned(value: u32) -> AxResult<u32> {
     }
 }
 
+fn read_timeout(timeout: *const timespec) -> AxResult<Option<Duration>> {
+    let Some(ts) = timeout.nullable() else {
+        return Ok(None);
+    };
+    // FIXME: AnyBitPattern
+    Ok(Some(
+        unsafe { ts.vm_read_uninit()?.assume_init() }.try_into_time_value()?,
+    ))
+}
+
+/// Converts an absolute timeout on the given clock into a relative one.
+fn absolute_timeout(deadline: Option<Duration>, realtime: bool) -> Option<Duration> {
+    let now = if realtime {
+        wall_time()
+    } else {
+        monotonic_time()
+    };
+    deadline.map(|deadline| deadline.saturating_sub(now))
+}
+
+/// Accesses a futex word for atomic updates.
+fn futex_word(uaddr: *const u32) -> AxResult<&'static AtomicU32> {
+    if !uaddr.addr().is_multiple_of(align_of::<u32>()) {
+        return Err(AxError::InvalidInput);
+    }
+    let word = UserPtr::<u32>::from(uaddr as *mut u32).get_as_mut()?;
+    // SAFETY: the word is valid, aligned user memory.
+    Ok(unsafe { AtomicU32::from_ptr(word) })
+}
+
+fn current_tid() -> u32 {
+    current().id().as_u64() as u32
+}
+
+/// Acquires a PI futex, blocking unless `trylock` is set.
+///
+/// There is no priority boosting: waiters queue in FIFO order and the lock is
+/// handed over directly to the first one on unlock.
+fn futex_lock_pi(
+    word: &AtomicU32,
+    table: &FutexTable,
+    key: &FutexKey,
+    timeout: Option<Duration>,
+    trylock: bool,
+) -> AxResult<isize> {
+    let tid = current_tid();
+    // Spurious wakeups must not restart the timeout.
+    let deadline = timeout.map(|timeout| monotonic_time() + timeout);
+    loop {
+        let val = word.load(Ordering::SeqCst);
+        let owner = val & FUTEX_TID_MASK;
+        if owner == 0 {
+            // Free, possibly because its owner died; keep the state bits.
+            if word
+                .compare_exchange(
+                    val,
+                    tid | (val & !FUTEX_TID_MASK),
+                    Ordering::SeqCst,
+                    Ordering::SeqCst,
+                )
+                .is_ok()
+            {
+                return Ok(0);
+            }
+            continue;
+        }
+        if owner == tid {
+            return Err(AxError::from(LinuxError::EDEADLK));
+        }
+        if trylock {
+            return Err(AxError::WouldBlock);
+        }
+        if val & FUTEX_OWNER_DIED == 0 && get_task(owner).is_err() {
+            return Err(AxError::NoSuchProcess);
+        }
+
+        let expected = val | FUTEX_WAITERS;
+        if val != expected
+            && word
+                .compare_exchange(val, expected, Ordering::SeqCst, Ordering::SeqCst)
+                .is_err()
+        {
+            continue;
+        }
+        let timeout = deadline.map(|deadline| deadline.saturating_sub(monotonic_time()));
+        match table.wait_if(key, u32::MAX, timeout, || {
+            word.load(Ordering::SeqCst) == expected
+        }) {
+            Ok(WakeReason::Acquired) => return Ok(0),
+            Ok(_) | Err(AxError::WouldBlock) => continue,
+            Err(err) => return Err(err),
+        }
+    }
+}
+
+/// Releases a PI futex, handing it over to the first waiter if any.
+fn futex_unlock_pi(word: &AtomicU32, table: &FutexTable, key: &FutexKey) -> AxResult<isize> {
+    let tid = current_tid();
+    table.wake_pi(key, |next| {
+        loop {
+            let val = word.load(Ordering::SeqCst);
+            if val & FUTEX_TID_MASK != tid {
+                return Err(AxError::OperationNotPermitted);
+            }
+            let new = match next {
+                Some((next, true)) => next | FUTEX_WAITERS,
+                Some((next, false)) => next,
+                None => 0,
+            };
+            if word
+                .compare_exchange(val, new, Ordering::SeqCst, Ordering::SeqCst)
+                .is_ok()
+            {
+                return Ok(true);
+            }
+        }
+    })?;
+    Ok(0)
+}
+
 pub fn sys_futex(
     uaddr: *const u32,
     futex_op: u32,
@@ -43,6 +189,7 @@ pub fn sys_futex(
     let futex_table = proc_data.futex_table_for(&key);
 
     let command = futex_op & (FUTEX_CMD_MASK as u32);
+    let realtime = futex_op & FUTEX_CLOCK_REALTIME != 0;
     match command {
         FUTEX_WAIT | FUTEX_WAIT_BITSET => {
             // Fast path
@@ -50,15 +197,7 @@ pub fn sys_futex(
                 return Err(AxError::WouldBlock);
             }
 
-            let timeout = if let Some(ts) = timeout.nullable() {
-                // FIXME: AnyBitPattern
-                let ts = unsafe { ts.vm_read_uninit()?.assume_init() }.try_into_time_value()?;
-                Some(ts)
-            } else {
-                None
-            };
-
-            let futex = futex_table.get_or_insert(&key);
+            let timeout = read_timeout(timeout)?;
 
             let bitset = if command == FUTEX_WAIT_BITSET {
                 value3
@@ -66,30 +205,21 @@ pub fn sys_futex(
                 u32::MAX
             };
 
-            if !futex
-                .wq
-                .wait_if(bitset, timeout, || uaddr.vm_read() == Ok(value))?
-            {
-                return Err(AxError::WouldBlock);
-            }
-
-            if futex.owner_dead.swap(false, Ordering::SeqCst) {
+            let reason =
+                futex_table.wait_if(&key, bitset, timeout, || uaddr.vm_read() == Ok(value))?;
+            if reason == WakeReason::OwnerDead {
                 Err(AxError::from(LinuxError::EOWNERDEAD))
             } else {
                 Ok(0)
             }
         }
         FUTEX_WAKE | FUTEX_WAKE_BITSET => {
-            let futex = futex_table.get(&key);
-            let mut count = 0;
-            if let Some(futex) = futex {
-                let bitset = if command == FUTEX_WAKE_BITSET {
-                    value3
-                } else {
-                    u32::MAX
-                };
-                count = futex.wq.wake(value as _, bitset);
-            }
+            let bitset = if command == FUTEX_WAKE_BITSET {
+                value3
+            } else {
+                u32::MAX
+            };
+            let count = futex_table.wake(&key, value as _, bitset);
             axtask::yield_now();
             Ok(count as _)
         }
@@ -100,24 +230,130 @@ pub fn sys_futex(
             }
             let value2 = assert_unsigned(timeout.addr() as u32)?;
 
-            let futex = futex_table.get(&key);
             let key2 = FutexKey::new_current(uaddr2.addr());
             let table2 = proc_data.futex_table_for(&key2);
-            let futex2 = table2.get_or_insert(&key2);
-
-            let mut count = 0;
-            if let Some(futex) = futex {
-                count = futex.wq.wake(value as _, u32::MAX);
-                if count == value as usize {
-                    count += futex.wq.requeue(value2 as _, &futex2.wq) as usize;
-                }
+
+            let mut count = futex_table.wake(&key, value as _, u32::MAX);
+            if count == value as usize {
+                count += futex_table.requeue(&key, value2 as _, &table2, &key2);
             }
             Ok(count as _)
         }
+        FUTEX_LOCK_PI | FUTEX_LOCK_PI2 | FUTEX_TRYLOCK_PI => {
+            let word = futex_word(uaddr)?;
+            // FUTEX_LOCK_PI always measures against CLOCK_REALTIME.
+            let realtime = command == FUTEX_LOCK_PI || realtime;
+            let timeout = absolute_timeout(read_timeout(timeout)?, realtime);
+            futex_lock_pi(
+                word,
+                &futex_table,
+                &key,
+                timeout,
+                command == FUTEX_TRYLOCK_PI,
+            )
+        }
+        FUTEX_UNLOCK_PI => futex_unlock_pi(futex_word(uaddr)?, &futex_table, &key),
+        FUTEX_WAIT_REQUEUE_PI => {
+            if uaddr == uaddr2 as *const u32 {
+                return Err(AxError::InvalidInput);
+            }
+            let word2 = futex_word(uaddr2)?;
+            let key2 = FutexKey::new_current(uaddr2.addr());
+            let table2 = proc_data.futex_table_for(&key2);
+            let timeout = absolute_timeout(read_timeout(timeout)?, realtime);
+
+            let reason =
+                futex_table.wait_if(&key, u32::MAX, timeout, || uaddr.vm_read() == Ok(value))?;
+            if reason == WakeReason::Acquired {
+                return Ok(0);
+            }
+            // Woken on the condition variable itself rather than requeued:
+            // take the mutex the way the requeue would have.
+            futex_lock_pi(word2, &table2, &key2, None, false)
+        }
+        FUTEX_CMP_REQUEUE_PI => {
+            // Linux only ever wakes one waiter here.
+            if value != 1 || uaddr == uaddr2 as *const u32 {
+                return Err(AxError::InvalidInput);
+            }
+            let nr_requeue = assert_unsigned(timeout.addr() as u32)?;
+            if uaddr.vm_read()? != value3 {
+                return Err(AxError::WouldBlock);
+            }
+            let word2 = futex_word(uaddr2)?;
+            let key2 = FutexKey::new_current(uaddr2.addr());
+            let table2 = proc_data.futex_table_for(&key2);
+
+            // Acquire the mutex on behalf of the first waiter if it is free.
+            let woke = futex_table.wake_pi(&key, |next| {
+                let Some((next, more)) = next else {
+                    return Ok(false);
+                };
+                let waiters = if more { FUTEX_WAITERS } else { 0 };
+                let val = word2.load(Ordering::SeqCst);
+                Ok(val & FUTEX_TID_MASK == 0
+                    && word2
+                        .compare_exchange(
+                            val,
+                            next | waiters | (val & FUTEX_OWNER_DIED),
+                            Ordering::SeqCst,
+                            Ordering::SeqCst,
+                        )
+                        .is_ok())
+            })?;
+
+            let requeued = futex_table.requeue(&key, nr_requeue as _, &table2, &key2);
+            if requeued > 0 {
+                word2.fetch_or(FUTEX_WAITERS, Ordering::SeqCst);
+            }
+            Ok((woke as usize + requeued) as _)
+        }
         _ => Err(AxError::Unsupported),
     }
 }
 
+pub fn sys_futex_waitv(
+    waiters: UserConstPtr<FutexWaitv>,
+    nr_futexes: u32,
+    flags: u32,
+    timeout: *const timespec,
+    clockid: u32,
+) -> AxResult<isize> {
+    debug!("sys_futex_waitv <= nr_futexes: {nr_futexes}, flags: {flags}, clockid: {clockid}");
+
+    if flags != 0 || nr_futexes == 0 || nr_futexes > FUTEX_WAITV_MAX {
+        return Err(AxError::InvalidInput);
+    }
+    let waiters = waiters.get_as_slice(nr_futexes as usize)?;
+
+    let proc_data = &current().as_thread().proc_data;
+    let mut targets = Vec::with_capacity(waiters.len());
+    for waiter in waiters {
+        if waiter.flags & !(FUTEX2_SIZE_U32 | FUTEX2_PRIVATE) != 0
+            || waiter.flags & FUTEX2_SIZE_U32 == 0
+            || waiter.reserved != 0
+            || !(waiter.uaddr as usize).is_multiple_of(align_of::<u32>())
+        {
+            return Err(AxError::InvalidInput);
+        }
+        let key = FutexKey::new_current(waiter.uaddr as usize);
+        targets.push((proc_data.futex_table_for(&key), key));
+    }
+
+    let timeout = match clockid {
+        _ if timeout.is_null() => None,
+        CLOCK_MONOTONIC => absolute_timeout(read_timeout(timeout)?, false),
+        CLOCK_REALTIME => absolute_timeout(read_timeout(timeout)?, true),
+        _ => return Err(AxError::InvalidInput),
+    };
+
+    wait_multiple(&targets, timeout, |index| {
+        let waiter = &waiters[index];
+        (waiter.uaddr as *const u32).vm_read() == Ok(waiter.val as u32)
+    })
+    .map(|index| index as _)
+}
+
 pub fn sys_get_robust_list(
     tid: u32,
     head: *mut *const robust_list_head,
@@ -77,7 +77,7 @@ pub fn sys_uname(name: *mut new_utsname) -> AxResult<isize> {
 pub fn sys_sysinfo(info: *mut sysinfo) -> AxResult<isize> {
     // FIXME: Zeroable
     let mut kinfo: sysinfo = unsafe { core::mem::zeroed() };
-    kinfo.procs = processes().len() as _;
+    kinfo.procs = processes().count() as _;
     kinfo.mem_unit = 1;
     info.vm_write(kinfo)?;
     Ok(0)
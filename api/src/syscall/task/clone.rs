@@ -1,9 +1,14 @@
 use alloc::sync::Arc;
+use core::{future::poll_fn, task::Poll};
 
 use axerrno::{AxError, AxResult};
 use axfs::FS_CONTEXT;
 use axhal::uspace::UserContext;
-use axtask::{AxTaskExt, current, spawn_task};
+use axtask::{
+    AxTaskExt, current,
+    future::{block_on, interruptible},
+    spawn_task,
+};
 use bitflags::bitflags;
 use kspin::SpinNoIrq;
 use linux_raw_sys::general::*;
@@ -96,11 +101,7 @@ pub fn sys_clone(
 ) -> AxResult<isize> {
     const FLAG_MASK: u32 = 0xff;
     let exit_signal = flags & FLAG_MASK;
-    let mut flags = CloneFlags::from_bits_truncate(flags & !FLAG_MASK);
-    if flags.contains(CloneFlags::VFORK) {
-        debug!("sys_clone: CLONE_VFORK slow path");
-        flags.remove(CloneFlags::VM);
-    }
+    let flags = CloneFlags::from_bits_truncate(flags & !FLAG_MASK);
 
     debug!(
         "sys_clone <= flags: {flags:?}, exit_signal: {exit_signal}, stack: {stack:#x}, ptid: \
@@ -146,7 +147,7 @@ pub fn sys_clone(
     let new_proc_data = if flags.contains(CloneFlags::THREAD) {
         new_task
             .ctx_mut()
-            .set_page_table_root(old_proc_data.aspace.lock().page_table_root());
+            .set_page_table_root(old_proc_data.aspace().lock().page_table_root());
         old_proc_data.clone()
     } else {
         let proc = if flags.contains(CloneFlags::PARENT) {
@@ -156,11 +157,13 @@ pub fn sys_clone(
         }
         .fork(tid);
 
+        // With `CLONE_VM | CLONE_VFORK` (`vfork`, `posix_spawn`) the child
+        // borrows our address space until `execve`, which builds it a new one.
         let aspace = if flags.contains(CloneFlags::VM) {
-            old_proc_data.aspace.clone()
+            old_proc_data.aspace().clone()
         } else {
-            let mut aspace = old_proc_data.aspace.lock();
-            let aspace = aspace.try_clone()?;
+            let aspace = old_proc_data.aspace();
+            let aspace = aspace.lock().try_clone()?;
             copy_from_kernel(&mut aspace.lock())?;
             aspace
         };
@@ -181,7 +184,17 @@ pub fn sys_clone(
             signal_actions,
             exit_signal,
         );
+        if flags.contains(CloneFlags::VM) {
+            proc_data.share_aspace(&old_proc_data);
+        } else {
+            proc_data
+                .aspace_state()
+                .copy_from(&old_proc_data.aspace_state());
+        }
         proc_data.set_umask(old_proc_data.umask());
+        if flags.contains(CloneFlags::VFORK) {
+            proc_data.set_vfork();
+        }
 
         {
             let mut scope = proc_data.scope.write();
@@ -214,7 +227,15 @@ pub fn sys_clone(
         *UserPtr::<i32>::from(parent_tid).get_as_mut()? = pidfd.add_to_fd_table(true)?;
     }
 
+    let vfork_child = flags
+        .contains(CloneFlags::VFORK)
+        .then(|| new_proc_data.clone());
+
     let thr = Thread::new(tid, new_proc_data);
+    thr.sched.inherit(&curr.as_thread().sched);
+    thr.time
+        .borrow_mut()
+        .set_timer_slack(curr.as_thread().time.borrow().timer_slack());
     if flags.contains(CloneFlags::CHILD_CLEARTID) {
         thr.set_clear_child_tid(child_tid);
     }
@@ -223,6 +244,29 @@ pub fn sys_clone(
     let task = spawn_task(new_task);
     add_task_to_table(&task);
 
+    if let Some(child) = vfork_child {
+        // Like Linux's `wait_for_vfork_done`, this wait is only killable: the
+        // child may be running on our stack, so other signals wait until it
+        // is done, but a parent that is being killed never returns to it.
+        loop {
+            let done = block_on(interruptible(poll_fn(|cx| {
+                if !child.in_vfork() {
+                    return Poll::Ready(());
+                }
+                child.exit_event.register(cx.waker());
+                if child.in_vfork() {
+                    Poll::Pending
+                } else {
+                    Poll::Ready(())
+                }
+            })));
+            if done.is_ok() || curr.as_thread().signal.pending().has(Signo::SIGKILL) {
+                break;
+            }
+            curr.clear_interrupt();
+        }
+    }
+
     Ok(tid as _)
 }
 
@@ -230,3 +274,8 @@ pub fn sys_clone(
 pub fn sys_fork(uctx: &UserContext) -> AxResult<isize> {
     sys_clone(uctx, SIGCHLD, 0, 0, 0, 0)
 }
+
+#[cfg(target_arch = "x86_64")]
+pub fn sys_vfork(uctx: &UserContext) -> AxResult<isize> {
+    sys_clone(uctx, CLONE_VM | CLONE_VFORK | SIGCHLD, 0, 0, 0, 0)
+}
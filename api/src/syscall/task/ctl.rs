@@ -97,6 +97,16 @@ pub fn sys_prctl(
             buf[..len].copy_from_slice(&name.as_bytes()[..len]);
             vm_write_slice(arg2 as _, &buf)?;
         }
+        PR_SET_TIMERSLACK => {
+            current()
+                .as_thread()
+                .time
+                .borrow_mut()
+                .set_timer_slack(arg2);
+        }
+        PR_GET_TIMERSLACK => {
+            return Ok(current().as_thread().time.borrow().timer_slack() as isize);
+        }
         PR_SET_SECCOMP => {}
         PR_MCE_KILL => {}
         PR_SET_MM_START_CODE
@@ -4,12 +4,34 @@ use core::ffi::c_char;
 use axerrno::{AxError, AxResult};
 use axfs::FS_CONTEXT;
 use axhal::uspace::UserContext;
+use axmm::AddrSpace;
+use axsync::Mutex;
 use axtask::current;
-use starry_core::{mm::load_user_app, task::AsThread};
+use starry_core::{
+    fault::FileMaps,
+    mm::{copy_from_kernel, load_user_app, new_user_aspace_empty},
+    task::{AsThread, ProcessData},
+};
 use starry_vm::vm_load_until_nul;
 
 use crate::{file::FD_TABLE, mm::vm_load_string};
 
+/// Installs `aspace` as the address space of the current (single-threaded)
+/// process.
+fn switch_aspace(proc_data: &ProcessData, aspace: AddrSpace) {
+    let root = aspace.page_table_root();
+    let old = proc_data.replace_aspace(Arc::new(Mutex::new(aspace)));
+    // SAFETY: the context of the running task is only read when switching
+    // away from it, which also saves the root we store here.
+    unsafe {
+        (*current().ctx_mut_ptr()).set_page_table_root(root);
+        axhal::asm::write_user_page_table(root);
+    }
+    axhal::asm::flush_tlb(None);
+    // Only now that nothing points at the old page table may it go away.
+    drop(old);
+}
+
 pub fn sys_execve(
     uctx: &mut UserContext,
     path: *const c_char,
@@ -49,10 +71,35 @@ pub fn sys_execve(
         return Err(AxError::WouldBlock);
     }
 
-    let mut aspace = proc_data.aspace.lock();
-    let (entry_point, user_stack_base) =
-        load_user_app(&mut aspace, Some(path.as_str()), &args, &envs)?;
-    drop(aspace);
+    // If the address space is shared with another process, e.g. we are a
+    // `vfork` child, build the new image in a fresh address space, as Linux
+    // does, instead of wiping memory the other process is still using.
+    let (entry_point, user_stack_base) = if proc_data.aspace_shared() {
+        let mut new_aspace = new_user_aspace_empty()?;
+        copy_from_kernel(&mut new_aspace)?;
+        let mut file_maps = FileMaps::default();
+        let image = load_user_app(
+            &mut new_aspace,
+            &mut file_maps,
+            Some(path.as_str()),
+            &args,
+            &envs,
+        )?;
+        switch_aspace(proc_data, new_aspace);
+        *proc_data.aspace_state().file_maps.lock() = file_maps;
+        image
+    } else {
+        let aspace = proc_data.aspace();
+        let mut aspace = aspace.lock();
+        load_user_app(
+            &mut aspace,
+            &mut proc_data.aspace_state().file_maps.lock(),
+            Some(path.as_str()),
+            &args,
+            &envs,
+        )?
+    };
+    proc_data.release_vfork();
 
     let loc = FS_CONTEXT.lock().resolve(&path)?;
     curr.set_name(loc.name());
@@ -61,6 +108,7 @@ pub fn sys_execve(
     *proc_data.cmdline.write() = Arc::new(args);
 
     *proc_data.signal.actions.lock() = Default::default();
+    proc_data.aspace_state().thp.lock().clear();
 
     // Close CLOEXEC file descriptors
     let mut fd_table = FD_TABLE.write();
@@ -1,14 +1,17 @@
+use alloc::{sync::Arc, vec, vec::Vec};
+
 use axerrno::{AxError, AxResult};
-use axhal::time::TimeValue;
+use axhal::{percpu::this_cpu_id, time::TimeValue};
 use axtask::{
-    AxCpuMask, current,
+    AxCpuMask, AxTaskRef, current,
     future::{block_on, interruptible, sleep},
 };
 use linux_raw_sys::general::{
     __kernel_clockid_t, CLOCK_MONOTONIC, CLOCK_REALTIME, PRIO_PGRP, PRIO_PROCESS, PRIO_USER,
-    SCHED_RR, TIMER_ABSTIME, timespec,
+    SCHED_RESET_ON_FORK, TIMER_ABSTIME, timespec,
 };
-use starry_core::task::{get_process_data, get_process_group};
+use starry_core::task::{AsThread, SchedPolicy, get_process_group, get_task, tasks};
+use starry_process::{Pid, Process};
 use starry_vm::{VmMutPtr, VmPtr, vm_load, vm_write_slice};
 
 use crate::time::TimeValueLike;
@@ -18,6 +21,16 @@ pub fn sys_sched_yield() -> AxResult<isize> {
     Ok(0)
 }
 
+pub fn sys_getcpu(cpu: *mut u32, node: *mut u32) -> AxResult<isize> {
+    if let Some(cpu) = cpu.nullable() {
+        cpu.vm_write(this_cpu_id() as u32)?;
+    }
+    if let Some(node) = node.nullable() {
+        node.vm_write(0)?;
+    }
+    Ok(0)
+}
+
 fn sleep_impl(clock: impl Fn() -> TimeValue, dur: TimeValue) -> TimeValue {
     debug!("sleep_impl <= {dur:?}");
 
@@ -86,17 +99,25 @@ pub fn sys_clock_nanosleep(
     }
 }
 
-pub fn sys_sched_getaffinity(pid: i32, cpusetsize: usize, user_mask: *mut u8) -> AxResult<isize> {
-    if cpusetsize * 8 < axconfig::plat::CPU_NUM {
+/// Finds the thread a scheduling syscall refers to, 0 being the caller.
+fn sched_target(tid: i32) -> AxResult<AxTaskRef> {
+    if tid < 0 {
         return Err(AxError::InvalidInput);
     }
+    get_task(tid as Pid)
+}
 
-    // TODO: support other threads
-    if pid != 0 {
-        return Err(AxError::OperationNotPermitted);
+pub fn sys_sched_getaffinity(pid: i32, cpusetsize: usize, user_mask: *mut u8) -> AxResult<isize> {
+    if cpusetsize * 8 < axconfig::plat::CPU_NUM {
+        return Err(AxError::InvalidInput);
     }
 
-    let mask = current().cpumask();
+    let task = sched_target(pid)?;
+    let mask = task
+        .as_thread()
+        .sched
+        .pending_affinity()
+        .unwrap_or_else(|| task.cpumask());
     let mask_bytes = mask.as_bytes();
 
     vm_write_slice(user_mask, mask_bytes)?;
@@ -104,11 +125,7 @@ pub fn sys_sched_getaffinity(pid: i32, cpusetsize: usize, user_mask: *mut u8) ->
     Ok(mask_bytes.len() as _)
 }
 
-pub fn sys_sched_setaffinity(
-    _pid: i32,
-    cpusetsize: usize,
-    user_mask: *const u8,
-) -> AxResult<isize> {
+pub fn sys_sched_setaffinity(pid: i32, cpusetsize: usize, user_mask: *const u8) -> AxResult<isize> {
     let size = cpusetsize.min(axconfig::plat::CPU_NUM.div_ceil(8));
     let user_mask = vm_load(user_mask, size)?;
     let mut cpu_mask = AxCpuMask::new();
@@ -118,54 +135,134 @@ pub fn sys_sched_setaffinity(
             cpu_mask.set(i, true);
         }
     }
+    if cpu_mask.is_empty() {
+        return Err(AxError::InvalidInput);
+    }
 
-    // TODO: support other threads
-    axtask::set_current_affinity(cpu_mask);
+    let task = sched_target(pid)?;
+    if task.id() == current().id() {
+        axtask::set_current_affinity(cpu_mask);
+    } else {
+        // Applied by the thread itself once it is back on its way to user
+        // space.
+        task.as_thread().sched.request_affinity(cpu_mask);
+    }
 
     Ok(0)
 }
 
-pub fn sys_sched_getscheduler(_pid: i32) -> AxResult<isize> {
-    Ok(SCHED_RR as _)
+/// Reads `sched_param::sched_priority` and checks it against `policy`.
+fn read_sched_priority(policy: SchedPolicy, param: *const i32) -> AxResult<u8> {
+    let priority = param.nullable().ok_or(AxError::InvalidInput)?.vm_read()?;
+    let valid = if policy.is_realtime() {
+        (1..=99).contains(&priority)
+    } else {
+        priority == 0
+    };
+    if !valid {
+        return Err(AxError::InvalidInput);
+    }
+    Ok(priority as u8)
+}
+
+pub fn sys_sched_getscheduler(pid: i32) -> AxResult<isize> {
+    Ok(sched_target(pid)?.as_thread().sched.policy() as _)
 }
 
-pub fn sys_sched_setscheduler(_pid: i32, _policy: i32, _param: *const ()) -> AxResult<isize> {
+pub fn sys_sched_setscheduler(pid: i32, policy: i32, param: *const i32) -> AxResult<isize> {
+    debug!("sys_sched_setscheduler <= pid: {pid}, policy: {policy}");
+    let policy =
+        SchedPolicy::from_raw(policy as u32 & !SCHED_RESET_ON_FORK).ok_or(AxError::InvalidInput)?;
+    let priority = read_sched_priority(policy, param)?;
+    sched_target(pid)?
+        .as_thread()
+        .sched
+        .set_policy(policy, priority);
     Ok(0)
 }
 
-pub fn sys_sched_getparam(_pid: i32, _param: *mut ()) -> AxResult<isize> {
+pub fn sys_sched_getparam(pid: i32, param: *mut i32) -> AxResult<isize> {
+    let priority = sched_target(pid)?.as_thread().sched.rt_priority();
+    param
+        .nullable()
+        .ok_or(AxError::InvalidInput)?
+        .vm_write(priority as i32)?;
     Ok(0)
 }
 
-pub fn sys_getpriority(which: u32, who: u32) -> AxResult<isize> {
-    debug!("sys_getpriority <= which: {which}, who: {who}");
+pub fn sys_sched_setparam(pid: i32, param: *const i32) -> AxResult<isize> {
+    let task = sched_target(pid)?;
+    let sched = &task.as_thread().sched;
+    let policy = sched.policy();
+    sched.set_policy(policy, read_sched_priority(policy, param)?);
+    Ok(0)
+}
 
-    match which {
-        PRIO_PROCESS => {
-            if who != 0 {
-                let _proc = get_process_data(who)?;
-            }
-            Ok(20)
-        }
+pub fn sys_sched_get_priority_max(policy: i32) -> AxResult<isize> {
+    match SchedPolicy::from_raw(policy as u32) {
+        Some(policy) if policy.is_realtime() => Ok(99),
+        Some(_) => Ok(0),
+        None => Err(AxError::InvalidInput),
+    }
+}
+
+pub fn sys_sched_get_priority_min(policy: i32) -> AxResult<isize> {
+    match SchedPolicy::from_raw(policy as u32) {
+        Some(policy) if policy.is_realtime() => Ok(1),
+        Some(_) => Ok(0),
+        None => Err(AxError::InvalidInput),
+    }
+}
+
+/// Collects the threads selected by a `which`/`who` pair of
+/// `getpriority`/`setpriority`.
+fn priority_targets(which: u32, who: u32) -> AxResult<Vec<AxTaskRef>> {
+    let threads_of = |procs: &[Arc<Process>]| {
+        procs
+            .iter()
+            .flat_map(|proc| proc.threads())
+            .filter_map(|tid| get_task(tid).ok())
+            .collect::<Vec<_>>()
+    };
+    let targets = match which {
+        PRIO_PROCESS => vec![get_task(who)?],
         PRIO_PGRP => {
-            if who != 0 {
-                let _pg = get_process_group(who)?;
-            }
-            Ok(20)
-        }
-        PRIO_USER => {
-            if who == 0 {
-                Ok(20)
+            let group = if who == 0 {
+                current().as_thread().proc_data.proc.group()
             } else {
-                Err(AxError::NoSuchProcess)
-            }
+                get_process_group(who)?
+            };
+            threads_of(&group.processes())
         }
-        _ => Err(AxError::InvalidInput),
+        // There is only one user.
+        PRIO_USER if who == 0 => tasks().collect(),
+        PRIO_USER => return Err(AxError::NoSuchProcess),
+        _ => return Err(AxError::InvalidInput),
+    };
+    if targets.is_empty() {
+        return Err(AxError::NoSuchProcess);
     }
+    Ok(targets)
 }
 
-/// TODO
-pub fn sys_setpriority(which: i32, who: i32, prio: i32) -> AxResult<isize> {
+pub fn sys_getpriority(which: u32, who: u32) -> AxResult<isize> {
+    debug!("sys_getpriority <= which: {which}, who: {who}");
+
+    let nice = priority_targets(which, who)?
+        .iter()
+        .map(|task| task.as_thread().sched.nice())
+        .min()
+        .unwrap_or(0);
+    // The raw syscall returns `20 - nice` so that the result is never
+    // negative.
+    Ok((20 - nice) as _)
+}
+
+pub fn sys_setpriority(which: u32, who: u32, prio: i32) -> AxResult<isize> {
     debug!("sys_setpriority <= which: {which}, who: {who}, prio: {prio}");
+
+    for task in priority_targets(which, who)? {
+        task.as_thread().sched.set_nice(prio);
+    }
     Ok(0)
-}
\ No newline at end of file
+}
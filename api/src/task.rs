@@ -1,11 +1,15 @@
-use core::{ffi::c_long, sync::atomic::Ordering};
+use core::{
+    ffi::c_long,
+    sync::atomic::{AtomicU32, Ordering},
+};
 
 use axerrno::{AxError, AxResult};
 use axhal::uspace::{ExceptionKind, ReturnReason, UserContext};
 use axtask::{TaskInner, current};
 use bytemuck::AnyBitPattern;
-use linux_raw_sys::general::ROBUST_LIST_LIMIT;
+use linux_raw_sys::general::{FUTEX_OWNER_DIED, FUTEX_TID_MASK, FUTEX_WAITERS, ROBUST_LIST_LIMIT};
 use starry_core::{
+    fault,
     futex::FutexKey,
     mm::access_user_memory,
     shm::SHM_MANAGER,
@@ -14,12 +18,14 @@ use starry_core::{
         set_timer_state,
     },
     time::TimerState,
+    vdso,
 };
 use starry_process::Pid;
 use starry_signal::{SignalInfo, Signo};
 use starry_vm::{VmMutPtr, VmPtr};
 
 use crate::{
+    mm::UserPtr,
     signal::{check_signals, unblock_next_signal},
     syscall::handle_syscall,
 };
@@ -43,6 +49,7 @@ pub fn new_user_task(
 
             let thr = curr.as_thread();
             while !thr.pending_exit() {
+                vdso::prepare_cpu();
                 let reason = uctx.run();
 
                 set_timer_state(&curr, TimerState::Kernel);
@@ -50,7 +57,7 @@ pub fn new_user_task(
                 match reason {
                     ReturnReason::Syscall => handle_syscall(&mut uctx),
                     ReturnReason::PageFault(addr, flags) => {
-                        if !thr.proc_data.aspace.lock().handle_page_fault(addr, flags) {
+                        if !fault::handle_page_fault(&thr.proc_data, addr, flags) {
                             info!(
                                 "{:?}: segmentation fault at {:#x} {:?}",
                                 thr.proc_data.proc, addr, flags
@@ -59,7 +66,11 @@ pub fn new_user_task(
                                 .expect("Failed to send SIGSEGV");
                         }
                     }
-                    ReturnReason::Interrupt => {}
+                    ReturnReason::Interrupt => {
+                        if thr.sched.yield_on_tick() {
+                            axtask::yield_now();
+                        }
+                    }
                     #[allow(unused_labels)]
                     ReturnReason::Exception(exc_info) => 'exc: {
                         // TODO: detailed handling
@@ -89,6 +100,7 @@ pub fn new_user_task(
                     while check_signals(thr, &mut uctx, None) {}
                 }
 
+                thr.sched.on_user_return();
                 set_timer_state(&curr, TimerState::User);
                 curr.clear_interrupt();
             }
@@ -120,13 +132,31 @@ fn handle_futex_death(entry: *mut RobustList, offset: i64) -> AxResult<()> {
     let key = FutexKey::new_current(address);
 
     let curr = current();
-    let futex_table = curr.as_thread().proc_data.futex_table_for(&key);
+    let tid = curr.id().as_u64() as u32;
+
+    // Mark the futex word the way Linux does, so PI lockers and userspace
+    // can see that the owner is gone. Other threads may be updating the word
+    // at the same time, so only replace what was read.
+    let word = UserPtr::<u32>::from(address).get_as_mut()?;
+    // SAFETY: the word is valid, aligned user memory.
+    let word = unsafe { AtomicU32::from_ptr(word) };
+    let mut val = word.load(Ordering::SeqCst);
+    while val & FUTEX_TID_MASK == tid {
+        match word.compare_exchange(
+            val,
+            (val & FUTEX_WAITERS) | FUTEX_OWNER_DIED,
+            Ordering::SeqCst,
+            Ordering::SeqCst,
+        ) {
+            Ok(_) => break,
+            Err(current) => val = current,
+        }
+    }
 
-    let Some(futex) = futex_table.get(&key) else {
-        return Ok(());
-    };
-    futex.owner_dead.store(true, Ordering::SeqCst);
-    futex.wq.wake(1, u32::MAX);
+    curr.as_thread()
+        .proc_data
+        .futex_table_for(&key)
+        .wake_owner_dead(&key);
     Ok(())
 }
 
@@ -167,11 +197,7 @@ pub fn do_exit(exit_code: i32, group_exit: bool) {
     let clear_child_tid = thr.clear_child_tid() as *mut u32;
     if clear_child_tid.vm_write(0).is_ok() {
         let key = FutexKey::new_current(clear_child_tid as usize);
-        let table = thr.proc_data.futex_table_for(&key);
-        let guard = table.get(&key);
-        if let Some(futex) = guard {
-            futex.wq.wake(1, u32::MAX);
-        }
+        thr.proc_data.futex_table_for(&key).wake(&key, 1, u32::MAX);
         axtask::yield_now();
     }
     let head = thr.robust_list_head() as *const RobustListHead;
@@ -192,6 +218,8 @@ pub fn do_exit(exit_code: i32, group_exit: bool) {
                 data.child_exit_event.wake();
             }
         }
+        thr.proc_data.release_vfork();
+        thr.proc_data.release_aspace();
         thr.proc_data.exit_event.wake();
 
         SHM_MANAGER.lock().clear_proc_shm(process.pid());
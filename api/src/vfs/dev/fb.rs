@@ -1,13 +1,33 @@
-use core::{any::Any, slice};
+use alloc::{
+    sync::{Arc, Weak},
+    vec::Vec,
+};
+use core::{
+    any::Any,
+    slice,
+    sync::atomic::{AtomicBool, Ordering},
+    time::Duration,
+};
 
 #[allow(unused_imports)]
 use axdriver::prelude::DisplayDriverOps;
 use axerrno::AxError;
 use axfs_ng_vfs::{NodeFlags, VfsError, VfsResult};
 use axhal::mem::virt_to_phys;
+use axtask::{
+    current,
+    future::{self, block_on},
+};
+use bytemuck::AnyBitPattern;
+use event_listener::{Event, listener};
+use lazy_static::lazy_static;
 use memory_addr::{PhysAddrRange, VirtAddr};
-use starry_core::vfs::{DeviceMmap, DeviceOps};
-use starry_vm::VmMutPtr;
+use spin::Mutex;
+use starry_core::{
+    task::{AsThread, ProcessData},
+    vfs::{DeviceMmap, DeviceOps},
+};
+use starry_vm::{VmMutPtr, VmPtr};
 
 // Types from https://github.com/Tangzh33/asterinas
 
@@ -77,13 +97,104 @@ struct FixScreenInfo {
     pub reserved: [u16; 2], // Reserved for future compatibility
 }
 
+/// A rectangle of the screen that was drawn to, passed to [`FBIO_DAMAGE`]
+#[repr(C)]
+#[derive(Debug, Clone, Copy, AnyBitPattern)]
+struct DamageRect {
+    x: u32,
+    y: u32,
+    width: u32,
+    height: u32,
+}
+
+/// Waits for the next frame to reach the display
+const FBIO_WAITFORVSYNC: u32 = 0x4004_4620;
+
+/// `_IOW('F', 0x80, struct DamageRect)`: reports a rectangle the caller drew
+/// to, which is flushed with the next frame. StarryOS specific.
+const FBIO_DAMAGE: u32 = 0x4010_4680;
+
+/// Frames are pushed to the display at most this often.
+const FRAME_INTERVAL: Duration = Duration::from_nanos(1_000_000_000 / 60);
+
+/// Drawn to through `write` or reported with [`FBIO_DAMAGE`] since the last
+/// flush.
+static DAMAGED: AtomicBool = AtomicBool::new(false);
+
+/// A process that mapped the framebuffer.
+///
+/// Devices are not told when they are closed, so a mapping is considered
+/// gone once the process that made it has exited.
+struct Mapper {
+    proc: Weak<ProcessData>,
+    /// Reports what it draws with [`FBIO_DAMAGE`], so its mappings need no
+    /// periodic refresh.
+    explicit_damage: bool,
+}
+
+static MAPPERS: Mutex<Vec<Mapper>> = Mutex::new(Vec::new());
+
+lazy_static! {
+    static ref EVENT_DAMAGE: Event = Event::new();
+    static ref EVENT_FRAME: Event = Event::new();
+}
+
+fn needs_refresh() -> bool {
+    if DAMAGED.load(Ordering::Acquire) {
+        return true;
+    }
+    let mut mappers = MAPPERS.lock();
+    mappers.retain(|mapper| mapper.proc.strong_count() > 0);
+    // Some program may draw without telling.
+    mappers.iter().any(|mapper| !mapper.explicit_damage)
+}
+
+fn mark_damaged() {
+    if !DAMAGED.swap(true, Ordering::AcqRel) {
+        EVENT_DAMAGE.notify(1);
+    }
+}
+
+/// Updates the entry of the current process, adding it if `add`.
+fn update_mapper(add: bool, f: impl FnOnce(&mut Mapper)) {
+    let proc_data = &current().as_thread().proc_data;
+    let mut mappers = MAPPERS.lock();
+    let index = mappers
+        .iter()
+        .position(|mapper| mapper.proc.as_ptr() == Arc::as_ptr(proc_data));
+    let mapper = match index {
+        Some(index) => &mut mappers[index],
+        None if add => {
+            mappers.push(Mapper {
+                proc: Arc::downgrade(proc_data),
+                explicit_damage: false,
+            });
+            mappers.last_mut().unwrap()
+        }
+        None => return,
+    };
+    f(mapper);
+}
+
+fn flush() {
+    DAMAGED.store(false, Ordering::Release);
+    // The display only takes whole frames.
+    if let Err(err) = axdisplay::framebuffer_flush() {
+        warn!("Failed to refresh framebuffer: {err:?}");
+    }
+    EVENT_FRAME.notify(usize::MAX);
+}
+
+/// Pushes frames while the screen may have changed, and sleeps otherwise.
 async fn refresh_task() {
-    let delay = core::time::Duration::from_secs_f32(1. / 60.);
     loop {
-        if let Err(err) = axdisplay::framebuffer_flush() {
-            warn!("Failed to refresh framebuffer: {err:?}");
+        listener!(EVENT_DAMAGE => listener);
+        if !needs_refresh() {
+            listener.await;
+            continue;
         }
-        axtask::future::sleep(delay).await;
+        flush();
+        future::sleep(FRAME_INTERVAL).await;
     }
 }
 
@@ -115,7 +226,10 @@ impl DeviceOps for FrameBuffer {
         let len = buf
             .len()
             .min((slice.len() as u64).saturating_sub(offset) as usize);
-        buf[..len].copy_from_slice(&slice[..len]);
+        if len > 0 {
+            let offset = offset as usize;
+            buf[..len].copy_from_slice(&slice[offset..offset + len]);
+        }
         Ok(len)
     }
 
@@ -124,8 +238,12 @@ impl DeviceOps for FrameBuffer {
         if offset >= slice.len() as u64 {
             return Err(VfsError::StorageFull);
         }
-        let len = buf.len().min(slice.len() - offset as usize);
-        slice[..len].copy_from_slice(&buf[..len]);
+        let offset = offset as usize;
+        let len = buf.len().min(slice.len() - offset);
+        slice[offset..offset + len].copy_from_slice(&buf[..len]);
+        if len > 0 {
+            mark_damaged();
+        }
         Ok(len)
     }
 
@@ -217,6 +335,37 @@ impl DeviceOps for FrameBuffer {
             0x4606 => Err(AxError::InvalidInput),
             // FBIOBLANK
             0x4611 => Err(AxError::InvalidInput),
+            FBIO_WAITFORVSYNC => {
+                if (arg as *const u32).vm_read()? != 0 {
+                    return Err(AxError::InvalidInput);
+                }
+                // Without a real vblank, the next frame pushed or one frame
+                // interval, whichever comes first, stands in for it.
+                listener!(EVENT_FRAME => listener);
+                let _ = block_on(future::timeout(Some(FRAME_INTERVAL), listener));
+                Ok(0)
+            }
+            FBIO_DAMAGE => {
+                let rect = (arg as *const DamageRect).vm_read()?;
+                let info = axdisplay::framebuffer_info();
+                if rect
+                    .x
+                    .checked_add(rect.width)
+                    .is_none_or(|x| x > info.width)
+                    || rect
+                        .y
+                        .checked_add(rect.height)
+                        .is_none_or(|y| y > info.height)
+                {
+                    return Err(AxError::InvalidInput);
+                }
+                update_mapper(false, |mapper| mapper.explicit_damage = true);
+                // The refresh task pushes it, at most once per frame.
+                if rect.width > 0 && rect.height > 0 {
+                    mark_damaged();
+                }
+                Ok(0)
+            }
             _ => Err(AxError::NotATty),
         }
     }
@@ -226,6 +375,8 @@ impl DeviceOps for FrameBuffer {
     }
 
     fn mmap(&self) -> DeviceMmap {
+        update_mapper(true, |_| {});
+        EVENT_DAMAGE.notify(1);
         DeviceMmap::Physical(PhysAddrRange::from_start_size(
             virt_to_phys(self.base),
             self.size,
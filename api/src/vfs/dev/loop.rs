@@ -1,3 +1,4 @@
+use alloc::sync::Arc;
 use core::{
     any::Any,
     sync::atomic::{AtomicBool, AtomicU32, Ordering},
@@ -9,23 +10,30 @@ use axfs_ng_vfs::{DeviceId, NodeFlags, VfsResult};
 use axsync::Mutex;
 use linux_raw_sys::{
     ioctl::{BLKGETSIZE, BLKGETSIZE64, BLKRAGET, BLKRASET, BLKROGET, BLKROSET},
-    loop_device::{LOOP_CLR_FD, LOOP_GET_STATUS, LOOP_SET_FD, LOOP_SET_STATUS, loop_info},
+    loop_device::{
+        LO_FLAGS_DIRECT_IO, LO_FLAGS_READ_ONLY, LOOP_CLR_FD, LOOP_GET_STATUS, LOOP_SET_DIRECT_IO,
+        LOOP_SET_FD, LOOP_SET_STATUS, loop_info,
+    },
 };
+use memory_addr::PAGE_SIZE_4K;
 use starry_core::vfs::{DeviceMmap, DeviceOps};
 use starry_vm::{VmMutPtr, VmPtr};
 
-use crate::file::get_file_like;
+use crate::file::{File, get_file_like};
 
 /// /dev/loopX devices
 pub struct LoopDevice {
     number: u32,
     dev_id: DeviceId,
     /// Underlying file for the loop device, if any.
-    pub file: Mutex<Option<FileBackend>>,
+    pub file: Mutex<Option<Arc<File>>>,
     /// Read-only flag for the loop device.
     pub ro: AtomicBool,
     /// Read-ahead size for the loop device, in bytes.
     pub ra: AtomicU32,
+    /// Whether I/O bypasses the page cache of the underlying file, set by
+    /// `LOOP_SET_DIRECT_IO`.
+    pub direct: AtomicBool,
 }
 
 impl LoopDevice {
@@ -36,6 +44,7 @@ impl LoopDevice {
             file: Mutex::new(None),
             ro: AtomicBool::new(false),
             ra: AtomicU32::new(512),
+            direct: AtomicBool::new(false),
         }
     }
 
@@ -47,6 +56,12 @@ impl LoopDevice {
         let mut res: loop_info = unsafe { core::mem::zeroed() };
         res.lo_number = self.number as _;
         res.lo_rdevice = self.dev_id.0 as _;
+        if self.ro.load(Ordering::Relaxed) {
+            res.lo_flags |= LO_FLAGS_READ_ONLY as i32;
+        }
+        if self.direct.load(Ordering::Relaxed) {
+            res.lo_flags |= LO_FLAGS_DIRECT_IO as i32;
+        }
         Ok(res)
     }
 
@@ -58,24 +73,80 @@ impl LoopDevice {
     /// Clone the underlying file of the loop device.
     pub fn clone_file(&self) -> VfsResult<FileBackend> {
         let file = self.file.lock().clone();
-        file.ok_or(AxError::from(LinuxError::ENXIO))
+        Ok(file
+            .ok_or(AxError::from(LinuxError::ENXIO))?
+            .inner()
+            .backend()?
+            .clone())
+    }
+
+    fn backing_file(&self) -> VfsResult<Arc<File>> {
+        let file = self.file.lock().clone();
+        file.ok_or(AxError::OperationNotPermitted)
+    }
+
+    /// Switches direct I/O on or off.
+    ///
+    /// Whatever was written through the page cache is flushed and the cache
+    /// dropped first, so that direct reads do not miss it and the data is
+    /// not kept twice. Files that only live in the page cache, such as those
+    /// on tmpfs, have nothing to bypass it to and are refused.
+    fn set_direct_io(&self, direct: bool) -> VfsResult<()> {
+        let file = self.file.lock().clone();
+        let file = file.ok_or(AxError::from(LinuxError::ENXIO))?;
+        if direct && !self.direct.load(Ordering::Acquire) {
+            let backend = file.inner().backend()?;
+            if backend.location().flags().contains(NodeFlags::ALWAYS_CACHE) {
+                return Err(AxError::InvalidInput);
+            }
+            file.sync(true)?;
+            let pages = backend.location().len()?.div_ceil(PAGE_SIZE_4K as u64);
+            backend.evict_pages(0, pages.min(u32::MAX as u64) as u32);
+        }
+        self.direct.store(direct, Ordering::Release);
+        Ok(())
     }
 }
 
 impl DeviceOps for LoopDevice {
     fn read_at(&self, mut buf: &mut [u8], offset: u64) -> VfsResult<usize> {
-        let file = self.file.lock().clone();
-        file.ok_or(AxError::OperationNotPermitted)?
-            .read_at(&mut buf, offset)
+        let file = self.backing_file()?;
+        let backend = file.inner().backend()?;
+        if self.direct.load(Ordering::Acquire) {
+            return backend.location().entry().as_file()?.read_at(buf, offset);
+        }
+        let read = backend.read_at(&mut buf, offset)?;
+        file.accessed(offset, read);
+        Ok(read)
     }
 
     fn write_at(&self, mut buf: &[u8], offset: u64) -> VfsResult<usize> {
         if self.ro.load(Ordering::Relaxed) {
             return Err(AxError::ReadOnlyFilesystem);
         }
-        let file = self.file.lock().clone();
-        file.ok_or(AxError::OperationNotPermitted)?
-            .write_at(&mut buf, offset)
+        let file = self.backing_file()?;
+        let backend = file.inner().backend()?;
+        if self.direct.load(Ordering::Acquire) {
+            // Someone may have gone through the cache since direct I/O was
+            // turned on. Its pages have to be written back and dropped
+            // before the write, or a dirty page covering part of the range
+            // would later be written back over it.
+            let first = offset / PAGE_SIZE_4K as u64;
+            let end = offset
+                .saturating_add(buf.len() as u64)
+                .div_ceil(PAGE_SIZE_4K as u64);
+            let first = first.min(u32::MAX as u64) as u32;
+            let end = end.min(u32::MAX as u64) as u32;
+            if (first..end).any(|page| backend.is_page_cached(page)) {
+                file.sync(true)?;
+                backend.evict_pages(first, end - first);
+            }
+            return backend.location().entry().as_file()?.write_at(buf, offset);
+        }
+        let written = backend.write_at(&mut buf, offset)?;
+        // Lets the flusher write it back and throttles the writer as needed.
+        file.written(offset, written);
+        Ok(written)
     }
 
     fn ioctl(&self, cmd: u32, arg: usize) -> VfsResult<usize> {
@@ -86,22 +157,26 @@ impl DeviceOps for LoopDevice {
                     return Err(AxError::BadFileDescriptor);
                 }
                 let f = get_file_like(fd)?;
-                let Ok(file) = f.into_any().downcast::<crate::file::File>() else {
+                let Ok(file) = f.into_any().downcast::<File>() else {
                     return Err(AxError::InvalidInput);
                 };
+                file.inner().backend()?;
                 let mut guard = self.file.lock();
                 if guard.is_some() {
                     return Err(AxError::ResourceBusy);
                 }
 
-                *guard = Some(file.inner().backend()?.clone());
+                *guard = Some(file);
+                self.direct.store(false, Ordering::Release);
             }
             LOOP_CLR_FD => {
-                let mut guard = self.file.lock();
-                if guard.is_none() {
-                    return Err(AxError::from(LinuxError::ENXIO));
-                }
-                *guard = None;
+                let file = self.file.lock().take();
+                let file = file.ok_or(AxError::from(LinuxError::ENXIO))?;
+                // Best effort, as the device is detached either way.
+                let _ = file.sync(true);
+            }
+            LOOP_SET_DIRECT_IO => {
+                self.set_direct_io(arg != 0)?;
             }
             LOOP_GET_STATUS => {
                 (arg as *mut loop_info).vm_write(self.get_info()?)?;
@@ -151,7 +226,10 @@ impl DeviceOps for LoopDevice {
     }
 
     fn mmap(&self) -> DeviceMmap {
-        if let Some(FileBackend::Cached(cache)) = self.file.lock().as_ref() {
+        let file = self.file.lock().clone();
+        if let Some(file) = file
+            && let Ok(FileBackend::Cached(cache)) = file.inner().backend()
+        {
             DeviceMmap::Cache(cache.clone())
         } else {
             DeviceMmap::None
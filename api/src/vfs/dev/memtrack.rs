@@ -1,8 +1,9 @@
-use alloc::{collections::btree_map::BTreeMap, vec::Vec};
+use alloc::{collections::btree_map::BTreeMap, string::String, vec::Vec};
 use core::{
     alloc::Layout,
     any::Any,
-    cmp, fmt,
+    cmp,
+    fmt::{self, Write},
     sync::atomic::{AtomicU64, Ordering},
 };
 
@@ -10,10 +11,11 @@ use axbacktrace::Backtrace;
 use axfs_ng_vfs::{NodeFlags, VfsResult};
 use starry_core::{
     mm::clear_elf_cache,
+    pool::PoolStats,
     task::{cleanup_task_tables, tasks},
 };
 
-use crate::vfs::DeviceOps;
+use crate::{file::PIPE_PAGES, io::COPY_BUFFERS, vfs::DeviceOps};
 
 static STAMPED_GENERATION: AtomicU64 = AtomicU64::new(0);
 
@@ -89,15 +91,44 @@ impl fmt::Display for MemoryCategory {
     }
 }
 
+fn pool_stats() -> [(&'static str, PoolStats); 2] {
+    [
+        ("pipe page", PIPE_PAGES.stats()),
+        ("copy buffer", COPY_BUFFERS.stats()),
+    ]
+}
+
+/// Counters of the object pools, one line per pool.
+fn pool_report() -> String {
+    let mut report = String::new();
+    for (name, stats) in pool_stats() {
+        let PoolStats {
+            hits,
+            misses,
+            frees,
+            drops,
+            cached,
+        } = stats;
+        let _ = writeln!(
+            report,
+            "{name}: hits {hits} misses {misses} frees {frees} drops {drops} cached {cached}"
+        );
+    }
+    report
+}
+
 fn run_memory_analysis() {
     // Wait for gc
     axtask::yield_now();
     cleanup_task_tables();
     clear_elf_cache();
+    // Cached objects are not leaks.
+    PIPE_PAGES.shrink();
+    COPY_BUFFERS.shrink();
 
     ax_println!(
         "Alive tasks: {:?}",
-        tasks().iter().map(|it| it.id_name()).collect::<Vec<_>>()
+        tasks().map(|it| it.id_name()).collect::<Vec<_>>()
     );
 
     let from = STAMPED_GENERATION.load(Ordering::SeqCst);
@@ -134,8 +165,13 @@ fn run_memory_analysis() {
 pub(crate) struct MemTrack;
 
 impl DeviceOps for MemTrack {
-    fn read_at(&self, buf: &mut [u8], _offset: u64) -> VfsResult<usize> {
-        Ok(buf.len())
+    fn read_at(&self, buf: &mut [u8], offset: u64) -> VfsResult<usize> {
+        let report = pool_report();
+        let report = report.as_bytes();
+        let start = (offset as usize).min(report.len());
+        let len = buf.len().min(report.len() - start);
+        buf[..len].copy_from_slice(&report[start..start + len]);
+        Ok(len)
     }
 
     fn write_at(&self, buf: &[u8], offset: u64) -> VfsResult<usize> {
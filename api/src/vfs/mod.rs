@@ -1,14 +1,17 @@
 //! Virtual filesystems
 
 pub mod dev;
+pub mod prefetch;
 mod proc;
 pub mod readahead;
+pub mod reclaim;
 mod tmp;
+pub mod writeback;
 
 use axerrno::LinuxResult;
-use axfs::{FS_CONTEXT, FsContext};
+use axfs::{FS_CONTEXT, FileBackend, FsContext};
 use axfs_ng_vfs::{
-    Filesystem, NodePermission,
+    Filesystem, NodeFlags, NodePermission,
     path::{Path, PathBuf},
 };
 pub use starry_core::vfs::{Device, DeviceOps, DirMapping, SimpleFs};
@@ -16,6 +19,12 @@ pub use tmp::MemoryFs;
 
 const DIR_PERMISSION: NodePermission = NodePermission::from_bits_truncate(0o755);
 
+/// Whether the data of `backend` only lives in its page cache, as on tmpfs,
+/// so that it must never be evicted nor written back.
+pub fn cache_only(backend: &FileBackend) -> bool {
+    backend.location().flags().contains(NodeFlags::ALWAYS_CACHE)
+}
+
 fn mount_at(fs: &FsContext, path: &str, mount_fs: Filesystem) -> LinuxResult<()> {
     if fs.resolve(path).is_err() {
         fs.create_dir(path, DIR_PERMISSION)?;
@@ -0,0 +1,204 @@
+//! Background readahead workers
+//!
+//! Async readahead windows are queued here and served by a fixed pool of
+//! kernel tasks instead of spawning a task per window. A window that is
+//! already queued or being read for the same file is not queued again, so two
+//! readers of one file never fetch the same pages twice, and a queued window
+//! whose files have all been closed is dropped without being read.
+
+use alloc::{
+    collections::VecDeque,
+    format,
+    sync::{Arc, Weak},
+    vec,
+    vec::Vec,
+};
+use core::{
+    ops::Range,
+    sync::atomic::{AtomicBool, Ordering},
+};
+
+use axfs::FileBackend;
+use axtask::future::block_on;
+use event_listener::{Event, listener};
+use lazy_static::lazy_static;
+use spin::Mutex;
+
+/// Number of readahead worker tasks
+const NUM_WORKERS: usize = 4;
+
+/// Maximum number of queued windows; readahead is best effort, so requests
+/// beyond this are dropped rather than queued
+const MAX_PENDING: usize = 256;
+
+/// Identifies the file a window belongs to
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct FileId {
+    pub device: u64,
+    pub inode: u64,
+}
+
+impl FileId {
+    /// Identifies the file behind `backend`
+    pub fn of(backend: &FileBackend) -> Option<Self> {
+        let metadata = backend.location().metadata().ok()?;
+        Some(Self {
+            device: metadata.device,
+            inode: metadata.inode,
+        })
+    }
+}
+
+struct Request {
+    file: FileId,
+    pages: Range<u32>,
+    backend: FileBackend,
+    /// Handles of the open files that asked for this window
+    owners: Vec<Weak<()>>,
+}
+
+impl Request {
+    fn is_cancelled(&self) -> bool {
+        self.owners.iter().all(|owner| owner.strong_count() == 0)
+    }
+}
+
+struct Queue {
+    pending: VecDeque<Request>,
+    /// Windows currently being read by a worker
+    running: Vec<(FileId, Range<u32>)>,
+}
+
+static QUEUE: Mutex<Queue> = Mutex::new(Queue {
+    pending: VecDeque::new(),
+    running: Vec::new(),
+});
+
+lazy_static! {
+    static ref EVENT_NEW_REQUEST: Event = Event::new();
+}
+
+/// Ties queued readahead windows to an open file
+///
+/// Dropping the handle (i.e. closing the file) cancels its windows that no
+/// worker has picked up yet.
+pub struct PrefetchHandle {
+    owner: Arc<()>,
+    queued: AtomicBool,
+}
+
+impl Default for PrefetchHandle {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl PrefetchHandle {
+    /// Create a new handle
+    pub fn new() -> Self {
+        Self {
+            owner: Arc::new(()),
+            queued: AtomicBool::new(false),
+        }
+    }
+
+    fn is_owner(&self, owner: &Weak<()>) -> bool {
+        owner.as_ptr() == Arc::as_ptr(&self.owner)
+    }
+
+    /// Queue `num_pages` pages from `start_page` to be read in the background
+    pub fn submit(&self, file: FileId, backend: &FileBackend, start_page: u32, num_pages: u32) {
+        let pages = start_page..start_page.saturating_add(num_pages);
+        if pages.is_empty() {
+            return;
+        }
+        let covers =
+            |f: &FileId, r: &Range<u32>| *f == file && r.start <= pages.start && pages.end <= r.end;
+
+        let mut queue = QUEUE.lock();
+        if queue.running.iter().any(|(f, r)| covers(f, r)) {
+            return;
+        }
+        if let Some(req) = queue.pending.iter_mut().find(|r| covers(&r.file, &r.pages)) {
+            if !req.owners.iter().any(|owner| self.is_owner(owner)) {
+                req.owners.push(Arc::downgrade(&self.owner));
+                self.queued.store(true, Ordering::Relaxed);
+            }
+            return;
+        }
+        if queue.pending.len() >= MAX_PENDING {
+            return;
+        }
+        queue.pending.push_back(Request {
+            file,
+            pages,
+            backend: backend.clone(),
+            owners: vec![Arc::downgrade(&self.owner)],
+        });
+        self.queued.store(true, Ordering::Relaxed);
+        drop(queue);
+
+        EVENT_NEW_REQUEST.notify(1);
+    }
+}
+
+impl Drop for PrefetchHandle {
+    fn drop(&mut self) {
+        if !self.queued.load(Ordering::Relaxed) {
+            return;
+        }
+        // Release the backends of cancelled windows right away instead of
+        // when a worker gets to them.
+        QUEUE.lock().pending.retain_mut(|req| {
+            req.owners.retain(|owner| !self.is_owner(owner));
+            !req.is_cancelled()
+        });
+    }
+}
+
+fn next_request() -> Option<Request> {
+    let mut queue = QUEUE.lock();
+    while let Some(req) = queue.pending.pop_front() {
+        if !req.is_cancelled() {
+            queue.running.push((req.file, req.pages.clone()));
+            return Some(req);
+        }
+    }
+    None
+}
+
+async fn worker() {
+    loop {
+        let Some(req) = next_request() else {
+            listener!(EVENT_NEW_REQUEST => listener);
+            if !QUEUE.lock().pending.is_empty() {
+                continue;
+            }
+            listener.await;
+            continue;
+        };
+
+        req.backend
+            .try_prefetch_pages(req.pages.start, req.pages.len() as u32);
+
+        let mut queue = QUEUE.lock();
+        if let Some(i) = queue
+            .running
+            .iter()
+            .position(|(f, r)| *f == req.file && *r == req.pages)
+        {
+            queue.running.swap_remove(i);
+        }
+    }
+}
+
+/// Spawns the readahead workers.
+pub fn spawn_workers() {
+    for i in 0..NUM_WORKERS {
+        axtask::spawn_raw(
+            || block_on(worker()),
+            format!("readahead/{i}"),
+            axconfig::TASK_STACK_SIZE,
+        );
+    }
+}
@@ -7,21 +7,41 @@ use alloc::{
     vec,
     vec::Vec,
 };
-use core::{ffi::CStr, iter};
+use core::{
+    ffi::CStr,
+    fmt::Write,
+    iter,
+    sync::atomic::{AtomicUsize, Ordering},
+};
 
 use axfs_ng_vfs::{Filesystem, NodeType, VfsError, VfsResult};
+use axhal::paging::MappingFlags;
 use axtask::{AxTaskRef, WeakAxTaskRef, current};
-use indoc::indoc;
+use indoc::{indoc, writedoc};
+use memory_addr::{PAGE_SIZE_4K, VirtAddr};
 use starry_core::{
-    task::{AsThread, TaskStat, get_task, tasks},
+    fault::{fault_around_bytes, set_fault_around_bytes},
+    mm::exec_cache_stats,
+    task::{AsThread, TaskStat, cpu_sched_stats, get_task, tasks},
+    thp::{ThpMode, set_thp_mode, thp_mode},
     vfs::{
-        DirMaker, DirMapping, NodeOpsMux, RwFile, SimpleDir, SimpleDirOps, SimpleFile,
+        DirMaker, DirMapping, NodeOpsMux, RwFile, SeqFile, SimpleDir, SimpleDirOps, SimpleFile,
         SimpleFileOperation, SimpleFs,
     },
 };
 use starry_process::Process;
 
-use crate::file::FD_TABLE;
+use crate::{
+    file::{BufferLimits, FD_TABLE, RMEM, WMEM},
+    syscall::stats,
+    vfs::{
+        reclaim::{self, WATERMARK_SCALE_FACTOR},
+        writeback::{
+            self, DIRTY_BACKGROUND_BYTES, DIRTY_BYTES, DIRTY_EXPIRE_CENTISECS,
+            DIRTY_WRITEBACK_CENTISECS,
+        },
+    },
+};
 
 const DUMMY_MEMINFO: &str = indoc! {"
     MemTotal:       32536204 kB
@@ -128,8 +148,9 @@ impl SimpleDirOps for ProcessTaskDir {
 }
 
 #[rustfmt::skip]
-fn task_status(task: &AxTaskRef) -> String {
-    format!(
+fn task_status(task: &AxTaskRef, out: &mut String) {
+    let _ = write!(
+        out,
         "Tgid:\t{}\n\
         Pid:\t{}\n\
         Uid:\t0 0 0 0\n\
@@ -140,7 +161,96 @@ fn task_status(task: &AxTaskRef) -> String {
         Mems_allowed_list:\t0",
         task.as_thread().proc_data.proc.pid(),
         task.id().as_u64()
-    )
+    );
+}
+
+/// Memory usage of one mapping, in bytes
+struct AreaUsage {
+    start: usize,
+    end: usize,
+    flags: MappingFlags,
+    rss: usize,
+    anon_huge: usize,
+}
+
+/// Calls `f` with the usage of each mapping of the task.
+fn for_each_area(task: &AxTaskRef, mut f: impl FnMut(AreaUsage)) {
+    let proc_data = &task.as_thread().proc_data;
+    let aspace = proc_data.aspace();
+    let aspace = aspace.lock();
+    let aspace_state = proc_data.aspace_state();
+    let thp = aspace_state.thp.lock();
+
+    for area in aspace.areas() {
+        let (start, end) = (area.start().as_usize(), area.end().as_usize());
+        let rss = (start..end)
+            .step_by(PAGE_SIZE_4K)
+            .filter(|va| aspace.page_table().query(VirtAddr::from(*va)).is_ok())
+            .count()
+            * PAGE_SIZE_4K;
+        f(AreaUsage {
+            start,
+            end,
+            flags: area.flags(),
+            rss,
+            anon_huge: thp.huge_bytes_in(&aspace, start..end),
+        });
+    }
+}
+
+/// Renders `/proc/[pid]/smaps`.
+fn task_smaps(task: &AxTaskRef, out: &mut String) {
+    for_each_area(task, |area| {
+        let perm = |flag, c| if area.flags.contains(flag) { c } else { '-' };
+        let _ = writedoc!(
+            out,
+            "
+                {:08x}-{:08x} {}{}{}p 00000000 00:00 0
+                Size:           {:8} kB
+                KernelPageSize: {:8} kB
+                MMUPageSize:    {:8} kB
+                Rss:            {:8} kB
+                AnonHugePages:  {:8} kB
+            ",
+            area.start,
+            area.end,
+            perm(MappingFlags::READ, 'r'),
+            perm(MappingFlags::WRITE, 'w'),
+            perm(MappingFlags::EXECUTE, 'x'),
+            (area.end - area.start) / 1024,
+            PAGE_SIZE_4K / 1024,
+            PAGE_SIZE_4K / 1024,
+            area.rss / 1024,
+            area.anon_huge / 1024,
+        );
+    });
+}
+
+/// Renders `/proc/[pid]/smaps_rollup`, the sum of `smaps`.
+fn task_smaps_rollup(task: &AxTaskRef, out: &mut String) {
+    let mut range = usize::MAX..0;
+    let (mut rss, mut anon_huge) = (0, 0);
+    for_each_area(task, |area| {
+        range.start = range.start.min(area.start);
+        range.end = range.end.max(area.end);
+        rss += area.rss;
+        anon_huge += area.anon_huge;
+    });
+    if range.is_empty() {
+        return;
+    }
+    let _ = writedoc!(
+        out,
+        "
+            {:08x}-{:08x} ---p 00000000 00:00 0                          [rollup]
+            Rss:            {:8} kB
+            AnonHugePages:  {:8} kB
+        ",
+        range.start,
+        range.end,
+        rss / 1024,
+        anon_huge / 1024,
+    );
 }
 
 /// The /proc/[pid]/fd directory
@@ -198,6 +308,8 @@ impl SimpleDirOps for ThreadDir {
                 "oom_score_adj",
                 "task",
                 "maps",
+                "smaps",
+                "smaps_rollup",
                 "mounts",
                 "cmdline",
                 "comm",
@@ -213,11 +325,22 @@ impl SimpleDirOps for ThreadDir {
         let fs = self.fs.clone();
         let task = self.task.upgrade().ok_or(VfsError::NotFound)?;
         Ok(match name {
-            "stat" => SimpleFile::new_regular(fs, move || {
-                Ok(format!("{}", TaskStat::from_thread(&task)?).into_bytes())
-            })
+            "stat" => SimpleFile::new_regular(
+                fs,
+                SeqFile::new(move |out| {
+                    let _ = write!(out, "{}", TaskStat::from_thread(&task)?);
+                    Ok(())
+                }),
+            )
+            .into(),
+            "status" => SimpleFile::new_regular(
+                fs,
+                SeqFile::new(move |out| {
+                    task_status(&task, out);
+                    Ok(())
+                }),
+            )
             .into(),
-            "status" => SimpleFile::new_regular(fs, move || Ok(task_status(&task))).into(),
             "oom_score_adj" => SimpleFile::new_regular(
                 fs,
                 RwFile::new(move |req| match req {
@@ -254,6 +377,22 @@ impl SimpleDirOps for ThreadDir {
                 "})
             })
             .into(),
+            "smaps" => SimpleFile::new_regular(
+                fs,
+                SeqFile::new(move |out| {
+                    task_smaps(&task, out);
+                    Ok(())
+                }),
+            )
+            .into(),
+            "smaps_rollup" => SimpleFile::new_regular(
+                fs,
+                SeqFile::new(move |out| {
+                    task_smaps_rollup(&task, out);
+                    Ok(())
+                }),
+            )
+            .into(),
             "mounts" => SimpleFile::new_regular(fs, move || {
                 Ok("proc /proc proc rw,nosuid,nodev,noexec,relatime 0 0\n")
             })
@@ -324,7 +463,6 @@ impl SimpleDirOps for ProcFsHandler {
     fn child_names<'a>(&'a self) -> Box<dyn Iterator<Item = Cow<'a, str>> + 'a> {
         Box::new(
             tasks()
-                .into_iter()
                 .map(|task| task.id().as_u64().to_string().into())
                 .chain([Cow::Borrowed("self")]),
         )
@@ -352,6 +490,24 @@ impl SimpleDirOps for ProcFsHandler {
     }
 }
 
+/// Parses the whitespace separated sizes written to a `net` sysctl.
+fn parse_sizes<const N: usize>(data: &[u8]) -> VfsResult<[usize; N]> {
+    let mut sizes = [0; N];
+    let mut words = str::from_utf8(data)
+        .map_err(|_| VfsError::InvalidInput)?
+        .split_ascii_whitespace();
+    for size in &mut sizes {
+        *size = words
+            .next()
+            .and_then(|it| it.parse().ok())
+            .ok_or(VfsError::InvalidInput)?;
+    }
+    if words.next().is_some() || sizes.iter().any(|&it| it == 0) {
+        return Err(VfsError::InvalidInput);
+    }
+    Ok(sizes)
+}
+
 fn builder(fs: Arc<SimpleFs>) -> DirMaker {
     let mut root = DirMapping::new();
     root.add(
@@ -362,7 +518,43 @@ fn builder(fs: Arc<SimpleFs>) -> DirMaker {
     );
     root.add(
         "meminfo",
-        SimpleFile::new_regular(fs.clone(), || Ok(DUMMY_MEMINFO)),
+        SimpleFile::new_regular(fs.clone(), || {
+            let stats = writeback::stats();
+            let mut out = String::with_capacity(DUMMY_MEMINFO.len());
+            for line in DUMMY_MEMINFO.lines() {
+                match line.split_once(':') {
+                    Some(("Dirty", _)) => {
+                        writeln!(out, "Dirty:          {:>8} kB", stats.dirty / 1024)
+                    }
+                    Some(("Writeback", _)) => {
+                        writeln!(out, "Writeback:      {:>8} kB", stats.writeback / 1024)
+                    }
+                    _ => writeln!(out, "{line}"),
+                }
+                .unwrap();
+            }
+            Ok(out)
+        }),
+    );
+    root.add(
+        "vmstat",
+        SimpleFile::new_regular(fs.clone(), || {
+            let stats = writeback::stats();
+            let lru = reclaim::stats();
+            let watermarks = reclaim::watermarks();
+            Ok(format!(
+                "nr_inactive_file {}\nnr_active_file {}\nnr_dirty {}\nnr_writeback {}\nnr_written \
+                 {}\npgsteal_kswapd {}\npages_low {}\npages_high {}\n",
+                lru.inactive,
+                lru.active,
+                stats.dirty / PAGE_SIZE_4K as u64,
+                stats.writeback / PAGE_SIZE_4K as u64,
+                stats.written / PAGE_SIZE_4K as u64,
+                lru.reclaimed,
+                watermarks.low,
+                watermarks.high,
+            ))
+        }),
     );
     root.add(
         "meminfo2",
@@ -384,11 +576,80 @@ fn builder(fs: Arc<SimpleFs>) -> DirMaker {
             }
         }),
     );
+    root.add(
+        "exec_cache",
+        SimpleFile::new_regular(fs.clone(), || {
+            let stats = exec_cache_stats();
+            Ok(format!(
+                "hits {}\nmisses {}\nentries {}\n",
+                stats.hits, stats.misses, stats.entries
+            ))
+        }),
+    );
+    root.add(
+        "schedstat",
+        SimpleFile::new_regular(fs.clone(), || {
+            let mut out = String::new();
+            for (cpu, stats) in cpu_sched_stats().iter().enumerate() {
+                let _ = writeln!(
+                    out,
+                    "cpu{cpu} nr_running {} migrations {}",
+                    stats.nr_running, stats.migrations
+                );
+            }
+            Ok(out)
+        }),
+    );
     root.add(
         "interrupts",
         SimpleFile::new_regular(fs.clone(), || Ok(format!("0: {}", crate::time::irq_cnt()))),
     );
 
+    root.add("starry", {
+        let mut starry = DirMapping::new();
+
+        starry.add(
+            "syscalls",
+            SimpleFile::new_regular(
+                fs.clone(),
+                RwFile::new(|req| match req {
+                    SimpleFileOperation::Read => Ok(Some(stats::report().into_bytes())),
+                    SimpleFileOperation::Write(data) => {
+                        match str::from_utf8(data).map(str::trim) {
+                            Ok("1") => stats::set_enabled(true),
+                            Ok("0") => stats::set_enabled(false),
+                            Ok("reset") => stats::reset(),
+                            _ => return Err(VfsError::InvalidInput),
+                        }
+                        Ok(None)
+                    }
+                }),
+            ),
+        );
+
+        // One read returns `/proc/[tid]/stat` of every task, each line
+        // prefixed by the TID.
+        starry.add(
+            "taskstats",
+            SimpleFile::new_regular(
+                fs.clone(),
+                SeqFile::new(|out| {
+                    for task in tasks() {
+                        if task.try_as_thread().is_none() {
+                            continue;
+                        }
+                        if let Ok(stat) = TaskStat::from_thread(&task) {
+                            let _ = write!(out, "{} {stat}", task.id().as_u64());
+                        }
+                    }
+                    Ok(())
+                }),
+            ),
+        );
+
+        SimpleDir::new_maker(fs.clone(), Arc::new(starry))
+    });
+
     root.add("sys", {
         let mut sys = DirMapping::new();
 
@@ -403,6 +664,174 @@ fn builder(fs: Arc<SimpleFs>) -> DirMaker {
             SimpleDir::new_maker(fs.clone(), Arc::new(kernel))
         });
 
+        sys.add("vm", {
+            let mut vm = DirMapping::new();
+
+            // Stands in for /sys/kernel/mm/transparent_hugepage/enabled.
+            vm.add(
+                "transparent_hugepage",
+                SimpleFile::new_regular(
+                    fs.clone(),
+                    RwFile::new(|req| match req {
+                        SimpleFileOperation::Read => Ok(Some(thp_mode().describe())),
+                        SimpleFileOperation::Write(data) => {
+                            let mode = str::from_utf8(data)
+                                .ok()
+                                .and_then(ThpMode::parse)
+                                .ok_or(VfsError::InvalidInput)?;
+                            set_thp_mode(mode);
+                            Ok(None)
+                        }
+                    }),
+                ),
+            );
+
+            // Stands in for /sys/kernel/debug/fault_around_bytes.
+            vm.add(
+                "fault_around_bytes",
+                SimpleFile::new_regular(
+                    fs.clone(),
+                    RwFile::new(|req| match req {
+                        SimpleFileOperation::Read => {
+                            Ok(Some(format!("{}\n", fault_around_bytes()).into_bytes()))
+                        }
+                        SimpleFileOperation::Write(data) => {
+                            let bytes = str::from_utf8(data)
+                                .ok()
+                                .and_then(|it| it.trim().parse::<usize>().ok())
+                                .ok_or(VfsError::InvalidInput)?;
+                            set_fault_around_bytes(bytes).map_err(|_| VfsError::InvalidInput)?;
+                            Ok(None)
+                        }
+                    }),
+                ),
+            );
+
+            vm.add(
+                "drop_caches",
+                SimpleFile::new_regular(
+                    fs.clone(),
+                    RwFile::new(|req| match req {
+                        SimpleFileOperation::Read => Err(VfsError::PermissionDenied),
+                        SimpleFileOperation::Write(data) => {
+                            let mode = str::from_utf8(data)
+                                .ok()
+                                .and_then(|it| it.trim().parse::<u32>().ok())
+                                .filter(|it| (1..=3).contains(it))
+                                .ok_or(VfsError::InvalidInput)?;
+                            // There are no reclaimable slab objects, so 2
+                            // does nothing of its own.
+                            if mode & 1 != 0 {
+                                reclaim::drop_page_cache();
+                            }
+                            Ok(None)
+                        }
+                    }),
+                ),
+            );
+
+            let files: [(&str, &'static AtomicUsize); 5] = [
+                ("dirty_background_bytes", &DIRTY_BACKGROUND_BYTES),
+                ("dirty_bytes", &DIRTY_BYTES),
+                ("dirty_expire_centisecs", &DIRTY_EXPIRE_CENTISECS),
+                ("dirty_writeback_centisecs", &DIRTY_WRITEBACK_CENTISECS),
+                ("watermark_scale_factor", &WATERMARK_SCALE_FACTOR),
+            ];
+            for (name, value) in files {
+                vm.add(
+                    name,
+                    SimpleFile::new_regular(
+                        fs.clone(),
+                        RwFile::new(move |req| match req {
+                            SimpleFileOperation::Read => Ok(Some(
+                                format!("{}\n", value.load(Ordering::Relaxed)).into_bytes(),
+                            )),
+                            SimpleFileOperation::Write(data) => {
+                                let new = str::from_utf8(data)
+                                    .ok()
+                                    .and_then(|it| it.trim().parse::<usize>().ok())
+                                    .ok_or(VfsError::InvalidInput)?;
+                                value.store(new, Ordering::Relaxed);
+                                Ok(None)
+                            }
+                        }),
+                    ),
+                );
+            }
+
+            SimpleDir::new_maker(fs.clone(), Arc::new(vm))
+        });
+
+        sys.add("net", {
+            let mut net = DirMapping::new();
+
+            net.add("core", {
+                let mut core = DirMapping::new();
+                let files: [(&str, &'static BufferLimits); 2] =
+                    [("rmem_max", &RMEM), ("wmem_max", &WMEM)];
+                for (name, limits) in files {
+                    core.add(
+                        name,
+                        SimpleFile::new_regular(
+                            fs.clone(),
+                            RwFile::new(move |req| match req {
+                                SimpleFileOperation::Read => Ok(Some(
+                                    format!("{}\n", limits.max_explicit.load(Ordering::Relaxed))
+                                        .into_bytes(),
+                                )),
+                                SimpleFileOperation::Write(data) => {
+                                    let [max] = parse_sizes(data)?;
+                                    limits.max_explicit.store(max, Ordering::Relaxed);
+                                    Ok(None)
+                                }
+                            }),
+                        ),
+                    );
+                }
+
+                SimpleDir::new_maker(fs.clone(), Arc::new(core))
+            });
+
+            net.add("ipv4", {
+                let mut ipv4 = DirMapping::new();
+                let files: [(&str, &'static BufferLimits); 2] =
+                    [("tcp_rmem", &RMEM), ("tcp_wmem", &WMEM)];
+                for (name, limits) in files {
+                    ipv4.add(
+                        name,
+                        SimpleFile::new_regular(
+                            fs.clone(),
+                            RwFile::new(move |req| match req {
+                                SimpleFileOperation::Read => Ok(Some(
+                                    format!(
+                                        "{}\t{}\t{}\n",
+                                        limits.min.load(Ordering::Relaxed),
+                                        limits.default.load(Ordering::Relaxed),
+                                        limits.max.load(Ordering::Relaxed),
+                                    )
+                                    .into_bytes(),
+                                )),
+                                SimpleFileOperation::Write(data) => {
+                                    let [min, default, max] = parse_sizes(data)?;
+                                    if min > default || default > max {
+                                        return Err(VfsError::InvalidInput);
+                                    }
+                                    limits.min.store(min, Ordering::Relaxed);
+                                    limits.default.store(default, Ordering::Relaxed);
+                                    limits.max.store(max, Ordering::Relaxed);
+                                    Ok(None)
+                                }
+                            }),
+                        ),
+                    );
+                }
+
+                SimpleDir::new_maker(fs.clone(), Arc::new(ipv4))
+            });
+
+            SimpleDir::new_maker(fs.clone(), Arc::new(net))
+        });
+
         SimpleDir::new_maker(fs.clone(), Arc::new(sys))
     });
 
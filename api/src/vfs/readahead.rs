@@ -4,9 +4,11 @@
 //! The algorithm detects sequential access patterns and prefetches pages ahead of the
 //! current read position to improve I/O performance.
 
+use alloc::{string::String, vec::Vec};
 use core::sync::atomic::{AtomicU32, AtomicU64, Ordering};
 
 use axfs::FileBackend;
+use spin::Mutex;
 
 /// Page size in bytes (4KB)
 pub const PAGE_SIZE: u64 = 4096;
@@ -24,16 +26,106 @@ const RA_MIN_PAGES: u32 = 2;
 /// Maximum allowed gap between reads to still be considered sequential (in pages)
 const RA_SEQ_GAP_PAGES: u64 = 2;
 
+/// Access pattern advised by userspace through `posix_fadvise`
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+#[repr(u32)]
+pub enum RaAdvice {
+    /// No advice, rely on pattern detection
+    Normal     = 0,
+    /// The file will be read sequentially: use the largest window at once
+    Sequential = 1,
+    /// The file will be read randomly: never read ahead
+    Random     = 2,
+}
+
+impl From<u32> for RaAdvice {
+    fn from(value: u32) -> Self {
+        match value {
+            1 => Self::Sequential,
+            2 => Self::Random,
+            _ => Self::Normal,
+        }
+    }
+}
+
+/// Bounds of the readahead window (in pages)
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct RaWindow {
+    /// Size of the first window after a cache miss
+    pub init_pages: u32,
+    /// Largest window reached by exponential growth
+    pub max_pages: u32,
+}
+
+impl RaWindow {
+    /// Window bounds used when the mount does not override them
+    pub const DEFAULT: Self = Self {
+        init_pages: RA_INIT_PAGES,
+        max_pages: RA_MAX_PAGES,
+    };
+
+    /// Parses `ra_init_kb=` and `ra_max_kb=` out of a comma-separated mount
+    /// option string, returning `None` if neither is present.
+    pub fn from_mount_options(options: &str) -> Option<Self> {
+        let mut window = Self::DEFAULT;
+        let mut found = false;
+        for opt in options.split(',') {
+            let Some((key, value)) = opt.split_once('=') else {
+                continue;
+            };
+            let Ok(kb) = value.trim().parse::<u32>() else {
+                continue;
+            };
+            let pages = (kb / (PAGE_SIZE as u32 / 1024)).max(1);
+            match key.trim() {
+                "ra_init_kb" => window.init_pages = pages,
+                "ra_max_kb" => window.max_pages = pages,
+                _ => continue,
+            }
+            found = true;
+        }
+        window.init_pages = window.init_pages.min(window.max_pages);
+        found.then_some(window)
+    }
+}
+
+/// Per-mount window overrides, keyed by mount point path
+static MOUNT_WINDOWS: Mutex<Vec<(String, RaWindow)>> = Mutex::new(Vec::new());
+
+/// Set (or with `None`, remove) the window bounds for files under `mount_point`
+pub fn set_mount_window(mount_point: &str, window: Option<RaWindow>) {
+    let mut windows = MOUNT_WINDOWS.lock();
+    windows.retain(|(path, _)| path != mount_point);
+    if let Some(window) = window {
+        windows.push((mount_point.into(), window));
+    }
+}
+
+/// Get the window bounds for a file, from the innermost mount containing it
+pub fn mount_window(path: &str) -> RaWindow {
+    let is_under = |mount_point: &str| {
+        path.strip_prefix(mount_point).is_some_and(|rest| {
+            rest.is_empty() || rest.starts_with('/') || mount_point.ends_with('/')
+        })
+    };
+    MOUNT_WINDOWS
+        .lock()
+        .iter()
+        .filter(|(mount_point, _)| is_under(mount_point))
+        .max_by_key(|(mount_point, _)| mount_point.len())
+        .map_or(RaWindow::DEFAULT, |(_, window)| *window)
+}
+
 /// Readahead access pattern
 #[derive(Debug, Clone, Copy, PartialEq, Eq)]
 #[repr(u32)]
 pub enum RaPattern {
     /// Initial state, no pattern detected yet
-    Initial = 0,
+    Initial    = 0,
     /// Sequential access detected
     Sequential = 1,
     /// Random access detected
-    Random = 2,
+    Random     = 2,
 }
 
 impl From<u32> for RaPattern {
@@ -60,6 +152,10 @@ pub struct ReadaheadState {
     pattern: AtomicU32,
     /// Number of consecutive sequential reads
     seq_count: AtomicU32,
+    advice: AtomicU32,
+    /// Window bounds; `max_pages == 0` means not resolved yet
+    init_pages: AtomicU32,
+    max_pages: AtomicU32,
 }
 
 impl Default for ReadaheadState {
@@ -78,6 +174,74 @@ impl ReadaheadState {
             prev_end: AtomicU64::new(0),
             pattern: AtomicU32::new(RaPattern::Initial as u32),
             seq_count: AtomicU32::new(0),
+            advice: AtomicU32::new(RaAdvice::Normal as u32),
+            init_pages: AtomicU32::new(0),
+            max_pages: AtomicU32::new(0),
+        }
+    }
+
+    /// Whether the window bounds have been set with [`Self::set_window`]
+    #[inline]
+    pub fn has_window(&self) -> bool {
+        self.max_pages.load(Ordering::Relaxed) != 0
+    }
+
+    /// Set the window bounds, normally from [`mount_window`]
+    pub fn set_window(&self, window: RaWindow) {
+        self.init_pages
+            .store(window.init_pages.max(1), Ordering::Relaxed);
+        self.max_pages
+            .store(window.max_pages.max(1), Ordering::Relaxed);
+    }
+
+    fn window(&self) -> RaWindow {
+        if !self.has_window() {
+            return RaWindow::DEFAULT;
+        }
+        RaWindow {
+            init_pages: self.init_pages.load(Ordering::Relaxed),
+            max_pages: self.max_pages.load(Ordering::Relaxed),
+        }
+    }
+
+    /// Get the advised access pattern
+    #[inline]
+    pub fn advice(&self) -> RaAdvice {
+        self.advice.load(Ordering::Relaxed).into()
+    }
+
+    /// Record a `posix_fadvise` access pattern hint
+    ///
+    /// Any change of advice throws the current window away, so that the next
+    /// read starts over with the new policy.
+    pub fn advise(&self, advice: RaAdvice) {
+        self.advice.store(advice as u32, Ordering::Relaxed);
+        self.ra_size.store(0, Ordering::Relaxed);
+        self.seq_count.store(0, Ordering::Relaxed);
+        let pattern = match advice {
+            RaAdvice::Normal => RaPattern::Initial,
+            RaAdvice::Sequential => RaPattern::Sequential,
+            RaAdvice::Random => RaPattern::Random,
+        };
+        self.pattern.store(pattern as u32, Ordering::Relaxed);
+    }
+
+    /// Largest window allowed by the current advice
+    ///
+    /// Like Linux, sequential advice doubles the mount's maximum.
+    fn max_ra_size(&self) -> u32 {
+        let max = self.window().max_pages;
+        match self.advice() {
+            RaAdvice::Sequential => max.saturating_mul(2),
+            _ => max,
+        }
+    }
+
+    /// Size of the first window after a cache miss
+    fn init_ra_size(&self) -> u32 {
+        match self.advice() {
+            RaAdvice::Sequential => self.max_ra_size(),
+            _ => self.window().init_pages,
         }
     }
 
@@ -113,10 +277,10 @@ impl ReadaheadState {
     fn next_ra_size(&self) -> u32 {
         let current = self.ra_size.load(Ordering::Relaxed);
         if current == 0 {
-            RA_INIT_PAGES
+            self.init_ra_size()
         } else {
             // Double the size, but cap at maximum
-            (current * 2).min(RA_MAX_PAGES)
+            current.saturating_mul(2).min(self.max_ra_size())
         }
     }
 
@@ -124,7 +288,9 @@ impl ReadaheadState {
     ///
     /// Returns (is_sequential, is_cache_hit) tuple
     fn detect_pattern(&self, read_start: u64, read_len: usize, cache_hit: bool) -> (bool, bool) {
-        let prev_end = self.prev_end.swap(read_start + read_len as u64, Ordering::Relaxed);
+        let prev_end = self
+            .prev_end
+            .swap(read_start + read_len as u64, Ordering::Relaxed);
         let pattern = self.pattern();
 
         // Check if this is a sequential read
@@ -134,7 +300,10 @@ impl ReadaheadState {
             prev_end - read_start
         };
 
-        let is_sequential = if prev_end == 0 {
+        let is_sequential = if self.advice() == RaAdvice::Sequential {
+            // Trust the advice over the heuristics
+            true
+        } else if prev_end == 0 {
             // First read - assume sequential if starting from beginning
             read_start < PAGE_SIZE * 4
         } else {
@@ -180,7 +349,7 @@ pub fn readahead_decide(
     read_start: u64,
     read_len: usize,
 ) -> ReadaheadAction {
-    if read_len == 0 {
+    if read_len == 0 || state.advice() == RaAdvice::Random {
         return ReadaheadAction::None;
     }
 
@@ -215,7 +384,7 @@ pub fn readahead_decide(
 
     // Initial readahead on cache miss with sequential pattern
     if !cache_hit && state.pattern() != RaPattern::Random {
-        let ra_size = RA_INIT_PAGES;
+        let ra_size = state.init_ra_size();
         let async_size = ra_size / 4;
 
         // Set initial window
@@ -0,0 +1,438 @@
+//! Page cache reclaim
+//!
+//! File pages read through the kernel are tracked in chunks of
+//! [`CHUNK_PAGES`] pages on two LRU lists. A chunk starts on the inactive
+//! list and moves to the active list once one of its pages is read a second
+//! time, so a file read once from start to end never pushes out the pages
+//! that are actually reused. Chunks brought in by readahead go to the cold
+//! end of the inactive list and are the first to go.
+//!
+//! A background task (`kswapd`) keeps the free memory between the low and
+//! high watermarks by evicting inactive chunks, refilling the inactive list
+//! from the active one as needed, and dropping the executable image cache as
+//! a last resort. `/proc/sys/vm/drop_caches` evicts everything tracked here.
+//!
+//! Reads are first recorded in a small buffer of the CPU they run on, and
+//! only applied to the lists, under their global lock, a batch at a time.
+//! Files whose data only lives in the page cache (tmpfs) are never tracked,
+//! and the chunks of a file are forgotten when its last link goes.
+
+use alloc::{collections::BTreeMap, vec::Vec};
+use core::{
+    mem,
+    ops::Range,
+    sync::atomic::{AtomicUsize, Ordering},
+    time::Duration,
+};
+
+use axconfig::plat::CPU_NUM;
+use axfs::FileBackend;
+use axhal::percpu::this_cpu_id;
+use axtask::future::{self, block_on};
+use event_listener::{Event, listener};
+use kspin::SpinNoPreempt;
+use lazy_static::lazy_static;
+use spin::Mutex;
+use starry_core::mm::clear_elf_cache;
+
+use super::{cache_only, prefetch::FileId, writeback};
+
+/// Number of pages tracked together
+pub const CHUNK_PAGES: u32 = 16;
+
+/// Reads buffered on a CPU before they are applied to the lists
+const PENDING_BATCH: usize = 32;
+
+/// How often `kswapd` checks the watermarks without being woken
+const KSWAPD_INTERVAL: Duration = Duration::from_millis(100);
+
+/// Chunks evicted per round before the watermarks are checked again
+const RECLAIM_BATCH: usize = 32;
+
+/// Free memory below which `kswapd` starts reclaiming, in thousandths of
+/// total memory (`watermark_scale_factor`)
+pub static WATERMARK_SCALE_FACTOR: AtomicUsize = AtomicUsize::new(10);
+
+/// Pages evicted since boot
+static RECLAIMED_PAGES: AtomicUsize = AtomicUsize::new(0);
+
+/// (device, inode, first page / CHUNK_PAGES)
+type ChunkKey = (u64, u64, u32);
+
+#[derive(Clone, Copy, PartialEq, Eq)]
+enum List {
+    Inactive,
+    Active,
+}
+
+struct Chunk {
+    backend: FileBackend,
+    list: List,
+    /// Position in its list
+    seq: i64,
+    /// Pages read since the chunk was put on its list
+    accessed: u16,
+}
+
+struct Lru {
+    chunks: BTreeMap<ChunkKey, Chunk>,
+    inactive: BTreeMap<i64, ChunkKey>,
+    active: BTreeMap<i64, ChunkKey>,
+    /// Next position at the recent end of a list
+    next_seq: i64,
+    /// Next position at the cold end of the inactive list; always before
+    /// `next_seq`
+    next_cold_seq: i64,
+}
+
+impl Lru {
+    const fn new() -> Self {
+        Self {
+            chunks: BTreeMap::new(),
+            inactive: BTreeMap::new(),
+            active: BTreeMap::new(),
+            next_seq: 0,
+            next_cold_seq: i64::MIN,
+        }
+    }
+
+    fn list(&mut self, list: List) -> &mut BTreeMap<i64, ChunkKey> {
+        match list {
+            List::Inactive => &mut self.inactive,
+            List::Active => &mut self.active,
+        }
+    }
+
+    fn recent_seq(&mut self) -> i64 {
+        let seq = self.next_seq;
+        self.next_seq += 1;
+        seq
+    }
+
+    /// Puts the chunk at `key` on the recent end of `list`.
+    fn move_to(&mut self, key: ChunkKey, list: List) {
+        let seq = self.recent_seq();
+        let chunk = self.chunks.get_mut(&key).unwrap();
+        let old = (chunk.list, chunk.seq);
+        chunk.list = list;
+        chunk.seq = seq;
+        chunk.accessed = 0;
+        self.list(old.0).remove(&old.1);
+        self.list(list).insert(seq, key);
+    }
+
+    fn insert(&mut self, key: ChunkKey, backend: &FileBackend, cold: bool) -> &mut Chunk {
+        if !self.chunks.contains_key(&key) {
+            let seq = if cold {
+                self.next_cold_seq += 1;
+                self.next_cold_seq
+            } else {
+                self.recent_seq()
+            };
+            self.inactive.insert(seq, key);
+            self.chunks.insert(
+                key,
+                Chunk {
+                    backend: backend.clone(),
+                    list: List::Inactive,
+                    seq,
+                    accessed: 0,
+                },
+            );
+        }
+        self.chunks.get_mut(&key).unwrap()
+    }
+
+    /// Applies reads buffered by a CPU.
+    fn apply(&mut self, batch: &mut Vec<Pending>) {
+        for pending in batch.drain(..) {
+            let Pending {
+                key,
+                backend,
+                readahead,
+                accessed,
+                reaccessed,
+            } = pending;
+            let entry = self.insert(key, &backend, readahead);
+            // A page read again while inactive makes the chunk active.
+            let activate =
+                entry.list == List::Inactive && (entry.accessed & accessed != 0 || reaccessed != 0);
+            entry.accessed |= accessed;
+            if activate {
+                self.move_to(key, List::Active);
+            }
+        }
+    }
+
+    /// Puts back a chunk that could not be evicted, at the recent end of the
+    /// inactive list.
+    fn put_back(&mut self, key: ChunkKey, mut chunk: Chunk) {
+        if self.chunks.contains_key(&key) {
+            return;
+        }
+        chunk.list = List::Inactive;
+        chunk.seq = self.recent_seq();
+        chunk.accessed = 0;
+        self.inactive.insert(chunk.seq, key);
+        self.chunks.insert(key, chunk);
+    }
+
+    /// Stops tracking every chunk of `file`.
+    fn forget(&mut self, file: FileId) {
+        let range = (file.device, file.inode, 0)..=(file.device, file.inode, u32::MAX);
+        let keys: Vec<_> = self.chunks.range(range).map(|(key, _)| *key).collect();
+        for key in keys {
+            let chunk = self.chunks.remove(&key).unwrap();
+            self.list(chunk.list).remove(&chunk.seq);
+        }
+    }
+
+    /// Takes the chunk at the cold end of the inactive list, refilling the
+    /// list from the active one if it is shorter.
+    fn pop_victim(&mut self) -> Option<(ChunkKey, Chunk)> {
+        if self.inactive.len() < self.active.len()
+            && let Some((_, key)) = self.active.pop_first()
+        {
+            // Demoted chunks keep their chance to be activated again.
+            let seq = self.recent_seq();
+            let chunk = self.chunks.get_mut(&key).unwrap();
+            chunk.list = List::Inactive;
+            chunk.seq = seq;
+            chunk.accessed = 0;
+            self.inactive.insert(seq, key);
+        }
+        let (_, key) = self.inactive.pop_first()?;
+        let chunk = self.chunks.remove(&key)?;
+        Some((key, chunk))
+    }
+}
+
+static LRU: Mutex<Lru> = Mutex::new(Lru::new());
+
+/// A read not yet applied to the lists
+struct Pending {
+    key: ChunkKey,
+    backend: FileBackend,
+    /// Brought in by readahead rather than read
+    readahead: bool,
+    /// Pages read
+    accessed: u16,
+    /// Pages read more than once
+    reaccessed: u16,
+}
+
+static PENDING: [SpinNoPreempt<Vec<Pending>>; CPU_NUM] =
+    [const { SpinNoPreempt::new(Vec::new()) }; CPU_NUM];
+
+lazy_static! {
+    static ref EVENT_KSWAPD: Event = Event::new();
+}
+
+fn chunks(pages: Range<u32>) -> Range<u32> {
+    pages.start / CHUNK_PAGES..pages.end.div_ceil(CHUNK_PAGES)
+}
+
+/// Buffers reads of the chunks of `pages` on this CPU.
+fn record(file: FileId, backend: &FileBackend, pages: Range<u32>, readahead: bool) {
+    if pages.is_empty() || cache_only(backend) {
+        return;
+    }
+    let mut pending = PENDING[this_cpu_id() % CPU_NUM].lock();
+    for chunk in chunks(pages.clone()) {
+        let key = (file.device, file.inode, chunk);
+        let first = chunk * CHUNK_PAGES;
+        let range = pages.start.max(first)..pages.end.min(first + CHUNK_PAGES);
+        let bits = if readahead {
+            0
+        } else {
+            (((1u32 << range.len()) - 1) << (range.start - first)) as u16
+        };
+        // Small sequential reads hit the same chunk over and over.
+        if let Some(last) = pending.last_mut()
+            && last.key == key
+            && last.readahead == readahead
+        {
+            last.reaccessed |= last.accessed & bits;
+            last.accessed |= bits;
+            continue;
+        }
+        pending.push(Pending {
+            key,
+            backend: backend.clone(),
+            readahead,
+            accessed: bits,
+            reaccessed: 0,
+        });
+    }
+    if pending.len() < PENDING_BATCH {
+        return;
+    }
+    let mut batch = mem::replace(&mut *pending, Vec::with_capacity(PENDING_BATCH));
+    // The lists are not locked with preemption off.
+    drop(pending);
+    LRU.lock().apply(&mut batch);
+}
+
+/// Applies the reads buffered on every CPU.
+fn drain_pending() {
+    for pending in &PENDING {
+        let mut batch = mem::take(&mut *pending.lock());
+        if !batch.is_empty() {
+            LRU.lock().apply(&mut batch);
+        }
+    }
+}
+
+/// Records that readahead brought in `pages` of `file`
+pub fn note_readahead(file: FileId, backend: &FileBackend, pages: Range<u32>) {
+    record(file, backend, pages, true);
+    wake_if_low();
+}
+
+/// Records that `pages` of `file` were read
+pub fn mark_accessed(file: FileId, backend: &FileBackend, pages: Range<u32>) {
+    record(file, backend, pages, false);
+}
+
+/// Stops tracking `file`, e.g. once it is unlinked, so that its cache is
+/// not kept alive by being on the lists.
+pub fn forget(file: FileId) {
+    drain_pending();
+    LRU.lock().forget(file);
+}
+
+/// Evicts the chunk, returning how many of its pages were cached, or `None`
+/// if its dirty data could not be written back.
+fn evict((device, inode, chunk): ChunkKey, backend: &FileBackend) -> Option<usize> {
+    let first = chunk * CHUNK_PAGES;
+    let cached = (first..first + CHUNK_PAGES)
+        .filter(|&page| backend.is_page_cached(page))
+        .count();
+    if cached == 0 {
+        return Some(0);
+    }
+    // Dirty data has to reach the disk before its pages can go.
+    writeback::writeback(FileId { device, inode }).ok()?;
+    backend.evict_pages(first, CHUNK_PAGES);
+    RECLAIMED_PAGES.fetch_add(cached, Ordering::Relaxed);
+    Some(cached)
+}
+
+/// Evicts up to `count` chunks, returning how many pages were freed and
+/// whether any chunk had to be kept.
+fn shrink(count: usize) -> (usize, bool) {
+    drain_pending();
+    let mut freed = 0;
+    let mut kept = false;
+    for _ in 0..count {
+        let Some((key, chunk)) = LRU.lock().pop_victim() else {
+            break;
+        };
+        match evict(key, &chunk.backend) {
+            Some(pages) => freed += pages,
+            None => {
+                // Tried again once it has gone round the list.
+                LRU.lock().put_back(key, chunk);
+                kept = true;
+            }
+        }
+    }
+    (freed, kept)
+}
+
+/// Drops the clean page cache, as writing 1 to `drop_caches` does
+///
+/// Chunks whose dirty data cannot be written back are kept.
+pub fn drop_page_cache() {
+    drain_pending();
+    let mut left = LRU.lock().chunks.len();
+    while left > 0 {
+        let (_, kept) = shrink(left.min(RECLAIM_BATCH));
+        let now = LRU.lock().chunks.len();
+        if kept && now >= left {
+            break;
+        }
+        left = now;
+    }
+    clear_elf_cache();
+}
+
+/// Free page counts `kswapd` works with
+#[derive(Debug, Clone, Copy)]
+pub struct Watermarks {
+    /// Free pages below which reclaim starts
+    pub low: usize,
+    /// Free pages at which reclaim stops
+    pub high: usize,
+}
+
+/// Returns the current watermarks.
+pub fn watermarks() -> Watermarks {
+    let allocator = axalloc::global_allocator();
+    let total = allocator.used_pages() + allocator.available_pages();
+    let low = total * WATERMARK_SCALE_FACTOR.load(Ordering::Relaxed) / 1000;
+    Watermarks { low, high: low * 2 }
+}
+
+fn free_pages() -> usize {
+    axalloc::global_allocator().available_pages()
+}
+
+fn wake_if_low() {
+    if free_pages() < watermarks().low {
+        EVENT_KSWAPD.notify(1);
+    }
+}
+
+async fn kswapd() {
+    loop {
+        listener!(EVENT_KSWAPD => listener);
+        if free_pages() >= watermarks().low {
+            let _ = future::timeout(Some(KSWAPD_INTERVAL), listener).await;
+            if free_pages() >= watermarks().low {
+                continue;
+            }
+        }
+
+        while free_pages() < watermarks().high {
+            let (freed, kept) = shrink(RECLAIM_BATCH);
+            if freed == 0 && (kept || LRU.lock().chunks.is_empty()) {
+                // Nothing left to evict but the executable images.
+                clear_elf_cache();
+                break;
+            }
+            axtask::yield_now();
+        }
+    }
+}
+
+/// Spawns `kswapd`.
+pub fn spawn_kswapd() {
+    axtask::spawn_raw(
+        || block_on(kswapd()),
+        "kswapd".into(),
+        axconfig::TASK_STACK_SIZE,
+    );
+}
+
+/// Reclaim counters, in pages
+#[derive(Debug, Clone, Copy)]
+pub struct ReclaimStats {
+    /// Chunks on the active list
+    pub active: usize,
+    /// Chunks on the inactive list
+    pub inactive: usize,
+    /// Pages evicted since boot
+    pub reclaimed: usize,
+}
+
+/// Returns the reclaim counters.
+pub fn stats() -> ReclaimStats {
+    drain_pending();
+    let lru = LRU.lock();
+    ReclaimStats {
+        active: lru.active.len() * CHUNK_PAGES as usize,
+        inactive: lru.inactive.len() * CHUNK_PAGES as usize,
+        reclaimed: RECLAIMED_PAGES.load(Ordering::Relaxed),
+    }
+}
@@ -6,6 +6,7 @@ use axfs_ng_vfs::{
     FilesystemOps, Metadata, MetadataUpdate, NodeFlags, NodeOps, NodePermission, NodeType,
     Reference, StatFs, VfsError, VfsResult, WeakDirEntry,
 };
+use axhal::percpu::this_cpu_id;
 use axpoll::{IoEvents, Pollable};
 use axsync::Mutex;
 use hashbrown::HashMap;
@@ -49,9 +50,17 @@ impl Borrow<str> for FileName {
     }
 }
 
+/// Number of independently locked parts of the inode table.
+const INODE_SHARDS: usize = 16;
+
 /// A simple in-memory filesystem that supports basic file operations.
+///
+/// Inode numbers are spread over [`INODE_SHARDS`] slabs, filled from the
+/// current CPU's shard, so that creating and deleting files in parallel does
+/// not contend on one table. Lookups never touch the table: directory
+/// entries hold their inodes directly, and each directory has its own lock.
 pub struct MemoryFs {
-    inodes: Mutex<Slab<Arc<Inode>>>,
+    inodes: [Mutex<Slab<Arc<Inode>>>; INODE_SHARDS],
     root: Mutex<Option<DirEntry>>,
 }
 
@@ -60,7 +69,7 @@ impl MemoryFs {
     #[allow(clippy::new_ret_no_self)]
     pub fn new() -> Filesystem {
         let fs = Arc::new(Self {
-            inodes: Mutex::new(Slab::new()),
+            inodes: [const { Mutex::new(Slab::new()) }; INODE_SHARDS],
             root: Mutex::default(),
         });
         let root_ino = Inode::new(
@@ -76,8 +85,9 @@ impl MemoryFs {
         Filesystem::new(fs)
     }
 
-    fn get(&self, ino: u64) -> Arc<Inode> {
-        self.inodes.lock()[ino as usize - 1].clone()
+    fn shard(&self, ino: u64) -> (&Mutex<Slab<Arc<Inode>>>, usize) {
+        let index = ino as usize - 1;
+        (&self.inodes[index % INODE_SHARDS], index / INODE_SHARDS)
     }
 }
 
@@ -96,11 +106,12 @@ impl FilesystemOps for MemoryFs {
 }
 
 fn release_inode(fs: &MemoryFs, inode: &Arc<Inode>, nlink: u64) {
-    let mut inodes = fs.inodes.lock();
+    let (shard, slot) = fs.shard(inode.ino);
+    let mut inodes = shard.lock();
     let mut metadata = inode.metadata.lock();
     metadata.nlink -= nlink;
     if metadata.nlink == 0 && Arc::strong_count(inode) == 2 {
-        inodes.remove(metadata.inode as usize - 1);
+        inodes.remove(slot);
     }
 }
 
@@ -133,13 +144,14 @@ struct Inode {
 impl Inode {
     pub fn new(
         fs: &Arc<MemoryFs>,
-        parent: Option<u64>,
+        parent: Option<Arc<Inode>>,
         node_type: NodeType,
         permission: NodePermission,
     ) -> Arc<Inode> {
-        let mut inodes = fs.inodes.lock();
+        let shard = this_cpu_id() % INODE_SHARDS;
+        let mut inodes = fs.inodes[shard].lock();
         let entry = inodes.vacant_entry();
-        let ino = entry.key() as u64 + 1;
+        let ino = (entry.key() * INODE_SHARDS + shard) as u64 + 1;
         let metadata = Metadata {
             device: 0,
             inode: ino,
@@ -169,10 +181,10 @@ impl Inode {
         drop(inodes);
         if let NodeContent::Dir(dir) = &result.content {
             let mut entries = dir.entries.lock();
-            entries.insert(".".into(), InodeRef::new(fs.clone(), ino));
+            entries.insert(".".into(), InodeRef::new(fs.clone(), result.clone()));
             entries.insert(
                 "..".into(),
-                InodeRef::new(fs.clone(), parent.unwrap_or(ino)),
+                InodeRef::new(fs.clone(), parent.unwrap_or_else(|| result.clone())),
             );
         }
         result
@@ -193,25 +205,24 @@ impl Inode {
     }
 }
 
+/// A link to an inode from a directory entry.
 struct InodeRef {
     fs: Arc<MemoryFs>,
-    ino: u64,
+    inode: Arc<Inode>,
 }
 
 impl InodeRef {
-    pub fn new(fs: Arc<MemoryFs>, ino: u64) -> Self {
-        fs.get(ino).metadata.lock().nlink += 1;
-        Self { fs, ino }
-    }
-
-    fn get(&self) -> Arc<Inode> {
-        self.fs.get(self.ino)
+    pub fn new(fs: Arc<MemoryFs>, inode: Arc<Inode>) -> Self {
+        inode.metadata.lock().nlink += 1;
+        Self { fs, inode }
     }
 }
 
 impl Drop for InodeRef {
     fn drop(&mut self) {
-        release_inode(&self.fs, &self.get(), 1);
+        // The table and this link are the only references left once the
+        // inode is unused.
+        release_inode(&self.fs, &self.inode, 1);
     }
 }
 
@@ -354,8 +365,8 @@ impl DirNodeOps for MemoryNode {
         {
             if !sink.accept(
                 &name.0,
-                entry.ino,
-                entry.get().metadata.lock().node_type,
+                entry.inode.ino,
+                entry.inode.metadata.lock().node_type,
                 i as u64 + 1,
             ) {
                 return Ok(count);
@@ -370,7 +381,7 @@ impl DirNodeOps for MemoryNode {
         let entries = dir.entries.lock();
 
         let entry = entries.get(name).ok_or(VfsError::NotFound)?;
-        let inode = entry.get();
+        let inode = entry.inode.clone();
         let node_type = inode.metadata.lock().node_type;
         self.new_entry(name, node_type, inode)
     }
@@ -387,8 +398,8 @@ impl DirNodeOps for MemoryNode {
         if entries.contains_key(name) {
             return Err(VfsError::AlreadyExists);
         }
-        let inode = Inode::new(&self.fs, Some(self.inode.ino), node_type, permission);
-        entries.insert(name.into(), InodeRef::new(self.fs.clone(), inode.ino));
+        let inode = Inode::new(&self.fs, Some(self.inode.clone()), node_type, permission);
+        entries.insert(name.into(), InodeRef::new(self.fs.clone(), inode.clone()));
         self.new_entry(name, node_type, inode)
     }
 
@@ -403,7 +414,7 @@ impl DirNodeOps for MemoryNode {
         }
         let inode = target.inode.clone();
         let node_type = target.metadata()?.node_type;
-        entries.insert(name.into(), InodeRef::new(self.fs.clone(), inode.ino));
+        entries.insert(name.into(), InodeRef::new(self.fs.clone(), inode.clone()));
         self.new_entry(name, node_type, inode)
     }
 
@@ -414,7 +425,7 @@ impl DirNodeOps for MemoryNode {
         let Some(entry) = entries.get(name) else {
             return Err(VfsError::NotFound);
         };
-        if let NodeContent::Dir(DirContent { entries }) = &entry.get().content
+        if let NodeContent::Dir(DirContent { entries }) = &entry.inode.content
             && entries.lock().len() > 2
         {
             return Err(VfsError::DirectoryNotEmpty);
@@ -0,0 +1,372 @@
+//! Dirty page accounting and background writeback
+//!
+//! The page cache knows which of its pages are dirty, but nothing decides
+//! when they reach the disk. Every write to a cached file is recorded here as
+//! a range of dirty pages, merged with what the file already had. A flusher
+//! task writes back files that have been dirty for longer than
+//! `dirty_expire_centisecs`, and every dirty file once the total passes
+//! `dirty_background_bytes`. A writer that pushes the total past
+//! `dirty_bytes` writes back its own file before returning, which keeps a
+//! burst from piling up more dirty data than the disk can take.
+//!
+//! Stores through shared mappings do not go through here; the pages that are
+//! mapped writable are recorded when the mapping is synced or unmapped. Files
+//! whose data only lives in the page cache (tmpfs) have nothing to be written
+//! back to and are never recorded.
+//!
+//! The table of dirty files is sharded by inode, so that writers of
+//! different files rarely take the same lock.
+
+use alloc::{collections::BTreeMap, vec::Vec};
+use core::{
+    iter,
+    ops::Range,
+    sync::atomic::{AtomicU64, AtomicUsize, Ordering},
+    time::Duration,
+};
+
+use axerrno::AxResult;
+use axfs::{FileBackend, FileFlags};
+use axhal::time::monotonic_time_nanos;
+use axtask::future::{self, block_on};
+use event_listener::{Event, listener};
+use lazy_static::lazy_static;
+use spin::Mutex;
+
+use super::{cache_only, prefetch::FileId, readahead::PAGE_SIZE};
+
+/// Default of `dirty_background_bytes`
+const DEFAULT_DIRTY_BACKGROUND_BYTES: usize = 16 * 1024 * 1024;
+/// Default of `dirty_bytes`
+const DEFAULT_DIRTY_BYTES: usize = 64 * 1024 * 1024;
+/// Default of `dirty_expire_centisecs`
+const DEFAULT_DIRTY_EXPIRE_CENTISECS: usize = 3000;
+/// Default of `dirty_writeback_centisecs`
+const DEFAULT_DIRTY_WRITEBACK_CENTISECS: usize = 500;
+/// How long the flusher waits after a failed writeback if periodic
+/// writeback is disabled
+const ERROR_BACKOFF: Duration = Duration::from_secs(5);
+/// Number of shards of the dirty file table
+const SHARDS: usize = 16;
+
+/// Dirty total past which the flusher writes back everything
+pub static DIRTY_BACKGROUND_BYTES: AtomicUsize = AtomicUsize::new(DEFAULT_DIRTY_BACKGROUND_BYTES);
+/// Dirty total past which writers write back their own file
+pub static DIRTY_BYTES: AtomicUsize = AtomicUsize::new(DEFAULT_DIRTY_BYTES);
+/// Age after which dirty data is written back, in hundredths of a second
+pub static DIRTY_EXPIRE_CENTISECS: AtomicUsize = AtomicUsize::new(DEFAULT_DIRTY_EXPIRE_CENTISECS);
+/// Interval between flusher runs, in hundredths of a second
+pub static DIRTY_WRITEBACK_CENTISECS: AtomicUsize =
+    AtomicUsize::new(DEFAULT_DIRTY_WRITEBACK_CENTISECS);
+
+/// Pages recorded as dirty
+static DIRTY_PAGES: AtomicUsize = AtomicUsize::new(0);
+/// Pages being written back
+static WRITEBACK_PAGES: AtomicUsize = AtomicUsize::new(0);
+/// Pages written back since boot
+static WRITTEN_PAGES: AtomicU64 = AtomicU64::new(0);
+
+struct DirtyFile {
+    backend: FileBackend,
+    flags: FileFlags,
+    /// Dirty pages, sorted and disjoint
+    pages: Vec<Range<u32>>,
+    /// When the file became dirty, in nanoseconds of monotonic time
+    since: u64,
+}
+
+impl DirtyFile {
+    fn num_pages(&self) -> usize {
+        self.pages.iter().map(|r| r.len()).sum()
+    }
+}
+
+type DirtyShard = Mutex<BTreeMap<(u64, u64), DirtyFile>>;
+
+static DIRTY: [DirtyShard; SHARDS] = [const { Mutex::new(BTreeMap::new()) }; SHARDS];
+
+fn shard(key: (u64, u64)) -> &'static DirtyShard {
+    &DIRTY[(key.0 ^ key.1) as usize % SHARDS]
+}
+
+/// Takes the entries of every shard that `f` selects.
+fn take_files(mut f: impl FnMut(&(u64, u64), &DirtyFile) -> bool) -> Vec<((u64, u64), DirtyFile)> {
+    let mut files = Vec::new();
+    for shard in &DIRTY {
+        let mut shard = shard.lock();
+        let keys: Vec<_> = shard
+            .iter()
+            .filter(|(key, entry)| f(key, entry))
+            .map(|(key, _)| *key)
+            .collect();
+        files.extend(
+            keys.into_iter()
+                .filter_map(|key| shard.remove(&key).map(|entry| (key, entry))),
+        );
+    }
+    files
+}
+
+lazy_static! {
+    static ref EVENT_FLUSH: Event = Event::new();
+}
+
+fn key(file: FileId) -> (u64, u64) {
+    (file.device, file.inode)
+}
+
+/// Adds `new` to `pages`, returning how many pages were not in it yet.
+fn insert_range(pages: &mut Vec<Range<u32>>, new: Range<u32>) -> usize {
+    let start = pages.partition_point(|r| r.end < new.start);
+    let end = pages.partition_point(|r| r.start <= new.end);
+    let mut merged = new.clone();
+    let mut covered = 0;
+    for r in &pages[start..end] {
+        covered += r.end.min(new.end).saturating_sub(r.start.max(new.start)) as usize;
+        merged = merged.start.min(r.start)..merged.end.max(r.end);
+    }
+    pages.splice(start..end, iter::once(merged));
+    new.len() - covered
+}
+
+fn page_range(offset: u64, len: u64) -> Range<u32> {
+    let start = (offset / PAGE_SIZE).min(u32::MAX as u64) as u32;
+    let end = offset
+        .saturating_add(len)
+        .div_ceil(PAGE_SIZE)
+        .min(u32::MAX as u64) as u32;
+    start..end
+}
+
+fn dirty_bytes() -> usize {
+    DIRTY_PAGES.load(Ordering::Relaxed) * PAGE_SIZE as usize
+}
+
+/// Records that `len` bytes at `offset` of `file` were written
+///
+/// Writes back the file right away if dirty data is over `dirty_bytes`.
+pub fn account_write(
+    file: FileId,
+    backend: &FileBackend,
+    flags: FileFlags,
+    offset: u64,
+    len: usize,
+) {
+    let pages = page_range(offset, len as u64);
+    if pages.is_empty() || cache_only(backend) {
+        return;
+    }
+    let mut dirty = shard(key(file)).lock();
+    let entry = dirty.entry(key(file)).or_insert_with(|| DirtyFile {
+        backend: backend.clone(),
+        flags,
+        pages: Vec::new(),
+        since: monotonic_time_nanos(),
+    });
+    let added = insert_range(&mut entry.pages, pages);
+    drop(dirty);
+    let total = DIRTY_PAGES.fetch_add(added, Ordering::Relaxed) + added;
+
+    let total = total * PAGE_SIZE as usize;
+    if total > DIRTY_BYTES.load(Ordering::Relaxed) {
+        EVENT_FLUSH.notify(1);
+        // Best effort; the data stays in the cache if this fails. The
+        // writer is throttled all the same.
+        let _ = writeback(file);
+    } else if total > DIRTY_BACKGROUND_BYTES.load(Ordering::Relaxed) {
+        EVENT_FLUSH.notify(1);
+    }
+}
+
+fn backend_id(backend: &FileBackend) -> Option<FileId> {
+    let metadata = backend.location().metadata().ok()?;
+    Some(FileId {
+        device: metadata.device,
+        inode: metadata.inode,
+    })
+}
+
+/// Records the pages of `backend` in `pages` that are in the cache as dirty
+///
+/// Used for shared writable mappings, whose stores the kernel does not see.
+pub fn account_mapped(backend: &FileBackend, pages: Range<u32>) {
+    if cache_only(backend) {
+        return;
+    }
+    let Some(file) = backend_id(backend) else {
+        return;
+    };
+    let flags = FileFlags::WRITE;
+    let mut run = None;
+    for page in pages.clone().chain(iter::once(pages.end)) {
+        let cached = page < pages.end && backend.is_page_cached(page);
+        match (run, cached) {
+            (None, true) => run = Some(page),
+            (Some(start), false) => {
+                account_write(
+                    file,
+                    backend,
+                    flags,
+                    start as u64 * PAGE_SIZE,
+                    (page - start) as usize * PAGE_SIZE as usize,
+                );
+                run = None;
+            }
+            _ => {}
+        }
+    }
+}
+
+/// Writes back `entry` with `sync`, putting its pages back if that fails.
+fn write_back(
+    file: (u64, u64),
+    entry: DirtyFile,
+    sync: impl FnOnce(&DirtyFile) -> AxResult,
+) -> AxResult {
+    let pages = entry.num_pages();
+    DIRTY_PAGES.fetch_sub(pages, Ordering::Relaxed);
+    WRITEBACK_PAGES.fetch_add(pages, Ordering::Relaxed);
+    let result = sync(&entry);
+    WRITEBACK_PAGES.fetch_sub(pages, Ordering::Relaxed);
+    match result {
+        Ok(()) => {
+            WRITTEN_PAGES.fetch_add(pages as u64, Ordering::Relaxed);
+        }
+        Err(_) => {
+            // Keep the pages dirty so that they are tried again.
+            let mut dirty = shard(file).lock();
+            let current = dirty.entry(file).or_insert_with(|| DirtyFile {
+                backend: entry.backend.clone(),
+                flags: entry.flags,
+                pages: Vec::new(),
+                since: entry.since,
+            });
+            current.since = current.since.min(entry.since);
+            let mut added = 0;
+            for range in entry.pages {
+                added += insert_range(&mut current.pages, range);
+            }
+            DIRTY_PAGES.fetch_add(added, Ordering::Relaxed);
+        }
+    }
+    result
+}
+
+/// Writes back the data of a dirty file.
+///
+/// The cache writes back everything it has dirty for the file, in as large
+/// runs as the dirty pages allow.
+fn sync_data(entry: &DirtyFile) -> AxResult {
+    axfs::File::new(entry.backend.clone(), entry.flags).sync(true)
+}
+
+/// Writes back the dirty pages of `file`
+pub fn writeback(file: FileId) -> AxResult {
+    let Some(entry) = shard(key(file)).lock().remove(&key(file)) else {
+        return Ok(());
+    };
+    write_back(key(file), entry, sync_data)
+}
+
+/// Runs `sync` to flush `file` on behalf of the user, treating its dirty
+/// pages as written back if that succeeds
+pub fn sync_file(file: FileId, sync: impl FnOnce() -> AxResult) -> AxResult {
+    let entry = shard(key(file)).lock().remove(&key(file));
+    match entry {
+        Some(entry) => write_back(key(file), entry, |_| sync()),
+        None => sync(),
+    }
+}
+
+/// Writes back the pages of a shared mapping of `backend`
+pub fn sync_mapped(backend: &FileBackend, pages: Range<u32>) -> AxResult {
+    let Some(file) = backend_id(backend) else {
+        return Ok(());
+    };
+    account_mapped(backend, pages);
+    writeback(file)
+}
+
+/// Writes back every dirty file, or only those of `device` if given
+pub fn writeback_all(device: Option<u64>) -> AxResult {
+    let files = take_files(|(dev, _), _| device.is_none_or(|device| *dev == device));
+    let mut result = Ok(());
+    for (key, entry) in files {
+        if let Err(err) = write_back(key, entry, sync_data) {
+            result = Err(err);
+        }
+    }
+    result
+}
+
+/// Takes the files the flusher should write back now, oldest first.
+fn expired_files() -> Vec<((u64, u64), DirtyFile)> {
+    let expire = DIRTY_EXPIRE_CENTISECS.load(Ordering::Relaxed) as u64 * 10_000_000;
+    let all = dirty_bytes() > DIRTY_BACKGROUND_BYTES.load(Ordering::Relaxed);
+    let now = monotonic_time_nanos();
+
+    let mut files = take_files(|_, entry| all || now.saturating_sub(entry.since) >= expire);
+    files.sort_unstable_by_key(|(_, entry)| entry.since);
+    files
+}
+
+async fn flusher() {
+    let mut failed = false;
+    loop {
+        let interval = DIRTY_WRITEBACK_CENTISECS.load(Ordering::Relaxed) as u64;
+        // An interval of 0 disables periodic writeback.
+        let interval = (interval > 0).then(|| Duration::from_millis(interval * 10));
+        if failed {
+            // The failed pages are dirty again, so the limits may still be
+            // exceeded; retrying right away would only spin.
+            future::sleep(interval.unwrap_or(ERROR_BACKOFF)).await;
+        } else {
+            listener!(EVENT_FLUSH => listener);
+            if dirty_bytes() <= DIRTY_BACKGROUND_BYTES.load(Ordering::Relaxed) {
+                let _ = future::timeout(interval, listener).await;
+            }
+        }
+
+        let mut errors = 0;
+        let mut last_err = None;
+        for (key, entry) in expired_files() {
+            if let Err(err) = write_back(key, entry, sync_data) {
+                errors += 1;
+                last_err = Some((key.1, err));
+            }
+        }
+        if let Some((inode, err)) = last_err {
+            warn!("writeback of {errors} file(s) failed, last inode {inode}: {err:?}");
+        }
+        failed = errors > 0;
+    }
+}
+
+/// Spawns the background flusher.
+pub fn spawn_flusher() {
+    axtask::spawn_raw(
+        || block_on(flusher()),
+        "flush".into(),
+        axconfig::TASK_STACK_SIZE,
+    );
+}
+
+/// Writeback counters, in bytes
+#[derive(Debug, Clone, Copy)]
+pub struct WritebackStats {
+    /// Data waiting to be written back
+    pub dirty: u64,
+    /// Data being written back
+    pub writeback: u64,
+    /// Data written back since boot
+    pub written: u64,
+}
+
+/// Returns the writeback counters.
+pub fn stats() -> WritebackStats {
+    WritebackStats {
+        dirty: dirty_bytes() as u64,
+        writeback: (WRITEBACK_PAGES.load(Ordering::Relaxed) * PAGE_SIZE as usize) as u64,
+        written: WRITTEN_PAGES.load(Ordering::Relaxed) * PAGE_SIZE,
+    }
+}
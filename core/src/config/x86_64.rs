@@ -21,3 +21,8 @@ pub const USER_INTERP_BASE: usize = 0x400_0000;
 
 /// The address of signal trampoline.
 pub const SIGNAL_TRAMPOLINE: usize = 0x4001_0000;
+
+/// The address of the vDSO data page.
+pub const VDSO_DATA: usize = 0x4001_1000;
+/// The address of the vDSO, right after its data page.
+pub const VDSO_BASE: usize = 0x4001_2000;
@@ -0,0 +1,266 @@
+//! User page fault handling.
+//!
+//! On top of what the address space does by itself, a read fault on a
+//! file-backed mapping also maps the neighbouring pages that are already in
+//! the page cache ("fault-around"), so a process walking through a mapped file
+//! or its own text takes one fault per window instead of one per page. Every
+//! fault is counted for its process, as major if the page had to be read from
+//! the file and as minor otherwise.
+
+use alloc::vec::Vec;
+use core::{
+    iter,
+    ops::Range,
+    sync::atomic::{AtomicUsize, Ordering},
+};
+
+use axerrno::{AxError, AxResult};
+use axfs::FileBackend;
+use axhal::paging::MappingFlags;
+use axmm::{AddrSpace, backend::Backend};
+use memory_addr::{MemoryAddr, PAGE_SIZE_4K, VirtAddr};
+
+use crate::task::ProcessData;
+
+/// Default size of the fault-around window.
+pub const DEFAULT_FAULT_AROUND_BYTES: usize = 64 * 1024;
+
+/// Largest accepted fault-around window, the span of one last-level page
+/// table.
+pub const MAX_FAULT_AROUND_BYTES: usize = 2 * 1024 * 1024;
+
+static FAULT_AROUND_BYTES: AtomicUsize = AtomicUsize::new(DEFAULT_FAULT_AROUND_BYTES);
+
+/// Returns the size of the fault-around window in bytes.
+pub fn fault_around_bytes() -> usize {
+    FAULT_AROUND_BYTES.load(Ordering::Relaxed)
+}
+
+/// Sets the size of the fault-around window.
+///
+/// The size is rounded down to a power of two number of pages; a window of
+/// one page disables fault-around.
+pub fn set_fault_around_bytes(bytes: usize) -> AxResult {
+    if bytes > MAX_FAULT_AROUND_BYTES {
+        return Err(AxError::InvalidInput);
+    }
+    let bytes = if bytes < PAGE_SIZE_4K {
+        PAGE_SIZE_4K
+    } else {
+        1 << bytes.ilog2()
+    };
+    FAULT_AROUND_BYTES.store(bytes, Ordering::Relaxed);
+    Ok(())
+}
+
+#[derive(Clone)]
+struct FileMapping {
+    range: Range<usize>,
+    backend: FileBackend,
+    /// File offset mapped at `range.start`.
+    offset: u64,
+    /// End of the file data, if the mapping continues with zero-filled pages.
+    file_end: Option<u64>,
+}
+
+impl FileMapping {
+    /// The file page mapped at `va`, or `None` if the page is zero-filled.
+    fn file_page(&self, va: usize) -> Option<u32> {
+        let offset = self.offset + (va.align_down_4k() - self.range.start) as u64;
+        if self.file_end.is_some_and(|end| offset >= end) {
+            return None;
+        }
+        Some((offset / PAGE_SIZE_4K as u64) as u32)
+    }
+}
+
+/// The file-backed ranges of a user address space.
+///
+/// Area backends do not expose the file behind them, so mappings are
+/// recorded here as they are made and forgotten as they are unmapped.
+#[derive(Clone, Default)]
+pub struct FileMaps {
+    /// Sorted and disjoint.
+    maps: Vec<FileMapping>,
+}
+
+impl FileMaps {
+    /// Records that `range` maps `backend` from file offset `offset`.
+    ///
+    /// If `file_end` is given, the pages from that file offset on are
+    /// zero-filled rather than read from the file.
+    pub fn insert(
+        &mut self,
+        range: Range<usize>,
+        backend: FileBackend,
+        offset: u64,
+        file_end: Option<u64>,
+    ) {
+        if range.is_empty() {
+            return;
+        }
+        self.remove(range.clone());
+        let pos = self.maps.partition_point(|m| m.range.start < range.start);
+        self.maps.insert(
+            pos,
+            FileMapping {
+                range,
+                backend,
+                offset,
+                file_end,
+            },
+        );
+    }
+
+    /// Forgets whatever is mapped in `range`.
+    pub fn remove(&mut self, range: Range<usize>) {
+        if range.is_empty()
+            || !self
+                .maps
+                .iter()
+                .any(|m| m.range.start < range.end && range.start < m.range.end)
+        {
+            return;
+        }
+        let mut kept = Vec::with_capacity(self.maps.len() + 1);
+        for m in self.maps.drain(..) {
+            if m.range.end <= range.start || range.end <= m.range.start {
+                kept.push(m);
+                continue;
+            }
+            if m.range.start < range.start {
+                kept.push(FileMapping {
+                    range: m.range.start..range.start,
+                    ..m.clone()
+                });
+            }
+            if range.end < m.range.end {
+                kept.push(FileMapping {
+                    range: range.end..m.range.end,
+                    offset: m.offset + (range.end - m.range.start) as u64,
+                    ..m
+                });
+            }
+        }
+        self.maps = kept;
+    }
+
+    /// Forgets all mappings.
+    pub fn clear(&mut self) {
+        self.maps.clear();
+    }
+
+    /// Calls `f` with the part of each mapping inside `range`, its backend
+    /// and the file offset that part starts at.
+    pub fn for_each_in(
+        &self,
+        range: Range<usize>,
+        mut f: impl FnMut(Range<usize>, &FileBackend, u64),
+    ) {
+        let pos = self.maps.partition_point(|m| m.range.end <= range.start);
+        for m in self.maps[pos..]
+            .iter()
+            .take_while(|m| m.range.start < range.end)
+        {
+            let start = m.range.start.max(range.start);
+            let end = m.range.end.min(range.end);
+            f(
+                start..end,
+                &m.backend,
+                m.offset + (start - m.range.start) as u64,
+            );
+        }
+    }
+
+    fn find(&self, va: usize) -> Option<&FileMapping> {
+        let pos = self.maps.partition_point(|m| m.range.end <= va);
+        self.maps.get(pos).filter(|m| m.range.start <= va)
+    }
+}
+
+/// Handles a page fault of the process at `vaddr`.
+///
+/// Returns `false` if the fault cannot be resolved.
+pub fn handle_page_fault(
+    proc_data: &ProcessData,
+    vaddr: VirtAddr,
+    access_flags: MappingFlags,
+) -> bool {
+    let aspace = proc_data.aspace();
+    let mut aspace = aspace.lock();
+    let aspace_state = proc_data.aspace_state();
+    let file_maps = aspace_state.file_maps.lock();
+
+    let mapping = file_maps
+        .find(vaddr.as_usize())
+        .filter(|m| m.file_page(vaddr.as_usize()).is_some());
+    let major = mapping.is_some_and(|m| {
+        m.file_page(vaddr.as_usize())
+            .is_some_and(|page| !m.backend.is_page_cached(page))
+    });
+
+    if !aspace.handle_page_fault(vaddr, access_flags) {
+        return false;
+    }
+    if major {
+        proc_data.majflt.fetch_add(1, Ordering::Relaxed);
+    } else {
+        proc_data.minflt.fetch_add(1, Ordering::Relaxed);
+    }
+
+    // A write to a private mapping copies the page, which is not worth doing
+    // ahead of time.
+    if let Some(mapping) = mapping
+        && !access_flags.contains(MappingFlags::WRITE)
+    {
+        fault_around(&mut aspace, mapping, vaddr.as_usize());
+    }
+    true
+}
+
+/// Maps the cached pages of `mapping` in the fault-around window of `va`.
+fn fault_around(aspace: &mut AddrSpace, mapping: &FileMapping, va: usize) {
+    let window = fault_around_bytes();
+    if window <= PAGE_SIZE_4K {
+        return;
+    }
+    let Some(area) = aspace.find_area(va.into()) else {
+        return;
+    };
+    if !area.flags().contains(MappingFlags::READ) {
+        return;
+    }
+    // Pages mapped into a shared writable mapping are counted as dirty when
+    // it goes away, so only those actually touched are mapped.
+    if area.flags().contains(MappingFlags::WRITE) && matches!(area.backend(), Backend::File(_)) {
+        return;
+    }
+    let window_start = va.align_down(window);
+    let start = window_start
+        .max(mapping.range.start)
+        .max(area.start().as_usize());
+    let end = window_start
+        .saturating_add(window)
+        .min(mapping.range.end)
+        .min(area.end().as_usize());
+
+    // Populate runs of pages that are cached but not mapped yet.
+    let mut run = None;
+    for page in (start..end).step_by(PAGE_SIZE_4K).chain(iter::once(end)) {
+        let wanted = page < end
+            && aspace.page_table().query(page.into()).is_err()
+            && mapping
+                .file_page(page)
+                .is_some_and(|index| mapping.backend.is_page_cached(index));
+        match (run, wanted) {
+            (None, true) => run = Some(page),
+            (Some(run_start), false) => {
+                // Best effort; the fault itself has been handled.
+                let _ =
+                    aspace.populate_area(run_start.into(), page - run_start, MappingFlags::READ);
+                run = None;
+            }
+            _ => {}
+        }
+    }
+}
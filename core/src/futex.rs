@@ -1,108 +1,196 @@
 //! Futex implementation.
+//!
+//! Every [`FutexTable`] hashes keys into a fixed array of buckets, each with
+//! its own lock and wait queue, so unrelated futexes never contend and waiting
+//! does not allocate per futex. A waiter keeps its bookkeeping on its own
+//! stack; queue entries point back to it and are only followed with the
+//! bucket lock held, and the waiter dequeues itself before returning.
 
 use alloc::{
+    boxed::Box,
     collections::vec_deque::VecDeque,
     sync::{Arc, Weak},
     vec::Vec,
 };
 use core::{
-    future::poll_fn,
-    ops::Deref,
-    sync::atomic::AtomicBool,
+    future::{Future, poll_fn},
+    ptr,
+    sync::atomic::{AtomicPtr, AtomicU32, Ordering},
     task::{Poll, Waker},
     time::Duration,
 };
 
-use axerrno::AxResult;
+use axerrno::{AxError, AxResult};
 use axmm::{
     AddrSpace,
     backend::{Backend, SharedPages},
 };
-use axsync::Mutex;
 use axtask::{
     current,
     future::{self, block_on, interruptible},
 };
-use hashbrown::HashMap;
 use kspin::SpinNoIrq;
 use memory_addr::VirtAddr;
 
 use crate::task::AsThread;
 
-/// Wait queue used by futex.
+/// Number of hash buckets in a [`FutexTable`], as a power of two.
+const FUTEX_HASH_BITS: u32 = 6;
+
+/// How a waiter was released.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum WakeReason {
+    /// Woken by a plain wake.
+    Woken     = 1,
+    /// The owner of a robust futex died.
+    OwnerDead = 2,
+    /// Ownership of a PI futex was handed over to the waiter.
+    Acquired  = 3,
+}
+
+/// State of one blocked task, shared by all of its queue entries.
+struct WaitState {
+    /// `reason << 16 | (index + 1)` once woken, 0 before.
+    status: AtomicU32,
+}
+
+impl WaitState {
+    /// Marks the waiter as woken through entry `index`. Only the first wake
+    /// counts.
+    fn complete(&self, reason: WakeReason, index: usize) -> bool {
+        let status = (reason as u32) << 16 | (index as u32 + 1);
+        self.status
+            .compare_exchange(0, status, Ordering::AcqRel, Ordering::Acquire)
+            .is_ok()
+    }
+
+    fn result(&self) -> Option<(usize, WakeReason)> {
+        let status = self.status.load(Ordering::Acquire);
+        let reason = match status >> 16 {
+            1 => WakeReason::Woken,
+            2 => WakeReason::OwnerDead,
+            3 => WakeReason::Acquired,
+            _ => return None,
+        };
+        Some(((status & 0xffff) as usize - 1, reason))
+    }
+}
+
+struct Waiter {
+    key: usize,
+    bitset: u32,
+    tid: u32,
+    /// Which of the waiter's futexes this entry is for.
+    index: usize,
+    waker: Waker,
+    state: *const WaitState,
+    /// The queue this entry currently sits in; updated on requeue.
+    location: *const AtomicPtr<WaitQueue>,
+}
+
+// SAFETY: the pointers are only dereferenced with the owning queue locked,
+// and the waiter removes its entries before the pointees go away.
+unsafe impl Send for Waiter {}
+
+/// Wait queue of a futex hash bucket.
 #[derive(Default)]
+#[repr(align(64))]
 pub struct WaitQueue {
-    queue: SpinNoIrq<VecDeque<(Waker, u32)>>,
+    queue: SpinNoIrq<VecDeque<Waiter>>,
 }
+
 impl WaitQueue {
-    /// Creates a new `WaitQueue`.
-    pub fn new() -> Self {
-        Self::default()
+    /// Wakes up at most `count` waiters on `key` whose bitset intersects with
+    /// the given bitmask.
+    fn wake(&self, key: usize, count: usize, mask: u32, reason: WakeReason) -> usize {
+        let mut woke = 0;
+        self.queue.lock().retain(|waiter| {
+            if woke >= count || waiter.key != key || (waiter.bitset & mask) == 0 {
+                return true;
+            }
+            // SAFETY: see `Waiter`.
+            if unsafe { &*waiter.state }.complete(reason, waiter.index) {
+                waiter.waker.wake_by_ref();
+                woke += 1;
+            }
+            false
+        });
+        woke
     }
 
-    /// Waits if the given condition is met.
+    /// Hands the futex `key` over to its first waiter.
     ///
-    /// Returns `false` if the condition is not met and no actual waiting
-    /// occurs.
-    pub fn wait_if(
+    /// `handoff` is called with the bucket locked and gets the waiter's tid
+    /// and whether others remain, or `None` if nobody waits. The waiter is only
+    /// released if it returns `Ok(true)`.
+    fn wake_pi(
         &self,
-        bitset: u32,
-        timeout: Option<Duration>,
-        condition: impl FnOnce() -> bool,
+        key: usize,
+        handoff: impl FnOnce(Option<(u32, bool)>) -> AxResult<bool>,
     ) -> AxResult<bool> {
-        let mut condition = Some(condition);
-        block_on(interruptible(future::timeout(
-            timeout,
-            poll_fn(|cx| {
-                if let Some(cond) = condition.take() {
-                    let mut queue = self.queue.lock();
-                    if !cond() {
-                        Poll::Ready(Ok(false))
-                    } else {
-                        queue.push_back((cx.waker().clone(), bitset));
-                        Poll::Pending
-                    }
-                } else {
-                    Poll::Ready(Ok(true))
-                }
-            }),
-        )))??
+        let mut queue = self.queue.lock();
+        let mut matching = queue.iter().enumerate().filter(|(_, waiter)| {
+            // SAFETY: see `Waiter`.
+            waiter.key == key && unsafe { &*waiter.state }.result().is_none()
+        });
+        let Some((index, first)) = matching.next() else {
+            handoff(None)?;
+            return Ok(false);
+        };
+        let tid = first.tid;
+        let more = matching.next().is_some();
+        if !handoff(Some((tid, more)))? {
+            return Ok(false);
+        }
+        let waiter = queue.remove(index).unwrap();
+        // SAFETY: see `Waiter`.
+        unsafe { &*waiter.state }.complete(WakeReason::Acquired, waiter.index);
+        waiter.waker.wake_by_ref();
+        Ok(true)
     }
 
-    /// Wakes up at most `count` tasks whose bitset intersects with the given
-    /// bitmask.
-    pub fn wake(&self, count: usize, mask: u32) -> usize {
-        let mut woke = 0;
-        self.queue.lock().retain(|(waker, bitset)| {
-            if woke >= count || (bitset & mask) == 0 {
-                true
-            } else {
-                waker.wake_by_ref();
-                woke += 1;
-                false
+    /// Requeues at most `count` waiters on `key` to `key2` in `target`.
+    fn requeue(&self, key: usize, count: usize, target: &WaitQueue, key2: usize) -> usize {
+        let mut moved = 0;
+        if ptr::eq(self, target) {
+            for waiter in self.queue.lock().iter_mut() {
+                if moved < count && waiter.key == key {
+                    waiter.key = key2;
+                    moved += 1;
+                }
             }
-        });
-        woke
+            return moved;
+        }
+
+        // Lock in address order to avoid deadlocking with a requeue the other
+        // way round.
+        let (mut src, mut dst) = if (self as *const Self) < (target as *const Self) {
+            let src = self.queue.lock();
+            (src, target.queue.lock())
+        } else {
+            let dst = target.queue.lock();
+            (self.queue.lock(), dst)
+        };
+        let mut i = 0;
+        while i < src.len() && moved < count {
+            if src[i].key != key {
+                i += 1;
+                continue;
+            }
+            let mut waiter = src.remove(i).unwrap();
+            waiter.key = key2;
+            // SAFETY: see `Waiter`.
+            unsafe { &*waiter.location }.store(target as *const _ as *mut _, Ordering::Release);
+            dst.push_back(waiter);
+            moved += 1;
+        }
+        moved
     }
 
     /// Checks if the wait queue is empty.
     pub fn is_empty(&self) -> bool {
         self.queue.lock().is_empty()
     }
-
-    /// Requeue at most `count` tasks to the target wait queue.
-    pub fn requeue(&self, mut count: usize, target: &WaitQueue) -> usize {
-        let tasks: Vec<_> = {
-            let mut wq = self.queue.lock();
-            count = count.min(wq.len());
-            wq.drain(..count).collect()
-        };
-        if !tasks.is_empty() {
-            let mut wq = target.queue.lock();
-            wq.extend(tasks);
-        }
-        count
-    }
 }
 
 /// A key that uniquely identifies a futex in the system.
@@ -147,7 +235,7 @@ impl FutexKey {
 
     /// Shortcut to create a `FutexKey` for the current task's address space.
     pub fn new_current(address: usize) -> Self {
-        Self::new(&current().as_thread().proc_data.aspace.lock(), address)
+        Self::new(&current().as_thread().proc_data.aspace().lock(), address)
     }
 
     fn as_usize(&self) -> usize {
@@ -158,85 +246,188 @@ impl FutexKey {
     }
 }
 
-/// The futex entry structure
-pub struct FutexEntry {
-    /// The wait queue associated with this futex.
-    pub wq: WaitQueue,
-
-    /// Used by robust list, indicates if the owner of this futex is dead.
-    pub owner_dead: AtomicBool,
-}
-
-impl FutexEntry {
-    fn new() -> Self {
-        Self {
-            wq: WaitQueue::new(),
-            owner_dead: AtomicBool::new(false),
-        }
-    }
+/// A table mapping futex keys to wait queues.
+pub struct FutexTable {
+    buckets: Box<[WaitQueue]>,
 }
 
-/// A table mapping memory addresses to futex wait queues.
-pub struct FutexTable(Mutex<HashMap<usize, Arc<FutexEntry>>>);
-
 impl FutexTable {
     /// Creates a new `FutexTable`.
     #[allow(clippy::new_without_default)]
     pub fn new() -> Self {
-        Self(Mutex::new(HashMap::new()))
+        Self {
+            buckets: (0..1 << FUTEX_HASH_BITS)
+                .map(|_| WaitQueue::default())
+                .collect(),
+        }
     }
 
-    /// Checks if the futex table is empty.
+    fn bucket(&self, key: usize) -> &WaitQueue {
+        let hash = (key as u64).wrapping_mul(0x9e37_79b9_7f4a_7c15) >> (64 - FUTEX_HASH_BITS);
+        &self.buckets[hash as usize]
+    }
+
+    /// Checks if no task waits on this table.
     pub fn is_empty(&self) -> bool {
-        self.0.lock().is_empty()
+        self.buckets.iter().all(WaitQueue::is_empty)
+    }
+
+    /// Waits on `key` if the given condition is met.
+    ///
+    /// `condition` is evaluated with the bucket locked, so a waker that
+    /// changes the futex word first cannot be missed. Returns `WouldBlock` if
+    /// the condition is not met.
+    pub fn wait_if(
+        &self,
+        key: &FutexKey,
+        bitset: u32,
+        timeout: Option<Duration>,
+        condition: impl FnOnce() -> bool,
+    ) -> AxResult<WakeReason> {
+        let mut condition = Some(condition);
+        let location = [AtomicPtr::new(ptr::null_mut())];
+        wait_in(
+            &[(self, key.as_usize(), bitset)],
+            &location,
+            timeout,
+            |_| condition.take().is_some_and(|cond| cond()),
+        )
+        .map(|(_, reason)| reason)
     }
 
-    /// Gets the wait queue associated with the given address.
-    pub fn get(&self, key: &FutexKey) -> Option<FutexGuard> {
+    /// Wakes up at most `count` waiters on `key` whose bitset intersects with
+    /// the given bitmask.
+    pub fn wake(&self, key: &FutexKey, count: usize, mask: u32) -> usize {
         let key = key.as_usize();
-        let entry = self.0.lock().get(&key).cloned()?;
-        Some(FutexGuard {
-            table: self,
-            key,
-            inner: entry,
-        })
+        self.bucket(key).wake(key, count, mask, WakeReason::Woken)
     }
 
-    /// Gets the wait queue associated with the given address, or inserts a a
-    /// new one if it doesn't exist.
-    pub fn get_or_insert(&self, key: &FutexKey) -> FutexGuard {
+    /// Wakes up one waiter on `key` to tell it that the futex owner died.
+    pub fn wake_owner_dead(&self, key: &FutexKey) -> usize {
         let key = key.as_usize();
-        let mut table = self.0.lock();
-        let entry = table
-            .entry(key)
-            .or_insert_with(|| Arc::new(FutexEntry::new()));
-        FutexGuard {
-            table: self,
-            key,
-            inner: entry.clone(),
-        }
+        self.bucket(key)
+            .wake(key, 1, u32::MAX, WakeReason::OwnerDead)
     }
-}
 
-#[doc(hidden)]
-pub struct FutexGuard<'a> {
-    table: &'a FutexTable,
-    key: usize,
-    inner: Arc<FutexEntry>,
+    /// Hands a PI futex over to its first waiter, see [`WaitQueue::wake_pi`].
+    pub fn wake_pi(
+        &self,
+        key: &FutexKey,
+        handoff: impl FnOnce(Option<(u32, bool)>) -> AxResult<bool>,
+    ) -> AxResult<bool> {
+        let key = key.as_usize();
+        self.bucket(key).wake_pi(key, handoff)
+    }
+
+    /// Requeues at most `count` waiters on `key` to `key2` in `target`.
+    pub fn requeue(
+        &self,
+        key: &FutexKey,
+        count: usize,
+        target: &FutexTable,
+        key2: &FutexKey,
+    ) -> usize {
+        let (key, key2) = (key.as_usize(), key2.as_usize());
+        self.bucket(key)
+            .requeue(key, count, target.bucket(key2), key2)
+    }
 }
 
-impl Deref for FutexGuard<'_> {
-    type Target = Arc<FutexEntry>;
+/// Waits on several futexes at once, as `futex_waitv` does.
+///
+/// `condition(i)` is evaluated with the bucket of `targets[i]` locked before
+/// queueing on it; if it fails, nothing is waited on and `WouldBlock` is
+/// returned. On success, returns the index of the futex that was woken.
+pub fn wait_multiple(
+    targets: &[(Arc<FutexTable>, FutexKey)],
+    timeout: Option<Duration>,
+    condition: impl FnMut(usize) -> bool,
+) -> AxResult<usize> {
+    let targets = targets
+        .iter()
+        .map(|(table, key)| (table.as_ref(), key.as_usize(), u32::MAX))
+        .collect::<Vec<_>>();
+    let locations = targets
+        .iter()
+        .map(|_| AtomicPtr::new(ptr::null_mut()))
+        .collect::<Vec<_>>();
+    wait_in(&targets, &locations, timeout, condition).map(|(index, _)| index)
+}
 
-    fn deref(&self) -> &Self::Target {
-        &self.inner
-    }
+fn block_with_timeout(timeout: Option<Duration>, fut: impl Future<Output = ()>) -> AxResult<()> {
+    block_on(interruptible(future::timeout(timeout, fut)))??;
+    Ok(())
 }
 
-impl Drop for FutexGuard<'_> {
-    fn drop(&mut self) {
-        if Arc::strong_count(&self.inner) <= 2 && self.inner.wq.is_empty() {
-            self.table.0.lock().remove(&self.key);
+fn wait_in(
+    targets: &[(&FutexTable, usize, u32)],
+    locations: &[AtomicPtr<WaitQueue>],
+    timeout: Option<Duration>,
+    mut condition: impl FnMut(usize) -> bool,
+) -> AxResult<(usize, WakeReason)> {
+    let state = WaitState {
+        status: AtomicU32::new(0),
+    };
+    let tid = current().id().as_u64() as u32;
+    let mut queued = 0;
+    let mut first = true;
+    let mut not_met = false;
+
+    let waited = block_with_timeout(
+        timeout,
+        poll_fn(|cx| {
+            if first {
+                first = false;
+                for (index, &(table, key, bitset)) in targets.iter().enumerate() {
+                    let bucket = table.bucket(key);
+                    let mut queue = bucket.queue.lock();
+                    if !condition(index) {
+                        not_met = true;
+                        return Poll::Ready(());
+                    }
+                    locations[index].store(bucket as *const _ as *mut _, Ordering::Relaxed);
+                    queue.push_back(Waiter {
+                        key,
+                        bitset,
+                        tid,
+                        index,
+                        waker: cx.waker().clone(),
+                        state: &state,
+                        location: &locations[index],
+                    });
+                    queued += 1;
+                }
+            }
+            if state.result().is_some() {
+                Poll::Ready(())
+            } else {
+                Poll::Pending
+            }
+        }),
+    );
+
+    // Entries may have been requeued meanwhile, so chase `location` until it
+    // is stable under the lock it names.
+    for location in &locations[..queued] {
+        loop {
+            let bucket = location.load(Ordering::Acquire);
+            // SAFETY: queues outlive the entries queued on them.
+            let mut queue = unsafe { &*bucket }.queue.lock();
+            if ptr::eq(location.load(Ordering::Acquire), bucket) {
+                queue.retain(|waiter| !ptr::eq(waiter.state, &state));
+                break;
+            }
         }
     }
+
+    // A wake that raced with a timeout or signal still wins, so that a PI
+    // handoff is never lost.
+    if let Some(result) = state.result() {
+        return Ok(result);
+    }
+    if not_met {
+        return Err(AxError::WouldBlock);
+    }
+    waited?;
+    Err(AxError::Interrupted)
 }
@@ -11,10 +11,14 @@ extern crate alloc;
 extern crate axlog;
 
 pub mod config;
+pub mod fault;
 pub mod futex;
 pub mod mm;
+pub mod pool;
 pub mod resources;
 pub mod shm;
 pub mod task;
+pub mod thp;
 pub mod time;
+pub mod vdso;
 pub mod vfs;
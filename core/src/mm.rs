@@ -1,12 +1,12 @@
 //! User address space management.
 
-use alloc::{borrow::ToOwned, string::String, vec, vec::Vec};
+use alloc::{borrow::ToOwned, string::String, sync::Arc, vec, vec::Vec};
 use core::{
     ffi::CStr,
     hint::unlikely,
     iter,
     mem::MaybeUninit,
-    sync::atomic::{AtomicBool, Ordering},
+    sync::atomic::{AtomicBool, AtomicU64, Ordering},
 };
 
 use axerrno::{AxError, AxResult};
@@ -24,10 +24,14 @@ use kernel_elf_parser::{AuxEntry, ELFHeaders, ELFHeadersBuilder, ELFParser, app_
 use kernel_guard::IrqSave;
 use memory_addr::{MemoryAddr, PAGE_SIZE_4K, VirtAddr};
 use ouroboros::self_referencing;
+use spin::RwLock;
 use starry_vm::{VmError, VmIo, VmResult};
 use uluru::LRUCache;
 
-use crate::config::{USER_SPACE_BASE, USER_SPACE_SIZE};
+use crate::{
+    config::{USER_SPACE_BASE, USER_SPACE_SIZE},
+    fault::FileMaps,
+};
 
 /// Creates a new empty user address space.
 pub fn new_user_aspace_empty() -> AxResult<AddrSpace> {
@@ -77,18 +81,31 @@ fn mapping_flags(flags: xmas_elf::program::Flags) -> MappingFlags {
     mapping_flags
 }
 
-/// Map the elf file to the user address space.
+/// A segment of an executable image, ready to be mapped.
+struct ImageSegment {
+    start: VirtAddr,
+    size: usize,
+    flags: MappingFlags,
+    backend: Backend,
+    file: FileBackend,
+    /// File offset mapped at `start`.
+    file_offset: u64,
+    /// End of the segment's file data; the rest is zero-filled.
+    file_end: u64,
+}
+
+/// Collect the loadable segments of an elf file.
 ///
 /// # Arguments
-/// - `uspace`: The address space of the user app.
-/// - `elf`: The elf file.
+/// - `base`: The load base of the elf file.
+/// - `entry`: The elf file.
 ///
 /// # Returns
-/// - The entry point of the user app.
-fn map_elf<'a>(
-    uspace: &mut AddrSpace,
+/// - The parser, for the entry point and the aux vector.
+fn elf_segments<'a>(
     base: usize,
     entry: &'a ElfCacheEntry,
+    segments: &mut Vec<ImageSegment>,
 ) -> AxResult<ELFParser<'a>> {
     let elf_parser = ELFParser::new(entry.borrow_elf(), base).map_err(|_| AxError::InvalidData)?;
     let cache = entry.borrow_cache();
@@ -101,7 +118,7 @@ fn map_elf<'a>(
     {
         let vaddr = ph.virtual_addr as usize + elf_parser.base();
         debug!(
-            "Mapping ELF segment: [{:#x?}, {:#x?}) flags: {}",
+            "ELF segment: [{:#x?}, {:#x?}) flags: {}",
             vaddr,
             vaddr + ph.mem_size as usize,
             ph.flags
@@ -122,15 +139,15 @@ fn map_elf<'a>(
             ph.offset,
             Some(ph.offset + ph.file_size),
         );
-        uspace.map(
-            seg_start.align_down_4k(),
-            seg_align_size,
-            mapping_flags(ph.flags),
-            false,
+        segments.push(ImageSegment {
+            start: seg_start.align_down_4k(),
+            size: seg_align_size,
+            flags: mapping_flags(ph.flags),
             backend,
-        )?;
-
-        // TDOO: flush the I-cache
+            file: FileBackend::Cached(cache.clone()),
+            file_offset: ph.offset - seg_pad as u64,
+            file_end: ph.offset + ph.file_size,
+        });
     }
 
     Ok(elf_parser)
@@ -175,6 +192,102 @@ impl ElfCacheEntry {
     }
 }
 
+/// An executable together with its dynamic linker, parsed and laid out once
+/// and then mapped into every process that runs it.
+///
+/// The segments are copy-on-write views of the page cache, so text pages are
+/// shared read-only by all processes mapping the image.
+struct ExecImage {
+    exe: Location,
+    segments: Vec<ImageSegment>,
+    entry: VirtAddr,
+    auxv: Vec<AuxEntry>,
+    last_used: AtomicU64,
+}
+
+impl ExecImage {
+    fn map(&self, uspace: &mut AddrSpace, file_maps: &mut FileMaps) -> AxResult {
+        for seg in &self.segments {
+            uspace.map(seg.start, seg.size, seg.flags, false, seg.backend.clone())?;
+            // TDOO: flush the I-cache
+            file_maps.insert(
+                seg.start.as_usize()..seg.start.as_usize() + seg.size,
+                seg.file.clone(),
+                seg.file_offset,
+                Some(seg.file_end),
+            );
+        }
+        Ok(())
+    }
+}
+
+/// Maximum number of cached executable images.
+const EXEC_CACHE_SIZE: usize = 32;
+
+/// Executable images by path identity, looked up without serializing execs.
+static EXEC_CACHE: RwLock<Vec<Arc<ExecImage>>> = RwLock::new(Vec::new());
+static EXEC_CACHE_CLOCK: AtomicU64 = AtomicU64::new(0);
+static EXEC_CACHE_HITS: AtomicU64 = AtomicU64::new(0);
+static EXEC_CACHE_MISSES: AtomicU64 = AtomicU64::new(0);
+
+/// Statistics of the executable image cache.
+#[derive(Debug, Clone, Copy)]
+pub struct ExecCacheStats {
+    /// Number of `execve`s served from the cache.
+    pub hits: u64,
+    /// Number of `execve`s that had to parse the executable.
+    pub misses: u64,
+    /// Number of cached images.
+    pub entries: usize,
+}
+
+/// Returns the statistics of the executable image cache.
+pub fn exec_cache_stats() -> ExecCacheStats {
+    ExecCacheStats {
+        hits: EXEC_CACHE_HITS.load(Ordering::Relaxed),
+        misses: EXEC_CACHE_MISSES.load(Ordering::Relaxed),
+        entries: EXEC_CACHE.read().len(),
+    }
+}
+
+fn exec_cache_lookup(loc: &Location) -> Option<Arc<ExecImage>> {
+    let image = EXEC_CACHE
+        .read()
+        .iter()
+        .find(|image| image.exe.ptr_eq(loc))
+        .cloned()?;
+    image.last_used.store(
+        EXEC_CACHE_CLOCK.fetch_add(1, Ordering::Relaxed),
+        Ordering::Relaxed,
+    );
+    Some(image)
+}
+
+fn exec_cache_insert(image: ExecImage) -> Arc<ExecImage> {
+    let mut cache = EXEC_CACHE.write();
+    // Another exec of the same binary may have won the race.
+    if let Some(existing) = cache.iter().find(|it| it.exe.ptr_eq(&image.exe)) {
+        return existing.clone();
+    }
+    if cache.len() >= EXEC_CACHE_SIZE
+        && let Some((lru, _)) = cache
+            .iter()
+            .enumerate()
+            .min_by_key(|(_, it)| it.last_used.load(Ordering::Relaxed))
+    {
+        cache.swap_remove(lru);
+    }
+    image.last_used.store(
+        EXEC_CACHE_CLOCK.fetch_add(1, Ordering::Relaxed),
+        Ordering::Relaxed,
+    );
+    let image = Arc::new(image);
+    cache.push(image.clone());
+    image
+}
+
+/// Parsed ELF headers, used to build [`ExecImage`]s. Dynamic linkers stay
+/// here while the executables using them come and go.
 struct ElfLoader(LRUCache<ElfCacheEntry, 32>);
 
 type LoadResult = Result<(VirtAddr, Vec<AuxEntry>), Vec<u8>>;
@@ -184,9 +297,8 @@ impl ElfLoader {
         Self(LRUCache::new())
     }
 
-    fn load(&mut self, uspace: &mut AddrSpace, path: &str) -> AxResult<LoadResult> {
-        let loc = FS_CONTEXT.lock().resolve(path)?;
-
+    fn build(&mut self, loc: Location) -> AxResult<Result<ExecImage, Vec<u8>>> {
+        let exe = loc.clone();
         if !self.0.touch(|e| e.borrow_cache().location().ptr_eq(&loc)) {
             match ElfCacheEntry::load(loc)? {
                 Ok(e) => {
@@ -198,9 +310,6 @@ impl ElfLoader {
             }
         }
 
-        uspace.clear();
-        map_trampoline(uspace)?;
-
         let entry = self.0.front().unwrap();
         let ldso = if let Some(header) = entry
             .borrow_elf()
@@ -238,9 +347,10 @@ impl ElfLoader {
             (entry, None)
         };
 
-        let elf = map_elf(uspace, crate::config::USER_SPACE_BASE, elf)?;
+        let mut segments = Vec::new();
+        let elf = elf_segments(crate::config::USER_SPACE_BASE, elf, &mut segments)?;
         let ldso = ldso
-            .map(|elf| map_elf(uspace, crate::config::USER_INTERP_BASE, elf))
+            .map(|elf| elf_segments(crate::config::USER_INTERP_BASE, elf, &mut segments))
             .transpose()?;
 
         let entry = VirtAddr::from_usize(
@@ -251,16 +361,51 @@ impl ElfLoader {
             .aux_vector(PAGE_SIZE_4K, ldso.map(|elf| elf.base()))
             .collect::<Vec<_>>();
 
-        Ok(Ok((entry, auxv)))
+        Ok(Ok(ExecImage {
+            exe,
+            segments,
+            entry,
+            auxv,
+            last_used: AtomicU64::new(0),
+        }))
     }
 }
 
 static ELF_LOADER: Mutex<ElfLoader> = Mutex::new(ElfLoader::new());
 
+/// Map the executable at `path` (and its dynamic linker) into `uspace`.
+///
+/// Returns the file contents instead if it is not an ELF file.
+fn load_elf(uspace: &mut AddrSpace, file_maps: &mut FileMaps, path: &str) -> AxResult<LoadResult> {
+    let loc = FS_CONTEXT.lock().resolve(path)?;
+
+    let image = if let Some(image) = exec_cache_lookup(&loc) {
+        EXEC_CACHE_HITS.fetch_add(1, Ordering::Relaxed);
+        image
+    } else {
+        EXEC_CACHE_MISSES.fetch_add(1, Ordering::Relaxed);
+        let image = { ELF_LOADER.lock().build(loc)? };
+        match image {
+            Ok(image) => exec_cache_insert(image),
+            Err(data) => return Ok(Err(data)),
+        }
+    };
+
+    uspace.clear();
+    file_maps.clear();
+    map_trampoline(uspace)?;
+    let mut auxv = image.auxv.clone();
+    crate::vdso::map(uspace, &mut auxv)?;
+    image.map(uspace, file_maps)?;
+
+    Ok(Ok((image.entry, auxv)))
+}
+
 /// Clear the ELF cache.
 ///
 /// Useful for removing noises during memory leak detect.
 pub fn clear_elf_cache() {
+    EXEC_CACHE.write().clear();
     ELF_LOADER.lock().0.clear();
 }
 
@@ -268,6 +413,7 @@ pub fn clear_elf_cache() {
 ///
 /// # Arguments
 /// - `uspace`: The address space of the user app.
+/// - `file_maps`: The file-backed ranges of `uspace`, updated to the new image.
 /// - `args`: The arguments of the user app. The first argument is the path of
 ///   the user app.
 /// - `envs`: The environment variables of the user app.
@@ -277,6 +423,7 @@ pub fn clear_elf_cache() {
 /// - The stack pointer of the user app.
 pub fn load_user_app(
     uspace: &mut AddrSpace,
+    file_maps: &mut FileMaps,
     path: Option<&str>,
     args: &[String],
     envs: &[String],
@@ -290,10 +437,10 @@ pub fn load_user_app(
         let new_args: Vec<String> = iter::once("/bin/sh".to_owned())
             .chain(args.iter().cloned())
             .collect();
-        return load_user_app(uspace, None, &new_args, envs);
+        return load_user_app(uspace, file_maps, None, &new_args, envs);
     }
 
-    let (entry, auxv) = match { ELF_LOADER.lock().load(uspace, path)? } {
+    let (entry, auxv) = match load_elf(uspace, file_maps, path)? {
         Ok((entry, auxv)) => (entry, auxv),
         Err(data) => {
             if data.starts_with(b"#!") {
@@ -308,7 +455,7 @@ pub fn load_user_app(
                     .chain(iter::once(path.to_owned()))
                     .chain(args.iter().skip(1).cloned())
                     .collect();
-                return load_user_app(uspace, None, &new_args, envs);
+                return load_user_app(uspace, file_maps, None, &new_args, envs);
             }
             return Err(AxError::InvalidExecutable);
         }
@@ -0,0 +1,155 @@
+//! Per-CPU object pools.
+//!
+//! An [`ObjectPool`] keeps freed objects of one kind for reuse, so hot paths
+//! that allocate and free the same object over and over do not go to the
+//! global allocator each time. Every CPU owns a small stack of objects (a
+//! "magazine") that only it touches; full and empty magazines are traded with
+//! a shared depot, which is the only place CPUs meet, and only once per
+//! magazine worth of objects.
+
+use alloc::vec::Vec;
+use core::mem;
+
+use axconfig::plat::CPU_NUM;
+use axhal::percpu::this_cpu_id;
+use kspin::SpinNoIrq;
+
+struct CpuCache<T> {
+    magazine: Vec<T>,
+    hits: u64,
+    misses: u64,
+    frees: u64,
+    drops: u64,
+}
+
+#[repr(align(64))]
+struct CpuSlot<T>(SpinNoIrq<CpuCache<T>>);
+
+/// Counters of an [`ObjectPool`].
+#[derive(Debug, Clone, Copy, Default)]
+pub struct PoolStats {
+    /// Number of objects handed out from the pool.
+    pub hits: u64,
+    /// Number of requests the pool could not serve.
+    pub misses: u64,
+    /// Number of objects taken back into the pool.
+    pub frees: u64,
+    /// Number of objects freed because the pool was full.
+    pub drops: u64,
+    /// Number of objects currently cached.
+    pub cached: usize,
+}
+
+/// A pool of reusable objects with per-CPU caches.
+pub struct ObjectPool<T> {
+    cpus: [CpuSlot<T>; CPU_NUM],
+    /// Full magazines.
+    depot: SpinNoIrq<Vec<Vec<T>>>,
+    /// Number of objects in a magazine.
+    magazine_size: usize,
+    /// Maximum number of full magazines in the depot.
+    depot_size: usize,
+}
+
+impl<T> ObjectPool<T> {
+    /// Creates a pool of magazines holding `magazine_size` objects each,
+    /// keeping up to `depot_size` full magazines besides those of the CPUs.
+    pub const fn new(magazine_size: usize, depot_size: usize) -> Self {
+        Self {
+            cpus: [const {
+                CpuSlot(SpinNoIrq::new(CpuCache {
+                    magazine: Vec::new(),
+                    hits: 0,
+                    misses: 0,
+                    frees: 0,
+                    drops: 0,
+                }))
+            }; CPU_NUM],
+            depot: SpinNoIrq::new(Vec::new()),
+            magazine_size,
+            depot_size,
+        }
+    }
+
+    fn slot(&self) -> &SpinNoIrq<CpuCache<T>> {
+        &self.cpus[this_cpu_id() % CPU_NUM].0
+    }
+
+    /// Takes an object from the pool, if there is one.
+    pub fn get(&self) -> Option<T> {
+        // The lock disables interrupts, so the task stays on this CPU while it
+        // holds the slot.
+        let mut cache = self.slot().lock();
+        if cache.magazine.is_empty()
+            && let Some(full) = self.depot.lock().pop()
+        {
+            // The empty magazine goes away; a new one is allocated when
+            // objects come back.
+            cache.magazine = full;
+        }
+        match cache.magazine.pop() {
+            Some(obj) => {
+                cache.hits += 1;
+                Some(obj)
+            }
+            None => {
+                cache.misses += 1;
+                None
+            }
+        }
+    }
+
+    /// Takes an object from the pool, or makes a new one with `f`.
+    pub fn get_or_else(&self, f: impl FnOnce() -> T) -> T {
+        self.get().unwrap_or_else(f)
+    }
+
+    /// Returns an object to the pool.
+    ///
+    /// The caller must have reset it to a reusable state.
+    pub fn put(&self, obj: T) {
+        let mut cache = self.slot().lock();
+        if cache.magazine.len() >= self.magazine_size {
+            let mut depot = self.depot.lock();
+            if depot.len() >= self.depot_size {
+                drop(depot);
+                cache.drops += 1;
+                drop(cache);
+                // Free outside the locks.
+                drop(obj);
+                return;
+            }
+            let full = mem::replace(&mut cache.magazine, Vec::with_capacity(self.magazine_size));
+            depot.push(full);
+        }
+        cache.magazine.push(obj);
+        cache.frees += 1;
+    }
+
+    /// Frees every cached object.
+    pub fn shrink(&self) {
+        let depot = mem::take(&mut *self.depot.lock());
+        drop(depot);
+        for cpu in &self.cpus {
+            let magazine = mem::take(&mut cpu.0.lock().magazine);
+            drop(magazine);
+        }
+    }
+
+    /// Returns the counters of the pool.
+    pub fn stats(&self) -> PoolStats {
+        let mut stats = PoolStats {
+            cached: self.depot.lock().iter().map(Vec::len).sum(),
+            ..Default::default()
+        };
+        for cpu in &self.cpus {
+            let cache = cpu.0.lock();
+            stats.hits += cache.hits;
+            stats.misses += cache.misses;
+            stats.frees += cache.frees;
+            stats.drops += cache.drops;
+            stats.cached += cache.magazine.len();
+        }
+        stats
+    }
+}
@@ -3,16 +3,22 @@
 use alloc::{collections::btree_map::BTreeMap, sync::Arc, vec::Vec};
 
 use axerrno::{AxError, AxResult};
-use axhal::{paging::MappingFlags, time::monotonic_time_nanos};
+use axhal::{
+    paging::{MappingFlags, PageSize},
+    time::monotonic_time_nanos,
+};
 use axmm::backend::SharedPages;
 use axsync::Mutex;
 use linux_raw_sys::{
     ctypes::{c_long, c_ushort},
     general::*,
 };
-use memory_addr::{PAGE_SIZE_4K, VirtAddr, VirtAddrRange};
+use memory_addr::{MemoryAddr, PAGE_SIZE_4K, VirtAddr, VirtAddrRange};
 use starry_process::Pid;
 
+/// Set in `shm_perm.mode` of segments locked with `SHM_LOCK`
+const SHM_LOCKED: __kernel_mode_t = 0o2000;
+
 /// Data structure used to pass permission information to IPC operations.
 #[repr(C)]
 #[derive(Clone, Copy)]
@@ -81,9 +87,16 @@ impl ShmidDs {
 pub struct ShmInner {
     /// Shared memory segment identifier.
     pub shmid: i32,
-    /// Number of pages in the shared memory segment.
+    /// Number of 4K pages in the shared memory segment, rounded up to a
+    /// multiple of [`Self::page_size`].
     pub page_num: usize,
+    /// Size of the pages backing the segment; not 4K for `SHM_HUGETLB`.
+    pub page_size: PageSize,
+    /// Whether the segment was locked with `SHM_LOCK`.
+    pub locked: bool,
     va_range: BTreeMap<Pid, VirtAddrRange>,
+    /// Attaches that have reserved the segment but are still mapping it.
+    attaching: usize,
     /// physical pages
     pub phys_pages: Option<Arc<SharedPages>>,
     /// whether remove on last detach, see shm_ctl
@@ -96,11 +109,21 @@ pub struct ShmInner {
 
 impl ShmInner {
     /// Creates a new [`ShmInner`].
-    pub fn new(key: i32, shmid: i32, size: usize, mapping_flags: MappingFlags, pid: Pid) -> Self {
+    pub fn new(
+        key: i32,
+        shmid: i32,
+        size: usize,
+        page_size: PageSize,
+        mapping_flags: MappingFlags,
+        pid: Pid,
+    ) -> Self {
         ShmInner {
             shmid,
-            page_num: memory_addr::align_up_4k(size) / PAGE_SIZE_4K,
+            page_num: size.align_up(page_size) / PAGE_SIZE_4K,
+            page_size,
+            locked: false,
             va_range: BTreeMap::new(),
+            attaching: 0,
             phys_pages: None,
             rmid: false,
             mapping_flags,
@@ -130,6 +153,15 @@ impl ShmInner {
         Ok(self.shmid as isize)
     }
 
+    /// Returns the [`ShmidDs`] reported by `IPC_STAT`.
+    pub fn stat(&self) -> ShmidDs {
+        let mut shmid_ds = self.shmid_ds;
+        if self.locked {
+            shmid_ds.shm_perm.mode |= SHM_LOCKED;
+        }
+        shmid_ds
+    }
+
     /// Maps the given physical shared pages to this shared memory segment.
     pub fn map_to_phys(&mut self, phys_pages: Arc<SharedPages>) {
         self.phys_pages = Some(phys_pages);
@@ -141,6 +173,22 @@ impl ShmInner {
         self.va_range.len()
     }
 
+    /// Returns whether the segment was marked with `IPC_RMID` and nobody is
+    /// attached to it or in the middle of attaching it.
+    pub fn removable(&self) -> bool {
+        self.rmid && self.va_range.is_empty() && self.attaching == 0
+    }
+
+    /// Keeps the segment alive while sys_shmat maps it without the lock held.
+    pub fn begin_attach(&mut self) {
+        self.attaching += 1;
+    }
+
+    /// Drops the reservation taken by [`Self::begin_attach`].
+    pub fn end_attach(&mut self) {
+        self.attaching -= 1;
+    }
+
     /// Returns the virtual address range associated with the given Pid.
     pub fn get_addr_range(&self, pid: Pid) -> Option<VirtAddrRange> {
         self.va_range.get(&pid).cloned()
@@ -357,7 +405,7 @@ impl ShmManager {
                 if let Some(shm_inner) = self.get_inner_by_shmid(shmid) {
                     let mut shm_inner = shm_inner.lock();
                     shm_inner.detach_process(pid);
-                    if shm_inner.rmid && shm_inner.attach_count() == 0 {
+                    if shm_inner.removable() {
                         self.remove_shmid(shmid);
                     }
                 }
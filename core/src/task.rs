@@ -1,6 +1,8 @@
 //! User task management.
 
+mod sched;
 mod stat;
+mod table;
 
 use alloc::{
     boxed::Box,
@@ -9,9 +11,11 @@ use alloc::{
     vec::Vec,
 };
 use core::{
+    any::Any,
     cell::RefCell,
+    mem,
     ops::Deref,
-    sync::atomic::{AtomicBool, AtomicI32, AtomicU32, AtomicUsize, Ordering},
+    sync::atomic::{AtomicBool, AtomicI32, AtomicU32, AtomicU64, AtomicUsize, Ordering},
 };
 
 use axerrno::{AxError, AxResult};
@@ -23,18 +27,23 @@ use extern_trait::extern_trait;
 use hashbrown::HashMap;
 use lazy_static::lazy_static;
 use scope_local::{ActiveScope, Scope};
-use spin::RwLock;
+use spin::{RwLock, RwLockReadGuard};
 use starry_process::{Pid, Process, ProcessGroup, Session};
 use starry_signal::{
     SignalInfo, Signo,
     api::{ProcessSignalManager, SignalActions, ThreadSignalManager},
 };
-use weak_map::WeakMap;
 
-pub use self::stat::TaskStat;
+pub use self::{
+    sched::{CpuSchedStats, NICE_MAX, NICE_MIN, SchedPolicy, SchedState, cpu_sched_stats},
+    stat::TaskStat,
+    table::{PidEntry, PidTable, PidTableIter},
+};
 use crate::{
+    fault::FileMaps,
     futex::{FutexKey, FutexTable},
     resources::Rlimits,
+    thp::ThpState,
     time::{TimeManager, TimerState},
 };
 
@@ -54,6 +63,9 @@ impl<T> Deref for AssumeSync<T> {
 
 /// The inner data of a thread.
 pub struct Thread {
+    /// The thread ID.
+    tid: Pid,
+
     /// The process data shared by all threads in the process.
     pub proc_data: Arc<ProcessData>,
 
@@ -80,6 +92,13 @@ pub struct Thread {
     /// The OOM score adjustment value.
     oom_score_adj: AtomicI32,
 
+    /// Scheduling policy, nice value and CPU bookkeeping.
+    pub sched: SchedState,
+
+    /// The wakers of the last blocking `poll` or `select`, kept for the next
+    /// one so that files polled again see the same wakers.
+    pub poll_wake: SpinNoIrq<Option<Arc<dyn Any + Send + Sync>>>,
+
     /// Ready to exit
     exit: AtomicBool,
 }
@@ -88,12 +107,15 @@ impl Thread {
     /// Create a new [`Thread`].
     pub fn new(tid: u32, proc_data: Arc<ProcessData>) -> Box<Self> {
         Box::new(Thread {
+            tid,
             signal: ThreadSignalManager::new(tid, proc_data.signal.clone()),
             proc_data,
             clear_child_tid: AtomicUsize::new(0),
             robust_list_head: AtomicUsize::new(0),
             time: AssumeSync(RefCell::new(TimeManager::new())),
             oom_score_adj: AtomicI32::new(200),
+            sched: SchedState::default(),
+            poll_wake: SpinNoIrq::new(None),
             exit: AtomicBool::new(false),
         })
     }
@@ -141,6 +163,13 @@ impl Thread {
     }
 }
 
+impl Drop for Thread {
+    fn drop(&mut self) {
+        // The task owning the thread is being dropped, so its entry is dead.
+        TASK_TABLE.remove_dead(self.tid);
+    }
+}
+
 #[extern_trait]
 unsafe impl TaskExt for Box<Thread> {
     fn on_enter(&self) {
@@ -173,6 +202,47 @@ impl AsThread for TaskInner {
     }
 }
 
+/// Bookkeeping that belongs to an address space rather than to a process.
+///
+/// Processes sharing an address space, such as a `vfork` child until
+/// `execve`, share this too, so that the fault handler and the THP scans of
+/// one see the mappings made by the other.
+pub struct AspaceState {
+    /// Number of processes using the address space.
+    users: AtomicUsize,
+    /// The user heap bottom
+    heap_bottom: AtomicUsize,
+    /// The user heap top
+    heap_top: AtomicUsize,
+    /// Transparent huge page bookkeeping.
+    pub thp: Mutex<ThpState>,
+    /// The file-backed ranges of the address space.
+    pub file_maps: Mutex<FileMaps>,
+}
+
+impl AspaceState {
+    fn new() -> Arc<Self> {
+        Arc::new(Self {
+            users: AtomicUsize::new(1),
+            heap_bottom: AtomicUsize::new(crate::config::USER_HEAP_BASE),
+            heap_top: AtomicUsize::new(crate::config::USER_HEAP_BASE),
+            thp: Mutex::new(ThpState::default()),
+            file_maps: Mutex::new(FileMaps::default()),
+        })
+    }
+
+    /// Copies the bookkeeping of `other`, for an address space cloned from
+    /// it by `fork`.
+    pub fn copy_from(&self, other: &AspaceState) {
+        self.heap_bottom
+            .store(other.heap_bottom.load(Ordering::Acquire), Ordering::Release);
+        self.heap_top
+            .store(other.heap_top.load(Ordering::Acquire), Ordering::Release);
+        *self.thp.lock() = other.thp.lock().clone();
+        *self.file_maps.lock() = other.file_maps.lock().clone();
+    }
+}
+
 /// [`Process`]-shared data.
 pub struct ProcessData {
     /// The process.
@@ -183,13 +253,11 @@ pub struct ProcessData {
     pub cmdline: RwLock<Arc<Vec<String>>>,
     /// The virtual memory address space.
     // TODO: scopify
-    pub aspace: Arc<Mutex<AddrSpace>>,
+    aspace: RwLock<Arc<Mutex<AddrSpace>>>,
+    /// The bookkeeping of `aspace`, shared with whoever shares `aspace`.
+    aspace_state: SpinNoIrq<Arc<AspaceState>>,
     /// The resource scope
     pub scope: RwLock<Scope>,
-    /// The user heap bottom
-    heap_bottom: AtomicUsize,
-    /// The user heap top
-    heap_top: AtomicUsize,
 
     /// The resource limits
     pub rlim: RwLock<Rlimits>,
@@ -209,6 +277,19 @@ pub struct ProcessData {
 
     /// The default mask for file permissions.
     umask: AtomicU32,
+
+    /// Number of page faults served without reading from a file.
+    pub minflt: AtomicU64,
+    /// Number of page faults that had to read from a file.
+    pub majflt: AtomicU64,
+    /// Number of syscalls counted while syscall statistics are enabled.
+    pub syscalls: AtomicU64,
+    /// Time spent in those syscalls, in nanoseconds.
+    pub syscall_ns: AtomicU64,
+
+    /// Whether this is a `vfork` child still borrowing its parent's address
+    /// space.
+    vfork: AtomicBool,
 }
 
 impl ProcessData {
@@ -225,10 +306,9 @@ impl ProcessData {
             proc,
             exe_path: RwLock::new(exe_path),
             cmdline: RwLock::new(cmdline),
-            aspace,
+            aspace: RwLock::new(aspace),
+            aspace_state: SpinNoIrq::new(AspaceState::new()),
             scope: RwLock::new(Scope::new()),
-            heap_bottom: AtomicUsize::new(crate::config::USER_HEAP_BASE),
-            heap_top: AtomicUsize::new(crate::config::USER_HEAP_BASE),
 
             rlim: RwLock::default(),
 
@@ -244,27 +324,108 @@ impl ProcessData {
             futex_table: Arc::new(FutexTable::new()),
 
             umask: AtomicU32::new(0o022),
+
+            minflt: AtomicU64::new(0),
+            majflt: AtomicU64::new(0),
+            syscalls: AtomicU64::new(0),
+            syscall_ns: AtomicU64::new(0),
+
+            vfork: AtomicBool::new(false),
         })
     }
 
+    /// Get the virtual memory address space.
+    ///
+    /// The guard only keeps [`Self::replace_aspace`] out; clone the [`Arc`]
+    /// to hold on to the address space for longer.
+    pub fn aspace(&self) -> RwLockReadGuard<'_, Arc<Mutex<AddrSpace>>> {
+        self.aspace.read()
+    }
+
+    /// Get the bookkeeping of the address space: its THP state, file-backed
+    /// ranges and heap.
+    pub fn aspace_state(&self) -> Arc<AspaceState> {
+        self.aspace_state.lock().clone()
+    }
+
+    /// Replace the virtual memory address space, returning the old one.
+    ///
+    /// The new address space starts with empty bookkeeping. The caller is
+    /// responsible for switching the page table of every thread of the
+    /// process.
+    pub fn replace_aspace(&self, aspace: Arc<Mutex<AddrSpace>>) -> Arc<Mutex<AddrSpace>> {
+        let mut guard = self.aspace.write();
+        let old = mem::replace(&mut *guard, aspace);
+        self.release_aspace();
+        drop(guard);
+        old
+    }
+
+    /// Records that this process was created with the address space of
+    /// `other`, as `clone` with `CLONE_VM` does, and shares its bookkeeping.
+    pub fn share_aspace(&self, other: &ProcessData) {
+        let state = other.aspace_state();
+        state.users.fetch_add(1, Ordering::AcqRel);
+        *self.aspace_state.lock() = state;
+    }
+
+    /// Whether another process that has not exited or called `execve` uses
+    /// the same address space.
+    pub fn aspace_shared(&self) -> bool {
+        self.aspace_state.lock().users.load(Ordering::Acquire) > 1
+    }
+
+    /// Stops counting this process as a user of its address space, when it
+    /// exits or gets a new one.
+    pub fn release_aspace(&self) {
+        let state = mem::replace(&mut *self.aspace_state.lock(), AspaceState::new());
+        state.users.fetch_sub(1, Ordering::AcqRel);
+    }
+
+    /// Mark this process as a `vfork` child.
+    pub fn set_vfork(&self) {
+        self.vfork.store(true, Ordering::Release);
+    }
+
+    /// Whether this is a `vfork` child that has not yet called `execve` or
+    /// exited.
+    pub fn in_vfork(&self) -> bool {
+        self.vfork.load(Ordering::Acquire)
+    }
+
+    /// Let the parent of a `vfork` child run again.
+    ///
+    /// The parent waits on [`Self::exit_event`].
+    pub fn release_vfork(&self) {
+        if self.vfork.swap(false, Ordering::AcqRel) {
+            self.exit_event.wake();
+        }
+    }
+
     /// Get the bottom address of the user heap.
     pub fn get_heap_bottom(&self) -> usize {
-        self.heap_bottom.load(Ordering::Acquire)
+        self.aspace_state.lock().heap_bottom.load(Ordering::Acquire)
     }
 
     /// Set the bottom address of the user heap.
     pub fn set_heap_bottom(&self, bottom: usize) {
-        self.heap_bottom.store(bottom, Ordering::Release)
+        self.aspace_state
+            .lock()
+            .heap_bottom
+            .store(bottom, Ordering::Release)
     }
 
     /// Get the top address of the user heap.
     pub fn get_heap_top(&self) -> usize {
-        self.heap_top.load(Ordering::Acquire)
+        self.aspace_state.lock().heap_top.load(Ordering::Acquire)
     }
 
     /// Set the top address of the user heap.
     pub fn set_heap_top(&self, top: usize) {
-        self.heap_top.store(top, Ordering::Release)
+        self.aspace_state
+            .lock()
+            .heap_top
+            .store(top, Ordering::Release)
     }
 
     /// Linux manual: A "clone" child is one which delivers no signal, or a
@@ -303,6 +464,12 @@ impl ProcessData {
     }
 }
 
+impl Drop for ProcessData {
+    fn drop(&mut self) {
+        PROCESS_TABLE.remove_dead(self.proc.pid());
+    }
+}
+
 struct FutexTables {
     map: HashMap<usize, Arc<FutexTable>>,
     operations: usize,
@@ -333,60 +500,52 @@ lazy_static! {
     static ref SHARED_FUTEX_TABLES: Mutex<FutexTables> = Mutex::new(FutexTables::new());
 }
 
-static TASK_TABLE: RwLock<WeakMap<Pid, WeakAxTaskRef>> = RwLock::new(WeakMap::new());
+static TASK_TABLE: PidTable<WeakAxTaskRef> = PidTable::new();
 
-static PROCESS_TABLE: RwLock<WeakMap<Pid, Weak<ProcessData>>> = RwLock::new(WeakMap::new());
+static PROCESS_TABLE: PidTable<Weak<ProcessData>> = PidTable::new();
 
-static PROCESS_GROUP_TABLE: RwLock<WeakMap<Pid, Weak<ProcessGroup>>> = RwLock::new(WeakMap::new());
+static PROCESS_GROUP_TABLE: PidTable<Weak<ProcessGroup>> = PidTable::new();
 
-static SESSION_TABLE: RwLock<WeakMap<Pid, Weak<Session>>> = RwLock::new(WeakMap::new());
+static SESSION_TABLE: PidTable<Weak<Session>> = PidTable::new();
 
 /// Cleanup expired entries in the task tables.
 ///
 /// This function is intended to be used during memory leak analysis to remove
-/// possible noise caused by expired entries in the [`WeakMap`].
+/// possible noise caused by expired entries in the [`PidTable`]s.
 pub fn cleanup_task_tables() {
-    TASK_TABLE.write().cleanup();
-    PROCESS_TABLE.write().cleanup();
-    PROCESS_GROUP_TABLE.write().cleanup();
-    SESSION_TABLE.write().cleanup();
+    TASK_TABLE.prune();
+    PROCESS_TABLE.prune();
+    PROCESS_GROUP_TABLE.prune();
+    SESSION_TABLE.prune();
 }
 
 /// Add the task, the thread and possibly its process, process group and session
 /// to the corresponding tables.
 pub fn add_task_to_table(task: &AxTaskRef) {
     let tid = task.id().as_u64() as Pid;
-
-    let mut task_table = TASK_TABLE.write();
-    task_table.insert(tid, task);
+    TASK_TABLE.insert(tid, task);
 
     let proc_data = &task.as_thread().proc_data;
     let proc = &proc_data.proc;
-    let pid = proc.pid();
-    let mut proc_table = PROCESS_TABLE.write();
-    if proc_table.contains_key(&pid) {
+    if !PROCESS_TABLE.insert(proc.pid(), proc_data) {
         return;
     }
-    proc_table.insert(pid, proc_data);
 
     let pg = proc.group();
-    let mut pg_table = PROCESS_GROUP_TABLE.write();
-    if pg_table.contains_key(&pg.pgid()) {
+    if !PROCESS_GROUP_TABLE.insert(pg.pgid(), &pg) {
         return;
     }
-    pg_table.insert(pg.pgid(), &pg);
 
     let session = pg.session();
-    let mut session_table = SESSION_TABLE.write();
-    if session_table.contains_key(&session.sid()) {
-        return;
-    }
-    session_table.insert(session.sid(), &session);
+    SESSION_TABLE.insert(session.sid(), &session);
 }
 
 /// Lists all tasks.
-pub fn tasks() -> Vec<AxTaskRef> {
-    TASK_TABLE.read().values().collect()
+///
+/// Nothing is collected up front: each step briefly locks one shard of the
+/// task table.
+pub fn tasks() -> PidTableIter<'static, WeakAxTaskRef> {
+    TASK_TABLE.iter()
 }
 
 /// Finds the task with the given TID.
@@ -394,12 +553,12 @@ pub fn get_task(tid: Pid) -> AxResult<AxTaskRef> {
     if tid == 0 {
         return Ok(current().clone());
     }
-    TASK_TABLE.read().get(&tid).ok_or(AxError::NoSuchProcess)
+    TASK_TABLE.get(tid).ok_or(AxError::NoSuchProcess)
 }
 
-/// Lists all processes.
-pub fn processes() -> Vec<Arc<ProcessData>> {
-    PROCESS_TABLE.read().values().collect()
+/// Lists all processes, the same way as [`tasks`].
+pub fn processes() -> PidTableIter<'static, Weak<ProcessData>> {
+    PROCESS_TABLE.iter()
 }
 
 /// Finds the process with the given PID.
@@ -407,20 +566,17 @@ pub fn get_process_data(pid: Pid) -> AxResult<Arc<ProcessData>> {
     if pid == 0 {
         return Ok(current().as_thread().proc_data.clone());
     }
-    PROCESS_TABLE.read().get(&pid).ok_or(AxError::NoSuchProcess)
+    PROCESS_TABLE.get(pid).ok_or(AxError::NoSuchProcess)
 }
 
 /// Finds the process group with the given PGID.
 pub fn get_process_group(pgid: Pid) -> AxResult<Arc<ProcessGroup>> {
-    PROCESS_GROUP_TABLE
-        .read()
-        .get(&pgid)
-        .ok_or(AxError::NoSuchProcess)
+    PROCESS_GROUP_TABLE.get(pgid).ok_or(AxError::NoSuchProcess)
 }
 
 /// Finds the session with the given SID.
 pub fn get_session(sid: Pid) -> AxResult<Arc<Session>> {
-    SESSION_TABLE.read().get(&sid).ok_or(AxError::NoSuchProcess)
+    SESSION_TABLE.get(sid).ok_or(AxError::NoSuchProcess)
 }
 
 /// Poll the timer
@@ -0,0 +1,271 @@
+//! Scheduling state of user threads.
+//!
+//! The run queues belong to `axtask`; what is tracked here is what userspace
+//! asks of them and what it can observe: the policy and nice value of each
+//! thread, affinity changes requested for threads other than the caller, and
+//! the CPU each thread last ran user code on, from which run queue lengths
+//! and migration counts per CPU are derived.
+//!
+//! The run queues have no notion of weight, so niceness is approximated on
+//! the way out of user space: every interrupt a thread takes earns it the
+//! weight Linux gives its nice value, and it keeps the CPU only while that
+//! adds up to a whole nice-0 tick. A thread at nice 0 or below never gives
+//! way early, one at nice 19 gives up the CPU at nearly every tick, and
+//! those in between in proportion, so none is starved. `SCHED_IDLE` gets
+//! the weight Linux gives it, below nice 19, and `SCHED_BATCH` that of its
+//! nice value.
+//!
+//! `SCHED_FIFO` and `SCHED_RR` are accepted and reported, with their
+//! priority, but not enforced: real-time threads never give way early, and
+//! otherwise share the round-robin run queues with everyone else.
+//!
+//! What this does not provide, since it needs changes to the `axtask`
+//! scheduler itself: a fair scheduling class (the nice weighting above only
+//! shortens time slices, it does not order the run queue), load balancing or
+//! idle-time work stealing between the per-CPU run queues, and moving a
+//! thread other than the caller to a new affinity mask right away (see
+//! [`SchedState::request_affinity`]).
+
+use alloc::vec::Vec;
+use core::sync::atomic::{
+    AtomicBool, AtomicI8, AtomicU8, AtomicU32, AtomicU64, AtomicUsize, Ordering,
+};
+
+use axconfig::plat::CPU_NUM;
+use axhal::percpu::this_cpu_id;
+use axtask::{AxCpuMask, TaskState};
+use kspin::SpinNoIrq;
+use linux_raw_sys::general::{SCHED_BATCH, SCHED_FIFO, SCHED_IDLE, SCHED_NORMAL, SCHED_RR};
+
+use super::{AsThread, tasks};
+
+/// Lowest (most favourable) nice value.
+pub const NICE_MIN: i32 = -20;
+/// Highest nice value.
+pub const NICE_MAX: i32 = 19;
+
+/// Weight of a nice-0 thread.
+const NICE_0_WEIGHT: u32 = 1024;
+
+/// Weights of nice values 1 to 19, as in Linux's `sched_prio_to_weight`.
+const POSITIVE_NICE_WEIGHTS: [u32; NICE_MAX as usize] = [
+    820, 655, 526, 423, 335, 272, 215, 172, 137, 110, 87, 70, 56, 45, 36, 29, 23, 18, 15,
+];
+
+/// Weight of a `SCHED_IDLE` thread, as in Linux.
+const IDLE_WEIGHT: u32 = 3;
+
+/// A scheduling policy.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+#[repr(u8)]
+pub enum SchedPolicy {
+    /// `SCHED_NORMAL`
+    Normal = SCHED_NORMAL as u8,
+    /// `SCHED_FIFO`
+    Fifo   = SCHED_FIFO as u8,
+    /// `SCHED_RR`
+    Rr     = SCHED_RR as u8,
+    /// `SCHED_BATCH`
+    Batch  = SCHED_BATCH as u8,
+    /// `SCHED_IDLE`
+    Idle   = SCHED_IDLE as u8,
+}
+
+impl SchedPolicy {
+    /// Parses a policy number, without flags.
+    pub fn from_raw(policy: u32) -> Option<Self> {
+        Some(match policy {
+            SCHED_NORMAL => Self::Normal,
+            SCHED_FIFO => Self::Fifo,
+            SCHED_RR => Self::Rr,
+            SCHED_BATCH => Self::Batch,
+            SCHED_IDLE => Self::Idle,
+            _ => return None,
+        })
+    }
+
+    /// Whether this is a real-time policy, which takes a priority in
+    /// `1..=99`.
+    pub fn is_realtime(self) -> bool {
+        matches!(self, Self::Fifo | Self::Rr)
+    }
+}
+
+static CPU_MIGRATIONS: [AtomicU64; CPU_NUM] = [const { AtomicU64::new(0) }; CPU_NUM];
+
+/// Scheduling state of a thread.
+pub struct SchedState {
+    policy: AtomicU8,
+    rt_priority: AtomicU8,
+    nice: AtomicI8,
+    /// CPU the thread last returned to user space on, `usize::MAX` before
+    /// the first time.
+    cpu: AtomicUsize,
+    migrations: AtomicU64,
+    affinity_pending: AtomicBool,
+    pending_affinity: SpinNoIrq<Option<AxCpuMask>>,
+    /// Weight earned towards the next tick, see [`SchedState::yield_on_tick`].
+    credit: AtomicU32,
+}
+
+impl Default for SchedState {
+    fn default() -> Self {
+        Self {
+            policy: AtomicU8::new(SchedPolicy::Normal as u8),
+            rt_priority: AtomicU8::new(0),
+            nice: AtomicI8::new(0),
+            cpu: AtomicUsize::new(usize::MAX),
+            migrations: AtomicU64::new(0),
+            affinity_pending: AtomicBool::new(false),
+            pending_affinity: SpinNoIrq::new(None),
+            credit: AtomicU32::new(0),
+        }
+    }
+}
+
+impl SchedState {
+    /// Copies the policy and nice value of `parent`, as `fork` does.
+    pub fn inherit(&self, parent: &SchedState) {
+        self.policy
+            .store(parent.policy.load(Ordering::Relaxed), Ordering::Relaxed);
+        self.rt_priority.store(
+            parent.rt_priority.load(Ordering::Relaxed),
+            Ordering::Relaxed,
+        );
+        self.nice
+            .store(parent.nice.load(Ordering::Relaxed), Ordering::Relaxed);
+    }
+
+    /// Returns the scheduling policy.
+    pub fn policy(&self) -> SchedPolicy {
+        SchedPolicy::from_raw(self.policy.load(Ordering::Relaxed) as u32)
+            .unwrap_or(SchedPolicy::Normal)
+    }
+
+    /// Returns the real-time priority, 0 for non-real-time policies.
+    pub fn rt_priority(&self) -> u8 {
+        self.rt_priority.load(Ordering::Relaxed)
+    }
+
+    /// Sets the scheduling policy and its real-time priority.
+    pub fn set_policy(&self, policy: SchedPolicy, rt_priority: u8) {
+        self.policy.store(policy as u8, Ordering::Relaxed);
+        self.rt_priority.store(rt_priority, Ordering::Relaxed);
+    }
+
+    /// Returns the nice value.
+    pub fn nice(&self) -> i32 {
+        self.nice.load(Ordering::Relaxed) as i32
+    }
+
+    /// Sets the nice value, clamped to [`NICE_MIN`]`..=`[`NICE_MAX`].
+    pub fn set_nice(&self, nice: i32) {
+        self.nice
+            .store(nice.clamp(NICE_MIN, NICE_MAX) as i8, Ordering::Relaxed);
+    }
+
+    /// Returns the weight of the thread, [`NICE_0_WEIGHT`] or more for
+    /// threads that never give way early.
+    fn weight(&self) -> u32 {
+        match self.policy() {
+            SchedPolicy::Fifo | SchedPolicy::Rr => NICE_0_WEIGHT,
+            SchedPolicy::Idle => IDLE_WEIGHT,
+            SchedPolicy::Normal | SchedPolicy::Batch => match self.nice() {
+                nice if nice <= 0 => NICE_0_WEIGHT,
+                nice => POSITIVE_NICE_WEIGHTS[nice as usize - 1],
+            },
+        }
+    }
+
+    /// Accounts a tick the thread spent in user space, returning whether it
+    /// should give up the CPU now. To be called by the thread itself.
+    pub fn yield_on_tick(&self) -> bool {
+        let weight = self.weight();
+        if weight >= NICE_0_WEIGHT {
+            return false;
+        }
+        let credit = self.credit.load(Ordering::Relaxed) + weight;
+        if credit >= NICE_0_WEIGHT {
+            self.credit.store(credit - NICE_0_WEIGHT, Ordering::Relaxed);
+            false
+        } else {
+            self.credit.store(credit, Ordering::Relaxed);
+            true
+        }
+    }
+
+    /// Returns the CPU the thread last ran user code on.
+    pub fn cpu(&self) -> Option<usize> {
+        let cpu = self.cpu.load(Ordering::Relaxed);
+        (cpu != usize::MAX).then_some(cpu)
+    }
+
+    /// Returns the number of times the thread moved to another CPU.
+    pub fn migrations(&self) -> u64 {
+        self.migrations.load(Ordering::Relaxed)
+    }
+
+    /// Asks the thread to move itself to `mask` the next time it returns to
+    /// user space.
+    ///
+    /// `axtask` only lets a task change its own affinity. A thread running
+    /// user code moves at its next timer tick, and a blocked one before it
+    /// runs user code again, but kernel code it runs meanwhile may still be
+    /// on a CPU outside `mask`.
+    pub fn request_affinity(&self, mask: AxCpuMask) {
+        *self.pending_affinity.lock() = Some(mask);
+        self.affinity_pending.store(true, Ordering::Release);
+    }
+
+    /// Returns the affinity requested through [`Self::request_affinity`] and
+    /// not yet applied.
+    pub fn pending_affinity(&self) -> Option<AxCpuMask> {
+        *self.pending_affinity.lock()
+    }
+
+    /// Bookkeeping on the way back to user space, to be called by the thread
+    /// itself.
+    pub fn on_user_return(&self) {
+        let cpu = this_cpu_id();
+        let prev = self.cpu.swap(cpu, Ordering::Relaxed);
+        if prev != cpu && prev != usize::MAX {
+            self.migrations.fetch_add(1, Ordering::Relaxed);
+            CPU_MIGRATIONS[cpu % CPU_NUM].fetch_add(1, Ordering::Relaxed);
+        }
+
+        if self.affinity_pending.swap(false, Ordering::Acquire)
+            && let Some(mask) = self.pending_affinity.lock().take()
+        {
+            axtask::set_current_affinity(mask);
+        }
+    }
+}
+
+/// Scheduling statistics of a CPU.
+#[derive(Debug, Clone, Copy, Default)]
+pub struct CpuSchedStats {
+    /// Number of runnable user threads that last ran on the CPU.
+    pub nr_running: usize,
+    /// Number of times a user thread moved to the CPU from another one.
+    pub migrations: u64,
+}
+
+/// Returns the scheduling statistics of every CPU.
+pub fn cpu_sched_stats() -> Vec<CpuSchedStats> {
+    let mut stats: Vec<CpuSchedStats> = CPU_MIGRATIONS
+        .iter()
+        .map(|migrations| CpuSchedStats {
+            nr_running: 0,
+            migrations: migrations.load(Ordering::Relaxed),
+        })
+        .collect();
+    for task in tasks() {
+        if !matches!(task.state(), TaskState::Running | TaskState::Ready) {
+            continue;
+        }
+        if let Some(cpu) = task.try_as_thread().and_then(|thr| thr.sched.cpu()) {
+            stats[cpu % CPU_NUM].nr_running += 1;
+        }
+    }
+    stats
+}
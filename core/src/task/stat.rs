@@ -1,4 +1,5 @@
 use alloc::{borrow::ToOwned, fmt, string::String};
+use core::sync::atomic::Ordering;
 
 use axerrno::AxResult;
 use axtask::{TaskInner, TaskState};
@@ -29,8 +30,8 @@ pub struct TaskStat {
     pub stime: u64,
     pub cutime: u64,
     pub cstime: u64,
-    pub priority: u32,
-    pub nice: u32,
+    pub priority: i32,
+    pub nice: i32,
     pub num_threads: u32,
     pub itrealvalue: u32,
     pub starttime: u64,
@@ -84,15 +85,29 @@ impl TaskStat {
         let ppid = proc.parent().map_or(0, |p| p.pid());
         let pgrp = proc.group().pgid();
         let session = proc.group().session().sid();
+        let sched = &thread.sched;
+        // As in Linux: -2 to -100 for real-time threads, 0 to 39 for others.
+        let priority = if sched.policy().is_realtime() {
+            -1 - sched.rt_priority() as i32
+        } else {
+            20 + sched.nice()
+        };
         Ok(Self {
             pid,
-            comm: comm.to_owned(),
+            comm,
             state,
             ppid,
             pgrp,
             session,
+            minflt: proc_data.minflt.load(Ordering::Relaxed),
+            majflt: proc_data.majflt.load(Ordering::Relaxed),
+            priority,
+            nice: sched.nice(),
             num_threads: proc.threads().len() as u32,
             exit_signal: proc_data.exit_signal.unwrap_or(Signo::SIGCHLD) as u8,
+            processor: sched.cpu().unwrap_or(0) as u32,
+            rt_priority: sched.rt_priority() as u32,
+            policy: sched.policy() as u32,
             exit_code: proc.exit_code(),
             ..Default::default()
         })
@@ -0,0 +1,143 @@
+//! PID-indexed tables.
+//!
+//! A table is split into [`SHARDS`] shards by PID, each behind its own lock,
+//! so that lookups only contend with inserts and removals of PIDs in the same
+//! shard. Tasks and processes take themselves out of their table when they
+//! are dropped; entries of objects that do not (process groups and sessions)
+//! are pruned from a shard whenever something is inserted into it.
+
+use alloc::{
+    collections::BTreeMap,
+    sync::{Arc, Weak},
+};
+
+use spin::RwLock;
+use starry_process::Pid;
+
+/// Number of shards of a table
+const SHARDS: usize = 64;
+
+/// A weak reference stored in a [`PidTable`].
+pub trait PidEntry {
+    /// The strong reference handed out by lookups.
+    type Strong;
+
+    /// Creates an entry pointing to `strong`.
+    fn downgrade(strong: &Self::Strong) -> Self;
+
+    /// Returns what the entry points to, if it is still alive.
+    fn upgrade(&self) -> Option<Self::Strong>;
+
+    /// Returns whether what the entry points to is gone.
+    fn is_dead(&self) -> bool;
+}
+
+impl<T> PidEntry for Weak<T> {
+    type Strong = Arc<T>;
+
+    fn downgrade(strong: &Arc<T>) -> Self {
+        Arc::downgrade(strong)
+    }
+
+    fn upgrade(&self) -> Option<Arc<T>> {
+        Weak::upgrade(self)
+    }
+
+    fn is_dead(&self) -> bool {
+        self.strong_count() == 0
+    }
+}
+
+/// A map from PIDs to weak references, sharded by PID.
+pub struct PidTable<W> {
+    shards: [RwLock<BTreeMap<Pid, W>>; SHARDS],
+}
+
+impl<W: PidEntry> PidTable<W> {
+    /// Creates an empty table.
+    pub const fn new() -> Self {
+        Self {
+            shards: [const { RwLock::new(BTreeMap::new()) }; SHARDS],
+        }
+    }
+
+    fn shard(&self, pid: Pid) -> &RwLock<BTreeMap<Pid, W>> {
+        &self.shards[pid as usize % SHARDS]
+    }
+
+    /// Finds the live entry of `pid`.
+    pub fn get(&self, pid: Pid) -> Option<W::Strong> {
+        self.shard(pid).read().get(&pid)?.upgrade()
+    }
+
+    /// Inserts `value` at `pid` unless a live entry is already there.
+    ///
+    /// Returns whether it was inserted.
+    pub fn insert(&self, pid: Pid, value: &W::Strong) -> bool {
+        let mut shard = self.shard(pid).write();
+        if shard.get(&pid).is_some_and(|entry| !entry.is_dead()) {
+            return false;
+        }
+        shard.retain(|_, entry| !entry.is_dead());
+        shard.insert(pid, W::downgrade(value));
+        true
+    }
+
+    /// Removes the entry of `pid` if what it points to is gone.
+    pub fn remove_dead(&self, pid: Pid) {
+        let mut shard = self.shard(pid).write();
+        if shard.get(&pid).is_some_and(W::is_dead) {
+            shard.remove(&pid);
+        }
+    }
+
+    /// Removes every dead entry.
+    pub fn prune(&self) {
+        for shard in &self.shards {
+            shard.write().retain(|_, entry| !entry.is_dead());
+        }
+    }
+
+    /// Iterates over the live entries.
+    ///
+    /// No lock is held between items, so entries inserted or removed during
+    /// the walk may or may not be seen.
+    pub fn iter(&self) -> PidTableIter<'_, W> {
+        PidTableIter {
+            table: self,
+            shard: 0,
+            next: Some(0),
+        }
+    }
+}
+
+/// Iterator over the live entries of a [`PidTable`], in PID order within
+/// each shard.
+pub struct PidTableIter<'a, W> {
+    table: &'a PidTable<W>,
+    shard: usize,
+    /// Smallest PID not yet visited in the current shard
+    next: Option<Pid>,
+}
+
+impl<W: PidEntry> Iterator for PidTableIter<'_, W> {
+    type Item = W::Strong;
+
+    fn next(&mut self) -> Option<W::Strong> {
+        while self.shard < SHARDS {
+            if let Some(next) = self.next {
+                let shard = self.table.shards[self.shard].read();
+                let found = shard
+                    .range(next..)
+                    .find_map(|(&pid, entry)| Some((pid, entry.upgrade()?)));
+                if let Some((pid, value)) = found {
+                    self.next = pid.checked_add(1);
+                    return Some(value);
+                }
+            }
+            self.shard += 1;
+            self.next = Some(0);
+        }
+        None
+    }
+}
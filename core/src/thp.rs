@@ -0,0 +1,489 @@
+//! Transparent huge pages.
+//!
+//! Private anonymous memory is backed by 2 MiB pages wherever the mode allows
+//! it: aligned chunks of new mappings get huge-page backends whose frames are
+//! allocated on first fault, `MADV_HUGEPAGE` converts chunks that have not been
+//! touched yet, and a background pass collapses chunks whose 4 KiB pages are
+//! all populated. A huge chunk that `munmap` or `mprotect` cuts through is
+//! split back into 4 KiB pages first, keeping its contents.
+//!
+//! A chunk is write-protected and the TLB flushed before its contents are
+//! copied, so that a thread storing to it waits in the fault handler instead
+//! of having its store lost. There is no TLB shootdown across CPUs, so a
+//! thread running elsewhere could keep writing through a stale entry; the
+//! background collapse is therefore only done on a single CPU, while splits,
+//! which `munmap` and `mprotect` need, are no worse than those calls.
+//!
+//! Lock order: the address space, then [`ThpState`].
+
+use alloc::{vec, vec::Vec};
+use core::{
+    ops::Range,
+    sync::atomic::{AtomicU8, Ordering},
+    time::Duration,
+};
+
+use axconfig::plat::CPU_NUM;
+use axerrno::{AxError, AxResult};
+use axhal::{
+    mem::phys_to_virt,
+    paging::{MappingFlags, PageSize},
+};
+use axmm::{AddrSpace, backend::Backend};
+use memory_addr::{MemoryAddr, PAGE_SIZE_4K, VirtAddr};
+
+use crate::task::processes;
+
+/// Size of a transparent huge page.
+pub const HUGE_PAGE_SIZE: usize = PageSize::Size2M as usize;
+
+/// Maximum number of chunks collapsed per process in one background pass.
+const COLLAPSE_BUDGET: usize = 8;
+
+/// Maximum number of chunks examined per process in one background pass.
+const SCAN_BUDGET: usize = 64;
+
+/// Interval between background collapse passes.
+const COLLAPSE_INTERVAL: Duration = Duration::from_secs(10);
+
+/// When anonymous memory is backed by huge pages.
+#[repr(u8)]
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum ThpMode {
+    /// Everywhere it fits, unless advised otherwise.
+    Always  = 0,
+    /// Only in ranges advised with `MADV_HUGEPAGE`.
+    Madvise = 1,
+    /// Never.
+    Never   = 2,
+}
+
+impl ThpMode {
+    /// Parses a mode the way it is written to the control file.
+    pub fn parse(s: &str) -> Option<Self> {
+        match s.trim() {
+            "always" => Some(Self::Always),
+            "madvise" => Some(Self::Madvise),
+            "never" => Some(Self::Never),
+            _ => None,
+        }
+    }
+
+    /// Lists all modes with the current one in brackets, as Linux does.
+    pub fn describe(self) -> &'static str {
+        match self {
+            Self::Always => "[always] madvise never\n",
+            Self::Madvise => "always [madvise] never\n",
+            Self::Never => "always madvise [never]\n",
+        }
+    }
+}
+
+static THP_MODE: AtomicU8 = AtomicU8::new(ThpMode::Madvise as u8);
+
+/// Returns the current huge page mode.
+pub fn thp_mode() -> ThpMode {
+    match THP_MODE.load(Ordering::Relaxed) {
+        0 => ThpMode::Always,
+        1 => ThpMode::Madvise,
+        _ => ThpMode::Never,
+    }
+}
+
+/// Sets the huge page mode. Existing huge pages are kept.
+pub fn set_thp_mode(mode: ThpMode) {
+    THP_MODE.store(mode as u8, Ordering::Relaxed);
+}
+
+/// A set of address ranges, kept sorted and disjoint.
+#[derive(Debug, Clone, Default)]
+pub struct RangeSet {
+    ranges: Vec<Range<usize>>,
+}
+
+impl RangeSet {
+    /// Adds `range` to the set.
+    pub fn insert(&mut self, range: Range<usize>) {
+        let pos = self.ranges.partition_point(|r| r.start < range.start);
+        self.ranges.insert(pos, range);
+        let mut merged: Vec<Range<usize>> = Vec::with_capacity(self.ranges.len());
+        for r in self.ranges.drain(..) {
+            match merged.last_mut() {
+                Some(last) if last.end >= r.start => last.end = last.end.max(r.end),
+                _ => merged.push(r),
+            }
+        }
+        self.ranges = merged;
+    }
+
+    /// Removes `range` from the set.
+    pub fn remove(&mut self, range: Range<usize>) {
+        let mut kept = Vec::with_capacity(self.ranges.len() + 1);
+        for r in self.ranges.drain(..) {
+            if r.end <= range.start || r.start >= range.end {
+                kept.push(r);
+                continue;
+            }
+            if r.start < range.start {
+                kept.push(r.start..range.start);
+            }
+            if r.end > range.end {
+                kept.push(range.end..r.end);
+            }
+        }
+        self.ranges = kept;
+    }
+
+    /// Checks whether all of `range` is in the set.
+    pub fn contains(&self, range: Range<usize>) -> bool {
+        let pos = self.ranges.partition_point(|r| r.end <= range.start);
+        self.ranges
+            .get(pos)
+            .is_some_and(|r| r.start <= range.start && r.end >= range.end)
+    }
+
+    /// Checks whether any of `range` is in the set.
+    pub fn overlaps(&self, range: Range<usize>) -> bool {
+        let pos = self.ranges.partition_point(|r| r.end <= range.start);
+        self.ranges.get(pos).is_some_and(|r| r.start < range.end)
+    }
+
+    /// Iterates over the ranges in the set.
+    pub fn iter(&self) -> impl Iterator<Item = Range<usize>> + '_ {
+        self.ranges.iter().cloned()
+    }
+
+    /// Empties the set.
+    pub fn clear(&mut self) {
+        self.ranges.clear();
+    }
+}
+
+/// The huge-page-aligned chunks lying entirely inside `range`.
+fn chunks(range: Range<usize>) -> impl Iterator<Item = Range<usize>> {
+    let start = range.start.align_up(HUGE_PAGE_SIZE);
+    let end = range.end.align_down(HUGE_PAGE_SIZE);
+    (start..end)
+        .step_by(HUGE_PAGE_SIZE)
+        .map(|start| start..start + HUGE_PAGE_SIZE)
+}
+
+/// Copies `[start, start + len)` out of `aspace` through the kernel mapping of
+/// its frames. Returns the data and the number of 4 KiB pages that were
+/// populated; missing pages read as zeroes.
+fn read_pages(aspace: &AddrSpace, start: VirtAddr, len: usize) -> (Vec<u8>, usize) {
+    let mut data = vec![0; len];
+    let mut populated = 0;
+    for (off, page) in data.chunks_exact_mut(PAGE_SIZE_4K).enumerate() {
+        if let Ok((paddr, ..)) = aspace.page_table().query(start + off * PAGE_SIZE_4K) {
+            // SAFETY: the frame is mapped and stays so while `aspace` is locked.
+            let src =
+                unsafe { core::slice::from_raw_parts(phys_to_virt(paddr).as_ptr(), PAGE_SIZE_4K) };
+            page.copy_from_slice(src);
+            populated += 1;
+        }
+    }
+    (data, populated)
+}
+
+/// Copies `data` into the (populated) pages at `start`.
+fn write_pages(aspace: &AddrSpace, start: VirtAddr, data: &[u8]) -> AxResult {
+    for (off, page) in data.chunks_exact(PAGE_SIZE_4K).enumerate() {
+        let (paddr, ..) = aspace
+            .page_table()
+            .query(start + off * PAGE_SIZE_4K)
+            .map_err(|_| AxError::BadAddress)?;
+        // SAFETY: the frame was just allocated for this mapping.
+        let dst = unsafe {
+            core::slice::from_raw_parts_mut(phys_to_virt(paddr).as_mut_ptr(), PAGE_SIZE_4K)
+        };
+        dst.copy_from_slice(page);
+    }
+    Ok(())
+}
+
+/// Returns the flags of the area covering all of `chunk`, if any.
+fn chunk_flags(aspace: &AddrSpace, chunk: &Range<usize>) -> Option<MappingFlags> {
+    let area = aspace.find_area(VirtAddr::from(chunk.start))?;
+    (area.end().as_usize() >= chunk.end).then(|| area.flags())
+}
+
+fn is_untouched(aspace: &AddrSpace, chunk: &Range<usize>) -> bool {
+    (chunk.start..chunk.end)
+        .step_by(PAGE_SIZE_4K)
+        .all(|va| aspace.page_table().query(VirtAddr::from(va)).is_err())
+}
+
+fn is_populated(aspace: &AddrSpace, chunk: &Range<usize>) -> bool {
+    (chunk.start..chunk.end)
+        .step_by(PAGE_SIZE_4K)
+        .all(|va| aspace.page_table().query(VirtAddr::from(va)).is_ok())
+}
+
+/// Makes `chunk` read-only so that its contents can be copied, and returns
+/// the flags to map the copy with.
+fn freeze(aspace: &mut AddrSpace, chunk: &Range<usize>) -> AxResult<MappingFlags> {
+    let flags = chunk_flags(aspace, chunk).ok_or(AxError::NoMemory)?;
+    if flags.contains(MappingFlags::WRITE) {
+        aspace.protect(
+            VirtAddr::from(chunk.start),
+            HUGE_PAGE_SIZE,
+            flags - MappingFlags::WRITE,
+        )?;
+        axhal::asm::flush_tlb(None);
+    }
+    Ok(flags)
+}
+
+/// Per-process huge page bookkeeping.
+#[derive(Debug, Clone, Default)]
+pub struct ThpState {
+    /// Ranges advised with `MADV_HUGEPAGE`.
+    pub advised: RangeSet,
+    /// Ranges advised with `MADV_NOHUGEPAGE`.
+    pub excluded: RangeSet,
+    /// Private anonymous memory, the only memory eligible for huge pages.
+    anon: RangeSet,
+    /// Chunks currently mapped with huge pages.
+    huge: RangeSet,
+    /// Address the next background pass starts scanning at.
+    scan_cursor: usize,
+}
+
+impl ThpState {
+    fn eligible(&self, chunk: &Range<usize>) -> bool {
+        self.anon.contains(chunk.clone())
+            && !self.excluded.overlaps(chunk.clone())
+            && match thp_mode() {
+                ThpMode::Always => true,
+                ThpMode::Madvise => self.advised.contains(chunk.clone()),
+                ThpMode::Never => false,
+            }
+    }
+
+    /// Records `MADV_HUGEPAGE` for `range`.
+    pub fn advise(&mut self, range: Range<usize>) {
+        self.excluded.remove(range.clone());
+        self.advised.insert(range);
+    }
+
+    /// Records `MADV_NOHUGEPAGE` for `range`.
+    pub fn unadvise(&mut self, range: Range<usize>) {
+        self.advised.remove(range.clone());
+        self.excluded.insert(range);
+    }
+
+    /// Forgets everything, e.g. on `execve`.
+    pub fn clear(&mut self) {
+        *self = Self::default();
+    }
+
+    /// Whether it is worth placing an anonymous mapping of `size` bytes at a
+    /// huge-page-aligned address.
+    pub fn wants_alignment(size: usize) -> bool {
+        size >= HUGE_PAGE_SIZE && thp_mode() != ThpMode::Never
+    }
+
+    /// Maps private anonymous memory, using huge pages for the aligned chunks
+    /// where allowed.
+    pub fn map_anonymous(
+        &mut self,
+        aspace: &mut AddrSpace,
+        start: VirtAddr,
+        size: usize,
+        flags: MappingFlags,
+        populate: bool,
+    ) -> AxResult {
+        let range = start.as_usize()..start.as_usize() + size;
+        self.anon.insert(range.clone());
+        let huge = chunks(range.clone())
+            .filter(|chunk| self.eligible(chunk))
+            .collect::<Vec<_>>();
+
+        let mut map = |range: Range<usize>, page_size: PageSize| {
+            let start = VirtAddr::from(range.start);
+            aspace.map(
+                start,
+                range.end - range.start,
+                flags,
+                populate,
+                Backend::new_alloc(start, page_size),
+            )
+        };
+        let mut cur = range.start;
+        for chunk in huge {
+            if cur < chunk.start {
+                map(cur..chunk.start, PageSize::Size4K)?;
+            }
+            map(chunk.clone(), PageSize::Size2M)?;
+            cur = chunk.end;
+            self.huge.insert(chunk);
+        }
+        if cur < range.end {
+            map(cur..range.end, PageSize::Size4K)?;
+        }
+        Ok(())
+    }
+
+    /// Prepares for `range` to be unmapped or replaced: splits the huge
+    /// chunks it cuts through and forgets it.
+    pub fn before_unmap(&mut self, aspace: &mut AddrSpace, range: Range<usize>) -> AxResult {
+        self.split_partial(aspace, range.clone())?;
+        self.anon.remove(range.clone());
+        self.huge.remove(range);
+        Ok(())
+    }
+
+    /// Splits the huge chunks that `range` covers only partly, e.g. before
+    /// `mprotect`.
+    pub fn split_partial(&mut self, aspace: &mut AddrSpace, range: Range<usize>) -> AxResult {
+        for edge in [range.start, range.end] {
+            let chunk = edge.align_down(HUGE_PAGE_SIZE);
+            let chunk = chunk..chunk + HUGE_PAGE_SIZE;
+            if edge != chunk.start && self.huge.contains(chunk.clone()) {
+                self.split(aspace, chunk)?;
+            }
+        }
+        Ok(())
+    }
+
+    fn split(&mut self, aspace: &mut AddrSpace, chunk: Range<usize>) -> AxResult {
+        let start = VirtAddr::from(chunk.start);
+        let flags = freeze(aspace, &chunk)?;
+        let (data, populated) = read_pages(aspace, start, HUGE_PAGE_SIZE);
+        aspace.unmap(start, HUGE_PAGE_SIZE)?;
+        aspace.map(
+            start,
+            HUGE_PAGE_SIZE,
+            flags,
+            populated > 0,
+            Backend::new_alloc(start, PageSize::Size4K),
+        )?;
+        if populated > 0 {
+            write_pages(aspace, start, &data)?;
+        }
+        self.huge.remove(chunk);
+        Ok(())
+    }
+
+    /// Switches the eligible chunks of `range` that were never touched to
+    /// huge pages, e.g. after `MADV_HUGEPAGE`. Touched chunks are left to the
+    /// background collapse.
+    pub fn promote_untouched(&mut self, aspace: &mut AddrSpace, range: Range<usize>) -> AxResult {
+        let candidates = chunks(range)
+            .filter(|chunk| self.eligible(chunk) && !self.huge.overlaps(chunk.clone()))
+            .collect::<Vec<_>>();
+        for chunk in candidates {
+            let Some(flags) = chunk_flags(aspace, &chunk) else {
+                continue;
+            };
+            if !is_untouched(aspace, &chunk) {
+                continue;
+            }
+            let start = VirtAddr::from(chunk.start);
+            aspace.unmap(start, HUGE_PAGE_SIZE)?;
+            aspace.map(
+                start,
+                HUGE_PAGE_SIZE,
+                flags,
+                false,
+                Backend::new_alloc(start, PageSize::Size2M),
+            )?;
+            self.huge.insert(chunk);
+        }
+        Ok(())
+    }
+
+    /// Collapses up to `budget` eligible chunks whose 4 KiB pages are all
+    /// populated into huge pages. Returns the number of chunks collapsed.
+    ///
+    /// At most [`SCAN_BUDGET`] chunks are examined, starting where the last
+    /// call left off. Being fully populated stands in for being hot, as we
+    /// keep no access statistics.
+    pub fn collapse(&mut self, aspace: &mut AddrSpace, budget: usize) -> AxResult<usize> {
+        let mut candidates = self
+            .anon
+            .iter()
+            .flat_map(chunks)
+            .filter(|chunk| self.eligible(chunk) && !self.huge.overlaps(chunk.clone()))
+            .collect::<Vec<_>>();
+        let resume = candidates.partition_point(|chunk| chunk.start < self.scan_cursor);
+        candidates.rotate_left(resume);
+
+        let mut collapsed = 0;
+        for chunk in candidates.into_iter().take(SCAN_BUDGET) {
+            if collapsed == budget {
+                break;
+            }
+            self.scan_cursor = chunk.end;
+            if chunk_flags(aspace, &chunk).is_none() || !is_populated(aspace, &chunk) {
+                continue;
+            }
+            let start = VirtAddr::from(chunk.start);
+            let flags = freeze(aspace, &chunk)?;
+            let (data, _) = read_pages(aspace, start, HUGE_PAGE_SIZE);
+            aspace.unmap(start, HUGE_PAGE_SIZE)?;
+            aspace.map(
+                start,
+                HUGE_PAGE_SIZE,
+                flags,
+                true,
+                Backend::new_alloc(start, PageSize::Size2M),
+            )?;
+            write_pages(aspace, start, &data)?;
+            self.huge.insert(chunk);
+            collapsed += 1;
+        }
+        Ok(collapsed)
+    }
+
+    /// Bytes of `range` backed by populated huge pages.
+    pub fn huge_bytes_in(&self, aspace: &AddrSpace, range: Range<usize>) -> usize {
+        self.huge
+            .iter()
+            .flat_map(chunks)
+            .filter(|chunk| chunk.start >= range.start && chunk.end <= range.end)
+            .filter(|chunk| {
+                aspace
+                    .page_table()
+                    .query(VirtAddr::from(chunk.start))
+                    .is_ok()
+            })
+            .count()
+            * HUGE_PAGE_SIZE
+    }
+}
+
+async fn collapse_task() {
+    loop {
+        axtask::future::sleep(COLLAPSE_INTERVAL).await;
+        if thp_mode() == ThpMode::Never {
+            continue;
+        }
+        for proc_data in processes() {
+            let aspace = proc_data.aspace();
+            let mut aspace = aspace.lock();
+            if let Err(err) = proc_data
+                .aspace_state()
+                .thp
+                .lock()
+                .collapse(&mut aspace, COLLAPSE_BUDGET)
+            {
+                warn!("thp: collapse failed for {:?}: {err:?}", proc_data.proc);
+            }
+        }
+    }
+}
+
+/// Spawns the background huge page collapse task.
+pub fn spawn_collapse_task() {
+    // See the module documentation.
+    if CPU_NUM > 1 {
+        return;
+    }
+    axtask::spawn_raw(
+        || axtask::future::block_on(collapse_task()),
+        "khugepaged".into(),
+        axconfig::TASK_STACK_SIZE,
+    );
+}
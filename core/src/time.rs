@@ -1,19 +1,36 @@
 //! Time management module.
+//!
+//! Interval timers are kept in a timer wheel per CPU and expired there by an
+//! alarm task bound to that CPU, so arming, re-arming and cancelling a timer
+//! are constant time and only contend with timers of the same CPU. Other
+//! kernel objects that need a deadline, like timerfds, arm the same wheels
+//! through [`set_alarm`].
 
-use alloc::{borrow::ToOwned, collections::binary_heap::BinaryHeap, sync::Arc};
+mod wheel;
+
+use alloc::{
+    format,
+    sync::{Arc, Weak},
+    vec::Vec,
+};
 use core::{mem, time::Duration};
 
-use axhal::time::{NANOS_PER_SEC, TimeValue, monotonic_time_nanos, wall_time};
+use axconfig::plat::CPU_NUM;
+use axhal::{
+    percpu::this_cpu_id,
+    time::{NANOS_PER_SEC, TimeValue, monotonic_time_nanos, wall_time},
+};
 use axtask::{
-    WeakAxTaskRef, current,
+    AxCpuMask, WeakAxTaskRef, current,
     future::{block_on, timeout_at},
 };
 use event_listener::{Event, listener};
+use kspin::SpinNoIrq;
 use lazy_static::lazy_static;
-use spin::Mutex;
 use starry_signal::Signo;
 use strum::FromRepr;
 
+pub use self::wheel::{TimerKey, TimerWheel};
 use crate::task::poll_timer;
 
 fn time_value_from_nanos(nanos: usize) -> TimeValue {
@@ -22,30 +39,113 @@ fn time_value_from_nanos(nanos: usize) -> TimeValue {
     TimeValue::new(secs, nsecs as u32)
 }
 
-struct Entry {
-    deadline: Duration,
-    task: WeakAxTaskRef,
+/// Length of a timer wheel tick.
+const TICK_NS: u64 = 1_000_000;
+
+/// Default timer slack of a thread, as in Linux.
+pub const DEFAULT_TIMER_SLACK_NS: usize = 50_000;
+
+fn tick_of(time: Duration) -> u64 {
+    (time.as_nanos() as u64).div_ceil(TICK_NS)
 }
-impl PartialEq for Entry {
-    fn eq(&self, other: &Self) -> bool {
-        self.deadline == other.deadline
-    }
+
+fn time_of(tick: u64) -> Duration {
+    Duration::from_nanos(tick.saturating_mul(TICK_NS))
 }
-impl Eq for Entry {}
-impl PartialOrd for Entry {
-    fn partial_cmp(&self, other: &Self) -> Option<core::cmp::Ordering> {
-        Some(other.deadline.cmp(&self.deadline))
-    }
+
+/// Something to notify when an alarm armed with [`set_alarm`] goes off.
+pub trait Alarm: Send + Sync {
+    /// Called from the alarm task of the CPU the alarm was armed on, with no
+    /// timer locks held, so it may arm the next alarm.
+    fn fire(&self);
+}
+
+/// What an expired alarm notifies.
+enum AlarmTarget {
+    /// A thread whose interval timers are due.
+    Task(WeakAxTaskRef),
+    Alarm(Weak<dyn Alarm>),
 }
-impl Ord for Entry {
-    fn cmp(&self, other: &Self) -> core::cmp::Ordering {
-        other.deadline.cmp(&self.deadline)
+
+impl AlarmTarget {
+    fn fire(self) {
+        match self {
+            AlarmTarget::Task(task) => {
+                if let Some(task) = task.upgrade() {
+                    poll_timer(&task);
+                }
+            }
+            AlarmTarget::Alarm(alarm) => {
+                if let Some(alarm) = alarm.upgrade() {
+                    alarm.fire();
+                }
+            }
+        }
     }
 }
 
+/// Timers armed on one CPU, expired by its own alarm task.
+struct CpuAlarms {
+    wheel: SpinNoIrq<TimerWheel<AlarmTarget>>,
+    event: Event,
+}
+
 lazy_static! {
-    static ref ALARM_LIST: Mutex<BinaryHeap<Entry>> = Mutex::new(BinaryHeap::new());
-    static ref EVENT_NEW_TIMER: Event = Event::new();
+    static ref ALARMS: Vec<CpuAlarms> = {
+        let now = tick_of(wall_time());
+        (0..CPU_NUM)
+            .map(|_| CpuAlarms {
+                wheel: SpinNoIrq::new(TimerWheel::new(now)),
+                event: Event::new(),
+            })
+            .collect()
+    };
+}
+
+/// A pending alarm.
+pub struct AlarmHandle {
+    cpu: usize,
+    key: TimerKey,
+}
+
+/// Arranges for `target` to be notified at `deadline`, or up to `slack_ns`
+/// later.
+///
+/// The deadline is rounded up to the largest power of two number of ticks
+/// within the slack, so that nearby alarms fire together in one wakeup.
+fn arm_alarm(deadline: Duration, slack_ns: usize, target: AlarmTarget) -> AlarmHandle {
+    let mut tick = tick_of(deadline);
+    let slack_ticks = slack_ns as u64 / TICK_NS;
+    if slack_ticks > 1 {
+        let granularity = 1 << slack_ticks.ilog2();
+        tick = tick.next_multiple_of(granularity);
+    }
+
+    let cpu = this_cpu_id() % CPU_NUM;
+    let alarms = &ALARMS[cpu];
+    let mut wheel = alarms.wheel.lock();
+    let next = wheel.next_tick();
+    let key = wheel.insert(tick, target);
+    drop(wheel);
+    if next.is_none_or(|next| tick < next) {
+        alarms.event.notify(1);
+    }
+    AlarmHandle { cpu, key }
+}
+
+/// Arranges for `alarm` to fire once the wall time reaches `deadline`.
+///
+/// Nothing keeps `alarm` alive in the meantime; if it is gone by then, the
+/// alarm is simply dropped.
+pub fn set_alarm(deadline: Duration, alarm: Weak<dyn Alarm>) -> AlarmHandle {
+    arm_alarm(deadline, 0, AlarmTarget::Alarm(alarm))
+}
+
+/// Cancels an alarm that has not fired yet.
+pub fn cancel_alarm(handle: AlarmHandle) {
+    let target = ALARMS[handle.cpu].wheel.lock().cancel(handle.key);
+    // Drop the reference outside the lock.
+    drop(target);
 }
 
 /// The type of interval timer.
@@ -76,13 +176,20 @@ impl ITimerType {
 struct ITimer {
     interval_ns: usize,
     remained_ns: usize,
+    slack_ns: usize,
+    /// The thread to poll when the timer expires.
+    owner: WeakAxTaskRef,
+    alarm: Option<AlarmHandle>,
 }
 
 impl ITimer {
-    pub fn new(interval_ns: usize, remained_ns: usize) -> Self {
-        let result = Self {
+    pub fn new(interval_ns: usize, remained_ns: usize, slack_ns: usize) -> Self {
+        let mut result = Self {
             interval_ns,
             remained_ns,
+            slack_ns,
+            owner: Arc::downgrade(&current()),
+            alarm: None,
         };
         result.renew_timer();
         result
@@ -102,19 +209,25 @@ impl ITimer {
         }
     }
 
-    pub fn renew_timer(&self) {
+    pub fn renew_timer(&mut self) {
+        if let Some(alarm) = self.alarm.take() {
+            cancel_alarm(alarm);
+        }
         if self.remained_ns > 0 {
             let deadline = wall_time() + Duration::from_nanos(self.remained_ns as u64);
-            let mut guard = ALARM_LIST.lock();
-            let should_wake = guard.peek().is_none_or(|it| it.deadline > deadline);
-            guard.push(Entry {
+            self.alarm = Some(arm_alarm(
                 deadline,
-                task: Arc::downgrade(&current()),
-            });
-            drop(guard);
-            if should_wake {
-                EVENT_NEW_TIMER.notify(1);
-            }
+                self.slack_ns,
+                AlarmTarget::Task(self.owner.clone()),
+            ));
+        }
+    }
+}
+
+impl Drop for ITimer {
+    fn drop(&mut self) {
+        if let Some(alarm) = self.alarm.take() {
+            cancel_alarm(alarm);
         }
     }
 }
@@ -138,6 +251,7 @@ pub struct TimeManager {
     last_wall_ns: usize,
     state: TimerState,
     itimers: [ITimer; 3],
+    timer_slack_ns: usize,
 }
 
 impl Default for TimeManager {
@@ -154,6 +268,7 @@ impl TimeManager {
             last_wall_ns: 0,
             state: TimerState::None,
             itimers: Default::default(),
+            timer_slack_ns: DEFAULT_TIMER_SLACK_NS,
         }
     }
 
@@ -200,7 +315,7 @@ impl TimeManager {
     ) -> (TimeValue, TimeValue) {
         let old = mem::replace(
             &mut self.itimers[ty as usize],
-            ITimer::new(interval_ns, remained_ns),
+            ITimer::new(interval_ns, remained_ns, self.timer_slack_ns),
         );
         (
             time_value_from_nanos(old.interval_ns),
@@ -217,6 +332,21 @@ impl TimeManager {
         )
     }
 
+    /// Returns the timer slack of the thread in nanoseconds.
+    pub fn timer_slack(&self) -> usize {
+        self.timer_slack_ns
+    }
+
+    /// Sets the timer slack of the thread, by which its timers may be
+    /// delayed to expire together with others. Zero restores the default.
+    pub fn set_timer_slack(&mut self, slack_ns: usize) {
+        self.timer_slack_ns = if slack_ns == 0 {
+            DEFAULT_TIMER_SLACK_NS
+        } else {
+            slack_ns
+        };
+    }
+
     fn update_itimer(&mut self, ty: ITimerType, delta: usize, emitter: impl Fn(Signo)) {
         if self.itimers[ty as usize].update(delta) {
             emitter(ty.signo());
@@ -224,53 +354,38 @@ impl TimeManager {
     }
 }
 
-async fn alarm_task() {
+async fn alarm_task(cpu: usize) {
+    let alarms = &ALARMS[cpu];
+    let mut expired = Vec::new();
     loop {
-        let guard = ALARM_LIST.lock();
-        let Some(entry) = guard.peek() else {
-            drop(guard);
-            listener!(EVENT_NEW_TIMER => listener);
-
-            if !ALARM_LIST.lock().is_empty() {
-                continue;
-            }
-            listener.await;
-
-            continue;
-        };
+        let now = tick_of(wall_time());
+        alarms.wheel.lock().advance(now, &mut expired);
+        for target in expired.drain(..) {
+            target.fire();
+        }
 
-        let now = wall_time();
-        if entry.deadline <= now {
-            let entry_deadline = entry.deadline;
-            if let Some(task) = entry.task.upgrade() {
-                drop(guard);
-                poll_timer(&task);
-            } else {
-                drop(guard);
-            }
-            let mut guard = ALARM_LIST.lock();
-            assert!(guard.pop().is_some_and(|it| it.deadline == entry_deadline));
-        } else {
-            let deadline = entry.deadline;
-            drop(guard);
-            listener!(EVENT_NEW_TIMER => listener);
-            if ALARM_LIST
-                .lock()
-                .peek()
-                .is_none_or(|it| it.deadline != deadline)
-            {
-                continue;
+        listener!(alarms.event => listener);
+        let next = alarms.wheel.lock().next_tick();
+        match next {
+            Some(next) if next <= tick_of(wall_time()) => continue,
+            Some(next) => {
+                let _ = timeout_at(Some(time_of(next)), listener).await;
             }
-            let _ = timeout_at(Some(deadline), listener).await;
+            None => listener.await,
         }
     }
 }
 
-/// Spawns the alarm task.
+/// Spawns the alarm tasks, one bound to each CPU.
 pub fn spawn_alarm_task() {
-    axtask::spawn_raw(
-        || block_on(alarm_task()),
-        "alarm_task".to_owned(),
-        axconfig::TASK_STACK_SIZE,
-    );
+    for cpu in 0..CPU_NUM {
+        axtask::spawn_raw(
+            move || {
+                axtask::set_current_affinity(AxCpuMask::one_shot(cpu));
+                block_on(alarm_task(cpu))
+            },
+            format!("alarm_task/{cpu}"),
+            axconfig::TASK_STACK_SIZE,
+        );
+    }
 }
@@ -0,0 +1,213 @@
+//! Hierarchical timer wheel.
+//!
+//! Timers are filed into one of [`LEVELS`] rings of [`LEVEL_SIZE`] slots;
+//! a slot of level `l` spans `LEVEL_SIZE^l` ticks. When the lower levels wrap
+//! around, the slot of the next level that is now due is emptied and its
+//! timers are filed again, closer to the bottom. Inserting and cancelling a
+//! timer are O(1): cancelling only frees the timer, and the dangling key left
+//! in its slot is skipped when the slot comes up.
+
+use alloc::vec::Vec;
+use core::mem;
+
+use slab::Slab;
+
+const LEVEL_BITS: u32 = 6;
+const LEVEL_SIZE: usize = 1 << LEVEL_BITS;
+const LEVELS: usize = 4;
+
+/// Deadlines further away than this are parked in the top level and filed
+/// again each time it comes around.
+const MAX_DELAY: u64 = 1 << (LEVEL_BITS * LEVELS as u32);
+
+/// Identifies a timer in a [`TimerWheel`].
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct TimerKey {
+    index: usize,
+    generation: u64,
+}
+
+struct Timer<T> {
+    deadline: u64,
+    generation: u64,
+    value: T,
+}
+
+/// A hierarchical timer wheel counting in abstract ticks.
+pub struct TimerWheel<T> {
+    /// The next tick to be processed.
+    now: u64,
+    timers: Slab<Timer<T>>,
+    slots: [[Vec<TimerKey>; LEVEL_SIZE]; LEVELS],
+    /// Bitmaps of the non-empty slots of each level.
+    occupied: [u64; LEVELS],
+    generation: u64,
+    /// Number of keys of cancelled timers still sitting in slots.
+    stale: usize,
+}
+
+impl<T> TimerWheel<T> {
+    /// Creates an empty wheel starting at tick `now`.
+    pub fn new(now: u64) -> Self {
+        Self {
+            now,
+            timers: Slab::new(),
+            slots: [const { [const { Vec::new() }; LEVEL_SIZE] }; LEVELS],
+            occupied: [0; LEVELS],
+            generation: 0,
+            stale: 0,
+        }
+    }
+
+    /// Whether there are no pending timers.
+    pub fn is_empty(&self) -> bool {
+        self.timers.is_empty()
+    }
+
+    fn file(&mut self, key: TimerKey, deadline: u64) {
+        let delta = deadline.saturating_sub(self.now).min(MAX_DELAY - 1);
+        let level = if delta == 0 {
+            0
+        } else {
+            (delta.ilog2() / LEVEL_BITS) as usize
+        };
+        let slot = ((self.now + delta) >> (level as u32 * LEVEL_BITS)) as usize & (LEVEL_SIZE - 1);
+        self.slots[level][slot].push(key);
+        self.occupied[level] |= 1 << slot;
+    }
+
+    /// Adds a timer expiring at tick `deadline`.
+    ///
+    /// A deadline in the past expires at the next [`Self::advance`].
+    pub fn insert(&mut self, deadline: u64, value: T) -> TimerKey {
+        self.generation += 1;
+        let generation = self.generation;
+        let index = self.timers.insert(Timer {
+            deadline,
+            generation,
+            value,
+        });
+        let key = TimerKey { index, generation };
+        self.file(key, deadline);
+        key
+    }
+
+    fn is_live(&self, key: TimerKey) -> bool {
+        self.timers
+            .get(key.index)
+            .is_some_and(|timer| timer.generation == key.generation)
+    }
+
+    /// Removes a pending timer, returning its value.
+    pub fn cancel(&mut self, key: TimerKey) -> Option<T> {
+        if !self.is_live(key) {
+            return None;
+        }
+        let timer = self.timers.remove(key.index);
+        self.stale += 1;
+        if self.stale > self.timers.len() + 1024 {
+            self.refile_all();
+        }
+        Some(timer.value)
+    }
+
+    /// Drops the keys of cancelled timers by filing every live timer anew.
+    fn refile_all(&mut self) {
+        for level in &mut self.slots {
+            for slot in level {
+                slot.clear();
+            }
+        }
+        self.occupied = [0; LEVELS];
+        self.stale = 0;
+        let live = self
+            .timers
+            .iter()
+            .map(|(index, timer)| {
+                let key = TimerKey {
+                    index,
+                    generation: timer.generation,
+                };
+                (key, timer.deadline)
+            })
+            .collect::<Vec<_>>();
+        for (key, deadline) in live {
+            self.file(key, deadline);
+        }
+    }
+
+    fn take_slot(&mut self, level: usize, slot: usize) -> Vec<TimerKey> {
+        self.occupied[level] &= !(1 << slot);
+        mem::take(&mut self.slots[level][slot])
+    }
+
+    /// Moves the timers of the slot of `level` that is now due down.
+    fn cascade(&mut self, level: usize) {
+        let slot = (self.now >> (level as u32 * LEVEL_BITS)) as usize & (LEVEL_SIZE - 1);
+        for key in self.take_slot(level, slot) {
+            if self.is_live(key) {
+                let deadline = self.timers[key.index].deadline;
+                self.file(key, deadline);
+            } else {
+                self.stale = self.stale.saturating_sub(1);
+            }
+        }
+    }
+
+    /// Processes all ticks up to and including `now`, collecting the values
+    /// of the timers that expired.
+    pub fn advance(&mut self, now: u64, expired: &mut Vec<T>) {
+        let mask = LEVEL_SIZE as u64 - 1;
+        while self.now <= now {
+            if self.now & mask != 0 && self.occupied[0] == 0 {
+                // Nothing can happen before the bottom level wraps around.
+                self.now = ((self.now | mask) + 1).min(now + 1);
+                continue;
+            }
+            let mut level = 1;
+            while level < LEVELS && self.now & ((1 << (level as u32 * LEVEL_BITS)) - 1) == 0 {
+                level += 1;
+            }
+            for level in (1..level).rev() {
+                self.cascade(level);
+            }
+
+            for key in self.take_slot(0, (self.now & mask) as usize) {
+                if self.is_live(key) {
+                    expired.push(self.timers.remove(key.index).value);
+                } else {
+                    self.stale = self.stale.saturating_sub(1);
+                }
+            }
+            self.now += 1;
+        }
+    }
+
+    /// Returns the earliest tick at which [`Self::advance`] may find work,
+    /// or `None` if no timer is pending.
+    pub fn next_tick(&self) -> Option<u64> {
+        if self.timers.is_empty() {
+            return None;
+        }
+        let mut next = u64::MAX;
+        for (level, &occupied) in self.occupied.iter().enumerate() {
+            if occupied == 0 {
+                continue;
+            }
+            let shift = level as u32 * LEVEL_BITS;
+            let current = (self.now >> shift) as u32 & (LEVEL_SIZE as u32 - 1);
+            let rotated = occupied.rotate_right(current);
+            // The current slot of an upper level was emptied on the way in,
+            // so anything there is a full turn away.
+            let rotated = if level == 0 { rotated } else { rotated & !1 };
+            let distance = if rotated == 0 {
+                LEVEL_SIZE as u64
+            } else {
+                rotated.trailing_zeros() as u64
+            };
+            let tick = (((self.now >> shift) + distance) << shift).max(self.now);
+            next = next.min(tick);
+        }
+        Some(next)
+    }
+}
@@ -0,0 +1,380 @@
+//! The vDSO.
+//!
+//! Every user address space maps two pages right after the signal
+//! trampoline: a data page the kernel keeps up to date under a sequence lock,
+//! and a small shared object, built at boot around the code in `vdso/*.S`,
+//! that reads it. `clock_gettime`, `gettimeofday` and `getcpu` are then
+//! served in user space from the hardware counter, without a trap; anything
+//! those cannot answer falls back to the real syscall.
+
+use alloc::{vec, vec::Vec};
+use core::{
+    cell::UnsafeCell,
+    sync::atomic::{AtomicBool, AtomicU32, AtomicU64, Ordering, fence},
+};
+
+use axconfig::plat::CPU_NUM;
+use axerrno::AxResult;
+use axhal::{
+    mem::virt_to_phys,
+    paging::MappingFlags,
+    percpu::this_cpu_id,
+    time::{NANOS_PER_SEC, current_ticks, nanos_to_ticks, ticks_to_nanos, wall_time_nanos},
+};
+use axmm::AddrSpace;
+use kernel_elf_parser::{AuxEntry, AuxType};
+use kspin::SpinNoIrq;
+use memory_addr::PAGE_SIZE_4K;
+use spin::Once;
+
+use crate::config::{VDSO_BASE, VDSO_DATA};
+
+cfg_if::cfg_if! {
+    if #[cfg(target_arch = "x86_64")] {
+        core::arch::global_asm!(include_str!("vdso/x86_64.S"));
+        const EM_MACHINE: u16 = 62;
+        const EF_FLAGS: u32 = 0;
+    } else if #[cfg(target_arch = "riscv64")] {
+        core::arch::global_asm!(include_str!("vdso/riscv64.S"));
+        const EM_MACHINE: u16 = 243;
+        // RVC, double-float ABI
+        const EF_FLAGS: u32 = 0x5;
+    } else if #[cfg(target_arch = "loongarch64")] {
+        core::arch::global_asm!(include_str!("vdso/loongarch64.S"));
+        const EM_MACHINE: u16 = 258;
+        // LP64D, object file ABI v1
+        const EF_FLAGS: u32 = 0x43;
+    } else {
+        // Never built; only there for the symbols.
+        core::arch::global_asm!(
+            ".pushsection .rodata.starry_vdso, \"a\"",
+            ".globl starry_vdso_start, starry_vdso_end",
+            ".globl starry_vdso_clock_gettime, starry_vdso_gettimeofday, starry_vdso_getcpu",
+            "starry_vdso_start:",
+            "starry_vdso_clock_gettime:",
+            "starry_vdso_gettimeofday:",
+            "starry_vdso_getcpu:",
+            "starry_vdso_end:",
+            ".popsection",
+        );
+        const EM_MACHINE: u16 = 0;
+        const EF_FLAGS: u32 = 0;
+    }
+}
+
+/// Whether this architecture has a vDSO.
+const SUPPORTED: bool = cfg!(any(
+    target_arch = "x86_64",
+    target_arch = "riscv64",
+    target_arch = "loongarch64"
+));
+
+/// Fractional bits of [`VdsoData::mult`].
+const SHIFT: u32 = 32;
+
+/// The data page shared with user space.
+///
+/// The layout is relied upon by the assembly in `vdso/*.S`.
+#[repr(C)]
+struct VdsoData {
+    /// Odd while an update is in progress.
+    seq: AtomicU32,
+    /// Whether user space may read the hardware counter.
+    counter: AtomicU32,
+    /// Counter value at the last update.
+    cycle_last: AtomicU64,
+    /// Nanoseconds per counter tick, with [`SHIFT`] fractional bits.
+    mult: AtomicU64,
+    shift: AtomicU32,
+    /// Whether the `getcpu` fast path may be used.
+    getcpu: AtomicU32,
+    /// Monotonic time at the last update, in nanoseconds.
+    mono_ns: AtomicU64,
+    /// Offset of the real-time clock from the monotonic one.
+    wall_offset_ns: AtomicU64,
+}
+
+#[repr(C, align(4096))]
+struct DataPage(VdsoData);
+
+#[repr(C, align(4096))]
+struct ImagePage(UnsafeCell<[u8; PAGE_SIZE_4K]>);
+
+// SAFETY: only written once, in `init`, before it is shared.
+unsafe impl Sync for ImagePage {}
+
+static DATA: DataPage = DataPage(VdsoData {
+    seq: AtomicU32::new(0),
+    counter: AtomicU32::new(0),
+    cycle_last: AtomicU64::new(0),
+    mult: AtomicU64::new(0),
+    shift: AtomicU32::new(SHIFT),
+    getcpu: AtomicU32::new(0),
+    mono_ns: AtomicU64::new(0),
+    wall_offset_ns: AtomicU64::new(0),
+});
+
+static IMAGE: ImagePage = ImagePage(UnsafeCell::new([0; PAGE_SIZE_4K]));
+
+static READY: Once = Once::new();
+
+/// Serializes updates of the data page.
+static WRITER: SpinNoIrq<()> = SpinNoIrq::new(());
+
+static CPU_READY: [AtomicBool; CPU_NUM] = [const { AtomicBool::new(false) }; CPU_NUM];
+
+unsafe extern "C" {
+    safe static starry_vdso_start: u8;
+    safe static starry_vdso_end: u8;
+    safe static starry_vdso_clock_gettime: u8;
+    safe static starry_vdso_gettimeofday: u8;
+    safe static starry_vdso_getcpu: u8;
+}
+
+/// Builds the vDSO and starts publishing the time in its data page.
+pub fn init() {
+    if !SUPPORTED {
+        return;
+    }
+    READY.call_once(|| {
+        let image = build_image();
+        assert!(image.len() <= PAGE_SIZE_4K, "vDSO does not fit in a page");
+        // SAFETY: nothing maps the page before `READY` is set.
+        unsafe { (*IMAGE.0.get())[..image.len()].copy_from_slice(&image) };
+
+        let data = &DATA.0;
+        let freq = nanos_to_ticks(NANOS_PER_SEC).max(1);
+        let mult = ((NANOS_PER_SEC as u128) << SHIFT) / freq as u128;
+        data.mult.store(mult as u64, Ordering::Relaxed);
+        data.counter.store(1, Ordering::Relaxed);
+        data.getcpu.store(has_getcpu() as u32, Ordering::Relaxed);
+        update();
+    });
+}
+
+/// Refreshes the data page; called on every timer tick.
+pub fn update() {
+    if !READY.is_completed() {
+        return;
+    }
+    // Another CPU is at it for the same tick.
+    let Some(_guard) = WRITER.try_lock() else {
+        return;
+    };
+    let data = &DATA.0;
+    let cycles = current_ticks();
+    let mono_ns = ticks_to_nanos(cycles);
+    let wall_offset_ns = wall_time_nanos().saturating_sub(mono_ns);
+
+    let seq = data.seq.load(Ordering::Relaxed);
+    data.seq.store(seq.wrapping_add(1), Ordering::Relaxed);
+    fence(Ordering::Release);
+    data.cycle_last.store(cycles, Ordering::Relaxed);
+    data.mono_ns.store(mono_ns, Ordering::Relaxed);
+    data.wall_offset_ns.store(wall_offset_ns, Ordering::Relaxed);
+    data.seq.store(seq.wrapping_add(2), Ordering::Release);
+}
+
+/// Lets user code on this CPU use the vDSO fast paths; called before every
+/// entry to user space and on every timer tick.
+#[inline]
+pub fn prepare_cpu() {
+    let cpu = this_cpu_id();
+    let ready = &CPU_READY[cpu % CPU_NUM];
+    if ready.load(Ordering::Relaxed) {
+        return;
+    }
+    prepare_cpu_slow(cpu);
+    ready.store(true, Ordering::Relaxed);
+}
+
+#[cold]
+fn prepare_cpu_slow(_cpu: usize) {
+    cfg_if::cfg_if! {
+        if #[cfg(target_arch = "x86_64")] {
+            if has_getcpu() {
+                // IA32_TSC_AUX, read by `rdtscp`.
+                // SAFETY: the MSR exists when `rdtscp` does.
+                unsafe {
+                    core::arch::asm!(
+                        "wrmsr",
+                        in("ecx") 0xc000_0103u32,
+                        in("eax") _cpu as u32,
+                        in("edx") 0u32,
+                    );
+                }
+            }
+        } else if #[cfg(target_arch = "riscv64")] {
+            // Allow `rdtime` in user mode.
+            // SAFETY: only affects what user mode may read.
+            unsafe { core::arch::asm!("csrs scounteren, {}", in(reg) 2usize) };
+        } else if #[cfg(target_arch = "loongarch64")] {
+            // The timer ID, returned by `rdtime.d`.
+            // SAFETY: nothing else uses the timer ID.
+            unsafe { core::arch::asm!("csrwr {}, 0x40", inout(reg) _cpu => _) };
+        }
+    }
+}
+
+/// Whether the CPU can tell user space its number without a syscall.
+fn has_getcpu() -> bool {
+    cfg_if::cfg_if! {
+        if #[cfg(target_arch = "x86_64")] {
+            #[allow(unused_unsafe)]
+            // SAFETY: `cpuid` is always available on x86_64.
+            let edx = unsafe { core::arch::x86_64::__cpuid(0x8000_0001) }.edx;
+            edx & (1 << 27) != 0
+        } else {
+            cfg!(target_arch = "loongarch64")
+        }
+    }
+}
+
+/// Maps the vDSO into `aspace` and advertises it in `auxv`.
+pub fn map(aspace: &mut AddrSpace, auxv: &mut Vec<AuxEntry>) -> AxResult {
+    if !READY.is_completed() {
+        return Ok(());
+    }
+    aspace.map_linear(
+        VDSO_DATA.into(),
+        virt_to_phys((&raw const DATA as usize).into()),
+        PAGE_SIZE_4K,
+        MappingFlags::READ | MappingFlags::USER,
+    )?;
+    aspace.map_linear(
+        VDSO_BASE.into(),
+        virt_to_phys((IMAGE.0.get() as usize).into()),
+        PAGE_SIZE_4K,
+        MappingFlags::READ | MappingFlags::EXECUTE | MappingFlags::USER,
+    )?;
+    // Ahead of the terminating null entry.
+    auxv.insert(0, AuxEntry::new(AuxType::SYSINFO_EHDR, VDSO_BASE));
+    Ok(())
+}
+
+/// Builds a shared object exporting the functions of the vDSO code, laid out
+/// to be mapped at offset 0 of its page.
+fn build_image() -> Vec<u8> {
+    const EHDR_SIZE: usize = 64;
+    const PHDR_SIZE: usize = 56;
+    const DYN_SIZE: usize = 16;
+    const SYM_SIZE: usize = 24;
+
+    let start = &raw const starry_vdso_start as usize;
+    let text = start..&raw const starry_vdso_end as usize;
+    let symbols = [
+        (
+            &b"__vdso_clock_gettime"[..],
+            &raw const starry_vdso_clock_gettime as usize,
+        ),
+        (
+            &b"__vdso_gettimeofday"[..],
+            &raw const starry_vdso_gettimeofday as usize,
+        ),
+        (
+            &b"__vdso_getcpu"[..],
+            &raw const starry_vdso_getcpu as usize,
+        ),
+    ];
+
+    let mut strtab = vec![0u8];
+    let soname = strtab.len();
+    strtab.extend_from_slice(b"linux-vdso.so.1\0");
+    let names = symbols
+        .iter()
+        .map(|(name, _)| {
+            let pos = strtab.len();
+            strtab.extend_from_slice(name);
+            strtab.push(0);
+            pos
+        })
+        .collect::<Vec<_>>();
+
+    let nsyms = symbols.len() + 1;
+    let phdr_off = EHDR_SIZE;
+    let dyn_off = phdr_off + 2 * PHDR_SIZE;
+    let dyn_len = 7 * DYN_SIZE;
+    let sym_off = dyn_off + dyn_len;
+    // One bucket chaining every symbol.
+    let hash_off = sym_off + nsyms * SYM_SIZE;
+    let str_off = hash_off + (3 + nsyms) * 4;
+    let text_off = (str_off + strtab.len()).next_multiple_of(16);
+    let total = text_off + text.len();
+
+    let mut out = Vec::with_capacity(total);
+    let u16 = |out: &mut Vec<u8>, v: u16| out.extend_from_slice(&v.to_le_bytes());
+    let u32 = |out: &mut Vec<u8>, v: u32| out.extend_from_slice(&v.to_le_bytes());
+    let u64 = |out: &mut Vec<u8>, v: u64| out.extend_from_slice(&v.to_le_bytes());
+
+    // ELF header: 64-bit, little-endian, shared object, no sections.
+    out.extend_from_slice(&[0x7f, b'E', b'L', b'F', 2, 1, 1, 0]);
+    out.extend_from_slice(&[0; 8]);
+    u16(&mut out, 3);
+    u16(&mut out, EM_MACHINE);
+    u32(&mut out, 1);
+    u64(&mut out, 0);
+    u64(&mut out, phdr_off as u64);
+    u64(&mut out, 0);
+    u32(&mut out, EF_FLAGS);
+    u16(&mut out, EHDR_SIZE as u16);
+    u16(&mut out, PHDR_SIZE as u16);
+    u16(&mut out, 2);
+    u16(&mut out, 64);
+    u16(&mut out, 0);
+    u16(&mut out, 0);
+
+    // PT_LOAD covering everything, readable and executable.
+    u32(&mut out, 1);
+    u32(&mut out, 5);
+    for v in [0, 0, 0, total as u64, total as u64, PAGE_SIZE_4K as u64] {
+        u64(&mut out, v);
+    }
+    // PT_DYNAMIC
+    u32(&mut out, 2);
+    u32(&mut out, 4);
+    for v in [dyn_off, dyn_off, dyn_off, dyn_len, dyn_len, 8] {
+        u64(&mut out, v as u64);
+    }
+
+    for (tag, val) in [
+        (4, hash_off),
+        (5, str_off),
+        (6, sym_off),
+        (10, strtab.len()),
+        (11, SYM_SIZE),
+        (14, soname),
+        (0, 0),
+    ] {
+        u64(&mut out, tag);
+        u64(&mut out, val as u64);
+    }
+
+    out.extend_from_slice(&[0; SYM_SIZE]);
+    for ((_, addr), name) in symbols.iter().zip(&names) {
+        u32(&mut out, *name as u32);
+        // STB_GLOBAL, STT_FUNC
+        out.push(0x12);
+        out.push(0);
+        // Any defined section; there is no section table.
+        u16(&mut out, 1);
+        u64(&mut out, (text_off + addr - start) as u64);
+        u64(&mut out, 0);
+    }
+
+    // With a single bucket the hash of a name does not matter.
+    u32(&mut out, 1);
+    u32(&mut out, nsyms as u32);
+    u32(&mut out, (nsyms - 1) as u32);
+    u32(&mut out, 0);
+    for i in 1..nsyms {
+        u32(&mut out, (i - 1) as u32);
+    }
+
+    out.extend_from_slice(&strtab);
+    out.resize(text_off, 0);
+    // SAFETY: the range spans the vDSO code in the kernel image.
+    out.extend_from_slice(unsafe {
+        core::slice::from_raw_parts(text.start as *const u8, text.len())
+    });
+    out
+}
@@ -1,11 +1,12 @@
-use alloc::{borrow::Cow, sync::Arc, vec::Vec};
-use core::{any::Any, cmp::Ordering, task::Context};
+use alloc::{borrow::Cow, string::String, sync::Arc, vec::Vec};
+use core::{any::Any, cmp::Ordering, mem, task::Context};
 
 use axfs_ng_vfs::{
     FileNodeOps, FilesystemOps, Metadata, MetadataUpdate, NodeFlags, NodeOps, NodePermission,
     NodeType, VfsError, VfsResult,
 };
 use axpoll::{IoEvents, Pollable};
+use axsync::Mutex;
 use inherit_methods_macro::inherit_methods;
 
 use super::fs::{SimpleFs, SimpleFsNode};
@@ -16,6 +17,15 @@ pub trait SimpleFileOps: Send + Sync + 'static {
     fn read_all(&self) -> VfsResult<Cow<[u8]>>;
     /// Replaces the file's content with `data`.
     fn write_all(&self, data: &[u8]) -> VfsResult<()>;
+
+    /// Appends all content in the file to `buf`, which is empty.
+    ///
+    /// Files that generate their content can write it straight into `buf`,
+    /// whose capacity is kept from the last read.
+    fn read_into(&self, buf: &mut Vec<u8>) -> VfsResult<()> {
+        buf.extend_from_slice(&self.read_all()?);
+        Ok(())
+    }
 }
 
 /// Type representing operation applied to a simple file.
@@ -69,10 +79,61 @@ where
     }
 }
 
+/// A read-only file whose text is written by `F` into the buffer of the
+/// reading file.
+pub struct SeqFile<F>(F);
+
+impl<F> SeqFile<F>
+where
+    F: Fn(&mut String) -> VfsResult<()> + Send + Sync,
+{
+    /// Creates a new `SeqFile`.
+    pub fn new(imp: F) -> Self {
+        Self(imp)
+    }
+}
+
+impl<F> SimpleFileOps for SeqFile<F>
+where
+    F: Fn(&mut String) -> VfsResult<()> + Send + Sync + 'static,
+{
+    fn read_all(&self) -> VfsResult<Cow<[u8]>> {
+        let mut buf = Vec::new();
+        self.read_into(&mut buf)?;
+        Ok(Cow::Owned(buf))
+    }
+
+    fn write_all(&self, _data: &[u8]) -> VfsResult<()> {
+        Err(VfsError::BadFileDescriptor)
+    }
+
+    fn read_into(&self, buf: &mut Vec<u8>) -> VfsResult<()> {
+        // `buf` is empty, so this only moves its allocation over.
+        let mut out = String::from_utf8(mem::take(buf)).unwrap_or_default();
+        let result = (self.0)(&mut out);
+        *buf = out.into_bytes();
+        result
+    }
+}
+
+/// Content of a [`SimpleFile`] as of the last read from its start
+#[derive(Default)]
+struct Snapshot {
+    data: Vec<u8>,
+    valid: bool,
+}
+
 /// A simple file.
+///
+/// Its content is generated when it is read from offset 0 and kept for reads
+/// further in, so reading a large file in small pieces generates it once,
+/// and every piece comes from the same version of it. Nodes of uncacheable
+/// directories such as `/proc/[pid]` are made per lookup, which makes the
+/// snapshot per open file.
 pub struct SimpleFile {
     node: SimpleFsNode,
     ops: Arc<dyn SimpleFileOps>,
+    snapshot: Mutex<Snapshot>,
 }
 
 impl SimpleFile {
@@ -82,9 +143,27 @@ impl SimpleFile {
         Arc::new(Self {
             node,
             ops: Arc::new(ops),
+            snapshot: Mutex::new(Snapshot::default()),
         })
     }
 
+    /// Calls `f` with the content, generating it first if `refresh` is set
+    /// or there is no snapshot.
+    fn with_snapshot<R>(&self, refresh: bool, f: impl FnOnce(&[u8]) -> R) -> VfsResult<R> {
+        let mut snapshot = self.snapshot.lock();
+        if refresh || !snapshot.valid {
+            snapshot.valid = false;
+            snapshot.data.clear();
+            self.ops.read_into(&mut snapshot.data)?;
+            snapshot.valid = true;
+        }
+        Ok(f(&snapshot.data))
+    }
+
+    fn invalidate(&self) {
+        self.snapshot.lock().valid = false;
+    }
+
     /// Creates a simple file from given file operations.
     pub fn new_regular(fs: Arc<SimpleFs>, ops: impl SimpleFileOps) -> Arc<Self> {
         Self::new(fs, NodeType::RegularFile, ops)
@@ -108,7 +187,7 @@ impl NodeOps for SimpleFile {
     }
 
     fn len(&self) -> VfsResult<u64> {
-        Ok(self.ops.read_all()?.len() as u64)
+        self.with_snapshot(false, |data| data.len() as u64)
     }
 
     fn flags(&self) -> NodeFlags {
@@ -118,17 +197,19 @@ impl NodeOps for SimpleFile {
 
 impl FileNodeOps for SimpleFile {
     fn read_at(&self, buf: &mut [u8], offset: u64) -> VfsResult<usize> {
-        let data = self.ops.read_all()?;
-        if offset >= data.len() as u64 {
-            return Ok(0);
-        }
-        let data = &data[offset as usize..];
-        let read = data.len().min(buf.len());
-        buf[..read].copy_from_slice(&data[..read]);
-        Ok(read)
+        self.with_snapshot(offset == 0, |data| {
+            if offset >= data.len() as u64 {
+                return 0;
+            }
+            let data = &data[offset as usize..];
+            let read = data.len().min(buf.len());
+            buf[..read].copy_from_slice(&data[..read]);
+            read
+        })
     }
 
     fn write_at(&self, buf: &[u8], offset: u64) -> VfsResult<usize> {
+        self.invalidate();
         let data = self.ops.read_all()?;
         if offset == 0 && buf.len() >= data.len() {
             self.ops.write_all(buf)?;
@@ -145,6 +226,7 @@ impl FileNodeOps for SimpleFile {
     }
 
     fn append(&self, buf: &[u8]) -> VfsResult<(usize, u64)> {
+        self.invalidate();
         let mut data = self.ops.read_all()?.to_vec();
         data.extend_from_slice(buf);
         self.ops.write_all(&data)?;
@@ -152,6 +234,7 @@ impl FileNodeOps for SimpleFile {
     }
 
     fn set_len(&self, len: u64) -> VfsResult<()> {
+        self.invalidate();
         let data = self.ops.read_all()?;
         match len.cmp(&(data.len() as u64)) {
             Ordering::Less => self.ops.write_all(&data[..len as usize]),
@@ -165,6 +248,7 @@ impl FileNodeOps for SimpleFile {
     }
 
     fn set_symlink(&self, target: &str) -> VfsResult<()> {
+        self.invalidate();
         self.ops.write_all(target.as_bytes())
     }
 }
@@ -0,0 +1,312 @@
+#!/usr/bin/env python3
+"""Runs the microbenchmarks in scripts/bench under QEMU and checks them
+against a stored baseline.
+
+The benchmarks are cross-compiled with the musl toolchain of ARCH and copied
+into /bench of the rootfs image with debugfs. Then the kernel is booted with
+`make run`, and each benchmark is run from the serial console. Every output
+line of the form `<name> [<word> | <key>=<value> ...] <metric>=<number>` is a
+result. Metrics starting with `ns_` or `us_` are better when lower, and all
+others are better when higher.
+
+Results are written as JSON with --output. If scripts/bench/baseline-ARCH.json
+exists, any result that is worse than the baseline by more than --threshold
+makes the script exit with status 1. A missing baseline is only reported,
+unless --require-baseline is given. Pass --update-baseline to store the
+results of this run as the new baseline.
+
+Under TCG (--accel n) timings depend on the host much more than with KVM, so
+the default threshold is wider there. A baseline is only meaningful for the
+accelerator and kind of host it was recorded on, and it stores the
+accelerator so that a mismatch is caught.
+"""
+
+import argparse
+import json
+import os
+import re
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+BENCH_DIR = os.path.join(ROOT, "scripts", "bench")
+DISK_IMG = os.path.join(ROOT, "arceos", "disk.img")
+
+# Benchmark, extra command line arguments.
+BENCHMARKS = [
+    ("syscall", []),
+    ("futex", []),
+    ("ipc", []),
+    ("epoll_wait", []),
+    ("process", []),
+    ("pid_lookup", []),
+    ("file", ["/tmp"]),
+    ("tcp", []),
+    ("user_copy", []),
+]
+
+PROMPT = "starry:~#"
+PORT = 4444
+RESULT = re.compile(r"^(\w+)((?: \S+)*?) (\w+)=(-?\d+(?:\.\d+)?)\s*$")
+DONE = re.compile(r"@@done (\d+)")
+
+parser = argparse.ArgumentParser()
+parser.add_argument("arch")
+parser.add_argument(
+    "--cc", help="C compiler for the guest (default: ARCH-linux-musl-gcc)"
+)
+parser.add_argument("--output", help="write the results to this JSON file")
+parser.add_argument("--baseline", help="baseline to compare against")
+parser.add_argument(
+    "--update-baseline",
+    action="store_true",
+    help="store the results as the new baseline",
+)
+parser.add_argument(
+    "--require-baseline",
+    action="store_true",
+    help="fail if there is no baseline to compare against",
+)
+parser.add_argument(
+    "--threshold",
+    type=float,
+    help="relative change that counts as a regression "
+    "(default: 0.15 with KVM, 0.35 under TCG)",
+)
+parser.add_argument(
+    "--only", nargs="+", metavar="NAME", help="only run these benchmarks"
+)
+parser.add_argument(
+    "--timeout",
+    type=int,
+    default=900,
+    help="seconds each benchmark may run (default: 900)",
+)
+parser.add_argument("--accel", default="n", help="ACCEL passed to make")
+
+args = parser.parse_args()
+arch = args.arch
+cc = args.cc or f"{arch}-linux-musl-gcc"
+threshold = args.threshold
+if threshold is None:
+    threshold = 0.15 if args.accel == "y" else 0.35
+baseline_path = args.baseline or os.path.join(BENCH_DIR, f"baseline-{arch}.json")
+benchmarks = [
+    (name, extra)
+    for name, extra in BENCHMARKS
+    if not args.only or name in args.only
+]
+if not benchmarks:
+    sys.exit("no benchmark selected")
+
+
+def build(outdir):
+    for name, _ in benchmarks:
+        subprocess.run(
+            [
+                cc,
+                "-O2",
+                "-static",
+                "-o",
+                os.path.join(outdir, name),
+                os.path.join(BENCH_DIR, name + ".c"),
+                "-lpthread",
+            ],
+            check=True,
+        )
+
+
+def install(outdir):
+    if not os.path.exists(DISK_IMG):
+        sys.exit(f"{DISK_IMG} not found, run `make ARCH={arch} rootfs` first")
+    commands = ["mkdir /bench", "cd /bench"]
+    for name, _ in benchmarks:
+        commands.append(f"rm {name}")
+        commands.append(f"write {os.path.join(outdir, name)} {name}")
+        commands.append(f"sif {name} mode 0100755")
+    # Errors such as an existing /bench are expected and harmless.
+    subprocess.run(
+        ["debugfs", "-w", "-f", "-", DISK_IMG],
+        input="\n".join(commands) + "\n",
+        text=True,
+        stdout=subprocess.DEVNULL,
+        stderr=subprocess.DEVNULL,
+        check=True,
+    )
+
+
+class Console:
+    def __init__(self, sock):
+        self.sock = sock
+        self.buffer = ""
+
+    def read_until(self, pattern, timeout):
+        deadline = time.monotonic() + timeout
+        while True:
+            match = pattern.search(self.buffer)
+            if match:
+                out = self.buffer[: match.end()]
+                self.buffer = self.buffer[match.end() :]
+                return out, match
+            left = deadline - time.monotonic()
+            if left <= 0:
+                raise Exception(f"Timeout waiting for {pattern.pattern!r}")
+            self.sock.settimeout(left)
+            try:
+                b = self.sock.recv(4096).decode("utf-8", errors="ignore")
+            except socket.timeout:
+                continue
+            if not b:
+                raise Exception("Serial console closed")
+            print(b, end="", file=sys.stderr)
+            self.buffer += b
+
+    def run(self, command, timeout):
+        self.buffer = ""
+        self.sock.sendall(f'{command}; echo "@@done $?"\r\n'.encode())
+        out, match = self.read_until(DONE, timeout)
+        return out, int(match.group(1))
+
+
+def parse(output):
+    results = {}
+    for line in output.splitlines():
+        match = RESULT.match(line.strip())
+        if match:
+            name, params, metric, value = match.groups()
+            results[f"{name}{params} {metric}"] = float(value)
+    return results
+
+
+def run_benchmarks():
+    qemu = subprocess.Popen(
+        [
+            "make",
+            "ARCH=" + arch,
+            "ACCEL=" + args.accel,
+            "ICOUNT=n",
+            "run",
+            f"QEMU_ARGS=-monitor none -serial tcp::{PORT},server=on",
+        ],
+        stderr=subprocess.PIPE,
+        text=True,
+    )
+    ready = threading.Event()
+
+    def worker():
+        for line in qemu.stderr:
+            print(line, file=sys.stderr, end="")
+            if "QEMU waiting for connection" in line:
+                ready.set()
+        ready.set()
+
+    thread = threading.Thread(target=worker)
+    thread.daemon = True
+    thread.start()
+
+    results = {}
+    try:
+        # `make run` builds the kernel first.
+        if not ready.wait(timeout=1800):
+            raise Exception("QEMU did not start in time")
+        if qemu.poll() is not None:
+            raise Exception("QEMU exited prematurely")
+
+        console = Console(socket.create_connection(("localhost", PORT), timeout=5))
+        console.read_until(re.compile(re.escape(PROMPT)), 60)
+        for name, extra in benchmarks:
+            command = " ".join([f"/bench/{name}"] + extra)
+            output, status = console.run(command, args.timeout)
+            if status != 0:
+                raise Exception(f"{name} exited with status {status}")
+            found = parse(output)
+            if not found:
+                raise Exception(f"{name} printed no results")
+            results.update(found)
+        console.sock.sendall(b"exit\r\n")
+    finally:
+        try:
+            qemu.wait(5)
+        except subprocess.TimeoutExpired:
+            qemu.terminate()
+            qemu.wait()
+    return results
+
+
+def lower_is_better(key):
+    metric = key.rsplit(" ", 1)[1]
+    return metric.startswith(("ns_", "us_"))
+
+
+def compare(results, baseline):
+    regressions = []
+    for key, base in sorted(baseline.items()):
+        if key not in results:
+            print(f"  missing  {key}")
+            continue
+        value = results[key]
+        change = (value - base) / base if base else 0.0
+        worse = -change if not lower_is_better(key) else change
+        mark = "ok"
+        if worse > threshold:
+            mark = "WORSE"
+            regressions.append(key)
+        elif worse < -threshold:
+            mark = "better"
+        print(f"  {mark:7}  {key}: {base:g} -> {value:g} ({change:+.1%})")
+    for key in sorted(results.keys() - baseline.keys()):
+        print(f"  new      {key}: {results[key]:g}")
+    return regressions
+
+
+with tempfile.TemporaryDirectory() as outdir:
+    build(outdir)
+    install(outdir)
+results = run_benchmarks()
+
+report = {"arch": arch, "accel": args.accel, "results": results}
+if args.output:
+    with open(args.output, "w") as f:
+        json.dump(report, f, indent=2, sort_keys=True)
+        f.write("\n")
+
+print()
+if args.update_baseline:
+    with open(baseline_path, "w") as f:
+        json.dump(report, f, indent=2, sort_keys=True)
+        f.write("\n")
+    print(f"\x1b[32m✔ Baseline written to {baseline_path}\x1b[0m")
+elif os.path.exists(baseline_path):
+    with open(baseline_path) as f:
+        baseline = json.load(f)
+    if baseline.get("accel", "n") != args.accel:
+        sys.exit(
+            f"{baseline_path} was recorded with ACCEL={baseline.get('accel', 'n')}, "
+            f"not ACCEL={args.accel}"
+        )
+    baseline = baseline["results"]
+    if args.only:
+        baseline = {
+            key: value
+            for key, value in baseline.items()
+            if key.split(" ", 1)[0] in args.only
+        }
+    regressions = compare(results, baseline)
+    if regressions:
+        print(f"\x1b[31m❌ {len(regressions)} benchmark(s) regressed\x1b[0m")
+        sys.exit(1)
+    print("\x1b[32m✔ No regression against the baseline\x1b[0m")
+else:
+    for key, value in sorted(results.items()):
+        print(f"  {key}: {value:g}")
+    if args.require_baseline:
+        print(
+            f"\x1b[31m❌ No baseline at {baseline_path}, record one with "
+            "--update-baseline\x1b[0m"
+        )
+        sys.exit(1)
+    print(f"No baseline at {baseline_path}, nothing to compare against")
@@ -0,0 +1,75 @@
+// epoll_wait latency as the number of registered and ready interests grows.
+//
+// Every interest is an eventfd; "ready" ones hold a non-zero counter and stay
+// level-triggered readable for the whole run. Prints one line per data point:
+//
+//     epoll_wait interests=<n> ready=<r> ns_per_call=<t>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ITERS 2000
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void run(int interests, int ready) {
+    int epfd = epoll_create1(0);
+    int *fds = calloc(interests, sizeof(int));
+    struct epoll_event *out = calloc(ready > 0 ? ready : 1, sizeof(*out));
+    if (epfd < 0 || !fds || !out) {
+        perror("setup");
+        exit(1);
+    }
+
+    for (int i = 0; i < interests; i++) {
+        fds[i] = eventfd(i < ready ? 1 : 0, EFD_NONBLOCK);
+        if (fds[i] < 0) {
+            perror("eventfd");
+            exit(1);
+        }
+        struct epoll_event ev = {.events = EPOLLIN, .data.u32 = i};
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &ev) < 0) {
+            perror("epoll_ctl");
+            exit(1);
+        }
+    }
+
+    int maxevents = ready > 0 ? ready : 1;
+    long long start = now_ns();
+    for (int i = 0; i < ITERS; i++) {
+        if (epoll_wait(epfd, out, maxevents, 0) != ready) {
+            fprintf(stderr, "unexpected event count\n");
+            exit(1);
+        }
+    }
+    long long elapsed = now_ns() - start;
+
+    printf("epoll_wait interests=%d ready=%d ns_per_call=%lld\n", interests,
+           ready, elapsed / ITERS);
+
+    for (int i = 0; i < interests; i++)
+        close(fds[i]);
+    close(epfd);
+    free(fds);
+    free(out);
+}
+
+int main(void) {
+    // The fd table holds at most 1024 files (AX_FILE_LIMIT).
+    static const int interests[] = {16, 128, 512, 1000};
+    static const int ready[] = {0, 1, 16, 256};
+
+    for (unsigned i = 0; i < sizeof(interests) / sizeof(*interests); i++)
+        for (unsigned j = 0; j < sizeof(ready) / sizeof(*ready); j++)
+            if (ready[j] <= interests[i])
+                run(interests[i], ready[j]);
+    return 0;
+}
@@ -0,0 +1,123 @@
+// Bandwidth of reading a cached file through mmap(2) and sendfile(2).
+//
+// A file of FILE_BYTES is written to the directory given as the first
+// argument (the current one by default) and read once to bring it into the
+// page cache. "mmap_read" then maps it and reads every word, and "sendfile"
+// sends it to a Unix socket drained by a child process. Prints one line per
+// data point:
+//
+//     file mmap_read mb_per_s=<bw>
+//     file sendfile mb_per_s=<bw>
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FILE_BYTES (64 << 20)
+#define CHUNK (1 << 20)
+#define ROUNDS 4
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void report(const char *op, long long elapsed) {
+    printf("file %s mb_per_s=%lld\n", op,
+           (long long)FILE_BYTES * ROUNDS * 1000 / elapsed);
+}
+
+static int make_file(const char *path) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    char *buf = malloc(CHUNK);
+    if (fd < 0 || !buf) {
+        perror("setup");
+        exit(1);
+    }
+    memset(buf, 0x5a, CHUNK);
+    for (long off = 0; off < FILE_BYTES; off += CHUNK) {
+        if (write(fd, buf, CHUNK) != CHUNK) {
+            perror("write");
+            exit(1);
+        }
+    }
+    // Warm the cache.
+    lseek(fd, 0, SEEK_SET);
+    while (read(fd, buf, CHUNK) > 0)
+        ;
+    free(buf);
+    return fd;
+}
+
+static void run_mmap_read(int fd) {
+    volatile uint64_t sink = 0;
+    long long start = now_ns();
+    for (int round = 0; round < ROUNDS; round++) {
+        const uint64_t *mem = mmap(NULL, FILE_BYTES, PROT_READ, MAP_SHARED, fd, 0);
+        if (mem == MAP_FAILED) {
+            perror("mmap");
+            exit(1);
+        }
+        uint64_t sum = 0;
+        for (size_t i = 0; i < FILE_BYTES / sizeof(*mem); i++)
+            sum += mem[i];
+        sink += sum;
+        munmap((void *)mem, FILE_BYTES);
+    }
+    report("mmap_read", now_ns() - start);
+}
+
+static void run_sendfile(int fd) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        perror("socketpair");
+        exit(1);
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        static char buf[CHUNK];
+        close(fds[0]);
+        while (read(fds[1], buf, CHUNK) > 0)
+            ;
+        _exit(0);
+    }
+    close(fds[1]);
+
+    long long start = now_ns();
+    for (int round = 0; round < ROUNDS; round++) {
+        off_t off = 0;
+        while (off < FILE_BYTES) {
+            if (sendfile(fds[0], fd, &off, FILE_BYTES - off) <= 0) {
+                perror("sendfile");
+                exit(1);
+            }
+        }
+    }
+    close(fds[0]);
+    waitpid(pid, NULL, 0);
+    report("sendfile", now_ns() - start);
+}
+
+int main(int argc, char **argv) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/bench-file.tmp", argc > 1 ? argv[1] : ".");
+    int fd = make_file(path);
+    run_mmap_read(fd);
+    run_sendfile(fd);
+    close(fd);
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,123 @@
+// Futex throughput under contention.
+//
+// "mutex" runs N threads incrementing a counter under one pthread mutex, so
+// every contended lock or unlock turns into FUTEX_WAIT/FUTEX_WAKE. "pingpong"
+// bounces a token between two threads through raw futex calls, measuring one
+// wait/wake round trip. Prints one line per data point:
+//
+//     futex mutex threads=<n> ns_per_op=<t>
+//     futex pingpong ns_per_roundtrip=<t>
+
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MUTEX_OPS 200000
+#define PINGPONG_ROUNDS 20000
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long futex(atomic_int *uaddr, int op, int val) {
+    return syscall(SYS_futex, uaddr, op | FUTEX_PRIVATE_FLAG, val, NULL, NULL, 0);
+}
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static long counter;
+static int ops_per_thread;
+
+static void *mutex_worker(void *arg) {
+    (void)arg;
+    for (int i = 0; i < ops_per_thread; i++) {
+        pthread_mutex_lock(&lock);
+        counter++;
+        pthread_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+static void run_mutex(int threads) {
+    pthread_t *tids = calloc(threads, sizeof(*tids));
+    if (!tids) {
+        perror("calloc");
+        exit(1);
+    }
+    counter = 0;
+    ops_per_thread = MUTEX_OPS / threads;
+
+    long long start = now_ns();
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&tids[i], NULL, mutex_worker, NULL) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < threads; i++)
+        pthread_join(tids[i], NULL);
+    long long elapsed = now_ns() - start;
+
+    if (counter != (long)ops_per_thread * threads) {
+        fprintf(stderr, "lost updates\n");
+        exit(1);
+    }
+    printf("futex mutex threads=%d ns_per_op=%lld\n", threads,
+           elapsed / counter);
+    free(tids);
+}
+
+// 0: ping's turn, 1: pong's turn.
+static atomic_int turn;
+
+static void wait_turn(int mine) {
+    while (atomic_load(&turn) != mine)
+        futex(&turn, FUTEX_WAIT, !mine);
+}
+
+static void pass_turn(int other) {
+    atomic_store(&turn, other);
+    futex(&turn, FUTEX_WAKE, 1);
+}
+
+static void *pong(void *arg) {
+    (void)arg;
+    for (int i = 0; i < PINGPONG_ROUNDS; i++) {
+        wait_turn(1);
+        pass_turn(0);
+    }
+    return NULL;
+}
+
+static void run_pingpong(void) {
+    pthread_t tid;
+    atomic_store(&turn, 0);
+    if (pthread_create(&tid, NULL, pong, NULL) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+
+    long long start = now_ns();
+    for (int i = 0; i < PINGPONG_ROUNDS; i++) {
+        pass_turn(1);
+        wait_turn(0);
+    }
+    long long elapsed = now_ns() - start;
+    pthread_join(tid, NULL);
+
+    printf("futex pingpong ns_per_roundtrip=%lld\n", elapsed / PINGPONG_ROUNDS);
+}
+
+int main(void) {
+    static const int threads[] = {1, 2, 4, 8, 16, 32};
+    for (size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); i++)
+        run_mutex(threads[i]);
+    run_pingpong();
+    return 0;
+}
@@ -0,0 +1,75 @@
+// Bandwidth of pipes and Unix stream sockets, per write size.
+//
+// A child process writes TOTAL bytes in chunks of the given size and the
+// parent reads them all. Prints one line per data point:
+//
+//     ipc <pipe|unix> size=<bytes> mb_per_s=<bw>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Bytes moved per data point.
+#define TOTAL (64 << 20)
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void run(const char *kind, size_t size) {
+    int fds[2];
+    int err = kind[0] == 'p' ? pipe(fds) : socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    char *buf = calloc(1, size);
+    if (err < 0 || !buf) {
+        perror("setup");
+        exit(1);
+    }
+
+    long long start = now_ns();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        for (long left = TOTAL; left > 0; left -= size) {
+            if (write(fds[1], buf, size) != (ssize_t)size) {
+                perror("write");
+                _exit(1);
+            }
+        }
+        _exit(0);
+    }
+
+    close(fds[1]);
+    long total = 0;
+    ssize_t n;
+    while ((n = read(fds[0], buf, size)) > 0)
+        total += n;
+    long long elapsed = now_ns() - start;
+    waitpid(pid, NULL, 0);
+    close(fds[0]);
+    free(buf);
+
+    if (total != TOTAL) {
+        fprintf(stderr, "short transfer\n");
+        exit(1);
+    }
+    printf("ipc %s size=%zu mb_per_s=%lld\n", kind, size,
+           (long long)TOTAL * 1000 / elapsed);
+}
+
+int main(void) {
+    static const size_t sizes[] = {4096, 65536};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        run("pipe", sizes[i]);
+        run("unix", sizes[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,103 @@
+// PID table lookups.
+//
+// N threads look up this process with kill(pid, 0) and one of its threads
+// with tgkill(pid, tid, 0), which go through the process and task tables.
+// With "forking", another thread keeps forking and reaping children
+// meanwhile, so lookups race with inserts and removals. Prints one line per
+// data point:
+//
+//     pid_lookup threads=<n> ns_per_lookup=<t>
+//     pid_lookup forking threads=<n> ns_per_lookup=<t>
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOOKUPS 200000
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static pid_t pid;
+static pid_t tid;
+static int lookups_per_thread;
+static atomic_int stop;
+
+static void *lookup_worker(void *arg) {
+    (void)arg;
+    for (int i = 0; i < lookups_per_thread; i += 2) {
+        if (kill(pid, 0) != 0 || syscall(SYS_tgkill, pid, tid, 0) != 0) {
+            perror("kill");
+            exit(1);
+        }
+    }
+    return NULL;
+}
+
+static void *fork_worker(void *arg) {
+    (void)arg;
+    while (!atomic_load(&stop)) {
+        pid_t child = fork();
+        if (child < 0) {
+            perror("fork");
+            exit(1);
+        }
+        if (child == 0)
+            _exit(0);
+        waitpid(child, NULL, 0);
+    }
+    return NULL;
+}
+
+static void run(int threads, int forking) {
+    pthread_t *tids = calloc(threads, sizeof(*tids));
+    pthread_t forker;
+    if (!tids) {
+        perror("calloc");
+        exit(1);
+    }
+    lookups_per_thread = LOOKUPS / threads;
+    atomic_store(&stop, 0);
+    if (forking && pthread_create(&forker, NULL, fork_worker, NULL) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+
+    long long start = now_ns();
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&tids[i], NULL, lookup_worker, NULL) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < threads; i++)
+        pthread_join(tids[i], NULL);
+    long long elapsed = now_ns() - start;
+
+    if (forking) {
+        atomic_store(&stop, 1);
+        pthread_join(forker, NULL);
+    }
+    printf("pid_lookup%s threads=%d ns_per_lookup=%lld\n",
+           forking ? " forking" : "", threads, elapsed / lookups_per_thread);
+    free(tids);
+}
+
+int main(void) {
+    static const int threads[] = {1, 4, 16};
+    pid = getpid();
+    tid = syscall(SYS_gettid);
+    for (int forking = 0; forking <= 1; forking++)
+        for (size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); i++)
+            run(threads[i], forking);
+    return 0;
+}
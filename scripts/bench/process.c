@@ -0,0 +1,77 @@
+// Cost of creating processes and of faulting in anonymous memory.
+//
+// "fork" forks a child that exits right away, "fork_exec" has it exec
+// /bin/true, and "page_fault" touches every page of a fresh anonymous
+// mapping once. Prints one line per data point:
+//
+//     process fork us_per_call=<t>
+//     process fork_exec us_per_call=<t>
+//     process page_fault ns_per_fault=<t>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FORK_ITERS 200
+#define FAULT_BYTES (64 << 20)
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void run_fork(int exec) {
+    long long start = now_ns();
+    for (int i = 0; i < FORK_ITERS; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            exit(1);
+        }
+        if (pid == 0) {
+            if (exec)
+                execl("/bin/true", "true", (char *)NULL);
+            _exit(0);
+        }
+        int status;
+        if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "child failed\n");
+            exit(1);
+        }
+    }
+    long long elapsed = now_ns() - start;
+    printf("process %s us_per_call=%lld\n", exec ? "fork_exec" : "fork",
+           elapsed / FORK_ITERS / 1000);
+}
+
+static void run_page_fault(void) {
+    long page = sysconf(_SC_PAGESIZE);
+    char *mem = mmap(NULL, FAULT_BYTES, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    // Count 4K faults, not huge page ones.
+    madvise(mem, FAULT_BYTES, MADV_NOHUGEPAGE);
+
+    long long start = now_ns();
+    for (long off = 0; off < FAULT_BYTES; off += page)
+        mem[off] = 1;
+    long long elapsed = now_ns() - start;
+    munmap(mem, FAULT_BYTES);
+    printf("process page_fault ns_per_fault=%lld\n",
+           elapsed / (FAULT_BYTES / page));
+}
+
+int main(void) {
+    run_fork(0);
+    run_fork(1);
+    run_page_fault();
+    return 0;
+}
@@ -0,0 +1,28 @@
+// Round trip of the cheapest system call.
+//
+// getpid(2) is issued through syscall(2) so that no libc caching gets in the
+// way. Prints one line:
+//
+//     syscall getpid ns_per_call=<t>
+
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ITERS 200000
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int main(void) {
+    long long start = now_ns();
+    for (int i = 0; i < ITERS; i++)
+        syscall(SYS_getpid);
+    long long elapsed = now_ns() - start;
+    printf("syscall getpid ns_per_call=%lld\n", elapsed / ITERS);
+    return 0;
+}
@@ -0,0 +1,92 @@
+// TCP bandwidth over the loopback interface, per write size.
+//
+// A child process connects to a listener on 127.0.0.1 and sends TOTAL bytes
+// in chunks of the given size; the parent receives them. Prints one line per
+// data point:
+//
+//     tcp loopback size=<bytes> mb_per_s=<bw>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Bytes moved per data point.
+#define TOTAL (64 << 20)
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void run(size_t size) {
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t len = sizeof(addr);
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    char *buf = calloc(1, size);
+    if (listener < 0 || !buf ||
+        bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listener, 1) < 0 ||
+        getsockname(listener, (struct sockaddr *)&addr, &len) < 0) {
+        perror("setup");
+        exit(1);
+    }
+
+    long long start = now_ns();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            perror("connect");
+            _exit(1);
+        }
+        for (long left = TOTAL; left > 0; left -= size) {
+            if (write(sock, buf, size) != (ssize_t)size) {
+                perror("write");
+                _exit(1);
+            }
+        }
+        _exit(0);
+    }
+
+    int conn = accept(listener, NULL, NULL);
+    if (conn < 0) {
+        perror("accept");
+        exit(1);
+    }
+    long total = 0;
+    ssize_t n;
+    while ((n = read(conn, buf, size)) > 0)
+        total += n;
+    long long elapsed = now_ns() - start;
+    waitpid(pid, NULL, 0);
+    close(conn);
+    close(listener);
+    free(buf);
+
+    if (total != TOTAL) {
+        fprintf(stderr, "short transfer\n");
+        exit(1);
+    }
+    printf("tcp loopback size=%zu mb_per_s=%lld\n", size,
+           (long long)TOTAL * 1000 / elapsed);
+}
+
+int main(void) {
+    static const size_t sizes[] = {4096, 65536};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+        run(sizes[i]);
+    return 0;
+}
@@ -0,0 +1,94 @@
+// Bandwidth of copies between user and kernel memory, per buffer size.
+//
+// read(2) from /dev/zero copies out to user memory, write(2) to /dev/null
+// copies in (or only validates, depending on the device), and access(2) on
+// a path of n slashes measures loading a user string of n bytes. Run it on
+// kernels before and after a change to the copy routines to compare them.
+// Prints one line per data point:
+//
+//     user_copy op=<read|write> size=<bytes> mb_per_s=<bw>
+//     user_copy op=string len=<bytes> ns_per_call=<t>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Bytes moved per data point.
+#define TOTAL (64 << 20)
+#define STRING_ITERS 20000
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void run_copy(const char *op, int fd, char *buf, size_t size) {
+    long iters = TOTAL / size;
+    long long start = now_ns();
+    for (long i = 0; i < iters; i++) {
+        ssize_t n = op[0] == 'r' ? read(fd, buf, size) : write(fd, buf, size);
+        if (n != (ssize_t)size) {
+            perror(op);
+            exit(1);
+        }
+    }
+    long long elapsed = now_ns() - start;
+    printf("user_copy op=%s size=%zu mb_per_s=%lld\n", op, size,
+           (long long)iters * size * 1000 / (elapsed > 0 ? elapsed : 1));
+}
+
+static void run_string(size_t len) {
+    char *path = malloc(len + 1);
+    if (!path) {
+        perror("malloc");
+        exit(1);
+    }
+    // Resolves to "/", so the path walk itself costs next to nothing.
+    memset(path, '/', len);
+    path[len] = 0;
+
+    long long start = now_ns();
+    for (int i = 0; i < STRING_ITERS; i++) {
+        if (access(path, F_OK) < 0) {
+            perror("access");
+            exit(1);
+        }
+    }
+    long long elapsed = now_ns() - start;
+    printf("user_copy op=string len=%zu ns_per_call=%lld\n", len,
+           elapsed / STRING_ITERS);
+    free(path);
+}
+
+int main(void) {
+    static const size_t sizes[] = {64,        512,       4096,
+                                   16 << 10,  64 << 10,  256 << 10,
+                                   1 << 20};
+    static const size_t lens[] = {16, 64, 256, 1024, 4000};
+    size_t max = sizes[sizeof(sizes) / sizeof(*sizes) - 1];
+
+    char *buf = malloc(max);
+    int zero = open("/dev/zero", O_RDONLY);
+    int null = open("/dev/null", O_WRONLY);
+    if (!buf || zero < 0 || null < 0) {
+        perror("setup");
+        return 1;
+    }
+    memset(buf, 1, max);
+
+    for (unsigned i = 0; i < sizeof(sizes) / sizeof(*sizes); i++)
+        run_copy("read", zero, buf, sizes[i]);
+    for (unsigned i = 0; i < sizeof(sizes) / sizeof(*sizes); i++)
+        run_copy("write", null, buf, sizes[i]);
+    for (unsigned i = 0; i < sizeof(lens) / sizeof(*lens); i++)
+        run_string(lens[i]);
+
+    close(zero);
+    close(null);
+    free(buf);
+    return 0;
+}
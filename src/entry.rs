@@ -9,6 +9,7 @@ use axsync::Mutex;
 use axtask::{AxTaskExt, spawn_task};
 use starry_api::{file::FD_TABLE, task::new_user_task, vfs::dev::tty::N_TTY};
 use starry_core::{
+    fault::FileMaps,
     mm::{copy_from_kernel, load_user_app, new_user_aspace_empty},
     task::{ProcessData, Thread, add_task_to_table},
 };
@@ -31,7 +32,8 @@ pub fn run_initproc(args: &[String], envs: &[String]) -> i32 {
         .expect("Failed to get executable absolute path");
     let name = loc.name();
 
-    let (entry_vaddr, ustack_top) = load_user_app(&mut uspace, None, args, envs)
+    let mut file_maps = FileMaps::default();
+    let (entry_vaddr, ustack_top) = load_user_app(&mut uspace, &mut file_maps, None, args, envs)
         .unwrap_or_else(|e| panic!("Failed to load user app: {}", e));
 
     let uctx = UserContext::new(entry_vaddr.into(), ustack_top, 0);
@@ -53,6 +55,7 @@ pub fn run_initproc(args: &[String], envs: &[String]) -> i32 {
         Arc::default(),
         None,
     );
+    *proc_data.file_maps.lock() = file_maps;
     {
         let mut scope = proc_data.scope.write();
         starry_api::file::add_stdio(&mut FD_TABLE.scope_mut(&mut scope).write())